@@ -0,0 +1,1290 @@
+/**
+ * @file anvil_main.cpp
+ * @brief Offline world pregenerator. Reads Anvil region files (.mca) of an existing
+ *        world, takes a 16^3 context from every chunk, runs the contexts through the
+ *        async job API (see async_jobs.h) and writes the regions back with the final
+ *        structures in place. No Minecraft server is needed.
+ *
+ *        The context of a chunk is the whole of one section of it (--section), so the
+ *        generated 14^3 volume sits inside that section, one block in from each side.
+ *        Block states are mapped to palette ids as DiffusionMod.blockStateToId() does
+ *        and the results are written with the states of DiffusionMod.FINAL_STATES,
+ *        after the settle pass (see settle.h). Only chunks with status full and
+ *        sections in the 1.18+ layout are generated; every other chunk is copied as is.
+ *
+ *        Work is pipelined so the denoise thread never waits on I/O:
+ *         - The main thread reads regions, at most MAX_OPEN_REGIONS at a time.
+ *         - Worker threads inflate and parse chunks, submit their contexts, and once
+ *           a job is done patch the section, re-encode the chunk and deflate it.
+ *         - A collector thread waits for finished jobs and hands them to the workers.
+ *        At most --in-flight chunks are held decoded at once, which bounds memory
+ *        and keeps the job queue full. A region is written, to a temporary file that
+ *        is then renamed over the output, as soon as its last chunk is done.
+ *
+ *        Generated chunks are marked unlit and their heightmaps dropped, so the game
+ *        recomputes both when it loads them. Block entities inside the generated
+ *        volume are removed; the shulker box and dropper get fresh ones on load.
+ *        Chunks stored outside the region (.mcc) are left as they are, so copy the
+ *        .mcc files along when writing to another directory.
+ *
+ *        Build by compiling this file together with every other .cpp file except
+ *        the *_main.cpp tools, with INFERENCE_NO_TEST_MAIN defined, and link zlib.
+ *
+ *  Usage: anvil_pregen [options] --out DIR <r.X.Z.mca ...>
+ *
+ *    --out DIR            Directory the regions are written to. May be the input
+ *                         directory, to update a world in place.
+ *    --regions-file PATH  Also read region paths from PATH, one per line.
+ *    --section N          Section index of the context in every chunk (default 4,
+ *                         blocks 64 to 79).
+ *    --threads N          Worker threads for parsing and compression (default: one
+ *                         per core).
+ *    --in-flight N        Chunks submitted but not yet written back (default 48).
+ *    --no-settle          Write the structures without the settle pass.
+ *    --stats-json PATH    Write every stat and the per-stage metrics as JSON when done.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "async_jobs.h"
+#include "block_states.h"
+#include "job_queue.h"
+#include "settle.h"
+#include "stats.h"
+
+const int REGION_CHUNKS = 32 * 32;
+const int REGION_SECTOR_SIZE = 4096;
+const int REGION_HEADER_SIZE = 2 * REGION_SECTOR_SIZE;   /* Locations, then timestamps */
+const int REGION_MAX_SECTORS = 255;
+
+const int CHUNK_COMPRESSION_GZIP = 1;
+const int CHUNK_COMPRESSION_ZLIB = 2;
+const int CHUNK_COMPRESSION_NONE = 3;
+const int CHUNK_COMPRESSION_EXTERNAL = 128;
+
+/* Far more than any vanilla chunk, to stop a corrupt stream from inflating forever */
+const size_t CHUNK_MAX_NBT_SIZE = 64 << 20;
+
+const int SECTION_BLOCKS = CHUNK_WIDTH * CHUNK_WIDTH * CHUNK_WIDTH;
+
+/* Two regions let the next one be read and parsed while the last chunks of the
+ * previous one are still denoising */
+const int MAX_OPEN_REGIONS = 2;
+
+const int64_t COLLECT_WAIT_NS = 100 * 1000 * 1000;
+
+/*
+ * NBT
+ */
+
+const int NBT_END        = 0;
+const int NBT_BYTE       = 1;
+const int NBT_SHORT      = 2;
+const int NBT_INT        = 3;
+const int NBT_LONG       = 4;
+const int NBT_FLOAT      = 5;
+const int NBT_DOUBLE     = 6;
+const int NBT_BYTE_ARRAY = 7;
+const int NBT_STRING     = 8;
+const int NBT_LIST       = 9;
+const int NBT_COMPOUND   = 10;
+const int NBT_INT_ARRAY  = 11;
+const int NBT_LONG_ARRAY = 12;
+
+const int NBT_MAX_DEPTH = 512;
+
+/**
+ * @brief A parsed NBT tag. Everything a chunk holds is kept, so the parts the tool
+ *        doesn't touch are written back bit for bit.
+ */
+struct NbtTag {
+    int type = NBT_END;
+    int64_t number = 0;             /* Integers, and floats by their bits */
+    std::string string;
+    std::vector<uint8_t> bytes;     /* Byte arrays */
+    std::vector<int64_t> numbers;   /* Int and long arrays */
+    int list_type = NBT_END;
+    std::vector<NbtTag> items;      /* List elements, or compound values */
+    std::vector<std::string> names; /* Compound keys, one per item */
+
+    NbtTag* find(const char* name, int expected_type) {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) {
+                return (items[i].type == expected_type) ? &items[i] : NULL;
+            }
+        }
+        return NULL;
+    }
+
+    const NbtTag* find(const char* name, int expected_type) const {
+        return const_cast<NbtTag*>(this)->find(name, expected_type);
+    }
+
+    void set(const char* name, NbtTag value) {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) {
+                items[i] = std::move(value);
+                return;
+            }
+        }
+        names.push_back(name);
+        items.push_back(std::move(value));
+    }
+
+    void remove(const char* name) {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) {
+                names.erase(names.begin() + i);
+                items.erase(items.begin() + i);
+                return;
+            }
+        }
+    }
+};
+
+static NbtTag nbt_string(const char* value) {
+    NbtTag tag;
+    tag.type = NBT_STRING;
+    tag.string = value;
+    return tag;
+}
+
+static NbtTag nbt_byte(int value) {
+    NbtTag tag;
+    tag.type = NBT_BYTE;
+    tag.number = value;
+    return tag;
+}
+
+struct NbtReader {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    bool ok;
+
+    bool has(size_t count) {
+        if (!ok || size - pos < count) {
+            ok = false;
+        }
+        return ok;
+    }
+
+    uint64_t big_endian(int count) {
+        if (!has(count)) {
+            return 0;
+        }
+        uint64_t value = 0;
+        for (int i = 0; i < count; i++) {
+            value = (value << 8) | data[pos++];
+        }
+        return value;
+    }
+
+    void string(std::string& out) {
+        size_t length = (size_t)big_endian(2);
+        if (has(length)) {
+            out.assign((const char*)data + pos, length);
+            pos += length;
+        }
+    }
+
+    /* Element count of an array or list, checked against what's left to read */
+    size_t count(size_t element_size) {
+        int32_t value = (int32_t)big_endian(4);
+        if (value < 0 || !has((size_t)value * element_size)) {
+            ok = false;
+            return 0;
+        }
+        return (size_t)value;
+    }
+};
+
+static void nbt_read_payload(NbtReader& reader, NbtTag& tag, int type, int depth) {
+
+    tag.type = type;
+
+    if (depth > NBT_MAX_DEPTH) {
+        reader.ok = false;
+        return;
+    }
+
+    switch (type) {
+    case NBT_BYTE:   tag.number = (int8_t)reader.big_endian(1);  break;
+    case NBT_SHORT:  tag.number = (int16_t)reader.big_endian(2); break;
+    case NBT_INT:    tag.number = (int32_t)reader.big_endian(4); break;
+    case NBT_FLOAT:  tag.number = (int64_t)reader.big_endian(4); break;
+    case NBT_LONG:
+    case NBT_DOUBLE: tag.number = (int64_t)reader.big_endian(8); break;
+    case NBT_STRING: reader.string(tag.string); break;
+
+    case NBT_BYTE_ARRAY: {
+        size_t count = reader.count(1);
+        tag.bytes.assign(reader.data + reader.pos, reader.data + reader.pos + count);
+        reader.pos += count;
+        break;
+    }
+
+    case NBT_INT_ARRAY:
+    case NBT_LONG_ARRAY: {
+        int element_size = (type == NBT_INT_ARRAY) ? 4 : 8;
+        size_t count = reader.count(element_size);
+        tag.numbers.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            uint64_t value = reader.big_endian(element_size);
+            tag.numbers[i] = (type == NBT_INT_ARRAY) ? (int32_t)value : (int64_t)value;
+        }
+        break;
+    }
+
+    case NBT_LIST: {
+        tag.list_type = (int)reader.big_endian(1);
+        size_t count = reader.count(1);
+        tag.items.resize(count);
+        for (size_t i = 0; i < count && reader.ok; i++) {
+            nbt_read_payload(reader, tag.items[i], tag.list_type, depth + 1);
+        }
+        break;
+    }
+
+    case NBT_COMPOUND:
+        for (;;) {
+            int child_type = (int)reader.big_endian(1);
+            if (!reader.ok || child_type == NBT_END) {
+                break;
+            }
+            tag.names.emplace_back();
+            reader.string(tag.names.back());
+            tag.items.emplace_back();
+            nbt_read_payload(reader, tag.items.back(), child_type, depth + 1);
+        }
+        break;
+
+    default:
+        reader.ok = false;
+        break;
+    }
+}
+
+/**
+ * @brief Parse the unnamed root compound of a chunk.
+ * @return true on success
+ */
+static bool nbt_parse(const std::vector<uint8_t>& data, NbtTag& root) {
+
+    NbtReader reader = { data.data(), data.size(), 0, true };
+    std::string root_name;
+
+    if (reader.big_endian(1) != NBT_COMPOUND) {
+        return false;
+    }
+
+    reader.string(root_name);
+    nbt_read_payload(reader, root, NBT_COMPOUND, 0);
+    return reader.ok;
+}
+
+static void put_big_endian(std::vector<uint8_t>& out, uint64_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        out.push_back((uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void put_string(std::vector<uint8_t>& out, const std::string& value) {
+    put_big_endian(out, value.size(), 2);
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+static void nbt_write_payload(std::vector<uint8_t>& out, const NbtTag& tag) {
+
+    switch (tag.type) {
+    case NBT_BYTE:   put_big_endian(out, (uint64_t)tag.number, 1); break;
+    case NBT_SHORT:  put_big_endian(out, (uint64_t)tag.number, 2); break;
+    case NBT_INT:
+    case NBT_FLOAT:  put_big_endian(out, (uint64_t)tag.number, 4); break;
+    case NBT_LONG:
+    case NBT_DOUBLE: put_big_endian(out, (uint64_t)tag.number, 8); break;
+    case NBT_STRING: put_string(out, tag.string); break;
+
+    case NBT_BYTE_ARRAY:
+        put_big_endian(out, tag.bytes.size(), 4);
+        out.insert(out.end(), tag.bytes.begin(), tag.bytes.end());
+        break;
+
+    case NBT_INT_ARRAY:
+    case NBT_LONG_ARRAY:
+        put_big_endian(out, tag.numbers.size(), 4);
+        for (int64_t value : tag.numbers) {
+            put_big_endian(out, (uint64_t)value, (tag.type == NBT_INT_ARRAY) ? 4 : 8);
+        }
+        break;
+
+    case NBT_LIST:
+        put_big_endian(out, (uint64_t)(tag.items.empty() ? tag.list_type : tag.items[0].type), 1);
+        put_big_endian(out, tag.items.size(), 4);
+        for (const NbtTag& item : tag.items) {
+            nbt_write_payload(out, item);
+        }
+        break;
+
+    case NBT_COMPOUND:
+        for (size_t i = 0; i < tag.items.size(); i++) {
+            put_big_endian(out, (uint64_t)tag.items[i].type, 1);
+            put_string(out, tag.names[i]);
+            nbt_write_payload(out, tag.items[i]);
+        }
+        put_big_endian(out, NBT_END, 1);
+        break;
+    }
+}
+
+static void nbt_write(std::vector<uint8_t>& out, const NbtTag& root) {
+    put_big_endian(out, NBT_COMPOUND, 1);
+    put_string(out, "");
+    nbt_write_payload(out, root);
+}
+
+/*
+ * Block states
+ */
+
+/* DiffusionMod.blockToId(), by block name without the namespace */
+struct ContextBlock {
+    const char* name;
+    int block_id;
+};
+
+static const ContextBlock CONTEXT_BLOCKS[] = {
+    { "dirt", 1 }, { "white_concrete", 2 }, { "stone_brick_slab", 3 }, { "grass_block", 4 },
+    { "oak_planks", 5 }, { "stone_bricks", 6 }, { "stripped_oak_wood", 7 }, { "white_wool", 9 },
+    { "green_concrete", 10 }, { "oak_slab", 15 }, { "sandstone", 16 }, { "bricks", 17 },
+    { "gravel", 25 },
+};
+
+static const char* block_name(const NbtTag& entry) {
+
+    const NbtTag* name = entry.find("Name", NBT_STRING);
+
+    if (!name) {
+        return "";
+    }
+
+    const char* value = name->string.c_str();
+    return (strncmp(value, "minecraft:", 10) == 0) ? value + 10 : value;
+}
+
+static const char* block_property(const NbtTag& entry, const char* property) {
+
+    const NbtTag* properties = entry.find("Properties", NBT_COMPOUND);
+    const NbtTag* value = properties ? properties->find(property, NBT_STRING) : NULL;
+
+    return value ? value->string.c_str() : "";
+}
+
+/**
+ * @brief Palette id of a section palette entry, as DiffusionMod.blockStateToId().
+ */
+static int context_block_id(const NbtTag& entry) {
+
+    const char* name = block_name(entry);
+
+    if (strcmp(name, "stone_brick_stairs") == 0) {
+
+        bool top = strcmp(block_property(entry, "half"), "top") == 0;
+        const char* facing = block_property(entry, "facing");
+
+        if (strcmp(facing, "north") == 0) return top ? 27 : 18;
+        if (strcmp(facing, "south") == 0) return top ? 26 : 19;
+        if (strcmp(facing, "east") == 0)  return top ? 29 : 20;
+        return top ? 28 : 21;
+
+    } else if (strcmp(name, "glass_pane") == 0) {
+        return (strcmp(block_property(entry, "north"), "true") == 0 ||
+                strcmp(block_property(entry, "south"), "true") == 0) ? 14 : 11;
+    }
+
+    for (const ContextBlock& block : CONTEXT_BLOCKS) {
+        if (strcmp(name, block.name) == 0) {
+            return block.block_id;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Name and properties of a palette entry as one string, to merge equal entries.
+ */
+static std::string palette_key(const NbtTag& entry) {
+
+    std::string key = block_name(entry);
+    const NbtTag* properties = entry.find("Properties", NBT_COMPOUND);
+
+    if (properties) {
+
+        std::vector<std::string> pairs;
+
+        for (size_t i = 0; i < properties->items.size(); i++) {
+            pairs.push_back(properties->names[i] + "=" + properties->items[i].string);
+        }
+
+        std::sort(pairs.begin(), pairs.end());
+
+        for (const std::string& pair : pairs) {
+            key += "," + pair;
+        }
+    }
+
+    return key;
+}
+
+/**
+ * @brief Section palette entry of a state index, as DiffusionMod.FINAL_STATES.
+ */
+static NbtTag palette_entry(uint16_t state) {
+
+    char text[BLOCK_STATE_STRING_MAX];
+    block_state_string(state, text);
+
+    /* "minecraft:name[property=value,...]" */
+    char* properties_text = strchr(text, '[');
+
+    if (properties_text) {
+        *properties_text++ = 0;
+        properties_text[strlen(properties_text) - 1] = 0;
+    }
+
+    NbtTag entry;
+    entry.type = NBT_COMPOUND;
+    entry.set("Name", nbt_string(text));
+
+    if (properties_text) {
+
+        NbtTag properties;
+        properties.type = NBT_COMPOUND;
+
+        for (char* pair = properties_text; pair; ) {
+
+            char* next = strchr(pair, ',');
+            char* equals = strchr(pair, '=');
+
+            if (next) {
+                *next++ = 0;
+            }
+
+            *equals = 0;
+            properties.set(pair, nbt_string(equals + 1));
+            pair = next;
+        }
+
+        entry.set("Properties", std::move(properties));
+    }
+
+    return entry;
+}
+
+/*
+ * Sections
+ */
+
+static int palette_bits(size_t palette_size) {
+
+    int bits = 4;   /* The game never packs block states tighter */
+
+    while (((size_t)1 << bits) < palette_size) {
+        bits++;
+    }
+
+    return bits;
+}
+
+/**
+ * @brief Unpack the palette index of every block of a section, in the section's
+ *        (y * 16 + z) * 16 + x order. Entries don't span longs.
+ * @return true on success
+ */
+static bool section_unpack(const NbtTag& block_states, std::vector<uint16_t>& indices) {
+
+    const NbtTag* palette = block_states.find("palette", NBT_LIST);
+
+    if (!palette || palette->items.empty() || palette->list_type != NBT_COMPOUND) {
+        return false;
+    }
+
+    indices.assign(SECTION_BLOCKS, 0);
+
+    if (palette->items.size() == 1) {
+        return true;
+    }
+
+    const NbtTag* data = block_states.find("data", NBT_LONG_ARRAY);
+    int bits = palette_bits(palette->items.size());
+    int per_long = 64 / bits;
+
+    if (!data || data->numbers.size() < (size_t)((SECTION_BLOCKS + per_long - 1) / per_long)) {
+        return false;
+    }
+
+    uint64_t mask = ((uint64_t)1 << bits) - 1;
+
+    for (int i = 0; i < SECTION_BLOCKS; i++) {
+
+        uint64_t index = ((uint64_t)data->numbers[i / per_long] >> ((i % per_long) * bits)) & mask;
+
+        if (index >= palette->items.size()) {
+            return false;
+        }
+
+        indices[i] = (uint16_t)index;
+    }
+
+    return true;
+}
+
+static void section_pack(NbtTag& block_states, std::vector<NbtTag> palette, const std::vector<uint16_t>& indices) {
+
+    size_t palette_size = palette.size();
+
+    NbtTag palette_tag;
+    palette_tag.type = NBT_LIST;
+    palette_tag.list_type = NBT_COMPOUND;
+    palette_tag.items = std::move(palette);
+    block_states.set("palette", std::move(palette_tag));
+
+    if (palette_size == 1) {
+        block_states.remove("data");
+        return;
+    }
+
+    int bits = palette_bits(palette_size);
+    int per_long = 64 / bits;
+
+    NbtTag data;
+    data.type = NBT_LONG_ARRAY;
+    data.numbers.assign((SECTION_BLOCKS + per_long - 1) / per_long, 0);
+
+    for (int i = 0; i < SECTION_BLOCKS; i++) {
+        data.numbers[i / per_long] = (int64_t)((uint64_t)data.numbers[i / per_long] | ((uint64_t)indices[i] << ((i % per_long) * bits)));
+    }
+
+    block_states.set("data", std::move(data));
+}
+
+static int section_order(int x, int y, int z) {
+    return (y * CHUNK_WIDTH + z) * CHUNK_WIDTH + x;
+}
+
+static bool is_generated(int x, int y, int z) {
+    return x >= 1 && x <= GENERATED_WIDTH &&
+           y >= 1 && y <= GENERATED_WIDTH &&
+           z >= 1 && z <= GENERATED_WIDTH;
+}
+
+/*
+ * Pipeline
+ */
+
+struct Region {
+    std::string output_path;
+    std::vector<uint8_t> file;
+    uint32_t locations[REGION_CHUNKS];
+    uint32_t timestamps[REGION_CHUNKS];
+    std::vector<uint8_t> rewritten[REGION_CHUNKS];  /* Compression byte and data, empty to copy the input */
+    int remaining;                                   /* Guarded by pipeline_mutex */
+};
+
+struct ChunkWork {
+    Region* region;
+    int index;
+    NbtTag root;
+    NbtTag* section;
+    std::vector<uint16_t> indices;
+    uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+    uint16_t states[PACKED_CHUNK_RECORD_SIZE];
+};
+
+static int section_y = 4;
+
+static std::mutex pool_mutex;
+static std::condition_variable pool_cv;
+static std::deque<std::function<void()>> pool_tasks;
+
+static std::mutex pipeline_mutex;
+static std::condition_variable pipeline_cv;
+static int chunks_in_flight = 0;
+static int regions_open = 0;
+
+static std::mutex jobs_mutex;
+static std::unordered_map<int32_t, ChunkWork*> jobs;
+
+static std::atomic<int64_t> chunks_generated(0);
+static std::atomic<int64_t> chunks_copied(0);
+static std::atomic<int64_t> chunks_failed(0);
+static std::atomic<int64_t> regions_written(0);
+
+static void pool_post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        pool_tasks.push_back(std::move(task));
+    }
+    pool_cv.notify_one();
+}
+
+static void pool_worker() {
+
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex);
+            pool_cv.wait(lock, [] { return !pool_tasks.empty(); });
+            task = std::move(pool_tasks.front());
+            pool_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+static bool inflate_chunk(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    /* 32 detects the gzip and zlib headers both */
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+        return false;
+    }
+
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)size;
+    out.resize(size * 4 + REGION_SECTOR_SIZE);
+
+    int result;
+
+    do {
+        if (stream.total_out == out.size()) {
+            if (out.size() >= CHUNK_MAX_NBT_SIZE) {
+                break;
+            }
+            out.resize(out.size() * 2);
+        }
+
+        stream.next_out = out.data() + stream.total_out;
+        stream.avail_out = (uInt)(out.size() - stream.total_out);
+        result = inflate(&stream, Z_NO_FLUSH);
+
+    } while (result == Z_OK);
+
+    out.resize(stream.total_out);
+    inflateEnd(&stream);
+
+    return result == Z_STREAM_END;
+}
+
+static bool deflate_chunk(const std::vector<uint8_t>& nbt, std::vector<uint8_t>& out) {
+
+    uLongf size = compressBound((uLong)nbt.size());
+    out.resize(1 + size);
+    out[0] = (uint8_t)CHUNK_COMPRESSION_ZLIB;
+
+    if (compress2(out.data() + 1, &size, nbt.data(), (uLong)nbt.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return false;
+    }
+
+    out.resize(1 + size);
+    return true;
+}
+
+/**
+ * @brief Find a region chunk's stored payload, its compression byte then the data.
+ * @return true if the chunk is present and its location is valid.
+ */
+static bool chunk_payload(const Region* region, int index, const uint8_t** payload, size_t* size) {
+
+    uint32_t location = region->locations[index];
+    size_t offset = (size_t)(location >> 8) * REGION_SECTOR_SIZE;
+    size_t sectors = location & 0xFF;
+
+    if (location == 0 || offset < (size_t)REGION_HEADER_SIZE || offset + 4 > region->file.size()) {
+        return false;
+    }
+
+    const uint8_t* stored = region->file.data() + offset;
+    size_t length = ((size_t)stored[0] << 24) | ((size_t)stored[1] << 16) | ((size_t)stored[2] << 8) | stored[3];
+
+    if (length < 1 || length + 4 > sectors * REGION_SECTOR_SIZE || offset + 4 + length > region->file.size()) {
+        return false;
+    }
+
+    *payload = stored + 4;
+    *size = length;
+    return true;
+}
+
+static bool write_region(Region* region) {
+
+    std::vector<uint8_t> header(REGION_HEADER_SIZE, 0);
+    std::string temporary_path = region->output_path + ".tmp";
+    FILE* file = fopen(temporary_path.c_str(), "wb");
+
+    if (!file) {
+        return false;
+    }
+
+    bool ok = fwrite(header.data(), header.size(), 1, file) == 1;
+    uint32_t sector = REGION_HEADER_SIZE / REGION_SECTOR_SIZE;
+    static const uint8_t padding[REGION_SECTOR_SIZE] = {};
+
+    for (int i = 0; i < REGION_CHUNKS && ok; i++) {
+
+        const uint8_t* payload;
+        size_t size;
+
+        if (!region->rewritten[i].empty()) {
+            payload = region->rewritten[i].data();
+            size = region->rewritten[i].size();
+        } else if (!chunk_payload(region, i, &payload, &size)) {
+            continue;
+        }
+
+        uint32_t sectors = (uint32_t)((size + 4 + REGION_SECTOR_SIZE - 1) / REGION_SECTOR_SIZE);
+        uint8_t length[4] = { (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size };
+
+        size_t padding_size = sectors * REGION_SECTOR_SIZE - 4 - size;
+
+        ok = fwrite(length, 4, 1, file) == 1 &&
+             fwrite(payload, size, 1, file) == 1 &&
+             (padding_size == 0 || fwrite(padding, padding_size, 1, file) == 1);
+
+        uint32_t location = (sector << 8) | sectors;
+
+        for (int b = 0; b < 4; b++) {
+            header[4 * i + b] = (uint8_t)(location >> (24 - 8 * b));
+            header[REGION_SECTOR_SIZE + 4 * i + b] = (uint8_t)(region->timestamps[i] >> (24 - 8 * b));
+        }
+
+        sector += sectors;
+    }
+
+    ok = ok && file_seek(file, 0, SEEK_SET) == 0 && fwrite(header.data(), header.size(), 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+
+#if defined(_MSC_VER)
+    /* rename() doesn't replace an existing file on Windows */
+    remove(region->output_path.c_str());
+#endif
+
+    return ok && rename(temporary_path.c_str(), region->output_path.c_str()) == 0;
+}
+
+/**
+ * @brief Drop a hold on a region, writing and freeing it once nothing holds it.
+ */
+static void region_release(Region* region) {
+    {
+        std::lock_guard<std::mutex> lock(pipeline_mutex);
+        if (--region->remaining > 0) {
+            return;
+        }
+    }
+
+    if (write_region(region)) {
+        regions_written++;
+        printf("[anvil] wrote %s\n", region->output_path.c_str());
+    } else {
+        printf("Failed to write %s\n", region->output_path.c_str());
+    }
+    fflush(stdout);
+
+    delete region;
+
+    {
+        std::lock_guard<std::mutex> lock(pipeline_mutex);
+        regions_open--;
+    }
+    pipeline_cv.notify_all();
+}
+
+static void chunk_finish(ChunkWork* work) {
+
+    Region* region = work->region;
+    delete work;
+
+    {
+        std::lock_guard<std::mutex> lock(pipeline_mutex);
+        chunks_in_flight--;
+    }
+    pipeline_cv.notify_all();
+
+    region_release(region);
+}
+
+/**
+ * @brief Worker task: inflate and parse a chunk, and submit the context of its section.
+ *        Chunks that can't be generated are finished right away and copied as is.
+ */
+static void chunk_decode(ChunkWork* work) {
+
+    const uint8_t* payload;
+    size_t size;
+    std::vector<uint8_t> nbt;
+
+    chunk_payload(work->region, work->index, &payload, &size);
+    int compression = payload[0];
+
+    if (compression == CHUNK_COMPRESSION_GZIP || compression == CHUNK_COMPRESSION_ZLIB) {
+        if (!inflate_chunk(payload + 1, size - 1, nbt)) {
+            chunks_failed++;
+            chunk_finish(work);
+            return;
+        }
+    } else if (compression == CHUNK_COMPRESSION_NONE) {
+        nbt.assign(payload + 1, payload + size);
+    } else {
+        /* External or LZ4 */
+        chunks_copied++;
+        chunk_finish(work);
+        return;
+    }
+
+    if (!nbt_parse(nbt, work->root)) {
+        chunks_failed++;
+        chunk_finish(work);
+        return;
+    }
+
+    nbt.clear();
+    nbt.shrink_to_fit();
+
+    const NbtTag* status = work->root.find("Status", NBT_STRING);
+    NbtTag* sections = work->root.find("sections", NBT_LIST);
+    NbtTag* block_states = NULL;
+    work->section = NULL;
+
+    if (status && (status->string == "minecraft:full" || status->string == "full") && sections) {
+        for (NbtTag& section : sections->items) {
+
+            const NbtTag* y = section.find("Y", NBT_BYTE);
+
+            if (section.type == NBT_COMPOUND && y && y->number == section_y) {
+                work->section = &section;
+                block_states = section.find("block_states", NBT_COMPOUND);
+                break;
+            }
+        }
+    }
+
+    if (!block_states || !section_unpack(*block_states, work->indices)) {
+        chunks_copied++;
+        chunk_finish(work);
+        return;
+    }
+
+    const NbtTag* palette = block_states->find("palette", NBT_LIST);
+    std::vector<uint8_t> palette_ids(palette->items.size());
+
+    for (size_t i = 0; i < palette_ids.size(); i++) {
+        palette_ids[i] = (uint8_t)context_block_id(palette->items[i]);
+    }
+
+    for         (int x = 0; x < CHUNK_WIDTH; x++) {
+        for     (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int z = 0; z < CHUNK_WIDTH; z++) {
+                work->context[packed_index(x, y, z, CHUNK_WIDTH)] = palette_ids[work->indices[section_order(x, y, z)]];
+            }
+        }
+    }
+
+    /* Held across the submit so the collector can't see the job before it's mapped */
+    std::lock_guard<std::mutex> lock(jobs_mutex);
+    int32_t job_id;
+
+    if (async_submit_batch(work->context, 1, &job_id) == 1 && job_id > 0) {
+        jobs[job_id] = work;
+    } else {
+        chunks_failed++;
+        pool_post([work] { chunk_finish(work); });
+    }
+}
+
+/**
+ * @brief Worker task: write a finished job's states into its section, then re-encode
+ *        and deflate the chunk.
+ */
+static void chunk_encode(ChunkWork* work) {
+
+    NbtTag* block_states = work->section->find("block_states", NBT_COMPOUND);
+    std::vector<NbtTag>& old_palette = block_states->find("palette", NBT_LIST)->items;
+
+    /* Border blocks keep their entries, generated blocks get the entry of their state.
+     * A state the border already uses shares its entry */
+    std::vector<NbtTag> palette;
+    std::vector<int> old_to_new(old_palette.size(), -1);
+    std::unordered_map<uint16_t, int> state_to_new;
+    std::unordered_map<std::string, int> key_to_new;
+    std::vector<uint16_t> indices(SECTION_BLOCKS);
+
+    auto add_entry = [&](NbtTag entry) {
+        auto found = key_to_new.emplace(palette_key(entry), (int)palette.size());
+        if (found.second) {
+            palette.push_back(std::move(entry));
+        }
+        return found.first->second;
+    };
+
+    for         (int x = 0; x < CHUNK_WIDTH; x++) {
+        for     (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int z = 0; z < CHUNK_WIDTH; z++) {
+
+                int i = section_order(x, y, z);
+
+                if (is_generated(x, y, z)) {
+
+                    uint16_t state = work->states[packed_index(x - 1, y - 1, z - 1, GENERATED_WIDTH)];
+
+                    if (block_state_id(state) >= BLOCK_STATE_PALETTE_SIZE) {
+                        state = block_state_pack(0, 0);
+                    }
+
+                    auto found = state_to_new.find(state);
+
+                    if (found == state_to_new.end()) {
+                        found = state_to_new.emplace(state, add_entry(palette_entry(state))).first;
+                    }
+
+                    indices[i] = (uint16_t)found->second;
+
+                } else {
+
+                    int old_index = work->indices[i];
+
+                    if (old_to_new[old_index] < 0) {
+                        old_to_new[old_index] = add_entry(old_palette[old_index]);
+                    }
+
+                    indices[i] = (uint16_t)old_to_new[old_index];
+                }
+            }
+        }
+    }
+
+    section_pack(*block_states, std::move(palette), indices);
+
+    /* Let the game relight the chunk and recompute its heightmaps on load */
+    work->section->remove("SkyLight");
+    work->section->remove("BlockLight");
+    work->root.set("isLightOn", nbt_byte(0));
+
+    NbtTag* heightmaps = work->root.find("Heightmaps", NBT_COMPOUND);
+
+    if (heightmaps) {
+        heightmaps->items.clear();
+        heightmaps->names.clear();
+    }
+
+    /* Block entities of replaced blocks would be orphaned */
+    NbtTag* block_entities = work->root.find("block_entities", NBT_LIST);
+    const NbtTag* x_pos = work->root.find("xPos", NBT_INT);
+    const NbtTag* z_pos = work->root.find("zPos", NBT_INT);
+
+    if (block_entities && x_pos && z_pos) {
+
+        std::vector<NbtTag>& items = block_entities->items;
+
+        for (size_t i = items.size(); i-- > 0; ) {
+
+            const NbtTag* x = items[i].find("x", NBT_INT);
+            const NbtTag* y = items[i].find("y", NBT_INT);
+            const NbtTag* z = items[i].find("z", NBT_INT);
+
+            if (x && y && z && is_generated((int)(x->number - x_pos->number * CHUNK_WIDTH),
+                                            (int)(y->number - section_y * CHUNK_WIDTH),
+                                            (int)(z->number - z_pos->number * CHUNK_WIDTH))) {
+                items.erase(items.begin() + i);
+            }
+        }
+    }
+
+    std::vector<uint8_t> nbt;
+    std::vector<uint8_t> payload;
+    nbt_write(nbt, work->root);
+
+    if (deflate_chunk(nbt, payload) && (payload.size() + 4) <= (size_t)REGION_MAX_SECTORS * REGION_SECTOR_SIZE) {
+        work->region->rewritten[work->index] = std::move(payload);
+        work->region->timestamps[work->index] = (uint32_t)time(NULL);
+        chunks_generated++;
+    } else {
+        chunks_failed++;
+    }
+
+    chunk_finish(work);
+}
+
+static void collect_jobs() {
+
+    for (;;) {
+
+        int32_t job_id = job_wait_async(COLLECT_WAIT_NS);
+
+        if (job_id == 0) {
+            continue;
+        }
+
+        ChunkWork* work = NULL;
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            auto found = jobs.find(job_id);
+
+            if (found != jobs.end()) {
+                work = found->second;
+                jobs.erase(found);
+            }
+        }
+
+        if (!work) {
+            continue;
+        }
+
+        if (async_take_job(job_id, work->states) == JOB_STATE_DONE) {
+            pool_post([work] { chunk_encode(work); });
+        } else {
+            chunks_failed++;
+            pool_post([work] { chunk_finish(work); });
+        }
+    }
+}
+
+/**
+ * @brief Read a region file and queue every chunk it holds.
+ * @return true on success
+ */
+static bool process_region(const char* path, const std::string& output_dir, int max_in_flight) {
+
+    FILE* file = fopen(path, "rb");
+
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+
+    Region* region = new Region();
+
+    file_seek(file, 0, SEEK_END);
+    region->file.resize((size_t)file_tell(file));
+    file_seek(file, 0, SEEK_SET);
+
+    bool ok = region->file.size() >= (size_t)REGION_HEADER_SIZE &&
+              fread(region->file.data(), region->file.size(), 1, file) == 1;
+    fclose(file);
+
+    if (!ok) {
+        printf("%s is not a region file\n", path);
+        delete region;
+        return false;
+    }
+
+    const char* name = path + strlen(path);
+
+    while (name > path && name[-1] != '/' && name[-1] != '\\') {
+        name--;
+    }
+
+    region->output_path = output_dir + "/" + name;
+
+    const uint8_t* header = region->file.data();
+
+    for (int i = 0; i < REGION_CHUNKS; i++) {
+        region->locations[i]  = ((uint32_t)header[4 * i] << 24) | ((uint32_t)header[4 * i + 1] << 16) |
+                                ((uint32_t)header[4 * i + 2] << 8) | header[4 * i + 3];
+        const uint8_t* stamp = header + REGION_SECTOR_SIZE + 4 * i;
+        region->timestamps[i] = ((uint32_t)stamp[0] << 24) | ((uint32_t)stamp[1] << 16) | ((uint32_t)stamp[2] << 8) | stamp[3];
+    }
+
+    /* The main thread's own hold keeps the region from being written before every chunk is queued */
+    {
+        std::lock_guard<std::mutex> lock(pipeline_mutex);
+        region->remaining = 1;
+        regions_open++;
+    }
+
+    int corrupt = 0;
+
+    for (int i = 0; i < REGION_CHUNKS; i++) {
+
+        const uint8_t* payload;
+        size_t size;
+
+        if (region->locations[i] == 0) {
+            continue;
+        }
+
+        if (!chunk_payload(region, i, &payload, &size)) {
+            corrupt++;
+            continue;
+        }
+
+        if (payload[0] & CHUNK_COMPRESSION_EXTERNAL) {
+            chunks_copied++;
+            continue;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(pipeline_mutex);
+            pipeline_cv.wait(lock, [max_in_flight] { return chunks_in_flight < max_in_flight; });
+            chunks_in_flight++;
+            region->remaining++;
+        }
+
+        ChunkWork* work = new ChunkWork();
+        work->region = region;
+        work->index = i;
+        pool_post([work] { chunk_decode(work); });
+    }
+
+    if (corrupt > 0) {
+        printf("%s: dropped %d chunks with invalid locations, the game regenerates them\n", path, corrupt);
+    }
+
+    region_release(region);
+    return true;
+}
+
+static void print_usage() {
+    printf("Usage: anvil_pregen [--regions-file PATH] [--section N] [--threads N] [--in-flight N] [--no-settle] [--stats-json PATH] --out DIR <r.X.Z.mca ...>\n");
+}
+
+int main(int argc, char** argv) {
+
+    std::vector<std::string> region_paths;
+    const char* output_dir = NULL;
+    const char* regions_file = NULL;
+    const char* stats_json_path = NULL;
+    int threads = (int)std::thread::hardware_concurrency();
+    int max_in_flight = 48;
+    bool settle = true;
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            output_dir = argv[++i];
+        } else if (strcmp(argv[i], "--regions-file") == 0 && i + 1 < argc) {
+            regions_file = argv[++i];
+        } else if (strcmp(argv[i], "--section") == 0 && i + 1 < argc) {
+            section_y = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--in-flight") == 0 && i + 1 < argc) {
+            max_in_flight = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-settle") == 0) {
+            settle = false;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_json_path = argv[++i];
+        } else if (argv[i][0] != '-') {
+            region_paths.push_back(argv[i]);
+        } else {
+            print_usage();
+            return INFER_ERROR_INVALID_ARG;
+        }
+    }
+
+    if (regions_file) {
+
+        FILE* list = fopen(regions_file, "r");
+
+        if (!list) {
+            printf("Failed to open %s\n", regions_file);
+            return INFER_ERROR_INVALID_ARG;
+        }
+
+        char line[4096];
+
+        while (fgets(line, sizeof(line), list)) {
+            line[strcspn(line, "\r\n")] = 0;
+            if (line[0]) {
+                region_paths.push_back(line);
+            }
+        }
+
+        fclose(list);
+    }
+
+    /* Jobs past MAX_JOBS would be rejected rather than queued */
+    if (!output_dir || region_paths.empty() || threads < 1 || max_in_flight < 1 || max_in_flight > MAX_JOBS) {
+        print_usage();
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    int result = Java_tbarnes_diffusionmod_Inference_init(NULL, NULL);
+
+    if (result != 0) {
+        printf("init failed (%d)\n", result);
+        return result;
+    }
+
+    Java_tbarnes_diffusionmod_Inference_setSettleMode(NULL, NULL, settle ? SETTLE_ALL : 0);
+
+    for (int i = 0; i < threads; i++) {
+        std::thread(pool_worker).detach();
+    }
+
+    std::thread(collect_jobs).detach();
+
+    auto run_start = std::chrono::steady_clock::now();
+    int64_t regions_failed = 0;
+
+    for (const std::string& path : region_paths) {
+        {
+            std::unique_lock<std::mutex> lock(pipeline_mutex);
+            pipeline_cv.wait(lock, [] { return regions_open < MAX_OPEN_REGIONS; });
+        }
+
+        if (!process_region(path.c_str(), output_dir, max_in_flight)) {
+            regions_failed++;
+        }
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(pipeline_mutex);
+        pipeline_cv.wait(lock, [] { return regions_open == 0; });
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+
+    printf("Wrote %lld regions in %.1f s: %lld chunks generated (%.3f chunks/s), %lld copied, %lld failed\n",
+        (long long)regions_written.load(), elapsed, (long long)chunks_generated.load(),
+        chunks_generated.load() / elapsed, (long long)chunks_copied.load(), (long long)chunks_failed.load());
+
+    if (stats_json_path) {
+        FILE* stats_file = fopen(stats_json_path, "w");
+
+        if (stats_file) {
+            stats_write_json(stats_file);
+            fclose(stats_file);
+        } else {
+            printf("Failed to write %s\n", stats_json_path);
+        }
+    }
+
+    /* The denoise thread lives for the lifetime of the process and can't be joined,
+     * so exit without running static destructors */
+    fflush(stdout);
+    _Exit((regions_failed > 0 || chunks_failed.load() > 0) ? INFER_ERROR_FAILED_OPERATION : 0);
+}
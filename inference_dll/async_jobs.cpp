@@ -0,0 +1,125 @@
+/**
+ * @file async_jobs.cpp
+ * @brief Entry points for worldgen threads. See async_jobs.h.
+ *
+ *  Like tick_buffer.cpp this includes "jni.h", to resolve direct ByteBuffers.
+ */
+
+#include <atomic>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <jni.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "job_queue.h"
+#include "block_states.h"
+#include "stats.h"
+#include "recorder.h"
+#include "async_jobs.h"
+
+static std::atomic<int32_t> next_async_id{ ASYNC_JOB_ID_FIRST };
+
+int async_submit_batch(const uint8_t* contexts, int32_t count, int32_t* job_ids) {
+
+    record_call(RECORD_SUBMIT_ASYNC_BATCH, { count }, contexts, count * PACKED_CONTEXT_RECORD_SIZE);
+
+    int submitted = 0;
+
+    for (int32_t i = 0; i < count; i++) {
+
+        int32_t job_id = next_async_id++;
+        int result = job_submit(job_id, contexts + (int64_t)i * PACKED_CONTEXT_RECORD_SIZE);
+
+        job_ids[i] = (result == 0) ? job_id : -result;
+        submitted += (result == 0) ? 1 : 0;
+    }
+
+    stat_add(STAT_ASYNC_BATCHES, 1);
+    stat_add(STAT_ASYNC_JOBS, submitted);
+
+    return submitted;
+}
+
+int async_take_job(int32_t job_id, uint16_t* states) {
+
+    static thread_local uint8_t block_ids[PACKED_CHUNK_RECORD_SIZE];
+    static thread_local uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+
+    int32_t error = 0;
+    int state = job_take_async(job_id, block_ids, context, &error);
+
+    if (state == JOB_STATE_DONE) {
+        block_states_compute(context, block_ids, states);
+    } else if (error != 0) {
+        inference_set_last_error(error);
+    }
+
+    return state;
+}
+
+/**
+ * @brief submitAsyncBatch
+ *  Submit contexts from any thread, see async_jobs.h.
+ * @param: contexts Direct buffer of count 16^3 context records
+ * @param: count Number of records
+ * @param: job_ids Direct buffer receiving count ints: the job id of each record, or
+ *         the negated error code if it was rejected
+ * @return: Number of jobs submitted, or -1 if the buffers are too small
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_submitAsyncBatch(JNIEnv* env, jclass unused,
+        jobject contexts, int32_t count, jobject job_ids) {
+
+    uint8_t* context_data = (uint8_t*)env->GetDirectBufferAddress(contexts);
+    int32_t* job_id_data = (int32_t*)env->GetDirectBufferAddress(job_ids);
+
+    if (!context_data || !job_id_data || count < 0 ||
+        env->GetDirectBufferCapacity(contexts) < (int64_t)count * PACKED_CONTEXT_RECORD_SIZE ||
+        env->GetDirectBufferCapacity(job_ids) < (int64_t)count * (int64_t)sizeof(int32_t)) {
+
+        inference_set_last_error(INFER_ERROR_INVALID_ARG);
+        return -1;
+    }
+
+    return async_submit_batch(context_data, count, job_id_data);
+}
+
+/**
+ * @brief waitAsyncJob
+ *  Block until a job from submitAsyncBatch() finishes. Each job is returned once.
+ * @param: timeout_ms Longest wait
+ * @return: Id of the finished job, 0 on timeout
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_waitAsyncJob(void* unused1, void* unused2, int32_t timeout_ms) {
+
+    record_call(RECORD_WAIT_ASYNC_JOB, { timeout_ms });
+
+    return job_wait_async((int64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000000);
+}
+
+/**
+ * @brief takeAsyncJob
+ *  Take the outcome of a job returned by waitAsyncJob() and free it.
+ * @param: job_id 
+ * @param: states Direct buffer receiving 14^3 shorts: the state index (block_states.h)
+ *         of each generated block, if the job is done
+ * @return: JOB_STATE_ constant. The error of a failed job is in getLastError().
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_takeAsyncJob(JNIEnv* env, jclass unused, int32_t job_id, jobject states) {
+
+    record_call(RECORD_TAKE_ASYNC_JOB, { job_id });
+
+    uint16_t* state_data = (uint16_t*)env->GetDirectBufferAddress(states);
+
+    if (!state_data || env->GetDirectBufferCapacity(states) < PACKED_CHUNK_RECORD_SIZE * (int64_t)sizeof(uint16_t)) {
+        inference_set_last_error(INFER_ERROR_INVALID_ARG);
+        return JOB_STATE_FREE;
+    }
+
+    return async_take_job(job_id, state_data);
+}
@@ -0,0 +1,47 @@
+/**
+ * @file async_jobs.h
+ * @brief Job submission for worldgen worker threads.
+ *
+ *  The tick buffers (tick_buffer.h) belong to the server thread. Chunk generation
+ *  runs on Minecraft's worldgen workers instead, many at once, and has to wait for
+ *  its structures without holding the server thread. These entry points may be
+ *  called from any thread and never wait on the denoise thread:
+ *
+ *   submitAsyncBatch()  Submits any number of contexts in one call and returns a
+ *                       job id for each, from ASYNC_JOB_ID_FIRST up.
+ *   waitAsyncJob()      Blocks the calling thread until one of those jobs finishes,
+ *                       or a timeout passes.
+ *   takeAsyncJob()      Returns the final state indices (block_states.h) of a
+ *                       finished job and frees it.
+ *
+ *  The mod batches the requests of all worldgen threads into one submit call per
+ *  round and completes their futures from a single thread that waits here (see
+ *  DiffusionWorldgen.java). The backend steps one chunk at a time, so a batch is
+ *  one native call and one pass over the job table, not a batched model step.
+ *
+ *  Async jobs share the job table and the scheduling policy with the tick's jobs,
+ *  and count towards MAX_JOBS.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "packed_chunk.h"
+
+/**
+ * @brief Submit contexts without going through JNI, as submitAsyncBatch() does.
+ *        Used by the native tools.
+ * @param contexts count records of PACKED_CONTEXT_RECORD_SIZE bytes
+ * @param job_ids Receives the id of each job, or the negated error code of a
+ *        rejected submission.
+ * @return Number of jobs submitted
+ */
+int async_submit_batch(const uint8_t* contexts, int32_t count, int32_t* job_ids);
+
+/**
+ * @brief Take a finished async job without going through JNI, as takeAsyncJob() does.
+ * @param states Receives PACKED_CHUNK_RECORD_SIZE state indices if the job is DONE.
+ * @return JOB_STATE_ constant
+ */
+int async_take_job(int32_t job_id, uint16_t* states);
@@ -0,0 +1,59 @@
+/**
+ * @file backend.h
+ * @brief Interface between the denoise thread and whatever runs the model.
+ *
+ *  The denoise thread in inference_main.cpp owns the schedule and the loops over
+ *  timesteps; a backend only runs single model steps on its inputs. The TensorRT
+ *  backend (backend_tensorrt.cpp) is the real one. The mock backend
+ *  (backend_mock.cpp) needs no GPU and is used by the tools when the DLL sources
+ *  are compiled with INFERENCE_MOCK_BACKEND defined.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "inference.h"
+
+class DenoiseBackend {
+public:
+    virtual ~DenoiseBackend() {}
+
+    virtual const char* name() const = 0;
+
+    /**
+     * @brief Load the model and allocate buffers. Called once, on the thread that
+     *        makes every later call.
+     * @return 0 on success, error code on failure.
+     */
+    virtual int init() = 0;
+
+    /**
+     * @brief Set the "context" and "mask" inputs of every following step.
+     */
+    virtual int set_context(const float x_context[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                            const float x_mask[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) = 0;
+
+    /**
+     * @brief Run one model step on x_t at timestep t and write the result to x_out.
+     *        Blocks until x_out is ready.
+     */
+    virtual int step(int32_t t, float alpha_t, float alpha_bar_t, float beta_t,
+                     const float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                     float x_out[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) = 0;
+};
+
+DenoiseBackend* create_tensorrt_backend();
+DenoiseBackend* create_mock_backend();
+
+/**
+ * @brief Time the mock backend spends in every step, standing in for the GPU.
+ *        Defaults to the INFERENCE_MOCK_STEP_US environment variable, or 200 us.
+ */
+void mock_backend_set_step_time(int64_t step_ns);
+
+/**
+ * @brief Make one mock step fail, the way a CUDA error would, after this many more
+ *        steps. Used to exercise the supervisor (supervisor.h).
+ */
+void mock_backend_fail_step(int64_t steps_from_now);
@@ -0,0 +1,107 @@
+/**
+ * @file backend_mock.cpp
+ * @brief Denoise backend that needs no GPU or model file. See backend.h.
+ *
+ *  Every step waits for a fixed time, standing in for the model, and then moves x_t
+ *  a little towards a target built from the context: the context shifted up by one
+ *  voxel, so solid blocks "grow" upwards. The output is deterministic apart from the
+ *  initial noise and decodes to plausible ids, which is all the tools need.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "inference.h"
+#include "backend.h"
+
+static std::atomic<int64_t> mock_step_ns = -1;
+static std::atomic<int64_t> mock_steps_until_failure = -1;
+
+void mock_backend_set_step_time(int64_t step_ns) {
+    mock_step_ns = step_ns;
+}
+
+void mock_backend_fail_step(int64_t steps_from_now) {
+    mock_steps_until_failure = steps_from_now;
+}
+
+static int64_t step_time_ns() {
+
+    int64_t step_ns = mock_step_ns;
+
+    if (step_ns < 0) {
+        const char* step_us = getenv("INFERENCE_MOCK_STEP_US");
+        step_ns = (step_us ? atoll(step_us) : 200) * 1000;
+        mock_step_ns = step_ns;
+    }
+
+    return step_ns;
+}
+
+class MockBackend : public DenoiseBackend {
+public:
+    const char* name() const override {
+        return "mock";
+    }
+
+    int init() override {
+        return 0;
+    }
+
+    int set_context(const float x_context[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                    const float x_mask[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) override {
+
+        for             (int d = 0; d < EMBEDDING_DIMENSIONS; d++) {
+            for         (int x = 0; x < CHUNK_WIDTH; x++) {
+                for     (int y = 0; y < CHUNK_WIDTH; y++) {
+                    for (int z = 0; z < CHUNK_WIDTH; z++) {
+                        target[d][x][y][z] = x_context[d][x][(y > 0) ? y - 1 : 0][z];
+                    }
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    int step(int32_t t, float alpha_t, float alpha_bar_t, float beta_t,
+             const float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+             float x_out[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) override {
+
+        /* Spin rather than sleep, sleeping is far too coarse for step times of a few
+         * hundred microseconds */
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(step_time_ns());
+
+        while (std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+
+        if (mock_steps_until_failure >= 0 && mock_steps_until_failure-- == 0) {
+            return INFER_ERROR_ENQUEUE;
+        }
+
+        /* Reaches the target exactly at t = 0. x_out may be x_t. */
+        float k = 1.0f / (float)(t + 1);
+
+        const float* in = &x_t[0][0][0][0];
+        const float* to = &target[0][0][0][0];
+        float* out = &x_out[0][0][0][0];
+
+        for (int i = 0; i < EMBEDDING_DIMENSIONS * CHUNK_WIDTH * CHUNK_WIDTH * CHUNK_WIDTH; i++) {
+            out[i] = in[i] + k * (to[i] - in[i]);
+        }
+
+        return 0;
+    }
+
+private:
+    float target[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+};
+
+DenoiseBackend* create_mock_backend() {
+    return new MockBackend();
+}
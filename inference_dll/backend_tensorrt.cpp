@@ -0,0 +1,304 @@
+/**
+ * @file backend_tensorrt.cpp
+ * @brief Denoise backend running the exported ONNX model with the NVIDIA TensorRT
+ *        runtime. See backend.h.
+ */
+
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <NvOnnxParser.h>
+#include <NvInfer.h>
+#include <cuda_runtime_api.h>
+
+#include "inference.h"
+#include "backend.h"
+
+/* This macro is used to print CUDA errors at a specific line number and return 
+ * a failed operation error code */
+#define CUDA_CHECK(expression) { \
+        cudaError_t err = (expression);\
+        if (err != cudaSuccess) { \
+            printf("CUDA error at line %d. (%s)\n", __LINE__, cudaGetErrorString(err)); \
+            return INFER_ERROR_FAILED_OPERATION; \
+        } \
+    }
+
+/*
+ * Constants:
+ */
+const int size_x              = 3 * 16 * 16 * 16 * sizeof(float);
+const int size_x_context      = 3 * 16 * 16 * 16 * sizeof(float);
+const int size_x_mask         = 1 * 16 * 16 * 16 * sizeof(float);
+
+const char *onnx_file_path = "C:/Users/tbarnes/Desktop/projects/voxelnet/experiments/TestTensorRT/ddim_single_update.onnx";
+const char *engine_cache_path = "C:/Users/tbarnes/Desktop/projects/voxelnet/experiments/TestTensorRT/ddim_single_update.trt";
+
+class TensorRTBackend : public DenoiseBackend {
+public:
+    const char* name() const override {
+        return "TensorRT";
+    }
+
+    ~TensorRTBackend() override;
+
+    int init() override;
+    int set_context(const float x_context[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                    const float x_mask[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) override;
+    int step(int32_t t, float alpha_t, float alpha_bar_t, float beta_t,
+             const float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+             float x_out[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) override;
+
+private:
+    nvinfer1::IExecutionContext* context = nullptr;
+    cudaStream_t stream = nullptr;
+
+    void* cuda_t = nullptr;
+    void* cuda_x_t = nullptr;
+    void* cuda_x_out = nullptr;
+    void* cuda_x_context = nullptr;
+    void* cuda_x_mask = nullptr;
+    void* cuda_alpha_t = nullptr;
+    void* cuda_alpha_bar_t = nullptr;
+    void* cuda_beta_t = nullptr;
+};
+
+/* The supervisor (supervisor.h) deletes a backend that failed and creates a new
+ * one, so everything init() allocated is given back. Errors are ignored, the
+ * device may be the reason the backend is going away. */
+TensorRTBackend::~TensorRTBackend() {
+
+    if (stream) {
+        cudaStreamDestroy(stream);
+    }
+
+    void* buffers[] = { cuda_t, cuda_x_t, cuda_x_out, cuda_x_context, cuda_x_mask,
+                        cuda_alpha_t, cuda_alpha_bar_t, cuda_beta_t };
+
+    for (void* buffer : buffers) {
+        if (buffer) {
+            cudaFree(buffer);
+        }
+    }
+
+    delete context;
+}
+
+int TensorRTBackend::init() {
+
+    /*
+     * Read the CUDA version 
+     */
+    int cuda_version;
+    cudaRuntimeGetVersion(&cuda_version);
+
+    /* Clear an error a failed backend may have left behind */
+    cudaGetLastError();
+
+    printf("TensorRT version: %d\n", getInferLibVersion());
+    printf("CUDA runtime version: %d\n", cuda_version);
+
+    /* 
+     * The full process for runtime is exporting is:
+     *  Pytorch (torch.onnx.export()) --> ONNX (nvonnxparser) --> .TRT
+     *
+     * The code below first checks if we already have a TensorRT .trt file. 
+     * If so, we use it. If not, we create the file by generating it from the ONNX file.
+     *
+     * Generating the .trt file from ONNX can take a while since TensorRT goes through a
+     * long optimization process.
+     */
+    class Logger : public nvinfer1::ILogger { /* Logger class required by createInferRuntime()*/
+        void log(Severity severity, const char* msg) noexcept override {
+            if (severity != Severity::kINFO)
+                printf("%s\n", msg);
+        }
+    } runtime_logger;
+
+    FILE* file = fopen(engine_cache_path, "rb");
+
+    nvinfer1::ICudaEngine* engine = nullptr;
+    nvinfer1::IRuntime* runtime = nvinfer1::createInferRuntime(runtime_logger);
+
+    if (!runtime) {
+        printf("Failed to create TensorRT runtime\n");
+        return INFER_ERROR_CREATE_RUNTIME;
+    }
+
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        size_t engine_size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        std::vector<char> engine_data(engine_size);
+
+        fread(engine_data.data(), 1, engine_size, file);
+        fclose(file);
+
+        engine = runtime->deserializeCudaEngine(engine_data.data(), engine_size);
+
+        if (!engine) {
+            printf("Failed to deserialize CUDA engine from %s\n", engine_cache_path);
+            return INFER_ERROR_DESERIALIZE_CUDA_ENGINE;
+        }
+        printf("Loaded prebuilt TensorRT engine from %s\n", engine_cache_path);
+
+    } else {
+        /* 
+         * The TensorRT .trt file wasn't found, so we need to generate it from the ONNX
+         * file and cache the result for next time.
+         */
+        nvinfer1::IBuilder *builder = nvinfer1::createInferBuilder(runtime_logger);
+        if (!builder) {
+            printf("Failed to create TensorRT builder\n");
+            return INFER_ERROR_BUILDING_FROM_ONNX;
+        }
+
+        nvinfer1::INetworkDefinition *network = builder->createNetworkV2(0);
+        if (!network) {
+            printf("Failed to create TensorRT network\n");
+            return INFER_ERROR_BUILDING_FROM_ONNX;
+        }
+
+        nvinfer1::IBuilderConfig *config = builder->createBuilderConfig();
+        if (!config) {
+            printf("Failed to create builder config\n");
+            return INFER_ERROR_BUILDING_FROM_ONNX;
+        }
+
+        nvonnxparser::IParser *parser = nvonnxparser::createParser(*network, runtime_logger);
+        if (!parser) {
+            printf("Failed to create ONNX parser\n");
+            return INFER_ERROR_BUILDING_FROM_ONNX;
+        }
+
+        if (!parser->parseFromFile(onnx_file_path, (int)nvinfer1::ILogger::Severity::kINFO)) {
+            printf("Error parsing ONNX file: %s\n", onnx_file_path);
+            return INFER_ERROR_BUILDING_FROM_ONNX;
+        }
+        printf("Successfully parsed ONNX model\n");
+
+        if (builder->platformHasFastFp16()) {
+            config->setFlag(nvinfer1::BuilderFlag::kFP16);
+            printf("Enabled FP16 precision\n");
+        }
+
+        config->setMemoryPoolLimit(nvinfer1::MemoryPoolType::kWORKSPACE, 1ULL << 30);
+
+        nvinfer1::IHostMemory *plan = builder->buildSerializedNetwork(*network, *config);
+        if (!plan) {
+            printf("Failed to build serialized network\n");
+            return INFER_ERROR_BUILDING_FROM_ONNX;
+        }
+
+        FILE* engine_out = fopen(engine_cache_path, "wb");
+
+        if (!engine_out) {
+            fclose(engine_out);
+            printf("Failed to save engine to %s\n", engine_cache_path);
+            return INFER_ERROR_ENGINE_SAVE;
+        }
+
+        fwrite(plan->data(), 1, plan->size(), engine_out);
+        fclose(engine_out);
+        printf("Saved serialized engine to %s\n", engine_cache_path);
+ 
+        engine = runtime->deserializeCudaEngine(plan->data(), plan->size());
+        if (!engine) {
+            printf("Failed to deserialize CUDA engine\n");
+            return INFER_ERROR_BUILDING_FROM_ONNX;
+        }
+
+        delete parser;
+        delete config;
+        delete network;
+        delete builder;
+    }
+
+    /* 
+     * Now that we have a TensorRT runtime, we need to setup the CUDA buffers to allow
+     * the denoising model to run.
+     */
+    context = engine->createExecutionContext();
+    if (!context) {
+        printf("Failed to create execution context\n");
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    printf("Number of layers in engine: %d\n", engine->getNbLayers());
+
+    printf("Finished trt init\n");
+
+    /* 
+     * Allocate buffers for the inputs and outputs of the CUDA model
+     * Some of these buffers are relatively large, such as the x_t buffer,
+     * while others only contain a single floating point number.
+     *
+     * The tensor addresses must match the names on the Pytorch torch.onnx.export().
+     */
+    CUDA_CHECK(cudaMalloc(&cuda_t,           sizeof(int32_t)));
+    CUDA_CHECK(cudaMalloc(&cuda_x_t,         size_x)); // Input for each model step
+    CUDA_CHECK(cudaMalloc(&cuda_x_out,       size_x)); // Output produced by the model
+    CUDA_CHECK(cudaMalloc(&cuda_x_context,   size_x_context));
+    CUDA_CHECK(cudaMalloc(&cuda_x_mask,      size_x_mask));
+    CUDA_CHECK(cudaMalloc(&cuda_alpha_t,     sizeof(float)));
+    CUDA_CHECK(cudaMalloc(&cuda_alpha_bar_t, sizeof(float)));
+    CUDA_CHECK(cudaMalloc(&cuda_beta_t,      sizeof(float)));
+
+    if (!context->setTensorAddress("t", cuda_t))                     { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+    if (!context->setTensorAddress("x_t", cuda_x_t))                 { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+    if (!context->setTensorAddress("x_out", cuda_x_out))             { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+    if (!context->setTensorAddress("context", cuda_x_context))       { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+    if (!context->setTensorAddress("mask", cuda_x_mask))             { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+    if (!context->setTensorAddress("alpha_t", cuda_alpha_t))         { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+    if (!context->setTensorAddress("alpha_bar_t", cuda_alpha_bar_t)) { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+    if (!context->setTensorAddress("beta_t", cuda_beta_t))           { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+
+    CUDA_CHECK(cudaStreamCreate(&stream));
+
+    return 0;
+}
+
+int TensorRTBackend::set_context(const float x_context[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                                 const float x_mask[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) {
+
+    /* Copy the "context" and "mask" tensors to the GPU */
+    CUDA_CHECK(cudaMemcpy(cuda_x_context, x_context, size_x_context, cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpy(cuda_x_mask, x_mask, size_x_mask, cudaMemcpyHostToDevice));
+
+    return 0;
+}
+
+int TensorRTBackend::step(int32_t t, float alpha_t, float alpha_bar_t, float beta_t,
+                          const float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                          float x_out[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) {
+
+    /* Copy the relevant input buffers for the TensorRT model */
+    CUDA_CHECK(cudaMemcpy(cuda_t, &t, sizeof(int32_t), cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpy(cuda_x_t, x_t, size_x, cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpy(cuda_alpha_t, &alpha_t, sizeof(float), cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpy(cuda_alpha_bar_t, &alpha_bar_t, sizeof(float), cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpy(cuda_beta_t, &beta_t, sizeof(float), cudaMemcpyHostToDevice));
+
+    /* Run the model asynchronously */
+    bool enqueue_succeeded = context->enqueueV3(stream);
+
+    if (!enqueue_succeeded) {
+        printf("enqueueV3 failed\n");
+        return INFER_ERROR_ENQUEUE;
+    }
+
+    /* Block waiting for the model to complete running */
+    CUDA_CHECK(cudaStreamSynchronize(stream));
+
+    /* x_out may be x_t, which is fine since x_t was already uploaded */
+    CUDA_CHECK(cudaMemcpy(x_out, cuda_x_out, size_x, cudaMemcpyDeviceToHost));
+
+    return 0;
+}
+
+DenoiseBackend* create_tensorrt_backend() {
+    return new TensorRTBackend();
+}
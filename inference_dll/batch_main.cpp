@@ -0,0 +1,429 @@
+/**
+ * @file batch_main.cpp
+ * @brief Offline batch generator. Reads a packed context stream (see packed_chunk.h),
+ *        submits every record to the job table (job_queue.h) and streams the
+ *        generated chunks to a packed chunk file. No Minecraft server is needed.
+ *
+ *        Up to --in-flight records are submitted at once, as the mod does through
+ *        the tick buffer, so the run measures the throughput of the scheduler and
+ *        not of one job at a time. Results are written in input order.
+ *
+ *        Memory use is constant: only the records in flight are held. The output
+ *        file is flushed after every record, so an interrupted run resumes from the
+ *        last completed record when restarted with the same arguments. A record
+ *        that fails or is cancelled stops the run, since the output has no way to
+ *        leave a gap.
+ *
+ *        Build by compiling this file together with every other .cpp file except
+ *        the *_main.cpp tools, with INFERENCE_NO_TEST_MAIN defined, using the same
+ *        include and library settings as inference.vcxproj. Define
+ *        INFERENCE_MOCK_BACKEND and leave out backend_tensorrt.cpp to run without a
+ *        GPU.
+ *
+ *  Usage: batch_generate [options] <contexts.vxct | -> <chunks.vxck>
+ *
+ *    --restart       Overwrite the output instead of resuming from it.
+ *    --count N       Stop after N records have been generated by this run.
+ *    --progress N    Print progress every N records (default 1).
+ *    --in-flight N   Records submitted at once (default 8, at most MAX_JOBS).
+ *    --library PATH  Also append every generated (context, result) pair to a
+ *                    structure library (see structure_library.h). Records that
+ *                    were answered from the loaded library aren't appended.
+ *    --history PREFIX Record every timestep of each record and export it to
+ *                    PREFIX<record>.vxhs (see history.h).
+ *    --perf          Sample hardware counters around the hot stages (see perf_counters.h).
+ *    --stats-json PATH  Write every stat and the per-stage metrics as JSON when done.
+ */
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+    #include <io.h>
+    #include <fcntl.h>
+#endif
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "stats.h"
+#include "structure_library.h"
+#include "history.h"
+#include "job_queue.h"
+
+/* How long to sleep between polls of the job table. A record takes seconds, so a
+ * millisecond of polling latency is negligible. */
+const int POLL_INTERVAL_MS = 1;
+
+const int DEFAULT_IN_FLIGHT = 8;
+
+/* Enough for every timestep of a run without evicting frames */
+const int64_t HISTORY_EXPORT_MAX_BYTES = 64 << 20;
+
+static void sleep_poll() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(POLL_INTERVAL_MS));
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* A record submitted to the job table, job id (record % in_flight) + 1 */
+struct BatchRecord {
+    int64_t record;
+    bool finished;
+    int32_t state;
+    int32_t error;
+    bool from_library;
+    uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+    uint8_t chunk[PACKED_CHUNK_RECORD_SIZE];
+};
+
+/**
+ * @brief Skip over records that a previous run already completed.
+ * @return true on success
+ */
+static bool skip_records(FILE* input, int64_t count) {
+
+    if (input != stdin) {
+        return file_seek(input, count * PACKED_CONTEXT_RECORD_SIZE, SEEK_CUR) == 0;
+    }
+
+    /* Pipes can't seek, so read and discard */
+    uint8_t discard[PACKED_CONTEXT_RECORD_SIZE];
+
+    for (int64_t i = 0; i < count; i++) {
+        if (fread(discard, PACKED_CONTEXT_RECORD_SIZE, 1, input) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Open the output file, either fresh or positioned after the last completed
+ *        record of a previous run.
+ * @return The file, or NULL on failure. completed is set to the number of records
+ *         already present.
+ */
+static FILE* open_output(const char* path, bool restart, int64_t* completed) {
+
+    *completed = 0;
+
+    if (!restart) {
+        FILE* file = fopen(path, "r+b");
+
+        if (file) {
+            if (!packed_read_header(file, PACKED_CHUNK_MAGIC, GENERATED_WIDTH)) {
+                printf("%s is not a packed chunk file, use --restart to overwrite it\n", path);
+                fclose(file);
+                return NULL;
+            }
+
+            file_seek(file, 0, SEEK_END);
+            int64_t data_size = (int64_t)file_tell(file) - (int64_t)sizeof(PackedHeader);
+
+            /* A partially written trailing record is simply overwritten */
+            *completed = data_size / PACKED_CHUNK_RECORD_SIZE;
+            file_seek(file, sizeof(PackedHeader) + *completed * PACKED_CHUNK_RECORD_SIZE, SEEK_SET);
+
+            return file;
+        }
+    }
+
+    FILE* file = fopen(path, "wb");
+
+    if (file && !packed_write_header(file, PACKED_CHUNK_MAGIC, GENERATED_WIDTH)) {
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+static void print_usage() {
+    printf("Usage: batch_generate [--restart] [--count N] [--progress N] [--in-flight N] [--library PATH] [--history PREFIX] [--perf] [--stats-json PATH] <contexts.vxct | -> <chunks.vxck>\n");
+}
+
+int main(int argc, char** argv) {
+
+    bool restart = false;
+    int64_t max_count = -1;
+    int64_t progress_interval = 1;
+    int in_flight = DEFAULT_IN_FLIGHT;
+    const char* input_path = NULL;
+    const char* output_path = NULL;
+    const char* library_path = NULL;
+    const char* history_prefix = NULL;
+    const char* stats_json_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "--restart") == 0) {
+            restart = true;
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            max_count = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc) {
+            progress_interval = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--in-flight") == 0 && i + 1 < argc) {
+            in_flight = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--library") == 0 && i + 1 < argc) {
+            library_path = argv[++i];
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            history_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            perf_set_enabled(true);
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_json_path = argv[++i];
+        } else if (!input_path) {
+            input_path = argv[i];
+        } else if (!output_path) {
+            output_path = argv[i];
+        } else {
+            print_usage();
+            return INFER_ERROR_INVALID_ARG;
+        }
+    }
+
+    if (!input_path || !output_path || progress_interval < 1 || in_flight < 1 || in_flight > MAX_JOBS) {
+        print_usage();
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    /*
+     * Open the input stream and work out how many records it holds (if it's a file)
+     */
+    FILE* input;
+    int64_t input_records = -1;
+
+    if (strcmp(input_path, "-") == 0) {
+        input = stdin;
+#if defined(_MSC_VER)
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    } else {
+        input = fopen(input_path, "rb");
+
+        if (!input) {
+            printf("Failed to open %s\n", input_path);
+            return INFER_ERROR_INVALID_ARG;
+        }
+
+        file_seek(input, 0, SEEK_END);
+        input_records = ((int64_t)file_tell(input) - (int64_t)sizeof(PackedHeader)) / PACKED_CONTEXT_RECORD_SIZE;
+        file_seek(input, 0, SEEK_SET);
+    }
+
+    if (!packed_read_header(input, PACKED_CONTEXT_MAGIC, CHUNK_WIDTH)) {
+        printf("%s is not a packed context stream\n", input_path);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    int64_t completed;
+    FILE* output = open_output(output_path, restart, &completed);
+
+    if (!output) {
+        printf("Failed to open %s\n", output_path);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    if (completed > 0) {
+        printf("Resuming after %lld completed records\n", (long long)completed);
+
+        if (!skip_records(input, completed)) {
+            printf("Input has fewer records than the output already holds\n");
+            return INFER_ERROR_INVALID_ARG;
+        }
+    }
+
+    if (library_path && library_writer_open(library_path) != 0) {
+        printf("Failed to open structure library %s\n", library_path);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    if (history_prefix) {
+        history_set_limit(HISTORY_EXPORT_MAX_BYTES);
+    }
+
+    int result = Java_tbarnes_diffusionmod_Inference_init(NULL, NULL);
+
+    if (result != 0) {
+        printf("init failed (%d)\n", result);
+        return result;
+    }
+
+    /*
+     * The loop below keeps in_flight records submitted. Finished jobs are read and
+     * collected as they come, and written out once every record before them is.
+     */
+    std::vector<BatchRecord> records(in_flight);
+    int64_t submitted = 0;
+    int64_t generated = 0;
+    bool have_input = true;
+    auto run_start = std::chrono::steady_clock::now();
+
+    while (result == 0) {
+
+        bool progressed = false;
+
+        /* Keep the window full */
+        while (have_input && submitted - generated < in_flight && (max_count < 0 || submitted < max_count)) {
+
+            BatchRecord& record = records[submitted % in_flight];
+
+            if (fread(record.context, PACKED_CONTEXT_RECORD_SIZE, 1, input) != 1) {
+                have_input = false;
+                break;
+            }
+
+            record.record = completed + submitted;
+            record.finished = false;
+            record.from_library = false;
+
+            result = job_submit((int32_t)(submitted % in_flight) + 1, record.context);
+
+            if (result != 0) {
+                printf("Failed to submit record %lld (%d)\n", (long long)record.record, result);
+                break;
+            }
+
+            submitted++;
+            progressed = true;
+        }
+
+        if (result != 0 || submitted == generated) {
+            break;
+        }
+
+        /* The final snapshot has to be read before a job can be collected */
+        for (int64_t i = generated; i < submitted; i++) {
+
+            int32_t job_id = (int32_t)(i % in_flight) + 1;
+            BatchRecord& record = records[i % in_flight];
+
+            if (!record.finished && job_state(job_id, NULL) == JOB_STATE_DONE) {
+                job_read(job_id, SPARSE_OUTPUT_OFF, false, record.chunk, NULL, NULL);
+            }
+        }
+
+        int32_t job_id;
+        int32_t state;
+        int32_t error;
+        JobReceipt receipt;
+
+        while (job_collect_finished(&job_id, &state, &error, &receipt)) {
+
+            BatchRecord& record = records[job_id - 1];
+
+            record.finished = true;
+            record.state = state;
+            record.error = error;
+            record.from_library = (receipt.from_library != 0);
+            progressed = true;
+        }
+
+        /* Write finished records in input order */
+        while (generated < submitted && records[generated % in_flight].finished) {
+
+            BatchRecord& record = records[generated % in_flight];
+
+            if (record.state != JOB_STATE_DONE) {
+                printf("Record %lld %s (error %d, last error %d)\n", (long long)record.record,
+                    (record.state == JOB_STATE_CANCELLED) ? "was cancelled" : "failed",
+                    record.error, Java_tbarnes_diffusionmod_Inference_getLastError(NULL, NULL));
+                result = record.error ? record.error : INFER_ERROR_FAILED_OPERATION;
+                break;
+            }
+
+            if (fwrite(record.chunk, PACKED_CHUNK_RECORD_SIZE, 1, output) != 1 || fflush(output) != 0) {
+                printf("Failed to write %s\n", output_path);
+                result = INFER_ERROR_FAILED_OPERATION;
+                break;
+            }
+
+            if (library_path && !record.from_library &&
+                library_writer_append(record.context, record.chunk) != 0) {
+                printf("Failed to write structure library %s\n", library_path);
+                result = INFER_ERROR_FAILED_OPERATION;
+                break;
+            }
+
+            if (history_prefix) {
+                char history_path[1024];
+                snprintf(history_path, sizeof(history_path), "%s%lld.vxhs", history_prefix, (long long)record.record);
+
+                if (history_export((int32_t)(generated % in_flight) + 1, history_path) != 0) {
+                    printf("Failed to write %s\n", history_path);
+                    result = INFER_ERROR_FAILED_OPERATION;
+                    break;
+                }
+            }
+
+            generated++;
+
+            if (generated % progress_interval == 0 || (!have_input && generated == submitted)) {
+
+                double elapsed = seconds_since(run_start);
+                double rate = generated / elapsed;
+                int64_t done = completed + generated;
+
+                if (input_records > 0) {
+                    double eta = (input_records - done) / rate;
+                    printf("[batch] %lld/%lld records (%.1f%%), %.3f records/s, eta %.0f s\n",
+                        (long long)done, (long long)input_records, 100.0 * done / input_records, rate, eta);
+                } else {
+                    printf("[batch] %lld records, %.3f records/s\n", (long long)done, rate);
+                }
+                fflush(stdout);
+            }
+        }
+
+        if (!progressed) {
+            sleep_poll();
+        }
+    }
+
+    double elapsed = seconds_since(run_start);
+
+    printf("Generated %lld records in %.1f s (%.3f records/s, %.1f model steps/s)\n",
+        (long long)generated, elapsed, generated / elapsed, generated * (double)(n_T * n_U) / elapsed);
+
+    int64_t lookups = stat_get(STAT_LIBRARY_LOOKUPS);
+
+    if (lookups > 0) {
+        printf("Structure library: %lld/%lld hits (%.1f%%), mean lookup %.1f us, max %.1f us\n",
+            (long long)stat_get(STAT_LIBRARY_HITS), (long long)lookups,
+            100.0 * stat_get(STAT_LIBRARY_HITS) / lookups,
+            stat_get(STAT_LIBRARY_LOOKUP_NS) / 1000.0 / lookups,
+            stat_get(STAT_LIBRARY_LOOKUP_MAX_NS) / 1000.0);
+    }
+
+    if (stats_json_path) {
+        FILE* stats_file = fopen(stats_json_path, "w");
+
+        if (stats_file) {
+            stats_write_json(stats_file);
+            fclose(stats_file);
+        } else {
+            printf("Failed to write %s\n", stats_json_path);
+        }
+    }
+
+    fclose(output);
+    library_writer_close();
+
+    if (input != stdin) {
+        fclose(input);
+    }
+
+    /* The denoise thread lives for the lifetime of the process and can't be joined,
+     * so exit without running static destructors */
+    fflush(stdout);
+    _Exit(result);
+}
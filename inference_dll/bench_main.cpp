@@ -0,0 +1,613 @@
+/**
+ * @file bench_main.cpp
+ * @brief Microbenchmarks of the host side stages around the model, each run in
+ *        isolation on fixed inputs so results can be compared across commits.
+ *        No GPU or model is needed.
+ *
+ *        Every benchmark runs its warmup iterations, then a number of timed
+ *        repetitions of a fixed iteration count. The per iteration time of each
+ *        repetition is summarized as min, median, mean, max and standard deviation.
+ *        Compare the medians between runs on the same machine; the machine section
+ *        (CPU, ISA, clock before and after) shows whether two runs are comparable.
+ *
+ *        The hardware counters of perf_counters.h are read around the timed
+ *        repetitions of each benchmark, and the JSON output gets cycles,
+ *        instructions, IPC and cache and branch misses per thousand instructions
+ *        for each. Stage sampling stays off, so the counters cost two reads per
+ *        benchmark and not per iteration. Where the counters can't be opened they
+ *        read 0 and "counters_available" is false.
+ *
+ *        Build by compiling this file together with block_embeddings.cpp, history.cpp,
+ *        perf_counters.cpp, recorder.cpp and stats.cpp.
+ *
+ *  Usage: bench_stages [options]
+ *
+ *    --warmup N        Untimed iterations before measuring (default 100).
+ *    --repetitions N   Timed repetitions per benchmark (default 30).
+ *    --iterations N    Iterations per repetition. By default it's picked so one
+ *                      repetition takes about 10 ms.
+ *    --filter TEXT     Only run benchmarks whose name contains TEXT.
+ *    --label TEXT      Stored in the JSON output, e.g. a commit hash.
+ *    --json PATH       Write the results as JSON.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define BENCH_X86
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #else
+        #include <cpuid.h>
+        #include <x86intrin.h>
+    #endif
+#endif
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "block_embeddings.h"
+#include "history.h"
+#include "perf_counters.h"
+
+/* Target length of one repetition when --iterations isn't given */
+const double REPETITION_TARGET_NS = 10e6;
+
+/*
+ * Fixed inputs. Everything is generated from constant seeds so every run and
+ * every commit measures the same data.
+ */
+static uint8_t context_record[PACKED_CONTEXT_RECORD_SIZE];
+static float x_context[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+static float x_mask[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+static float x_noise[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+static float x_latent[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+static float x_snapshot[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+static uint8_t decoded_ids[PACKED_CHUNK_RECORD_SIZE];
+
+/* Two frames about 5% apart, alternated to give the history realistic deltas */
+static uint8_t history_frames[2][PACKED_CHUNK_RECORD_SIZE];
+static int history_frame;
+static int history_recorded;
+
+static FILE* export_file;
+static int export_records;
+
+static uint32_t noise_seed = 1;
+
+static void make_inputs() {
+
+    std::mt19937 gen(12345);
+    std::uniform_int_distribution<int> id_dist(0, 30);
+
+    for (int i = 0; i < PACKED_CONTEXT_RECORD_SIZE; i++) {
+        context_record[i] = (uint8_t)id_dist(gen);
+    }
+
+    /* A latent close to convergence: the embedding of the context plus some noise */
+    embed_context(context_record, x_latent);
+    fill_normal_noise(678, x_noise);
+
+    for            (int w = 0; w < EMBEDDING_DIMENSIONS; w++) {
+        for        (int i = 0; i < CHUNK_WIDTH; i++) {
+            for    (int j = 0; j < CHUNK_WIDTH; j++) {
+                for (int k = 0; k < CHUNK_WIDTH; k++) {
+                    x_latent[w][i][j][k] += 0.3f * x_noise[w][i][j][k];
+                }
+            }
+        }
+    }
+
+    decode_block_ids(x_latent, history_frames[0]);
+    memcpy(history_frames[1], history_frames[0], PACKED_CHUNK_RECORD_SIZE);
+
+    for (int i = 0; i < PACKED_CHUNK_RECORD_SIZE; i += 20) {
+        history_frames[1][i] = (uint8_t)id_dist(gen);
+    }
+}
+
+/*
+ * Benchmarks. Each function is one iteration.
+ */
+static void bench_context_embedding() {
+    embed_context(context_record, x_context);
+}
+
+static void bench_mask_construction() {
+    build_context_mask(x_mask);
+}
+
+static void bench_normal_noise_fill() {
+    fill_normal_noise(noise_seed++, x_noise);
+}
+
+static void bench_snapshot_copy() {
+
+    /* The copy is never read, so hide the destination from the optimizer */
+    float* volatile destination = &x_snapshot[0][0][0][0];
+    memcpy(destination, x_latent, sizeof(x_snapshot));
+}
+
+static void bench_decode_scalar() {
+    decode_block_ids(x_latent, decoded_ids);
+}
+
+static void bench_decode_sse() {
+    decode_block_ids_sse(x_latent, decoded_ids);
+}
+
+static void bench_decode_sorted() {
+    decode_block_ids_sorted(x_latent, decoded_ids);
+}
+
+static void bench_delta_extraction() {
+
+    /* Restart at the length of a real run so the history doesn't grow without bound */
+    if (history_recorded == n_T) {
+        history_begin(0);
+        history_recorded = 0;
+    }
+
+    history_record(0, n_T - 1 - history_recorded, history_frames[history_frame]);
+    history_frame ^= 1;
+    history_recorded++;
+}
+
+static void bench_packed_export() {
+
+    if (export_records == 1024) {
+        file_seek(export_file, sizeof(PackedHeader), SEEK_SET);
+        export_records = 0;
+    }
+
+    fwrite(decoded_ids, PACKED_CHUNK_RECORD_SIZE, 1, export_file);
+    export_records++;
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+    { "context_embedding", bench_context_embedding },
+    { "mask_construction", bench_mask_construction },
+    { "normal_noise_fill", bench_normal_noise_fill },
+    { "snapshot_copy",     bench_snapshot_copy },
+    { "decode_scalar",     bench_decode_scalar },
+    { "decode_sse",        bench_decode_sse },
+    { "decode_sorted",     bench_decode_sorted },
+    { "delta_extraction",  bench_delta_extraction },
+    { "packed_export",     bench_packed_export },
+};
+
+struct BenchmarkResult {
+    const char* name;
+    int64_t iterations;
+    double min_ns;
+    double median_ns;
+    double mean_ns;
+    double max_ns;
+    double stddev_ns;
+    uint64_t counters[PERF_COUNTER_COUNT];  /* Over all timed repetitions */
+    int64_t counted_iterations;
+};
+
+/* A PERF_VALUE_ hardware counter over the timed repetitions */
+static double counter(const BenchmarkResult& result, int value) {
+    return (double)result.counters[value - PERF_VALUE_CYCLES];
+}
+
+static double now_ns() {
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double time_iterations(const Benchmark& benchmark, int64_t iterations) {
+
+    double start = now_ns();
+
+    for (int64_t i = 0; i < iterations; i++) {
+        benchmark.run();
+    }
+
+    return now_ns() - start;
+}
+
+static BenchmarkResult run_benchmark(const Benchmark& benchmark, int warmup, int repetitions, int64_t iterations) {
+
+    time_iterations(benchmark, warmup);
+
+    /* Grow the iteration count until a repetition takes long enough to time */
+    if (iterations <= 0) {
+
+        iterations = 1;
+
+        for (;;) {
+            double elapsed = time_iterations(benchmark, iterations);
+
+            if (elapsed >= REPETITION_TARGET_NS / 10) {
+                iterations = std::max<int64_t>(1, (int64_t)(iterations * REPETITION_TARGET_NS / elapsed));
+                break;
+            }
+
+            iterations *= 10;
+        }
+    }
+
+    std::vector<double> samples;
+    uint64_t counts_before[PERF_COUNTER_COUNT];
+    uint64_t counts_after[PERF_COUNTER_COUNT];
+
+    perf_read_thread_counters(counts_before);
+
+    for (int i = 0; i < repetitions; i++) {
+        samples.push_back(time_iterations(benchmark, iterations) / iterations);
+    }
+
+    perf_read_thread_counters(counts_after);
+
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+
+    for (double sample : samples) {
+        sum += sample;
+    }
+
+    double mean = sum / samples.size();
+    double variance = 0.0;
+
+    for (double sample : samples) {
+        variance += (sample - mean) * (sample - mean);
+    }
+
+    size_t middle = samples.size() / 2;
+
+    BenchmarkResult result;
+    result.name = benchmark.name;
+    result.iterations = iterations;
+    result.min_ns = samples.front();
+    result.median_ns = (samples.size() % 2) ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2;
+    result.mean_ns = mean;
+    result.max_ns = samples.back();
+    result.stddev_ns = sqrt(variance / samples.size());
+    result.counted_iterations = iterations * repetitions;
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        result.counters[i] = counts_after[i] - counts_before[i];
+    }
+
+    return result;
+}
+
+/*
+ * Machine description.
+ */
+struct MachineInfo {
+    char cpu[64];
+    std::vector<const char*> cpu_features;  /* Supported by the CPU */
+    std::vector<const char*> compiled_isa;  /* Assumed by this build */
+    double tsc_mhz;
+};
+
+#if defined(BENCH_X86)
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+    __cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static void read_cpu(MachineInfo* info) {
+
+    uint32_t regs[4];
+
+    cpuid(0x80000000, 0, regs);
+
+    if (regs[0] >= 0x80000004) {
+        for (uint32_t leaf = 0; leaf < 3; leaf++) {
+            cpuid(0x80000002 + leaf, 0, regs);
+            memcpy(info->cpu + leaf * 16, regs, 16);
+        }
+    }
+
+    cpuid(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    if (regs[3] & (1u << 26)) info->cpu_features.push_back("sse2");
+    if (regs[2] & (1u << 19)) info->cpu_features.push_back("sse4.1");
+    if (regs[2] & (1u << 20)) info->cpu_features.push_back("sse4.2");
+    if (regs[2] & (1u << 28)) info->cpu_features.push_back("avx");
+    if (regs[2] & (1u << 12)) info->cpu_features.push_back("fma");
+
+    if (max_leaf >= 7) {
+        cpuid(7, 0, regs);
+        if (regs[1] & (1u << 5))  info->cpu_features.push_back("avx2");
+        if (regs[1] & (1u << 16)) info->cpu_features.push_back("avx512f");
+    }
+
+    /* The time stamp counter runs at a fixed rate, usually the base clock */
+    uint64_t tsc_start = __rdtsc();
+    double start = now_ns();
+
+    while (now_ns() - start < 50e6) {
+    }
+
+    info->tsc_mhz = (double)(__rdtsc() - tsc_start) / ((now_ns() - start) / 1000.0);
+}
+
+#else
+
+static void read_cpu(MachineInfo* info) {
+    strcpy(info->cpu, "unknown");
+}
+
+#endif
+
+/**
+ * @brief Current clock of CPU 0 in MHz, or 0 where the OS doesn't expose it.
+ */
+static double current_cpu_mhz() {
+
+    double mhz = 0.0;
+    FILE* file = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+
+    if (file) {
+        long long khz = 0;
+
+        if (fscanf(file, "%lld", &khz) == 1) {
+            mhz = khz / 1000.0;
+        }
+
+        fclose(file);
+        return mhz;
+    }
+
+    /* Virtual machines often have no cpufreq, but report a clock here */
+    file = fopen("/proc/cpuinfo", "r");
+
+    if (file) {
+        char line[256];
+
+        while (fgets(line, sizeof(line), file)) {
+            if (sscanf(line, "cpu MHz : %lf", &mhz) == 1) {
+                break;
+            }
+        }
+
+        fclose(file);
+    }
+
+    return mhz;
+}
+
+static void read_machine_info(MachineInfo* info) {
+
+    memset(info->cpu, 0, sizeof(info->cpu));
+    info->tsc_mhz = 0.0;
+    read_cpu(info);
+
+    /* Trim the padding some CPUs put in front of the brand string */
+    char* cpu = info->cpu;
+    while (*cpu == ' ') cpu++;
+    memmove(info->cpu, cpu, strlen(cpu) + 1);
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    info->compiled_isa.push_back("sse2");
+#endif
+#if defined(__AVX__)
+    info->compiled_isa.push_back("avx");
+#endif
+#if defined(__AVX2__)
+    info->compiled_isa.push_back("avx2");
+#endif
+#if defined(__FMA__)
+    info->compiled_isa.push_back("fma");
+#endif
+#if defined(__AVX512F__)
+    info->compiled_isa.push_back("avx512f");
+#endif
+#if defined(__ARM_NEON)
+    info->compiled_isa.push_back("neon");
+#endif
+}
+
+static void write_string_list(FILE* file, const std::vector<const char*>& list) {
+
+    fprintf(file, "[");
+
+    for (size_t i = 0; i < list.size(); i++) {
+        fprintf(file, "%s\"%s\"", i ? ", " : "", list[i]);
+    }
+
+    fprintf(file, "]");
+}
+
+static bool write_json(const char* path, const char* label, const MachineInfo& machine,
+                       double mhz_before, double mhz_after, int warmup, int repetitions,
+                       const std::vector<BenchmarkResult>& results) {
+
+    FILE* file = fopen(path, "w");
+
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "{\n  \"label\": \"%s\",\n", label);
+    fprintf(file, "  \"machine\": {\n    \"cpu\": \"%s\",\n    \"cpu_features\": ", machine.cpu);
+    write_string_list(file, machine.cpu_features);
+    fprintf(file, ",\n    \"compiled_isa\": ");
+    write_string_list(file, machine.compiled_isa);
+    fprintf(file, ",\n    \"tsc_mhz\": %.1f,\n    \"cpu_mhz_before\": %.1f,\n    \"cpu_mhz_after\": %.1f\n  },\n",
+        machine.tsc_mhz, mhz_before, mhz_after);
+    fprintf(file, "  \"config\": { \"warmup\": %d, \"repetitions\": %d },\n", warmup, repetitions);
+    fprintf(file, "  \"counters_available\": %s,\n  \"benchmarks\": [\n", perf_counters_available() ? "true" : "false");
+
+    for (size_t i = 0; i < results.size(); i++) {
+
+        const BenchmarkResult& result = results[i];
+
+        double counted       = (double)result.counted_iterations;
+        double cycles        = counter(result, PERF_VALUE_CYCLES);
+        double instructions  = counter(result, PERF_VALUE_INSTRUCTIONS);
+        double llc_misses    = counter(result, PERF_VALUE_LLC_MISSES);
+        double branch_misses = counter(result, PERF_VALUE_BRANCH_MISSES);
+
+        fprintf(file,
+            "    { \"name\": \"%s\", \"iterations\": %lld, \"min_ns\": %.1f, \"median_ns\": %.1f, "
+            "\"mean_ns\": %.1f, \"max_ns\": %.1f, \"stddev_ns\": %.1f,\n"
+            "      \"counters\": { \"cycles\": %.0f, \"instructions\": %.0f, \"llc_misses\": %.0f, "
+            "\"branch_misses\": %.0f, \"cycles_per_iteration\": %.1f, \"ipc\": %.3f, "
+            "\"llc_misses_per_kinstr\": %.3f, \"branch_misses_per_kinstr\": %.3f } }%s\n",
+            result.name, (long long)result.iterations, result.min_ns, result.median_ns,
+            result.mean_ns, result.max_ns, result.stddev_ns,
+            cycles, instructions, llc_misses, branch_misses,
+            counted > 0 ? cycles / counted : 0.0,
+            cycles > 0 ? instructions / cycles : 0.0,
+            instructions > 0 ? 1000.0 * llc_misses / instructions : 0.0,
+            instructions > 0 ? 1000.0 * branch_misses / instructions : 0.0,
+            (i + 1 < results.size()) ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+
+    return fclose(file) == 0;
+}
+
+/**
+ * @brief The alternative decoders are only worth timing if they agree with the
+ *        reference decoder, on the fixed latent and on pure noise.
+ */
+static bool decoders_agree() {
+
+    uint8_t expected[PACKED_CHUNK_RECORD_SIZE];
+    uint8_t actual[PACKED_CHUNK_RECORD_SIZE];
+
+    const float (*inputs[2])[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH] = { x_latent, x_noise };
+
+    for (int i = 0; i < 2; i++) {
+
+        decode_block_ids(inputs[i], expected);
+
+        decode_block_ids_sse(inputs[i], actual);
+        if (memcmp(expected, actual, sizeof(actual)) != 0) {
+            printf("decode_block_ids_sse() disagrees with decode_block_ids()\n");
+            return false;
+        }
+
+        decode_block_ids_sorted(inputs[i], actual);
+        if (memcmp(expected, actual, sizeof(actual)) != 0) {
+            printf("decode_block_ids_sorted() disagrees with decode_block_ids()\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void print_usage() {
+    printf("Usage: bench_stages [--warmup N] [--repetitions N] [--iterations N] [--filter TEXT] [--label TEXT] [--json PATH]\n");
+}
+
+int main(int argc, char** argv) {
+
+    int warmup = 100;
+    int repetitions = 30;
+    int64_t iterations = 0;
+    const char* filter = NULL;
+    const char* label = "";
+    const char* json_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+            label = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            print_usage();
+            return INFER_ERROR_INVALID_ARG;
+        }
+    }
+
+    if (warmup < 0 || repetitions < 1) {
+        print_usage();
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    make_inputs();
+
+    if (!decoders_agree()) {
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    history_set_limit(64 << 20);
+    history_begin(0);
+    export_file = tmpfile();
+
+    if (!export_file || !packed_write_header(export_file, PACKED_CHUNK_MAGIC, GENERATED_WIDTH)) {
+        printf("Failed to create a temporary file for packed_export\n");
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    MachineInfo machine;
+    read_machine_info(&machine);
+
+    printf("CPU: %s (tsc %.0f MHz)\n", machine.cpu, machine.tsc_mhz);
+
+    double mhz_before = current_cpu_mhz();
+    std::vector<BenchmarkResult> results;
+
+    printf("%-20s %12s %12s %12s %12s %12s %8s\n", "benchmark", "iterations", "min ns", "median ns", "mean ns", "stddev ns", "ipc");
+
+    for (const Benchmark& benchmark : benchmarks) {
+
+        if (filter && !strstr(benchmark.name, filter)) {
+            continue;
+        }
+
+        BenchmarkResult result = run_benchmark(benchmark, warmup, repetitions, iterations);
+        results.push_back(result);
+
+        double cycles = counter(result, PERF_VALUE_CYCLES);
+        double instructions = counter(result, PERF_VALUE_INSTRUCTIONS);
+
+        printf("%-20s %12lld %12.1f %12.1f %12.1f %12.1f %8.2f\n", result.name, (long long)result.iterations,
+            result.min_ns, result.median_ns, result.mean_ns, result.stddev_ns, cycles > 0 ? instructions / cycles : 0.0);
+        fflush(stdout);
+    }
+
+    double mhz_after = current_cpu_mhz();
+
+    if (mhz_before > 0.0) {
+        printf("CPU 0 clock: %.0f MHz before, %.0f MHz after\n", mhz_before, mhz_after);
+    }
+
+    if (json_path && !write_json(json_path, label, machine, mhz_before, mhz_after, warmup, repetitions, results)) {
+        printf("Failed to write %s\n", json_path);
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    fclose(export_file);
+    return 0;
+}
@@ -0,0 +1,290 @@
+/**
+ * @file block_embeddings.cpp
+ * @brief Block id embedding table and the encode/decode passes around the model.
+ */
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+
+#include <float.h>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define BLOCK_EMBEDDINGS_SSE
+    #include <emmintrin.h>
+#endif
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "perf_counters.h"
+#include "block_embeddings.h"
+
+/* Declared extern in block_embeddings.h so the table has external linkage */
+const float block_id_embeddings[BLOCK_ID_COUNT][EMBEDDING_DIMENSIONS] = {
+    { 0.0, 0.0, 0.0   }, { -2.0, -1.0, 0.1 }, { 2.0, -1.0, 0.2  }, { 0.0, -1.0, -0.1 }, 
+    { -2.0, 2.0, -1.0 }, { -2.0, -1.0, -0.2}, { 0.0, -1.0, -0.3 }, { -2.0, -1.0, 0.4 }, 
+    { 2.0, 2.0, 2.0   }, { 2.0, -1.0, 0.5  }, { -2.0, 2.0, 0.0  }, { 2.0, 0.0, -0.5  },  
+    { 0.0, -1.0, -0.6 }, { -1.5, 1.0, 0.6  }, { 2.0, 0.0, 0.7   }, { -2.0, -1.0, -0.7}, 
+    { 0.0, -1.0, 0.8  }, { 0.0, -1.0, -0.8 }, { 0.0, -1.0, -0.9 }, { 0.0, -1.0, 0.9  }, 
+    { 0.0, -1.0, -1.0 }, { 0.0, -1.0, 1.0  }, { 0.0, -1.0, 0.0  }, { -2.0, 0.0, 0.1  },  
+    { 2.0, 0.0, -1.1  }, { -2.0, -1.0, -1.2}, { 0.0, -1.0, 1.1  }, { 0.0, -1.0, -1.3 }, 
+    { 0.0, -1.0, 1.2  }, { 0.0, -1.0, -1.4 }, { -2.0, 1.0, -1.5 }, { 0.5, 0.0, 0.5   }, 
+    { 0.5, 1.0, 0.5   }, { 0.5, 0.0, 1.5   }, { 0.5, 1.0, 1.5   }, { 0.0, 0.5, 1.5   }, 
+    { 0.0, 0.5, 0.5   }, { 1.0, 0.5, 1.5   }, { 1.0, 0.5, 0.5   }, { -3.0, 1.0, -2.0 }, 
+    { -2.0, 1.0, 1.7  }, { 1.5, 1.0, -0.5  }, { 1.5, 2.0, -0.5  }, { 1.5, 1.0, -1.5  }, 
+    { 1.5, 2.0, -1.5  }, { 2.0, 1.5, -0.5  }, { 2.0, 1.5, -1.5  }, { 1.0, 1.5, -0.5  },  
+    { 1.0, 1.5, -1.5  }, { 0.0, -2.0, 1.0  }, { 0.0, -1.0, 1.1  }, { 0.0, -1.0, -1.1 }, 
+    { 2.0, 0.0, -1.2  }, { 0.0, -1.0, 1.2  }, { 0.0, -1.0, -1.3 }, { 0.0, -1.0, 1.3  },
+    { 0.0, -1.0, -1.4 }, { 0.0, -1.0, 1.4  }, { 0.0, -1.0, -1.5 }, { 2.0, 0.0, 1.2   }, 
+    { 2.0, 0.0, -1.6  }, { 2.0, 0.0, 1.3   }, { 2.0, 0.0, -1.7  }, { 2.0, 0.0, 1.4   },
+    { 2.0, 0.0, -1.8  }, { 2.0, 0.0, 1.5   }, { 2.0, 0.0, -1.9  }, { 2.0, 0.0, 1.6   }, 
+    { 2.0, 0.0, -2.0  }, { 2.0, 0.0, 1.7   }, { 2.0, 0.0, -2.1  }, { 0.0, -1.0, -2.2 },   
+    { 0.0, -1.0, 1.8  }, { 0.0, -1.0, -2.3 }, { 0.0, -1.0, 1.9  }, { 0.0, -1.0, -2.4 }, 
+    { 0.0, -1.0, 2.0  }, { 0.0, -1.0, -2.5 }, { 0.0, -1.0, 2.1  }, { 0.0, -1.0, -2.6 }, 
+    { 0.0, -1.0, 2.2  }, { 0.0, -1.0, -2.7 }, { 0.0, -1.0, 2.3  }, { 0.0, -1.0, -2.8 },   
+    { 0.0, -1.0, 2.4  }, { 0.0, -1.0, -2.9 }, { 0.0, -1.0, 2.5  }, { 0.0, -1.0, -3.0 },
+    { 0.0, -1.0, 2.6  }, { 0.0, -1.0, -3.1 }, { 0.0, -1.0, 2.7  }, { 0.0, -1.0, -3.2 }, 
+    { 0.0, -1.0, 2.8  }, { 0.0, -1.0, -3.3 }, { 0.0, -1.0, 2.9  }, { 2.0, 0.0, -3.4  },  
+};
+
+void embed_context(const uint8_t* context,
+                   float x_context[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) {
+
+    for         (int x = 0; x < CHUNK_WIDTH; x++) {
+        for     (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int z = 0; z < CHUNK_WIDTH; z++) {
+
+                int block_id = context[packed_index(x, y, z, CHUNK_WIDTH)];
+
+                if (block_id >= BLOCK_ID_COUNT) {
+                    block_id = 0;
+                }
+
+                for (int dim = 0; dim < EMBEDDING_DIMENSIONS; dim++) {
+                    x_context[dim][x][y][z] = block_id_embeddings[block_id][dim];
+                }
+            }
+        }
+    }
+}
+
+void build_context_mask(float x_mask[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) {
+
+    for         (int x = 0; x < CHUNK_WIDTH; x++) {
+        for     (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int z = 0; z < CHUNK_WIDTH; z++) {
+                x_mask[x][y][z] = 1.0f;
+            }
+        }
+    }
+}
+
+void fill_normal_noise(uint32_t seed, float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) {
+
+    std::mt19937 gen(seed); // Mersenne Twister engine
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    for            (int w = 0; w < EMBEDDING_DIMENSIONS; w++) {
+        for        (int i = 0; i < CHUNK_WIDTH; i++) {
+            for    (int j = 0; j < CHUNK_WIDTH; j++) {
+                for (int k = 0; k < CHUNK_WIDTH; k++) {
+                    x[w][i][j][k] = dist(gen);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * This is equivalent to a matrix multiply of x and transpose(block_id_embeddings).
+ * Since we only care about the index of the smallest element in each row of the
+ * output 4096 x BLOCK_ID_COUNT matrix, we don't need to actually store the
+ * entire matrix.
+ */
+void decode_block_ids(const float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                      uint8_t* block_ids) {
+
+    PerfScope perf_scope(PERF_STAGE_DECODE);
+
+    for (int i = 1; i < CHUNK_WIDTH - 1; i++) {
+        for (int j = 1; j < CHUNK_WIDTH - 1; j++) {
+            for (int k = 1; k < CHUNK_WIDTH - 1; k++) {
+
+                float min_distance = FLT_MAX;
+                int closest_id = 0;
+
+                for (int id = 0; id < BLOCK_ID_COUNT; id++) {
+                    float distance = 0.0f;
+
+                    for (int dim = 0; dim < EMBEDDING_DIMENSIONS; dim++) {
+                        float diff = x[dim][i][j][k] - block_id_embeddings[id][dim];
+                        distance += diff * diff;
+                    }
+
+                    if (distance < min_distance) {
+                        min_distance = distance;
+                        closest_id = id;
+                    }
+                }
+
+                block_ids[packed_index(i-1, j-1, k-1, GENERATED_WIDTH)] = (uint8_t)closest_id;
+            }
+        }
+    }
+}
+
+#if defined(BLOCK_EMBEDDINGS_SSE)
+
+/* Embeddings by dimension, so four ids load with one instruction */
+alignas(16) static float embedding_columns[EMBEDDING_DIMENSIONS][BLOCK_ID_COUNT];
+static std::once_flag embedding_columns_once;
+
+void decode_block_ids_sse(const float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                          uint8_t* block_ids) {
+
+    static_assert(BLOCK_ID_COUNT % 4 == 0, "Ids are processed four at a time");
+    static_assert(EMBEDDING_DIMENSIONS == 3, "The distance below is unrolled for 3 dimensions");
+
+    std::call_once(embedding_columns_once, []() {
+        for (int id = 0; id < BLOCK_ID_COUNT; id++) {
+            for (int dim = 0; dim < EMBEDDING_DIMENSIONS; dim++) {
+                embedding_columns[dim][id] = block_id_embeddings[id][dim];
+            }
+        }
+    });
+
+    PerfScope perf_scope(PERF_STAGE_DECODE);
+
+    for (int i = 1; i < CHUNK_WIDTH - 1; i++) {
+        for (int j = 1; j < CHUNK_WIDTH - 1; j++) {
+            for (int k = 1; k < CHUNK_WIDTH - 1; k++) {
+
+                __m128 v0 = _mm_set1_ps(x[0][i][j][k]);
+                __m128 v1 = _mm_set1_ps(x[1][i][j][k]);
+                __m128 v2 = _mm_set1_ps(x[2][i][j][k]);
+
+                /* Lane l tracks ids l, l + 4, l + 8, ... Strict less keeps the lowest
+                 * id of each lane on ties, like the scalar loop. */
+                __m128 min_distance = _mm_set1_ps(FLT_MAX);
+                __m128i closest_id = _mm_setzero_si128();
+                __m128i ids = _mm_setr_epi32(0, 1, 2, 3);
+                const __m128i four = _mm_set1_epi32(4);
+
+                for (int id = 0; id < BLOCK_ID_COUNT; id += 4) {
+
+                    /* Same summation order as the scalar loop, so distances match bit for bit */
+                    __m128 d0 = _mm_sub_ps(v0, _mm_load_ps(&embedding_columns[0][id]));
+                    __m128 d1 = _mm_sub_ps(v1, _mm_load_ps(&embedding_columns[1][id]));
+                    __m128 d2 = _mm_sub_ps(v2, _mm_load_ps(&embedding_columns[2][id]));
+
+                    __m128 distance = _mm_mul_ps(d0, d0);
+                    distance = _mm_add_ps(distance, _mm_mul_ps(d1, d1));
+                    distance = _mm_add_ps(distance, _mm_mul_ps(d2, d2));
+
+                    __m128 closer = _mm_cmplt_ps(distance, min_distance);
+                    min_distance = _mm_min_ps(distance, min_distance);
+                    closest_id = _mm_or_si128(_mm_and_si128(_mm_castps_si128(closer), ids),
+                                              _mm_andnot_si128(_mm_castps_si128(closer), closest_id));
+                    ids = _mm_add_epi32(ids, four);
+                }
+
+                alignas(16) float lane_distance[4];
+                alignas(16) int32_t lane_id[4];
+                _mm_store_ps(lane_distance, min_distance);
+                _mm_store_si128((__m128i*)lane_id, closest_id);
+
+                int best = 0;
+
+                for (int lane = 1; lane < 4; lane++) {
+                    if (lane_distance[lane] < lane_distance[best] ||
+                        (lane_distance[lane] == lane_distance[best] && lane_id[lane] < lane_id[best])) {
+                        best = lane;
+                    }
+                }
+
+                block_ids[packed_index(i-1, j-1, k-1, GENERATED_WIDTH)] = (uint8_t)lane_id[best];
+            }
+        }
+    }
+}
+
+#else
+
+void decode_block_ids_sse(const float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                          uint8_t* block_ids) {
+    decode_block_ids(x, block_ids);
+}
+
+#endif
+
+/* Ids ordered by their first embedding dimension */
+static int sorted_ids[BLOCK_ID_COUNT];
+static float sorted_first[BLOCK_ID_COUNT];
+static std::once_flag sorted_ids_once;
+
+void decode_block_ids_sorted(const float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                             uint8_t* block_ids) {
+
+    std::call_once(sorted_ids_once, []() {
+
+        for (int id = 0; id < BLOCK_ID_COUNT; id++) {
+            sorted_ids[id] = id;
+        }
+
+        std::stable_sort(sorted_ids, sorted_ids + BLOCK_ID_COUNT, [](int a, int b) {
+            return block_id_embeddings[a][0] < block_id_embeddings[b][0];
+        });
+
+        for (int i = 0; i < BLOCK_ID_COUNT; i++) {
+            sorted_first[i] = block_id_embeddings[sorted_ids[i]][0];
+        }
+    });
+
+    PerfScope perf_scope(PERF_STAGE_DECODE);
+
+    for (int i = 1; i < CHUNK_WIDTH - 1; i++) {
+        for (int j = 1; j < CHUNK_WIDTH - 1; j++) {
+            for (int k = 1; k < CHUNK_WIDTH - 1; k++) {
+
+                float min_distance = FLT_MAX;
+                int closest_id = BLOCK_ID_COUNT;
+
+                float value = x[0][i][j][k];
+                int start = (int)(std::lower_bound(sorted_first, sorted_first + BLOCK_ID_COUNT, value) - sorted_first);
+                int up = start;
+                int down = start - 1;
+
+                /* Walk outwards in both directions. Once the first dimension alone is
+                 * further than the best distance, nothing beyond it can win, even a tie
+                 * with a lower id. */
+                while (up < BLOCK_ID_COUNT || down >= 0) {
+
+                    float up_gap = (up < BLOCK_ID_COUNT) ? sorted_first[up] - value : FLT_MAX;
+                    float down_gap = (down >= 0) ? value - sorted_first[down] : FLT_MAX;
+                    bool take_up = up_gap <= down_gap;
+                    float gap = take_up ? up_gap : down_gap;
+
+                    if (gap * gap > min_distance) {
+                        break;
+                    }
+
+                    int id = take_up ? sorted_ids[up++] : sorted_ids[down--];
+                    float distance = 0.0f;
+
+                    for (int dim = 0; dim < EMBEDDING_DIMENSIONS; dim++) {
+                        float diff = x[dim][i][j][k] - block_id_embeddings[id][dim];
+                        distance += diff * diff;
+                    }
+
+                    if (distance < min_distance || (distance == min_distance && id < closest_id)) {
+                        min_distance = distance;
+                        closest_id = id;
+                    }
+                }
+
+                block_ids[packed_index(i-1, j-1, k-1, GENERATED_WIDTH)] = (uint8_t)closest_id;
+            }
+        }
+    }
+}
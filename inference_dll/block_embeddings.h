@@ -0,0 +1,58 @@
+/**
+ * @file block_embeddings.h
+ * @brief Conversion between block ids and the 3 dimensional embedding space the
+ *        model denoises in, along with the other host side passes around the model.
+ *        Each pass is a separate function so bench_main.cpp can time it on its own.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "inference.h"
+
+extern const float block_id_embeddings[BLOCK_ID_COUNT][EMBEDDING_DIMENSIONS];
+
+/**
+ * @brief Build the "context" model input from a packed CHUNK_WIDTH^3 context record.
+ */
+void embed_context(const uint8_t* context,
+                   float x_context[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]);
+
+/**
+ * @brief Build the "mask" model input. Every voxel of a context record is known, so
+ *        the mask is all ones.
+ */
+void build_context_mask(float x_mask[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]);
+
+/**
+ * @brief Fill x with normally distributed values from a Mersenne Twister seeded
+ *        with seed. The same seed always gives the same x.
+ */
+void fill_normal_noise(uint32_t seed, float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]);
+
+/**
+ * @brief Find the closest block id embedding for every voxel of the middle 14^3
+ *        and write them as packed GENERATED_WIDTH^3 ids. Ties go to the lowest id.
+ */
+void decode_block_ids(const float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                      uint8_t* block_ids);
+
+/*
+ * Alternative decoders with the same output as decode_block_ids(), kept for
+ * bench_main.cpp.
+ */
+
+/**
+ * @brief Four ids per SSE instruction. Falls back to decode_block_ids() on targets
+ *        without SSE.
+ */
+void decode_block_ids_sse(const float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                          uint8_t* block_ids);
+
+/**
+ * @brief Searches the embeddings sorted by their first dimension outwards from the
+ *        voxel, stopping once the first dimension alone is further than the best match.
+ */
+void decode_block_ids_sorted(const float x[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                             uint8_t* block_ids);
@@ -0,0 +1,253 @@
+/**
+ * @file block_states.cpp
+ * @brief Stair shapes and pane connections. See block_states.h.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "block_states.h"
+
+/* Horizontal directions in clockwise order, so turning is adding 1 or 3 mod 4 */
+const int DIRECTION_NORTH = 0;
+const int DIRECTION_EAST  = 1;
+const int DIRECTION_SOUTH = 2;
+const int DIRECTION_WEST  = 3;
+
+static const int direction_dx[4]   = { 0, 1, 0, -1 };
+static const int direction_dz[4]   = { -1, 0, 1, 0 };
+static const int direction_pane[4] = { PANE_NORTH, PANE_EAST, PANE_SOUTH, PANE_WEST };
+
+const int BLOCK_KIND_NONE  = 0; /* Air, and anything a pane can't attach to */
+const int BLOCK_KIND_SOLID = 1; /* Full faces on every side */
+const int BLOCK_KIND_STAIRS = 2;
+const int BLOCK_KIND_PANE  = 3;
+
+struct BlockKind {
+    int kind;
+    int facing;     /* Stairs only, the side of the full back */
+    bool top;       /* Stairs only */
+    int axis_panes; /* Panes only, connections of the palette variant */
+};
+
+/**
+ * @brief What the shape rules need to know about a palette id, see the palette in
+ *        DiffusionMod.BLOCK_STATES.
+ */
+static BlockKind block_kind(int block_id) {
+
+    switch (block_id) {
+    case 11: return { BLOCK_KIND_PANE, 0, false, PANE_EAST | PANE_WEST };
+    case 14: return { BLOCK_KIND_PANE, 0, false, PANE_NORTH | PANE_SOUTH };
+    case 18: return { BLOCK_KIND_STAIRS, DIRECTION_NORTH, false, 0 };
+    case 19: return { BLOCK_KIND_STAIRS, DIRECTION_SOUTH, false, 0 };
+    case 20: return { BLOCK_KIND_STAIRS, DIRECTION_EAST,  false, 0 };
+    case 21: return { BLOCK_KIND_STAIRS, DIRECTION_WEST,  false, 0 };
+    case 26: return { BLOCK_KIND_STAIRS, DIRECTION_SOUTH, true,  0 };
+    case 27: return { BLOCK_KIND_STAIRS, DIRECTION_NORTH, true,  0 };
+    case 28: return { BLOCK_KIND_STAIRS, DIRECTION_WEST,  true,  0 };
+    case 29: return { BLOCK_KIND_STAIRS, DIRECTION_EAST,  true,  0 };
+
+    /* Air, the slabs (only half faces on the sides), and the shulker box, which
+     * the game excludes from connections */
+    case 0: case 3: case 13: case 15:
+        return { BLOCK_KIND_NONE, 0, false, 0 };
+
+    default:
+        /* Ids past the palette are placed as air */
+        return { (block_id <= 30) ? BLOCK_KIND_SOLID : BLOCK_KIND_NONE, 0, false, 0 };
+    }
+}
+
+/**
+ * @brief The generated ids inside the context border, read in context coordinates.
+ */
+struct StateVolume {
+    const uint8_t* context;
+    const uint8_t* block_ids;
+
+    BlockKind at(int x, int y, int z) const {
+
+        if (x < 0 || x >= CHUNK_WIDTH || y < 0 || y >= CHUNK_WIDTH || z < 0 || z >= CHUNK_WIDTH) {
+            return block_kind(0);
+        }
+
+        bool generated = x >= 1 && x <= GENERATED_WIDTH &&
+                         y >= 1 && y <= GENERATED_WIDTH &&
+                         z >= 1 && z <= GENERATED_WIDTH;
+
+        return block_kind(generated ? block_ids[packed_index(x - 1, y - 1, z - 1, GENERATED_WIDTH)]
+                                    : context[packed_index(x, y, z, CHUNK_WIDTH)]);
+    }
+};
+
+/**
+ * @brief StairBlock.canTakeShape(): the stairs beside don't continue this run.
+ */
+static bool stairs_can_take_shape(const StateVolume& volume, int x, int y, int z,
+                                  const BlockKind& stairs, int side) {
+
+    BlockKind beside = volume.at(x + direction_dx[side], y, z + direction_dz[side]);
+
+    return beside.kind != BLOCK_KIND_STAIRS || beside.facing != stairs.facing || beside.top != stairs.top;
+}
+
+/**
+ * @brief StairBlock.getStairsShape(). Stairs behind the back at a right angle make
+ *        an outer corner, stairs in front at a right angle an inner corner.
+ */
+static int stairs_shape(const StateVolume& volume, int x, int y, int z, const BlockKind& stairs) {
+
+    int facing = stairs.facing;
+    int counter_clockwise = (facing + 3) % 4;
+
+    BlockKind behind = volume.at(x + direction_dx[facing], y, z + direction_dz[facing]);
+
+    if (behind.kind == BLOCK_KIND_STAIRS && behind.top == stairs.top &&
+        (behind.facing & 1) != (facing & 1) &&
+        stairs_can_take_shape(volume, x, y, z, stairs, (behind.facing + 2) % 4)) {
+
+        return (behind.facing == counter_clockwise) ? STAIRS_SHAPE_OUTER_LEFT : STAIRS_SHAPE_OUTER_RIGHT;
+    }
+
+    BlockKind in_front = volume.at(x - direction_dx[facing], y, z - direction_dz[facing]);
+
+    if (in_front.kind == BLOCK_KIND_STAIRS && in_front.top == stairs.top &&
+        (in_front.facing & 1) != (facing & 1) &&
+        stairs_can_take_shape(volume, x, y, z, stairs, in_front.facing)) {
+
+        return (in_front.facing == counter_clockwise) ? STAIRS_SHAPE_INNER_LEFT : STAIRS_SHAPE_INNER_RIGHT;
+    }
+
+    return STAIRS_SHAPE_STRAIGHT;
+}
+
+/**
+ * @brief IronBarsBlock.attachsTo() for the neighbor on one side of a pane: other
+ *        panes, and any face that's full towards the pane.
+ */
+static bool pane_attaches(const BlockKind& neighbor, int side) {
+
+    switch (neighbor.kind) {
+    case BLOCK_KIND_PANE:   return true;
+    case BLOCK_KIND_SOLID:  return true;
+    case BLOCK_KIND_STAIRS: return neighbor.facing == (side + 2) % 4;
+    default:                return false;
+    }
+}
+
+void block_states_compute(const uint8_t* context, const uint8_t* block_ids, uint16_t* states) {
+
+    StateVolume volume = { context, block_ids };
+
+    for         (int x = 0; x < GENERATED_WIDTH; x++) {
+        for     (int y = 0; y < GENERATED_WIDTH; y++) {
+            for (int z = 0; z < GENERATED_WIDTH; z++) {
+
+                int i = packed_index(x, y, z, GENERATED_WIDTH);
+                int block_id = block_ids[i];
+                BlockKind kind = block_kind(block_id);
+                int properties = 0;
+
+                if (kind.kind == BLOCK_KIND_STAIRS) {
+                    properties = stairs_shape(volume, x + 1, y + 1, z + 1, kind);
+                } else if (kind.kind == BLOCK_KIND_PANE) {
+
+                    for (int side = 0; side < 4; side++) {
+                        if (pane_attaches(volume.at(x + 1 + direction_dx[side], y + 1, z + 1 + direction_dz[side]), side)) {
+                            properties |= direction_pane[side];
+                        }
+                    }
+
+                    if (properties == 0) {
+                        properties = kind.axis_panes;
+                    }
+                }
+
+                states[i] = block_state_pack(block_id, properties);
+            }
+        }
+    }
+}
+
+/* The blocks of DiffusionMod.BLOCK_STATES with their properties in name order. Stairs
+ * take their shape and panes their connections (east, north, south, west) as %s */
+struct PaletteState {
+    const char* name;
+    const char* properties;
+};
+
+static const PaletteState palette_states[BLOCK_STATE_PALETTE_SIZE] = {
+    { "air", "" },
+    { "dirt", "" },
+    { "white_concrete", "" },
+    { "stone_brick_slab", "type=bottom,waterlogged=false" },
+    { "grass_block", "snowy=false" },
+    { "oak_planks", "" },
+    { "stone_bricks", "" },
+    { "stripped_oak_wood", "axis=y" },
+    { "end_stone_bricks", "" },
+    { "white_wool", "" },
+    { "green_concrete", "" },
+    { "glass_pane", "east=%s,north=%s,south=%s,waterlogged=false,west=%s" },
+    { "smooth_stone", "" },
+    { "brown_shulker_box", "facing=up" },
+    { "glass_pane", "east=%s,north=%s,south=%s,waterlogged=false,west=%s" },
+    { "oak_slab", "type=bottom,waterlogged=false" },
+    { "sandstone", "" },
+    { "bricks", "" },
+    { "stone_brick_stairs", "facing=north,half=bottom,shape=%s,waterlogged=false" },
+    { "stone_brick_stairs", "facing=south,half=bottom,shape=%s,waterlogged=false" },
+    { "stone_brick_stairs", "facing=east,half=bottom,shape=%s,waterlogged=false" },
+    { "stone_brick_stairs", "facing=west,half=bottom,shape=%s,waterlogged=false" },
+    { "stone_bricks", "" },
+    { "bookshelf", "" },
+    { "glass", "" },
+    { "gravel", "" },
+    { "stone_brick_stairs", "facing=south,half=top,shape=%s,waterlogged=false" },
+    { "stone_brick_stairs", "facing=north,half=top,shape=%s,waterlogged=false" },
+    { "stone_brick_stairs", "facing=west,half=top,shape=%s,waterlogged=false" },
+    { "stone_brick_stairs", "facing=east,half=top,shape=%s,waterlogged=false" },
+    { "dropper", "facing=north,triggered=false" },
+};
+
+static const char* const stairs_shape_names[] = { "straight", "inner_left", "inner_right", "outer_left", "outer_right" };
+
+uint16_t block_state_of_context(int block_id) {
+
+    BlockKind kind = block_kind(block_id);
+
+    return block_state_pack(block_id, (kind.kind == BLOCK_KIND_PANE) ? kind.axis_panes : 0);
+}
+
+int block_state_string(uint16_t state, char* out) {
+
+    int block_id = block_state_id(state);
+    int properties = block_state_properties(state);
+
+    if (block_id >= BLOCK_STATE_PALETTE_SIZE) {
+        block_id = 0;
+        properties = 0;
+    }
+
+    const PaletteState& palette = palette_states[block_id];
+    BlockKind kind = block_kind(block_id);
+    char values[BLOCK_STATE_STRING_MAX];
+
+    if (kind.kind == BLOCK_KIND_STAIRS) {
+        snprintf(values, sizeof(values), palette.properties,
+                 stairs_shape_names[(properties <= STAIRS_SHAPE_OUTER_RIGHT) ? properties : STAIRS_SHAPE_OUTER_RIGHT]);
+    } else if (kind.kind == BLOCK_KIND_PANE) {
+        snprintf(values, sizeof(values), palette.properties,
+                 (properties & PANE_EAST)  ? "true" : "false",
+                 (properties & PANE_NORTH) ? "true" : "false",
+                 (properties & PANE_SOUTH) ? "true" : "false",
+                 (properties & PANE_WEST)  ? "true" : "false");
+    } else {
+        snprintf(values, sizeof(values), "%s", palette.properties);
+    }
+
+    return snprintf(out, BLOCK_STATE_STRING_MAX, values[0] ? "minecraft:%s[%s]" : "minecraft:%s", palette.name, values);
+}
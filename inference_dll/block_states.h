@@ -0,0 +1,83 @@
+/**
+ * @file block_states.h
+ * @brief Full block states for the palette ids whose shape depends on neighbors.
+ *
+ *  Minecraft works out the shape of stairs and the connections of glass panes from
+ *  their neighbors, one updateShape() call at a time as blocks are placed, and each
+ *  change cascades into the neighbors' updates. The palette fixes only part of these
+ *  states: the facing and half of stairs (ids 18-21, 26-29) and the axis of a pane
+ *  (ids 11, 14). block_states_compute() works out the rest for a whole generated
+ *  volume at once, from the generated ids and the context border around them, so
+ *  the mod can place final states without neighbor updates.
+ *
+ *  A state index is a palette id in the low BLOCK_STATE_ID_BITS and the computed
+ *  properties above it:
+ *   stairs  a STAIRS_SHAPE_ constant
+ *   panes   PANE_ bits of the connected sides. A pane with nothing to connect to
+ *           keeps the axis of its id rather than becoming a post.
+ *  Every other id has no properties, so its state index is the id.
+ *
+ *  The rules follow StairBlock.getStairsShape() and IronBarsBlock.attachsTo() of
+ *  the game version the mod targets.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "inference.h"
+
+const int BLOCK_STATE_ID_BITS = 7; /* BLOCK_ID_COUNT ids, with 4 bits of properties above */
+
+const int STAIRS_SHAPE_STRAIGHT    = 0;
+const int STAIRS_SHAPE_INNER_LEFT  = 1;
+const int STAIRS_SHAPE_INNER_RIGHT = 2;
+const int STAIRS_SHAPE_OUTER_LEFT  = 3;
+const int STAIRS_SHAPE_OUTER_RIGHT = 4;
+
+const int PANE_NORTH = 1;   /* -z */
+const int PANE_EAST  = 2;   /* +x */
+const int PANE_SOUTH = 4;   /* +z */
+const int PANE_WEST  = 8;   /* -x */
+
+static_assert(BLOCK_ID_COUNT <= (1 << BLOCK_STATE_ID_BITS), "Block ids must fit BLOCK_STATE_ID_BITS");
+
+inline uint16_t block_state_pack(int block_id, int properties) {
+    return (uint16_t)((properties << BLOCK_STATE_ID_BITS) | block_id);
+}
+
+inline int block_state_id(uint16_t state) {
+    return state & ((1 << BLOCK_STATE_ID_BITS) - 1);
+}
+
+inline int block_state_properties(uint16_t state) {
+    return state >> BLOCK_STATE_ID_BITS;
+}
+
+/* Ids from here on are past DiffusionMod.BLOCK_STATES and placed as air */
+const int BLOCK_STATE_PALETTE_SIZE = 31;
+
+const int BLOCK_STATE_STRING_MAX = 128;
+
+/**
+ * @brief State index of a context id. Context blocks keep the state the world gave
+ *        them as far as the id tells: stairs straight, panes along their axis.
+ */
+uint16_t block_state_of_context(int block_id);
+
+/**
+ * @brief Format a state index as the game writes block states,
+ *        "minecraft:name[property=value,...]" with every property of the state in name
+ *        order, e.g. for schematic palettes.
+ * @param out Receives up to BLOCK_STATE_STRING_MAX bytes including the terminator.
+ * @return Length of the string.
+ */
+int block_state_string(uint16_t state, char* out);
+
+/**
+ * @brief Compute the state index of every generated voxel.
+ * @param context Packed CHUNK_WIDTH^3 context ids. Only the border is used.
+ * @param block_ids Packed GENERATED_WIDTH^3 generated ids, placed inside the border.
+ * @param states Receives GENERATED_WIDTH^3 state indices in the same order.
+ */
+void block_states_compute(const uint8_t* context, const uint8_t* block_ids, uint16_t* states);
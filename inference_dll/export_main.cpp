@@ -0,0 +1,214 @@
+/**
+ * @file export_main.cpp
+ * @brief Exports generated chunks from a packed chunk file (see packed_chunk.h) to a
+ *        Sponge schematic or a structure template (see schematic.h).
+ *
+ *        Records are laid out as a grid of sections, record N at grid position
+ *        (x * grid_y + y) * grid_z + z counting from --first, like the ids inside a
+ *        record. Each section is the generated 14^3 inside the border of the context
+ *        it was generated from, so neighbouring records line up as the chunks of the
+ *        world did. Records are read back from the files as the exporter asks for
+ *        them, so memory use doesn't depend on the size of the grid.
+ *
+ *        Build by compiling this file together with every other .cpp file except
+ *        the *_main.cpp tools and backend_tensorrt.cpp, with INFERENCE_NO_TEST_MAIN
+ *        and INFERENCE_MOCK_BACKEND defined. No model is run.
+ *
+ *  Usage: schematic_export [options] <chunks.vxck> <output.schem | output.nbt>
+ *
+ *    --contexts PATH   Context stream the chunks were generated from. Fills the
+ *                      border and gives stairs and panes their neighbours. Without
+ *                      it the border is air.
+ *    --first N         First record to export (default 0).
+ *    --grid X Y Z      Sections along each axis (default: every record, in a row
+ *                      along x). Positions past the last record are air.
+ *    --format NAME     sponge or structure (default: structure for .nbt, else sponge).
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "block_states.h"
+#include "schematic.h"
+
+struct RecordSource {
+    FILE* chunks;
+    FILE* contexts;
+    int64_t first;
+    int64_t count;
+    int grid_y;
+    int grid_z;
+};
+
+static bool read_record(FILE* file, int64_t record, int record_size, uint8_t* data) {
+    return file_seek(file, sizeof(PackedHeader) + record * record_size, SEEK_SET) == 0 &&
+           fread(data, record_size, 1, file) == 1;
+}
+
+static bool record_source(void* user, int section_x, int section_y, int section_z, uint16_t* states) {
+
+    const RecordSource* source = (const RecordSource*)user;
+    int64_t record = source->first + ((int64_t)section_x * source->grid_y + section_y) * source->grid_z + section_z;
+
+    uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+    uint8_t block_ids[PACKED_CHUNK_RECORD_SIZE];
+    uint16_t generated[PACKED_CHUNK_RECORD_SIZE];
+
+    memset(context, 0, sizeof(context));
+
+    if (record >= source->count) {
+        memset(states, 0, PACKED_CONTEXT_RECORD_SIZE * sizeof(uint16_t));
+        return true;
+    }
+
+    if (!read_record(source->chunks, record, PACKED_CHUNK_RECORD_SIZE, block_ids) ||
+        (source->contexts && !read_record(source->contexts, record, PACKED_CONTEXT_RECORD_SIZE, context))) {
+        printf("Failed to read record %lld\n", (long long)record);
+        return false;
+    }
+
+    block_states_compute(context, block_ids, generated);
+
+    for         (int x = 0; x < CHUNK_WIDTH; x++) {
+        for     (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int z = 0; z < CHUNK_WIDTH; z++) {
+
+                bool inside = x >= 1 && x <= GENERATED_WIDTH &&
+                              y >= 1 && y <= GENERATED_WIDTH &&
+                              z >= 1 && z <= GENERATED_WIDTH;
+
+                states[packed_index(x, y, z, CHUNK_WIDTH)] = inside
+                    ? generated[packed_index(x - 1, y - 1, z - 1, GENERATED_WIDTH)]
+                    : block_state_of_context(context[packed_index(x, y, z, CHUNK_WIDTH)]);
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Open a packed stream and count its records.
+ * @return The file, or NULL if it isn't a stream of the given kind.
+ */
+static FILE* open_stream(const char* path, uint32_t magic, int width, int record_size, int64_t* count) {
+
+    FILE* file = fopen(path, "rb");
+
+    if (!file || !packed_read_header(file, magic, width)) {
+        printf("%s is not a packed stream of %d^3 records\n", path, width);
+        if (file) {
+            fclose(file);
+        }
+        return NULL;
+    }
+
+    file_seek(file, 0, SEEK_END);
+    *count = ((int64_t)file_tell(file) - (int64_t)sizeof(PackedHeader)) / record_size;
+
+    return file;
+}
+
+static void print_usage() {
+    printf("Usage: schematic_export [--contexts PATH] [--first N] [--grid X Y Z] [--format sponge|structure] <chunks.vxck> <output.schem | output.nbt>\n");
+}
+
+int main(int argc, char** argv) {
+
+    const char* chunks_path = NULL;
+    const char* output_path = NULL;
+    const char* contexts_path = NULL;
+    const char* format_name = NULL;
+    int64_t first = 0;
+    int grid[3] = { 0, 1, 1 };
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "--contexts") == 0 && i + 1 < argc) {
+            contexts_path = argv[++i];
+        } else if (strcmp(argv[i], "--first") == 0 && i + 1 < argc) {
+            first = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--grid") == 0 && i + 3 < argc) {
+            grid[0] = atoi(argv[++i]);
+            grid[1] = atoi(argv[++i]);
+            grid[2] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            format_name = argv[++i];
+        } else if (!chunks_path) {
+            chunks_path = argv[i];
+        } else if (!output_path) {
+            output_path = argv[i];
+        } else {
+            print_usage();
+            return INFER_ERROR_INVALID_ARG;
+        }
+    }
+
+    if (!chunks_path || !output_path || first < 0) {
+        print_usage();
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    int format;
+    size_t output_length = strlen(output_path);
+
+    if (format_name) {
+        format = (strcmp(format_name, "structure") == 0) ? SCHEMATIC_FORMAT_STRUCTURE : SCHEMATIC_FORMAT_SPONGE;
+    } else {
+        format = (output_length > 4 && strcmp(output_path + output_length - 4, ".nbt") == 0)
+            ? SCHEMATIC_FORMAT_STRUCTURE : SCHEMATIC_FORMAT_SPONGE;
+    }
+
+    RecordSource source = {};
+    source.first = first;
+
+    source.chunks = open_stream(chunks_path, PACKED_CHUNK_MAGIC, GENERATED_WIDTH, PACKED_CHUNK_RECORD_SIZE, &source.count);
+
+    if (!source.chunks) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    if (contexts_path) {
+
+        int64_t context_count;
+        source.contexts = open_stream(contexts_path, PACKED_CONTEXT_MAGIC, CHUNK_WIDTH, PACKED_CONTEXT_RECORD_SIZE, &context_count);
+
+        if (!source.contexts) {
+            return INFER_ERROR_INVALID_ARG;
+        }
+
+        if (context_count < source.count) {
+            source.count = context_count;
+        }
+    }
+
+    if (grid[0] == 0) {
+        grid[0] = (int)std::max<int64_t>(source.count - first, 1);
+    }
+
+    source.grid_y = grid[1];
+    source.grid_z = grid[2];
+
+    int result = schematic_export(output_path, format, grid[0], grid[1], grid[2], record_source, &source);
+
+    if (result == 0) {
+        printf("Exported %d x %d x %d sections to %s\n", grid[0], grid[1], grid[2], output_path);
+    } else {
+        printf("Export failed (%d)\n", result);
+    }
+
+    fclose(source.chunks);
+
+    if (source.contexts) {
+        fclose(source.contexts);
+    }
+
+    return result;
+}
@@ -0,0 +1,347 @@
+/**
+ * @file history.cpp
+ * @brief Delta compressed per-job history of decoded block ids. See history.h.
+ */
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "inference.h"
+#include "history.h"
+
+struct HistorySegment {
+    std::vector<uint8_t> data;          /* Keyframe followed by delta frames */
+    std::vector<uint32_t> offsets;      /* Start of each frame in data */
+    std::vector<int32_t> timesteps;
+};
+
+/* The recorded frames of one job's run */
+struct HistoryRun {
+    std::deque<HistorySegment> segments;
+    int64_t bytes;
+    bool force_keyframe;
+    uint64_t begin_order;               /* For dropping the oldest run */
+    uint8_t previous[PACKED_CHUNK_RECORD_SIZE]; /* Last recorded frame, the base for the next delta */
+};
+
+static std::mutex history_mtx;
+static std::unordered_map<int32_t, HistoryRun> history_runs;
+static std::atomic<int64_t> history_max_bytes;
+static uint64_t history_next_begin_order;
+
+static void put_varint(std::vector<uint8_t>& data, uint32_t value) {
+
+    while (value >= 0x80) {
+        data.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+
+    data.push_back((uint8_t)value);
+}
+
+static uint32_t get_varint(const uint8_t** cursor) {
+
+    uint32_t value = 0;
+    int shift = 0;
+
+    for (;;) {
+        uint8_t byte = *(*cursor)++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80)) {
+            return value;
+        }
+
+        shift += 7;
+    }
+}
+
+static int64_t segment_bytes(const HistorySegment& segment) {
+    return (int64_t)(segment.data.size() + segment.offsets.size() * (sizeof(uint32_t) + sizeof(int32_t)));
+}
+
+/**
+ * @brief Keyframes are coded as (run length, id) pairs.
+ */
+static void encode_keyframe(std::vector<uint8_t>& data, const uint8_t* block_ids) {
+
+    int i = 0;
+
+    while (i < PACKED_CHUNK_RECORD_SIZE) {
+
+        int run = 1;
+
+        while (i + run < PACKED_CHUNK_RECORD_SIZE && block_ids[i + run] == block_ids[i]) {
+            run++;
+        }
+
+        put_varint(data, run);
+        data.push_back(block_ids[i]);
+        i += run;
+    }
+}
+
+/**
+ * @brief Delta frames are coded as (unchanged count, changed count, changed ids...)
+ *        groups. Trailing unchanged indices aren't stored.
+ */
+static void encode_delta(std::vector<uint8_t>& data, const uint8_t* previous, const uint8_t* block_ids) {
+
+    int i = 0;
+    int run_end = 0;
+
+    while (i < PACKED_CHUNK_RECORD_SIZE) {
+
+        if (block_ids[i] == previous[i]) {
+            i++;
+            continue;
+        }
+
+        int start = i;
+
+        while (i < PACKED_CHUNK_RECORD_SIZE && block_ids[i] != previous[i]) {
+            i++;
+        }
+
+        put_varint(data, start - run_end);
+        put_varint(data, i - start);
+        data.insert(data.end(), block_ids + start, block_ids + i);
+        run_end = i;
+    }
+}
+
+static void decode_keyframe(const uint8_t* cursor, uint8_t* block_ids) {
+
+    int i = 0;
+
+    while (i < PACKED_CHUNK_RECORD_SIZE) {
+        uint32_t run = get_varint(&cursor);
+        memset(block_ids + i, *cursor++, run);
+        i += run;
+    }
+}
+
+static void apply_delta(const uint8_t* cursor, const uint8_t* end, uint8_t* block_ids) {
+
+    int i = 0;
+
+    while (cursor < end) {
+        i += get_varint(&cursor);
+        uint32_t changed = get_varint(&cursor);
+        memcpy(block_ids + i, cursor, changed);
+        cursor += changed;
+        i += changed;
+    }
+}
+
+void history_set_limit(int64_t max_bytes) {
+
+    std::lock_guard<std::mutex> lock(history_mtx);
+
+    if (max_bytes > 0 && max_bytes < HISTORY_MIN_BYTES) {
+        max_bytes = HISTORY_MIN_BYTES;
+    }
+
+    history_max_bytes = max_bytes;
+}
+
+bool history_enabled() {
+    return history_max_bytes > 0;
+}
+
+void history_begin(int32_t job_id) {
+
+    std::lock_guard<std::mutex> lock(history_mtx);
+
+    if (history_max_bytes <= 0) {
+        history_runs.erase(job_id);
+        return;
+    }
+
+    /* Make room by dropping the run that began first */
+    if (history_runs.find(job_id) == history_runs.end() && history_runs.size() >= (size_t)HISTORY_MAX_RUNS) {
+
+        auto oldest = history_runs.begin();
+
+        for (auto it = history_runs.begin(); it != history_runs.end(); ++it) {
+            if (it->second.begin_order < oldest->second.begin_order) {
+                oldest = it;
+            }
+        }
+
+        history_runs.erase(oldest);
+    }
+
+    HistoryRun& run = history_runs[job_id];
+
+    run.segments.clear();
+    run.bytes = 0;
+    run.force_keyframe = false;
+    run.begin_order = history_next_begin_order++;
+}
+
+void history_record(int32_t job_id, int32_t t, const uint8_t* block_ids) {
+
+    std::lock_guard<std::mutex> lock(history_mtx);
+
+    auto found = history_runs.find(job_id);
+
+    if (history_max_bytes <= 0 || found == history_runs.end()) {
+        return;
+    }
+
+    HistoryRun& run = found->second;
+
+    bool keyframe = run.segments.empty() || run.force_keyframe ||
+                    run.segments.back().offsets.size() >= (size_t)HISTORY_KEYFRAME_INTERVAL;
+
+    if (keyframe) {
+        run.segments.emplace_back();
+        run.force_keyframe = false;
+    }
+
+    HistorySegment& segment = run.segments.back();
+    int64_t bytes_before = segment_bytes(segment);
+
+    segment.offsets.push_back((uint32_t)segment.data.size());
+    segment.timesteps.push_back(t);
+
+    if (keyframe) {
+        encode_keyframe(segment.data, block_ids);
+    } else {
+        encode_delta(segment.data, run.previous, block_ids);
+    }
+
+    memcpy(run.previous, block_ids, PACKED_CHUNK_RECORD_SIZE);
+    run.bytes += segment_bytes(segment) - bytes_before;
+
+    /* Drop whole segments from the front so every held frame stays decodable. If
+     * the only segment is over the limit, end it early so it can be dropped next. */
+    while (run.bytes > history_max_bytes && run.segments.size() > 1) {
+        run.bytes -= segment_bytes(run.segments.front());
+        run.segments.pop_front();
+    }
+
+    if (run.bytes > history_max_bytes) {
+        run.force_keyframe = true;
+    }
+}
+
+int64_t history_memory_bytes(int32_t job_id) {
+
+    std::lock_guard<std::mutex> lock(history_mtx);
+
+    auto found = history_runs.find(job_id);
+    return (found == history_runs.end()) ? 0 : found->second.bytes;
+}
+
+int64_t history_total_bytes() {
+
+    std::lock_guard<std::mutex> lock(history_mtx);
+
+    int64_t bytes = 0;
+
+    for (const auto& run : history_runs) {
+        bytes += run.second.bytes;
+    }
+
+    return bytes;
+}
+
+int history_frame_count(int32_t job_id) {
+
+    std::lock_guard<std::mutex> lock(history_mtx);
+
+    auto found = history_runs.find(job_id);
+    size_t count = 0;
+
+    if (found != history_runs.end()) {
+        for (const HistorySegment& segment : found->second.segments) {
+            count += segment.offsets.size();
+        }
+    }
+
+    return (int)count;
+}
+
+/**
+ * @brief Rebuild a frame of a job's run with history_mtx held.
+ */
+static int32_t read_locked(int32_t job_id, int frame, uint8_t* block_ids) {
+
+    auto found = history_runs.find(job_id);
+
+    if (frame < 0 || found == history_runs.end()) {
+        return -1;
+    }
+
+    for (const HistorySegment& segment : found->second.segments) {
+
+        int frames = (int)segment.offsets.size();
+
+        if (frame >= frames) {
+            frame -= frames;
+            continue;
+        }
+
+        const uint8_t* data = segment.data.data();
+
+        decode_keyframe(data, block_ids);
+
+        for (int i = 1; i <= frame; i++) {
+            uint32_t end = (i + 1 < frames) ? segment.offsets[i + 1] : (uint32_t)segment.data.size();
+            apply_delta(data + segment.offsets[i], data + end, block_ids);
+        }
+
+        return segment.timesteps[frame];
+    }
+
+    return -1;
+}
+
+int32_t history_read(int32_t job_id, int frame, uint8_t* block_ids) {
+
+    std::lock_guard<std::mutex> lock(history_mtx);
+
+    return read_locked(job_id, frame, block_ids);
+}
+
+int history_export(int32_t job_id, const char* path) {
+
+    FILE* file = fopen(path, "wb");
+
+    if (!file) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    bool ok = packed_write_header(file, HISTORY_MAGIC, GENERATED_WIDTH);
+
+    {
+        std::lock_guard<std::mutex> lock(history_mtx);
+
+        uint8_t block_ids[PACKED_CHUNK_RECORD_SIZE];
+
+        for (int frame = 0; ok; frame++) {
+
+            int32_t t = read_locked(job_id, frame, block_ids);
+
+            if (t < 0) {
+                break;
+            }
+
+            ok = fwrite(&t, sizeof(t), 1, file) == 1 &&
+                 fwrite(block_ids, sizeof(block_ids), 1, file) == 1;
+        }
+    }
+
+    ok = (fclose(file) == 0) && ok;
+
+    return ok ? 0 : INFER_ERROR_FAILED_OPERATION;
+}
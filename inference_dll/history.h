@@ -0,0 +1,75 @@
+/**
+ * @file history.h
+ * @brief Optional recorder of how the decoded block ids evolve over a diffusion run.
+ *        Used for "growth" timelapses and for debugging the sampler.
+ *
+ *  Every recorded frame is the decoded 14^3 ids at one timestep. Frames are grouped
+ *  into segments that start with a keyframe (run-length coded ids) followed by up to
+ *  HISTORY_KEYFRAME_INTERVAL - 1 delta frames. A delta frame only stores the runs of
+ *  indices whose id changed since the previous frame, along with their new ids, so
+ *  any frame can be rebuilt by decoding at most one segment.
+ *
+ *  Every job records its own run, keyed by job id, so jobs that share the denoise
+ *  thread under round robin or finish from the structure library don't overwrite
+ *  each other's frames. A run is kept after its job is collected, so the frames can
+ *  still be read once the structure is placed, until the id is submitted again or
+ *  HISTORY_MAX_RUNS newer runs have begun.
+ *
+ *  Memory is bounded by a per-run byte limit. When the limit is exceeded the oldest
+ *  segment is dropped, so the most recent frames are always available.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "packed_chunk.h"
+
+const uint32_t HISTORY_MAGIC = 0x53485856; /* "VXHS" little endian */
+const int HISTORY_KEYFRAME_INTERVAL = 50;
+const int HISTORY_MIN_BYTES = 64 * 1024;
+const int HISTORY_MAX_RUNS = 64;    /* As many as the job table holds */
+
+/**
+ * @brief Set the byte limit for the recorded history. 0 disables recording.
+ *        Limits below HISTORY_MIN_BYTES are raised to it.
+ */
+void history_set_limit(int64_t max_bytes);
+bool history_enabled();
+
+/**
+ * @brief Start a new run for a job, discarding its previous frames. Called when the
+ *        job is submitted. Does nothing but drop old frames while recording is off.
+ */
+void history_begin(int32_t job_id);
+
+/**
+ * @brief Append a frame of packed GENERATED_WIDTH^3 ids decoded at timestep t to a
+ *        job's run. Ignored for a job without a run.
+ */
+void history_record(int32_t job_id, int32_t t, const uint8_t* block_ids);
+
+int history_frame_count(int32_t job_id);
+
+/**
+ * @brief Bytes the held frames of a job take.
+ */
+int64_t history_memory_bytes(int32_t job_id);
+
+/**
+ * @brief Bytes the held frames of every run take.
+ */
+int64_t history_total_bytes();
+
+/**
+ * @brief Rebuild a frame of a job's run. Frame 0 is the oldest frame still held.
+ * @return The frame's timestep, or -1 if the frame doesn't exist.
+ */
+int32_t history_read(int32_t job_id, int frame, uint8_t* block_ids);
+
+/**
+ * @brief Write every held frame of a job's run, oldest first, as a PackedHeader with HISTORY_MAGIC
+ *        followed by records of an int32 timestep and GENERATED_WIDTH^3 id bytes.
+ * @return 0 on success, error code on failure.
+ */
+int history_export(int32_t job_id, const char* path);
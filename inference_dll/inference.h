@@ -0,0 +1,130 @@
+/**
+ * @file inference.h
+ * @brief Shared constants and the exported entry points of inference_main.cpp.
+ *        The Java side binds to these by name through Inference.java. Native tools
+ *        (such as the batch generator) include this header and link against
+ *        inference_main.cpp to drive the same entry points without a game server.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+    #define DLL_EXPORT __declspec(dllexport)
+#elif defined(__GNUC__)
+    #define DLL_EXPORT __attribute__((visibility("default")))
+#endif
+
+/*
+ * Constants:
+ */
+const int INFER_ERROR_INVALID_ARG             = 1;
+const int INFER_ERROR_FAILED_OPERATION        = 2;
+const int INFER_ERROR_INVALID_OPERATION       = 3;
+const int INFER_ERROR_DESERIALIZE_CUDA_ENGINE = 4;
+const int INFER_ERROR_BUILDING_FROM_ONNX      = 5;
+const int INFER_ERROR_ENGINE_SAVE             = 6;
+const int INFER_ERROR_SET_TENSOR_ADDRESS      = 7;
+const int INFER_ERROR_ENQUEUE                 = 8;
+const int INFER_ERROR_CREATE_RUNTIME          = 9;
+const int INFER_ERROR_STEP_TIMEOUT            = 10; /* A backend step stalled, see watchdog.h */
+
+const int BLOCK_ID_COUNT = 96;
+const int EMBEDDING_DIMENSIONS = 3;
+const int CHUNK_WIDTH = 16;
+const int GENERATED_WIDTH = CHUNK_WIDTH - 2; /* Middle 14^3 blocks without surrounding context */
+
+/*
+ * Sparse output modes for setSparseOutputMode():
+ *  NON_AIR lists every generated voxel that isn't air.
+ *  CHANGED lists every generated voxel that differs from what the world holds, which
+ *  is the context at the start of a run and then the ids already emitted.
+ *  CHANGED_STATES is CHANGED with full block states (block_states.h) in place of
+ *  ids, so a stair whose neighbors change is listed again with its new shape.
+ *  Entries are packed with sparse_pack_state(). A job should be read with one of
+ *  the two CHANGED modes only, each keeps its own baseline.
+ */
+const int SPARSE_OUTPUT_OFF            = 0;
+const int SPARSE_OUTPUT_NON_AIR        = 1;
+const int SPARSE_OUTPUT_CHANGED        = 2;
+const int SPARSE_OUTPUT_CHANGED_STATES = 3;
+
+const int n_U = 5;    /* Number of inpainting steps per timestep */
+const int n_T = 1000; /* Number of timesteps */
+
+/**
+ * @brief Record an error for getLastError(). Used by the entry points that live
+ *        outside inference_main.cpp.
+ */
+void inference_set_last_error(int32_t error);
+
+/*
+ * Exported entry points. The two leading pointers are the JNIEnv and jclass
+ * arguments that the JVM passes to every native method. They are unused.
+ */
+extern "C" {
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_init(void* unused1, void* unused2);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setContextBlock(void* unused1, void* unused2,
+        int32_t x, int32_t y, int32_t z, int32_t block_id);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_startDiffusion(void* unused1, void* unused2);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_getCurrentTimestep(void* unused1, void* unused2);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_cacheCurrentTimestepForReading(void* unused1, void* unused2);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_readBlockFromCachedTimestep(void* unused1, void* unused2,
+        int32_t x, int32_t y, int32_t z);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_getLastError(void* unused1, void* unused2);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setLibrarySimilarityThreshold(void* unused1, void* unused2,
+        float threshold);
+
+DLL_EXPORT int64_t Java_tbarnes_diffusionmod_Inference_getStat(void* unused1, void* unused2, int32_t stat);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setPerfCountersEnabled(void* unused1, void* unused2, int32_t enabled);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setSparseOutputMode(void* unused1, void* unused2, int32_t mode);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_getSparseCount(void* unused1, void* unused2);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_readSparseEntry(void* unused1, void* unused2, int32_t i);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setHistoryMemoryLimit(void* unused1, void* unused2, int32_t max_bytes);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_getHistoryFrameCount(void* unused1, void* unused2, int32_t job_id);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_cacheHistoryFrameForReading(void* unused1, void* unused2, int32_t job_id, int32_t frame);
+
+/* registerTickBuffers() is declared with JNI types in tick_buffer.cpp */
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_tick(void* unused1, void* unused2, int32_t command_bytes);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setSchedulerPolicy(void* unused1, void* unused2,
+        int32_t policy, int32_t quantum_timesteps);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setShadowMode(void* unused1, void* unused2,
+        int32_t backend, int32_t sample_every, int32_t u_steps);
+
+DLL_EXPORT int64_t Java_tbarnes_diffusionmod_Inference_getTracePhase(void* unused1, void* unused2,
+        int32_t job_id, int32_t phase);
+
+DLL_EXPORT int64_t Java_tbarnes_diffusionmod_Inference_getTracePercentile(void* unused1, void* unused2,
+        int32_t phase, int32_t permille);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_startMetricsServer(void* unused1, void* unused2, int32_t port);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setWatchdogTimeout(void* unused1, void* unused2, int32_t timeout);
+
+DLL_EXPORT int64_t Java_tbarnes_diffusionmod_Inference_getWatchdogWindow(void* unused1, void* unused2,
+        int32_t i, int32_t field);
+
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_setSettleMode(void* unused1, void* unused2, int32_t flags);
+
+/* submitAsyncBatch() and takeAsyncJob() are declared with JNI types in async_jobs.cpp */
+DLL_EXPORT int32_t Java_tbarnes_diffusionmod_Inference_waitAsyncJob(void* unused1, void* unused2, int32_t timeout_ms);
+
+}
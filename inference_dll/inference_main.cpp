@@ -1,17 +1,22 @@
 /**
  * @file inference_main.cpp
  * @brief This file is an interface between the Minecraft mod and the ONNX model from 
- *        PyTorch. It works by leveraging the NVIDIA TensorRT runtime to optimize and
- *        run the ONNX model. Instead of including "jni.h" for the Java Native Interface,
+ *        PyTorch. It works by leveraging the NVIDIA TensorRT runtime (backend_tensorrt.cpp)
+ *        to optimize and run the ONNX model. Instead of including "jni.h" for the Java Native Interface,
  *        this file simply defines functions with the correct prototype so atomic datatypes
- *        in function arguments and returns are usable from Java. 
+ *        in function arguments and returns are usable from Java. The command buffer
+ *        entry points in tick_buffer.cpp are the one place that needs "jni.h".
+ *
+ *        Generation requests are jobs in job_queue.h. The entry points below drive
+ *        the single job with id LEGACY_JOB_ID.
  */
 
-#include <random>
 #include <mutex>
 #include <thread>
 #include <condition_variable>
 #include <chrono>
+#include <atomic>
+#include <vector>
 
 #include <stdlib.h>
 #include <string.h>
@@ -22,120 +27,71 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 
-#include <NvOnnxParser.h>
-#include <NvInfer.h>
-#include <NvOnnxParser.h>
-#include <cuda_runtime_api.h>
-
-#if defined(_MSC_VER)
-    #define DLL_EXPORT __declspec(dllexport)
-#elif defined(__GNUC__)
-    #define DLL_EXPORT __attribute__((visibility("default")))
-#endif
-
-/* This macro is used to print CUDA errors at a specific line number and return 
- * a failed operation error code */
-#define CUDA_CHECK(expression) { \
-        cudaError_t err = (expression);\
-        if (err != cudaSuccess) { \
-            printf("CUDA error at line %d. (%s)\n", __LINE__, cudaGetErrorString(err)); \
-            return INFER_ERROR_FAILED_OPERATION; \
-        } \
-    }
+#include "inference.h"
+#include "backend.h"
+#include "block_embeddings.h"
+#include "job_queue.h"
+#include "stats.h"
+#include "structure_library.h"
+#include "history.h"
+#include "perf_counters.h"
+#include "shadow.h"
+#include "recorder.h"
+#include "metrics_export.h"
+#include "watchdog.h"
+#include "supervisor.h"
 
 /*
  * Constants:
  */
-const int INFER_ERROR_INVALID_ARG             = 1;
-const int INFER_ERROR_FAILED_OPERATION        = 2;
-const int INFER_ERROR_INVALID_OPERATION       = 3;
-const int INFER_ERROR_DESERIALIZE_CUDA_ENGINE = 4;
-const int INFER_ERROR_BUILDING_FROM_ONNX      = 5;
-const int INFER_ERROR_ENGINE_SAVE             = 6;
-const int INFER_ERROR_SET_TENSOR_ADDRESS      = 7;
-const int INFER_ERROR_ENQUEUE                 = 8;
-const int INFER_ERROR_CREATE_RUNTIME          = 9;
-
-const int BLOCK_ID_COUNT = 96;
-const int EMBEDDING_DIMENSIONS = 3;
-const int CHUNK_WIDTH = 16;
-
-const int n_U = 5;    /* Number of inpainting steps per timestep */
-const int n_T = 1000; /* Number of timesteps */
-const int instances = n_U * n_T;
-
-const int size_x              = 3 * 16 * 16 * 16 * sizeof(float);
-const int size_x_context      = 3 * 16 * 16 * 16 * sizeof(float);
-const int size_x_mask         = 1 * 16 * 16 * 16 * sizeof(float);
-const int size_normal_epsilon = 3 * 16 * 16 * 16 * sizeof(float);
-const int size_normal_z       = 3 * 16 * 16 * 16 * sizeof(float);
-const int size_alpha     = n_T * sizeof(float);
-const int size_alpha_bar = n_T * sizeof(float);
-const int size_beta      = n_T * sizeof(float);
-
-const char *onnx_file_path = "C:/Users/tbarnes/Desktop/projects/voxelnet/experiments/TestTensorRT/ddim_single_update.onnx";
-const char *engine_cache_path = "C:/Users/tbarnes/Desktop/projects/voxelnet/experiments/TestTensorRT/ddim_single_update.trt";
-
-const float block_id_embeddings[BLOCK_ID_COUNT][EMBEDDING_DIMENSIONS] = {
-    { 0.0, 0.0, 0.0   }, { -2.0, -1.0, 0.1 }, { 2.0, -1.0, 0.2  }, { 0.0, -1.0, -0.1 }, 
-    { -2.0, 2.0, -1.0 }, { -2.0, -1.0, -0.2}, { 0.0, -1.0, -0.3 }, { -2.0, -1.0, 0.4 }, 
-    { 2.0, 2.0, 2.0   }, { 2.0, -1.0, 0.5  }, { -2.0, 2.0, 0.0  }, { 2.0, 0.0, -0.5  },  
-    { 0.0, -1.0, -0.6 }, { -1.5, 1.0, 0.6  }, { 2.0, 0.0, 0.7   }, { -2.0, -1.0, -0.7}, 
-    { 0.0, -1.0, 0.8  }, { 0.0, -1.0, -0.8 }, { 0.0, -1.0, -0.9 }, { 0.0, -1.0, 0.9  }, 
-    { 0.0, -1.0, -1.0 }, { 0.0, -1.0, 1.0  }, { 0.0, -1.0, 0.0  }, { -2.0, 0.0, 0.1  },  
-    { 2.0, 0.0, -1.1  }, { -2.0, -1.0, -1.2}, { 0.0, -1.0, 1.1  }, { 0.0, -1.0, -1.3 }, 
-    { 0.0, -1.0, 1.2  }, { 0.0, -1.0, -1.4 }, { -2.0, 1.0, -1.5 }, { 0.5, 0.0, 0.5   }, 
-    { 0.5, 1.0, 0.5   }, { 0.5, 0.0, 1.5   }, { 0.5, 1.0, 1.5   }, { 0.0, 0.5, 1.5   }, 
-    { 0.0, 0.5, 0.5   }, { 1.0, 0.5, 1.5   }, { 1.0, 0.5, 0.5   }, { -3.0, 1.0, -2.0 }, 
-    { -2.0, 1.0, 1.7  }, { 1.5, 1.0, -0.5  }, { 1.5, 2.0, -0.5  }, { 1.5, 1.0, -1.5  }, 
-    { 1.5, 2.0, -1.5  }, { 2.0, 1.5, -0.5  }, { 2.0, 1.5, -1.5  }, { 1.0, 1.5, -0.5  },  
-    { 1.0, 1.5, -1.5  }, { 0.0, -2.0, 1.0  }, { 0.0, -1.0, 1.1  }, { 0.0, -1.0, -1.1 }, 
-    { 2.0, 0.0, -1.2  }, { 0.0, -1.0, 1.2  }, { 0.0, -1.0, -1.3 }, { 0.0, -1.0, 1.3  },
-    { 0.0, -1.0, -1.4 }, { 0.0, -1.0, 1.4  }, { 0.0, -1.0, -1.5 }, { 2.0, 0.0, 1.2   }, 
-    { 2.0, 0.0, -1.6  }, { 2.0, 0.0, 1.3   }, { 2.0, 0.0, -1.7  }, { 2.0, 0.0, 1.4   },
-    { 2.0, 0.0, -1.8  }, { 2.0, 0.0, 1.5   }, { 2.0, 0.0, -1.9  }, { 2.0, 0.0, 1.6   }, 
-    { 2.0, 0.0, -2.0  }, { 2.0, 0.0, 1.7   }, { 2.0, 0.0, -2.1  }, { 0.0, -1.0, -2.2 },   
-    { 0.0, -1.0, 1.8  }, { 0.0, -1.0, -2.3 }, { 0.0, -1.0, 1.9  }, { 0.0, -1.0, -2.4 }, 
-    { 0.0, -1.0, 2.0  }, { 0.0, -1.0, -2.5 }, { 0.0, -1.0, 2.1  }, { 0.0, -1.0, -2.6 }, 
-    { 0.0, -1.0, 2.2  }, { 0.0, -1.0, -2.7 }, { 0.0, -1.0, 2.3  }, { 0.0, -1.0, -2.8 },   
-    { 0.0, -1.0, 2.4  }, { 0.0, -1.0, -2.9 }, { 0.0, -1.0, 2.5  }, { 0.0, -1.0, -3.0 },
-    { 0.0, -1.0, 2.6  }, { 0.0, -1.0, -3.1 }, { 0.0, -1.0, 2.7  }, { 0.0, -1.0, -3.2 }, 
-    { 0.0, -1.0, 2.8  }, { 0.0, -1.0, -3.3 }, { 0.0, -1.0, 2.9  }, { 2.0, 0.0, -3.4  },  
-};
+const char *library_file_path = "C:/Users/tbarnes/Desktop/projects/voxelnet/experiments/TestTensorRT/pregenerated.vxlb";
+
 
 
 /* 
  * Program wide global variables and buffers:
  */
-static nvinfer1::IExecutionContext* context;
 
-static std::mutex mtx;
-static std::condition_variable cv;
-static bool denoise_should_start;
 static std::thread global_denoise_thread;
 
 static std::atomic<bool> init_called;
 static std::atomic<bool> init_complete;
-static std::atomic<bool> diffusion_running;
-static std::atomic<int32_t> global_timestep = 0;
 static std::atomic<int32_t> global_last_error;
 
 static float x_t       [EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
-static float x_t_cached[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
 static float x_context [EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
 static float x_mask                          [CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
 
 /* Middle 14^3 blocks without surrounding context */
-static int cached_block_ids[CHUNK_WIDTH-2][CHUNK_WIDTH-2][CHUNK_WIDTH-2]; 
+static uint8_t cached_block_ids[PACKED_CHUNK_RECORD_SIZE];
+
+/* Block ids passed to setContextBlock(), submitted by the next startDiffusion() */
+static uint8_t context_block_ids[CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+
+/* Sparse output of the legacy job, built by cacheCurrentTimestepForReading() */
+static int sparse_output_mode = SPARSE_OUTPUT_OFF;
+static int32_t sparse_entries[PACKED_CHUNK_RECORD_SIZE];
+static int32_t sparse_count;
 
 static float alpha[n_T];
 static float beta[n_T];
-static float alpha_bar[n_T];A
+static float alpha_bar[n_T];
 
+/* Decoded ids of the latest timestep, used by the denoise thread for the history */
+static uint8_t step_block_ids[PACKED_CHUNK_RECORD_SIZE];
+
+void inference_set_last_error(int32_t error) {
+    global_last_error = error;
+}
+
+/* Bytes handed to and returned by the backend, for the job receipts (job_queue.h).
+ * A step takes x_t and four scalars and returns x_out. */
+const int64_t CONTEXT_UPLOAD_BYTES = sizeof(x_context) + sizeof(x_mask);
+const int64_t STEP_TRANSFER_BYTES = 2 * sizeof(x_t) + sizeof(int32_t) + 3 * sizeof(float);
 
 /**
  * @brief This is the main thread that's kicked off at the beginning for init.
- *        It handles the denoising process and contains all the CUDA and TensorRT code.
+ *        It handles the denoising process and drives the backend.
  *        No resources are cleaned up in this thread since it survives for the lifetime 
  *        of the program.
  *
@@ -143,145 +99,6 @@ static float alpha_bar[n_T];A
  */
 int denoise_thread_main() {
 
-    /*
-     * Read the CUDA version 
-     */
-    int cuda_version;
-    cudaRuntimeGetVersion(&cuda_version);
-    printf("TensorRT version: %d\n", getInferLibVersion());
-    printf("CUDA runtime version: %d\n", cuda_version);
-
-    /* 
-     * The full process for runtime is exporting is:
-     *  Pytorch (torch.onnx.export()) --> ONNX (nvonnxparser) --> .TRT
-     *
-     * The code below first checks if we already have a TensorRT .trt file. 
-     * If so, we use it. If not, we create the file by generating it from the ONNX file.
-     *
-     * Generating the .trt file from ONNX can take a while since TensorRT goes through a
-     * long optimization process.
-     */
-    class Logger : public nvinfer1::ILogger { /* Logger class required by createInferRuntime()*/
-        void log(Severity severity, const char* msg) noexcept override {
-            if (severity != Severity::kINFO)
-                printf("%s\n", msg);
-        }
-    } runtime_logger;
-
-    FILE* file = fopen(engine_cache_path, "rb");
-
-    nvinfer1::ICudaEngine* engine = nullptr;
-    nvinfer1::IRuntime* runtime = nvinfer1::createInferRuntime(runtime_logger);
-
-    if (!runtime) {
-        printf("Failed to create TensorRT runtime\n");
-        return INFER_ERROR_CREATE_RUNTIME;
-    }
-
-    if (file) {
-        fseek(file, 0, SEEK_END);
-        size_t engine_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-
-        std::vector<char> engine_data(engine_size);
-
-        fread(engine_data.data(), 1, engine_size, file);
-        fclose(file);
-
-        engine = runtime->deserializeCudaEngine(engine_data.data(), engine_size);
-
-        if (!engine) {
-            printf("Failed to deserialize CUDA engine from %s\n", engine_cache_path);
-            return INFER_ERROR_DESERIALIZE_CUDA_ENGINE;
-        }
-        printf("Loaded prebuilt TensorRT engine from %s\n", engine_cache_path);
-
-    } else {
-        /* 
-         * The TensorRT .trt file wasn't found, so we need to generate it from the ONNX
-         * file and cache the result for next time.
-         */
-        nvinfer1::IBuilder *builder = nvinfer1::createInferBuilder(runtime_logger);
-        if (!builder) {
-            printf("Failed to create TensorRT builder\n");
-            return INFER_ERROR_BUILDING_FROM_ONNX;
-        }
-
-        nvinfer1::INetworkDefinition *network = builder->createNetworkV2(0);
-        if (!network) {
-            printf("Failed to create TensorRT network\n");
-            return INFER_ERROR_BUILDING_FROM_ONNX;
-        }
-
-        nvinfer1::IBuilderConfig *config = builder->createBuilderConfig();
-        if (!config) {
-            printf("Failed to create builder config\n");
-            return INFER_ERROR_BUILDING_FROM_ONNX;
-        }
-
-        nvonnxparser::IParser *parser = nvonnxparser::createParser(*network, runtime_logger);
-        if (!parser) {
-            printf("Failed to create ONNX parser\n");
-            return INFER_ERROR_BUILDING_FROM_ONNX;
-        }
-
-        if (!parser->parseFromFile(onnx_file_path, (int)nvinfer1::ILogger::Severity::kINFO)) {
-            printf("Error parsing ONNX file: %s\n", onnx_file_path);
-            return INFER_ERROR_BUILDING_FROM_ONNX;
-        }
-        printf("Successfully parsed ONNX model\n");
-
-        if (builder->platformHasFastFp16()) {
-            config->setFlag(nvinfer1::BuilderFlag::kFP16);
-            printf("Enabled FP16 precision\n");
-        }
-
-        config->setMemoryPoolLimit(nvinfer1::MemoryPoolType::kWORKSPACE, 1ULL << 30);
-
-        nvinfer1::IHostMemory *plan = builder->buildSerializedNetwork(*network, *config);
-        if (!plan) {
-            printf("Failed to build serialized network\n");
-            return INFER_ERROR_BUILDING_FROM_ONNX;
-        }
-
-        FILE* engine_out = fopen(engine_cache_path, "wb");
-
-        if (!engine_out) {
-            fclose(engine_out);
-            printf("Failed to save engine to %s\n", engine_cache_path);
-            return INFER_ERROR_ENGINE_SAVE;
-        }
-
-        fwrite(plan->data(), 1, plan->size(), engine_out);
-        fclose(engine_out);
-        printf("Saved serialized engine to %s\n", engine_cache_path);
- 
-        engine = runtime->deserializeCudaEngine(plan->data(), plan->size());
-        if (!engine) {
-            printf("Failed to deserialize CUDA engine\n");
-            return INFER_ERROR_BUILDING_FROM_ONNX;
-        }
-
-        delete parser;
-        delete config;
-        delete network;
-        delete builder;
-    }
-
-    /* 
-     * Now that we have a TensorRT runtime, we need to setup the CUDA buffers to allow
-     * the denoising model to run.
-     */
-    context = engine->createExecutionContext();
-    if (!context) {
-        printf("Failed to create execution context\n");
-        return INFER_ERROR_FAILED_OPERATION;
-    }
-
-    printf("Number of layers in engine: %d\n", engine->getNbLayers());
-
-    printf("Finished trt init\n");
-
     /* 
      * Compute the denoising schedule for every timestep.
      * This is equivalent to the Python code:
@@ -315,145 +132,148 @@ int denoise_thread_main() {
         }
     }
 
-    /* 
-     * Allocate buffers for the inputs and outputs of the CUDA model
-     * Some of these buffers are relatively large, such as the x_t buffer,
-     * while others only contain a single floating point number.
-     *
-     * The tensor addresses must match the names on the Pytorch torch.onnx.export().
-     */
-    void* cuda_t;
-    void* cuda_x_t;
-    void* cuda_x_out;
-    void* cuda_x_context;
-    void* cuda_x_mask;
-    void* cuda_alpha_t;
-    void* cuda_alpha_bar_t;
-    void* cuda_beta_t;
-
-    CUDA_CHECK(cudaMalloc(&cuda_t,           sizeof(int32_t)));
-    CUDA_CHECK(cudaMalloc(&cuda_x_t,         size_x)); // Input for each model step
-    CUDA_CHECK(cudaMalloc(&cuda_x_out,       size_x)); // Output produced by the model
-    CUDA_CHECK(cudaMalloc(&cuda_x_context,   size_x_context));
-    CUDA_CHECK(cudaMalloc(&cuda_x_mask,      size_x_mask));
-    CUDA_CHECK(cudaMalloc(&cuda_alpha_t,     sizeof(float)));
-    CUDA_CHECK(cudaMalloc(&cuda_alpha_bar_t, sizeof(float)));
-    CUDA_CHECK(cudaMalloc(&cuda_beta_t,      sizeof(float)));
-
-    if (!context->setTensorAddress("t", cuda_t))                     { return INFER_ERROR_SET_TENSOR_ADDRESS; }
-    if (!context->setTensorAddress("x_t", cuda_x_t))                 { return INFER_ERROR_SET_TENSOR_ADDRESS; }
-    if (!context->setTensorAddress("x_out", cuda_x_out))             { return INFER_ERROR_SET_TENSOR_ADDRESS; }
-    if (!context->setTensorAddress("context", cuda_x_context))       { return INFER_ERROR_SET_TENSOR_ADDRESS; }
-    if (!context->setTensorAddress("mask", cuda_x_mask))             { return INFER_ERROR_SET_TENSOR_ADDRESS; }
-    if (!context->setTensorAddress("alpha_t", cuda_alpha_t))         { return INFER_ERROR_SET_TENSOR_ADDRESS; }
-    if (!context->setTensorAddress("alpha_bar_t", cuda_alpha_bar_t)) { return INFER_ERROR_SET_TENSOR_ADDRESS; }
-    if (!context->setTensorAddress("beta_t", cuda_beta_t))           { return INFER_ERROR_SET_TENSOR_ADDRESS; }
+    shadow_set_schedule(alpha, alpha_bar, beta);
+
+    /* The backend is initialized up front so a failure shows in getLastError()
+     * before the first job. See supervisor.h for what happens when it fails. */
+    supervisor_backend();
 
     init_complete = true;
 
-    cudaStream_t stream;
-    CUDA_CHECK(cudaStreamCreate(&stream));
-   
+
     /* 
-     * This is the main loop. Each loop iteration represents one fully denoised chunk.
-     * the start of the loop is blocked waiting on a start signal from startDiffusion()
+     * This is the main loop. Each loop iteration runs one job until it's finished or
+     * the scheduler preempts it. The start of the loop is blocked waiting for a job
+     * to be queued (see job_queue.h)
      */
     for (;;) {
 
-        /* Wait until the mutex unlocks */
-        {
-            std::unique_lock<std::mutex> lock(mtx);
+        /* Jobs stay queued while the primary backend is in its backoff */
+        supervisor_wait_for_retry();
 
-            while (!denoise_should_start) {
-                cv.wait(lock);
-            }
+        uint8_t job_context[PACKED_CONTEXT_RECORD_SIZE];
+        int32_t first_t;
+        uint32_t seed;
+        int job_slot = job_wait_next(job_context, x_t, &first_t, &seed);
 
-            denoise_should_start = false; // Auto reset so it blocks next loop iteration.
-        }
+        DenoiseBackend* backend = supervisor_backend();
 
-        /* Fill in the middle 14^3 voxels of the mask*/
-        for         (int x = 1; x < CHUNK_WIDTH - 1; x++) {
-            for     (int y = 1; y < CHUNK_WIDTH - 1; y++) {
-                for (int z = 1; z < CHUNK_WIDTH - 1; z++) {
-                    x_mask[x][y][z] = 1.0f;
-                }
+        if (!backend) {
+            if (supervisor_retry_pending()) {
+                job_requeue(job_slot);
+            } else {
+                job_finish(job_slot, JOB_STATE_FAILED, supervisor_last_error());
             }
+            continue;
         }
 
-        /* Copy the "context" and "mask" tensors to the GPU */
-        CUDA_CHECK(cudaMemcpy(cuda_x_context, x_context, size_x_context, cudaMemcpyHostToDevice));
-        CUDA_CHECK(cudaMemcpy(cuda_x_mask, x_mask, size_x_mask, cudaMemcpyHostToDevice));
+        int result;
+
+        {
+            PerfScope perf_scope(PERF_STAGE_CONTEXT_UPLOAD);
+
+            embed_context(job_context, x_context);
+            build_context_mask(x_mask);
 
-        /* Zero-out the context and mask CPU buffers so they're clean
-         * for the next diffusion run. We don't need the CPU buffers anymore
-         * since context and mask are already on the GPU. */
-        memset(x_context, 0, sizeof(x_context));
-        memset(x_mask, 0, sizeof(x_mask));
+            result = backend->set_context(x_context, x_mask);
+        }
        
         /*
          * We need to fill the initial x_t with normally distributed random values.
+         * A preempted job continues from the latent job_wait_next() copied out.
          */
-        {
-            std::random_device rd;  // Seed generator
-            std::mt19937 gen(rd()); // Mersenne Twister engine
-            std::normal_distribution<float> dist(0.0f, 1.0f);
-
-            for            (int w = 0; w < EMBEDDING_DIMENSIONS; w++) {
-                for        (int x = 0; x < CHUNK_WIDTH; x++) {
-                   for     (int y = 0; y < CHUNK_WIDTH; y++) {
-                       for (int z = 0; z < CHUNK_WIDTH; z++) {
-                           x_t[w][x][y][z] = dist(gen);
-                       }
-                   }
-                }
-            }
+        if (first_t == n_T - 1) {
+            PerfScope perf_scope(PERF_STAGE_RNG_FILL);
+
+            /* The seed comes from the job so a shadow run (shadow.h) can repeat it */
+            fill_normal_noise(seed, x_t);
         }
 
+        bool cancelled = false;
+        bool preempted = false;
+        int64_t device_ns = 0;
+        int64_t invocations = 0;
+        int64_t history_decode_ns = 0;
+        int32_t job_id = job_slot_id(job_slot);
 
         /* 
          * These 'for' loops iterate over the denoising steps. The 't' steps represent the 
          * primary denoising steps whiel the 'u' steps are used to blend the known and
          * unknown regions during in-painting. 
          */
-        for (int t = n_T - 1; t >= 0; t -= 1) {
-            for (int u = 0; u < n_U; u++) {
+        for (int t = first_t; t >= 0 && !cancelled && !preempted && result == 0; t -= 1) {
+
+            auto step_start = std::chrono::steady_clock::now();
 
-                int load_index = t * n_U + u;
+            for (int u = 0; u < n_U; u++) {
 
-                /* Copy the relevant input buffers for the TensorRT model */
-                CUDA_CHECK(cudaMemcpy(cuda_t, &t, sizeof(int32_t), cudaMemcpyHostToDevice));
-                CUDA_CHECK(cudaMemcpy(cuda_x_t, x_t, size_x, cudaMemcpyHostToDevice));
-                CUDA_CHECK(cudaMemcpy(cuda_alpha_t, &alpha[t], sizeof(float), cudaMemcpyHostToDevice));
-                CUDA_CHECK(cudaMemcpy(cuda_alpha_bar_t, &alpha_bar[t], sizeof(float), cudaMemcpyHostToDevice));
-                CUDA_CHECK(cudaMemcpy(cuda_beta_t, &beta[t], sizeof(float), cudaMemcpyHostToDevice));
+                PerfScope perf_scope(PERF_STAGE_BACKEND_STEP);
 
-                /* Run the model asynchronously */
-                bool enqueue_succeeded = context->enqueueV3(stream);
+                /* One chunk per step, so the batch size is always 1 */
+                watchdog_step_begin(job_slot, job_id, t, backend->name(), 1);
+                result = backend->step(t, alpha[t], alpha_bar[t], beta[t], x_t, x_t);
+                watchdog_step_end();
+                invocations++;
 
-                if (!enqueue_succeeded) {
-                    printf("enqueueV3 failed\n");
-                    return INFER_ERROR_ENQUEUE;
+                if (result != 0) {
+                    break;
                 }
+            }
 
-                /* Block waiting for the model to complete running */
-                CUDA_CHECK(cudaStreamSynchronize(stream));
+            if (result != 0) {
+                break;
+            }
 
-                cudaError_t result;
+            device_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - step_start).count();
 
-                {
-                    std::lock_guard<std::mutex> lock(mtx);
-                    result = cudaMemcpy(x_t, cuda_x_out, size_x, cudaMemcpyDeviceToHost);
-                }
+            /* The history is decoded here rather than on read so every timestep is
+             * captured, regardless of how often the game polls. */
+            if (history_enabled() && job_id >= 0) {
+                auto decode_start = std::chrono::steady_clock::now();
+
+                decode_block_ids(x_t, step_block_ids);
+                history_record(job_id, t, step_block_ids);
+
+                history_decode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - decode_start).count();
+            }
 
-                CUDA_CHECK(result);
+            /* Only complete timesteps are published, so readers never see a
+             * partially in-painted sample */
+            {
+                PerfScope perf_scope(PERF_STAGE_SNAPSHOT_COPY);
+                cancelled = !job_publish(job_slot, t, x_t) && t > 0;
             }
 
-            global_timestep = t;
-            /* TODO: I should copy out the x_t only once it's completed all n_U iterations.
-             * Otherwise, I'll be copying out a partially in-painted sample */
+            preempted = !cancelled && job_yield(job_slot, first_t - t + 1);
         }
 
-        diffusion_running = false;
+        device_ns = job_add_device_time(job_slot, device_ns);
+        stat_add(STAT_MODEL_STEPS, invocations);
+        job_add_usage(job_slot, invocations, CONTEXT_UPLOAD_BYTES + invocations * STEP_TRANSFER_BYTES,
+                      history_decode_ns, history_memory_bytes(job_id));
+
+        if (result != 0) {
+            /* The backend is in an unknown state. The job resumes from its last
+             * published latent on whatever backend the supervisor has next. */
+            supervisor_backend_failed(result);
+            job_requeue(job_slot);
+            continue;
+        }
+
+        if (!preempted && !cancelled && shadow_sample()) {
+            decode_block_ids(x_t, step_block_ids);
+            shadow_submit(job_context, seed, step_block_ids, device_ns);
+        }
+
+        if (!preempted) {
+            job_finish(job_slot, cancelled ? JOB_STATE_CANCELLED : JOB_STATE_DONE, 0);
+        }
+
+        if (!preempted && !cancelled) {
+            supervisor_job_succeeded();
+        }
     }
 
     return 0; /* Never reached */
@@ -475,14 +295,23 @@ static void denoise_thread_wrapper() {
 extern "C" DLL_EXPORT
 int32_t Java_tbarnes_diffusionmod_Inference_init(void* unused1, void* unused2) {
 
+    /* Recording is opt in, for reproducing a session with replay_main.cpp */
+    const char* record_path = getenv("INFERENCE_RECORD_PATH");
+
+    if (record_path && !init_called) {
+        recorder_start(record_path);
+    }
+
+    record_call(RECORD_INIT, {});
+
     if (init_called) {
         global_last_error = INFER_ERROR_INVALID_OPERATION;
         return INFER_ERROR_INVALID_OPERATION;
     }
 
-    denoise_thread = std::thread(denoise_thread_wrapper);
+    global_denoise_thread = std::thread(denoise_thread_wrapper);
 
-    if (!denoise_thread.joinable()) {
+    if (!global_denoise_thread.joinable()) {
 
         printf("Thread creation failed\n");
         global_last_error = INFER_ERROR_INVALID_OPERATION;
@@ -490,6 +319,13 @@ int32_t Java_tbarnes_diffusionmod_Inference_init(void* unused1, void* unused2) {
     }
 
     init_called = true;
+
+    /* The structure library is optional, so a missing file isn't an error */
+    library_load(library_file_path);
+
+    /* Prometheus export is opt in, see metrics_export.h */
+    metrics_start_from_environment();
+
     return 0;
 }
 
@@ -507,6 +343,8 @@ extern "C" DLL_EXPORT
 int32_t Java_tbarnes_diffusionmod_Inference_setContextBlock(void* unused1, void* unused2,
         int32_t x, int32_t y, int32_t z, int32_t block_id) {
 
+    record_call(RECORD_SET_CONTEXT_BLOCK, { x, y, z, block_id });
+
     if (x < 0 || x >= CHUNK_WIDTH ||
         y < 0 || y >= CHUNK_WIDTH ||
         z < 0 || z >= CHUNK_WIDTH ||
@@ -516,13 +354,7 @@ int32_t Java_tbarnes_diffusionmod_Inference_setContextBlock(void* unused1, void*
         return INFER_ERROR_INVALID_ARG;
     }
 
-    /* Use the embedding matrix to find the vector for this block_id. */
-
-    for (int dim = 0; dim < EMBEDDING_DIMENSIONS; dim++) {
-        x_context[dim][x][y][z] = block_id_embeddings[block_id][dim];
-    }
-    
-    x_mask[x][y][z] = 1.0f;
+    context_block_ids[x][y][z] = (uint8_t)block_id;
 
     return 0;
 }
@@ -532,21 +364,28 @@ int32_t Java_tbarnes_diffusionmod_Inference_setContextBlock(void* unused1, void*
  */
 extern "C" DLL_EXPORT
 int32_t Java_tbarnes_diffusionmod_Inference_startDiffusion(void* unused1, void* unused2) {
-    
-    if (diffusion_running) {
+
+    record_call(RECORD_START_DIFFUSION, {});
+
+    int state = job_state(LEGACY_JOB_ID, NULL);
+
+    if (state == JOB_STATE_QUEUED || state == JOB_STATE_RUNNING) {
         global_last_error = INFER_ERROR_INVALID_OPERATION;
         return INFER_ERROR_INVALID_OPERATION;
     }
 
-    global_timestep = n_T;
-    diffusion_running = true;
+    job_release(LEGACY_JOB_ID);
 
-    {
-        std::lock_guard<std::mutex> lock(mtx);
-        denoise_should_start = true;
-        cv.notify_one();
+    int result = job_submit(LEGACY_JOB_ID, &context_block_ids[0][0][0]);
+
+    if (result != 0) {
+        global_last_error = result;
+        return result;
     }
 
+    sparse_count = 0;
+    memset(context_block_ids, 0, sizeof(context_block_ids));
+
     return 0;
 }
 
@@ -557,7 +396,13 @@ int32_t Java_tbarnes_diffusionmod_Inference_startDiffusion(void* unused1, void*
  */
 extern "C" DLL_EXPORT
 int32_t Java_tbarnes_diffusionmod_Inference_getCurrentTimestep(void* unused1, void* unused2) { 
-    return global_timestep;
+
+    record_call(RECORD_GET_CURRENT_TIMESTEP, {});
+
+    int32_t timestep = 0;
+    job_state(LEGACY_JOB_ID, &timestep);
+
+    return timestep;
 }
 
 /** 
@@ -568,42 +413,11 @@ int32_t Java_tbarnes_diffusionmod_Inference_getCurrentTimestep(void* unused1, vo
 extern "C" DLL_EXPORT
 int32_t Java_tbarnes_diffusionmod_Inference_cacheCurrentTimestepForReading(void* unused1, void* unused2) { 
 
-    {
-        std::lock_guard<std::mutex> lock(mtx);
-        memcpy(x_t_cached, x_t, sizeof(x_t));
-    }
-
-    /* Perform matrix multiply of x_t and transpose(block_id_embeddings)
-     * Since we only care about the index of the smallest element in each row of the output
-     * 4096 x BLOCK_ID_COUNT matrix, we don't need to actually store the entire matrix. */
-
-    for (int x = 1; x < 15; x++) {
-        for (int y = 1; y < 15; y++) {
-            for (int z = 1; z < 15; z++) {
+    record_call(RECORD_CACHE_CURRENT_TIMESTEP, {});
 
-                float min_distance = FLT_MAX;
-                int closest_id = 0;
+    int32_t t = job_read(LEGACY_JOB_ID, sparse_output_mode, false, cached_block_ids, sparse_entries, &sparse_count);
 
-                for (int i = 0; i < BLOCK_ID_COUNT; i++) {
-                    float distance = 0.0f;
-
-                    for (int j = 0; j < EMBEDDING_DIMENSIONS; j++) {
-                        float diff = x_t_cached[j][x][y][z] - block_id_embeddings[i][j];
-                        distance += diff * diff;
-                    }
-
-                    if (distance < min_distance) {
-                        min_distance = distance;
-                        closest_id = i;
-                    }
-                }
-
-                cached_block_ids[x-1][y-1][z-1] = closest_id;
-            }
-        }
-    }
-
-    return global_timestep;
+    return (t == JOB_READ_UNKNOWN) ? 0 : t;
 }
 
 /** 
@@ -619,18 +433,204 @@ extern "C" DLL_EXPORT
 int32_t Java_tbarnes_diffusionmod_Inference_readBlockFromCachedTimestep(void* unused1, void* unused2, 
         int32_t x, int32_t y, int32_t z) {
 
-    return cached_block_ids[x][y][z];
+    record_call(RECORD_READ_BLOCK, { x, y, z });
+
+    return cached_block_ids[packed_index(x, y, z, GENERATED_WIDTH)];
 }
 
 
+/** 
+ * @brief setLibrarySimilarityThreshold
+ *  Set the fraction of identical context voxels needed to answer a submitted job
+ *  from the structure library. A value above 1 disables the library.
+ * @param: threshold 
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_setLibrarySimilarityThreshold(void* unused1, void* unused2,
+        float threshold) {
+
+    record_call(RECORD_SET_LIBRARY_SIMILARITY, { float_bits(threshold) });
+
+    if (!(threshold >= 0.0f)) {
+        global_last_error = INFER_ERROR_INVALID_ARG;
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    job_set_library_similarity(threshold);
+    return 0;
+}
+
+/** 
+ * @brief setSparseOutputMode
+ *  Choose whether cacheCurrentTimestepForReading() also builds a sparse list of
+ *  (index, id) entries, read with getSparseCount() and readSparseEntry().
+ * @param: mode One of the SPARSE_OUTPUT_ constants in inference.h
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_setSparseOutputMode(void* unused1, void* unused2, int32_t mode) {
+
+    record_call(RECORD_SET_SPARSE_OUTPUT_MODE, { mode });
+
+    if (mode != SPARSE_OUTPUT_OFF && mode != SPARSE_OUTPUT_NON_AIR && mode != SPARSE_OUTPUT_CHANGED &&
+        mode != SPARSE_OUTPUT_CHANGED_STATES) {
+        global_last_error = INFER_ERROR_INVALID_ARG;
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    sparse_output_mode = mode;
+    return 0;
+}
+
+/** 
+ * @brief getSparseCount
+ * @return: Number of sparse entries built by the last cacheCurrentTimestepForReading()
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_getSparseCount(void* unused1, void* unused2) {
+
+    record_call(RECORD_GET_SPARSE_COUNT, {});
+
+    return sparse_count;
+}
+
+/** 
+ * @brief readSparseEntry
+ * @param: i In range [0, getSparseCount())
+ * @return: Entry packed as (index << SPARSE_ID_BITS) | block_id, where index is
+ *          (x * 14 + y) * 14 + z. Returns -1 if i is out of range.
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_readSparseEntry(void* unused1, void* unused2, int32_t i) {
+
+    record_call(RECORD_READ_SPARSE_ENTRY, { i });
+
+    if (i < 0 || i >= sparse_count) {
+        global_last_error = INFER_ERROR_INVALID_ARG;
+        return -1;
+    }
+
+    return sparse_entries[i];
+}
+
+/** 
+ * @brief setHistoryMemoryLimit
+ *  Enable recording of the decoded ids at every timestep of each run.
+ * @param: max_bytes Memory bound for one run's history, 0 disables recording.
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_setHistoryMemoryLimit(void* unused1, void* unused2, int32_t max_bytes) {
+
+    record_call(RECORD_SET_HISTORY_MEMORY_LIMIT, { max_bytes });
+
+    if (max_bytes < 0) {
+        global_last_error = INFER_ERROR_INVALID_ARG;
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    history_set_limit(max_bytes);
+    return 0;
+}
+
+/** 
+ * @brief getHistoryFrameCount
+ * @param: job_id Job whose run to count, LEGACY_JOB_ID for startDiffusion()
+ * @return: Number of frames held for the job's latest run. Frame 0 is the oldest.
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_getHistoryFrameCount(void* unused1, void* unused2, int32_t job_id) {
+
+    record_call(RECORD_GET_HISTORY_FRAME_COUNT, { job_id });
+
+    return history_frame_count(job_id);
+}
+
+/** 
+ * @brief cacheHistoryFrameForReading
+ *  Rebuild a recorded frame so it can be read with readBlockFromCachedTimestep().
+ * @param: job_id Job whose run to read, LEGACY_JOB_ID for startDiffusion()
+ * @param: frame In range [0, getHistoryFrameCount(job_id))
+ * @return: Timestep of the frame, or -1 if the frame doesn't exist.
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_cacheHistoryFrameForReading(void* unused1, void* unused2, int32_t job_id,
+                                                                        int32_t frame) {
+
+    record_call(RECORD_CACHE_HISTORY_FRAME, { job_id, frame });
+
+    uint8_t packed[PACKED_CHUNK_RECORD_SIZE];
+    int32_t t = history_read(job_id, frame, packed);
+
+    if (t < 0) {
+        global_last_error = INFER_ERROR_INVALID_ARG;
+        return -1;
+    }
+
+    memcpy(cached_block_ids, packed, sizeof(cached_block_ids));
+
+    return t;
+}
+
+/**
+ * @brief setSchedulerPolicy
+ *  Choose how the denoise thread shares its time between queued jobs.
+ * @param: policy JOB_POLICY_ constant from job_queue.h
+ * @param: quantum_timesteps Timesteps a job runs before round robin may switch jobs
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_setSchedulerPolicy(void* unused1, void* unused2,
+        int32_t policy, int32_t quantum_timesteps) {
+
+    record_call(RECORD_SET_SCHEDULER_POLICY, { policy, quantum_timesteps });
+
+    int result = job_set_policy(policy, quantum_timesteps);
+
+    if (result != 0) {
+        global_last_error = result;
+    }
+
+    return result;
+}
+
+/**
+ * @brief setShadowMode
+ *  Run a sample of finished jobs again on a secondary backend or sampler config and
+ *  compare the outputs in the STAT_SHADOW_ stats. See shadow.h.
+ * @param: backend SHADOW_BACKEND_ constant
+ * @param: sample_every Shadow one in every sample_every jobs, 0 to turn shadowing off
+ * @param: u_steps In-painting steps per timestep of the shadow runs
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_setShadowMode(void* unused1, void* unused2,
+        int32_t backend, int32_t sample_every, int32_t u_steps) {
+
+    record_call(RECORD_SET_SHADOW_MODE, { backend, sample_every, u_steps });
+
+    int result = shadow_configure(backend, sample_every, u_steps);
+
+    if (result != 0) {
+        global_last_error = result;
+    }
+
+    return result;
+}
+
 extern "C" DLL_EXPORT
 int32_t Java_tbarnes_diffusionmod_Inference_getLastError(void* unused1, void* unused2) {
 
-    return (int32_t)error_return;
+    record_call(RECORD_GET_LAST_ERROR, {});
+
+    return (int32_t)global_last_error;
 }
 
-#if 1
-void main() {
+/* Standalone tools such as batch_main.cpp provide their own main() and
+ * compile this file with INFERENCE_NO_TEST_MAIN defined. */
+#ifndef INFERENCE_NO_TEST_MAIN
+int main() {
 
     int result = Java_tbarnes_diffusionmod_Inference_init(0, 0);
     
@@ -0,0 +1,1110 @@
+/**
+ * @file job_queue.cpp
+ * @brief Job table shared by the game thread and the denoise thread. See job_queue.h.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <condition_variable>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "block_embeddings.h"
+#include "structure_library.h"
+#include "history.h"
+#include "perf_counters.h"
+#include "stats.h"
+#include "recorder.h"
+#include "trace.h"
+#include "block_states.h"
+#include "settle.h"
+#include "light.h"
+#include "job_queue.h"
+
+struct Job {
+    int32_t id;
+    int state;
+    int error;
+    uint32_t serial;            /* Changes every time the slot is reused */
+    uint64_t submit_order;
+    uint64_t queue_order;       /* Submission, or the latest preemption */
+    int64_t submit_ns;
+    int64_t device_ns;          /* Backend time spent on the job */
+    int64_t queued_since_ns;    /* Submission, or the latest preemption */
+    JobReceipt receipt;         /* backend_ns is filled in from device_ns at collection */
+    uint32_t seed;              /* Seed of the initial noise */
+    bool seed_overridden;       /* The seed came from job_override_seed() */
+    uint64_t context_hash;
+    int leader;                 /* Slot of the job this one is coalesced into, -1 if none */
+    uint32_t leader_serial;     /* Serial of that slot when it was joined */
+    bool started;
+    bool cancel_requested;
+    int stall_error;            /* Set by the watchdog while the job's step is stuck */
+
+    int32_t timestep;           /* Latest published timestep, n_T before the first */
+    int32_t read_timestep;      /* Timestep of the latest read, n_T + 1 before the first */
+    int32_t decoded_timestep;   /* Timestep held in block_ids, -1 if none */
+    bool light_read;            /* The light record was delivered by job_read_light() */
+    bool async_reported;        /* Returned by job_wait_async() */
+
+    uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+    float latent[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+    uint8_t block_ids[PACKED_CHUNK_RECORD_SIZE];
+
+    /* What the world holds at each generated position: the context at submission,
+     * then every id emitted by a SPARSE_OUTPUT_CHANGED read since. */
+    uint8_t applied_block_ids[PACKED_CHUNK_RECORD_SIZE];
+
+    /* The same for SPARSE_OUTPUT_CHANGED_STATES reads, as state indices */
+    uint16_t applied_states[PACKED_CHUNK_RECORD_SIZE];
+};
+
+static std::mutex jobs_mtx;
+static std::condition_variable jobs_cv;
+static std::condition_variable finished_cv;  /* A job finished, for job_wait_async() */
+static Job jobs[MAX_JOBS];
+static uint64_t next_submit_order;
+static uint64_t next_queue_order;
+static std::mt19937 seed_source{ std::random_device()() };
+
+struct SeedOverride {
+    int32_t job_id;
+    uint32_t seed;
+};
+
+static SeedOverride seed_overrides[MAX_JOBS];
+static int seed_override_count;
+static std::atomic<float> library_min_similarity = 0.98f;
+static std::atomic<bool> coalescing_enabled = true;
+
+static int policy = JOB_POLICY_FIFO;
+static int32_t policy_quantum = n_T;
+static std::atomic<JobClock> job_clock;
+
+static bool job_finished(const Job& job) {
+    return job.state == JOB_STATE_DONE || job.state == JOB_STATE_CANCELLED || job.state == JOB_STATE_FAILED;
+}
+
+/**
+ * @brief Slot of a job with jobs_mtx held, or -1.
+ */
+static int find_job(int32_t job_id) {
+
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+        if (jobs[slot].state != JOB_STATE_FREE && jobs[slot].id == job_id) {
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Whether a job is coalesced into the job in a slot, with jobs_mtx held.
+ *        A follower stops following once it finishes or takes over.
+ */
+static bool job_follows(const Job& job, int slot) {
+    return job.leader == slot && job.leader_serial == jobs[slot].serial &&
+           (job.state == JOB_STATE_QUEUED || job.state == JOB_STATE_RUNNING);
+}
+
+void job_set_library_similarity(float min_similarity) {
+    library_min_similarity = min_similarity;
+}
+
+void job_set_coalescing(bool enabled) {
+    coalescing_enabled = enabled;
+}
+
+int job_set_policy(int new_policy, int32_t quantum_timesteps) {
+
+    if ((new_policy != JOB_POLICY_FIFO && new_policy != JOB_POLICY_ROUND_ROBIN) || quantum_timesteps < 1) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    policy = new_policy;
+    policy_quantum = quantum_timesteps;
+
+    return 0;
+}
+
+void job_set_clock(JobClock clock) {
+    job_clock = clock;
+}
+
+int64_t job_now_ns() {
+
+    JobClock clock = job_clock;
+
+    if (clock) {
+        return clock();
+    }
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void job_override_seed(int32_t job_id, uint32_t seed) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    if (seed_override_count < MAX_JOBS) {
+        seed_overrides[seed_override_count++] = { job_id, seed };
+    }
+}
+
+/**
+ * @brief Seed for a new job with jobs_mtx held, from an override if there is one.
+ */
+static uint32_t next_seed(int32_t job_id, bool* overridden) {
+
+    for (int i = 0; i < seed_override_count; i++) {
+        if (seed_overrides[i].job_id == job_id) {
+            uint32_t seed = seed_overrides[i].seed;
+            seed_overrides[i] = seed_overrides[--seed_override_count];
+            *overridden = true;
+            return seed;
+        }
+    }
+
+    *overridden = false;
+    return (uint32_t)seed_source();
+}
+
+/**
+ * @brief FNV-1a of a packed context, to find identical submissions quickly.
+ */
+static uint64_t hash_context(const uint8_t* context) {
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+
+    for (int i = 0; i < PACKED_CONTEXT_RECORD_SIZE; i++) {
+        hash = (hash ^ context[i]) * 0x100000001B3ull;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Slot of a queued or running job that a new submission can be coalesced
+ *        into, with jobs_mtx held, or -1. Seeds drawn at random are interchangeable,
+ *        overridden ones only match the same seed so replays stay deterministic.
+ */
+static int find_leader(const uint8_t* context, uint64_t hash, bool seed_overridden, uint32_t seed) {
+
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+
+        const Job& job = jobs[slot];
+
+        if ((job.state != JOB_STATE_QUEUED && job.state != JOB_STATE_RUNNING) ||
+            job.leader >= 0 || job.id < 0 || job.cancel_requested || job.stall_error) {
+            continue;
+        }
+
+        if (job.context_hash != hash || job.seed_overridden != seed_overridden ||
+            (seed_overridden && job.seed != seed)) {
+            continue;
+        }
+
+        if (memcmp(job.context, context, PACKED_CONTEXT_RECORD_SIZE) == 0) {
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Account for a job starting to run, with jobs_mtx held.
+ */
+static void mark_running(Job& job, int64_t now_ns) {
+
+    job.state = JOB_STATE_RUNNING;
+    job.receipt.queue_ns += now_ns - job.queued_since_ns;
+
+    if (!job.started) {
+        int64_t queue_ns = now_ns - job.submit_ns;
+
+        job.started = true;
+        stat_add(STAT_JOBS_QUEUE_NS, queue_ns);
+        stat_max(STAT_JOBS_QUEUE_MAX_NS, queue_ns);
+        trace_mark(job.id, TRACE_MARK_STARTED, now_ns);
+    }
+}
+
+/**
+ * @brief Bring the followers of the job in a slot up to its state, timestep and
+ *        outcome, with jobs_mtx held.
+ * @param with_latent Also copy the latest published latent.
+ */
+static void update_followers(int slot, bool with_latent) {
+
+    const Job& leader = jobs[slot];
+    int64_t now_ns = job_now_ns();
+
+    /* A stalled job is failed for its followers right away, as for its owner */
+    int state = leader.stall_error ? JOB_STATE_FAILED : leader.state;
+    int error = leader.stall_error ? leader.stall_error : leader.error;
+
+    for (int other = 0; other < MAX_JOBS; other++) {
+
+        Job& job = jobs[other];
+
+        if (other == slot || !job_follows(job, slot)) {
+            continue;
+        }
+
+        job.timestep = leader.timestep;
+
+        if (with_latent) {
+            memcpy(job.latent, leader.latent, sizeof(job.latent));
+        }
+
+        if (state == JOB_STATE_RUNNING && job.state == JOB_STATE_QUEUED) {
+            mark_running(job, now_ns);
+        } else if (state == JOB_STATE_QUEUED && job.state == JOB_STATE_RUNNING) {
+            job.state = JOB_STATE_QUEUED;
+            job.queued_since_ns = now_ns;
+        } else if (state != JOB_STATE_QUEUED && state != JOB_STATE_RUNNING) {
+
+            if (job.state == JOB_STATE_QUEUED) {
+                job.receipt.queue_ns += now_ns - job.queued_since_ns;
+            }
+
+            job.state = state;
+            job.error = error;
+            job.receipt.steps_skipped = (int64_t)n_T * n_U;
+
+            if (state == JOB_STATE_DONE) {
+                stat_add(STAT_JOBS_COMPLETED, 1);
+                trace_mark(job.id, TRACE_MARK_DENOISED, now_ns);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Hand the work of a job that's going away to its earliest follower, with
+ *        jobs_mtx held. The follower takes the job's place in the queue and resumes
+ *        from the latest latent it was given, like a preempted job. The other
+ *        followers follow it instead.
+ */
+static void promote_follower(int slot) {
+
+    const Job& job = jobs[slot];
+    int successor = -1;
+
+    for (int other = 0; other < MAX_JOBS; other++) {
+        if (other != slot && job_follows(jobs[other], slot) &&
+            (successor < 0 || jobs[other].submit_order < jobs[successor].submit_order)) {
+            successor = other;
+        }
+    }
+
+    if (successor < 0) {
+        return;
+    }
+
+    int64_t now_ns = job_now_ns();
+
+    for (int other = 0; other < MAX_JOBS; other++) {
+
+        Job& follower = jobs[other];
+
+        if (other == slot || !job_follows(follower, slot)) {
+            continue;
+        }
+
+        if (follower.state == JOB_STATE_RUNNING) {
+            follower.queued_since_ns = now_ns;
+        }
+
+        follower.state = JOB_STATE_QUEUED;
+        follower.leader = successor;
+        follower.leader_serial = jobs[successor].serial;
+    }
+
+    Job& next = jobs[successor];
+
+    next.leader = -1;
+    next.submit_order = job.submit_order;
+    next.queue_order = job.queue_order;
+    jobs_cv.notify_one();
+}
+
+int job_submit(int32_t job_id, const uint8_t* context) {
+
+    /* The library has its own lock, so search it before taking the table */
+    uint8_t library_block_ids[PACKED_CHUNK_RECORD_SIZE];
+    bool library_hit = library_lookup(context, library_min_similarity, library_block_ids);
+    uint64_t context_hash = hash_context(context);
+
+    if (library_hit && settle_mode() != 0) {
+        settle_apply(context, library_block_ids);
+    }
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    if (find_job(job_id) >= 0) {
+        return INFER_ERROR_INVALID_OPERATION;
+    }
+
+    int slot = 0;
+
+    while (slot < MAX_JOBS && jobs[slot].state != JOB_STATE_FREE) {
+        slot++;
+    }
+
+    if (slot == MAX_JOBS) {
+        return INFER_ERROR_INVALID_OPERATION;
+    }
+
+    Job& job = jobs[slot];
+
+    bool seed_overridden;
+    uint32_t seed = next_seed(job_id, &seed_overridden);
+    int leader = (library_hit || !coalescing_enabled) ? -1 : find_leader(context, context_hash, seed_overridden, seed);
+
+    job.id = job_id;
+    job.error = 0;
+    job.serial++;
+    job.submit_order = next_submit_order++;
+    job.queue_order = next_queue_order++;
+    job.submit_ns = job_now_ns();
+    job.device_ns = 0;
+    job.queued_since_ns = job.submit_ns;
+    job.receipt = {};
+    job.receipt.peak_memory_bytes = sizeof(Job);
+    job.seed = (leader >= 0) ? jobs[leader].seed : seed;
+    job.seed_overridden = seed_overridden;
+    job.context_hash = context_hash;
+    job.leader = -1;
+    job.started = false;
+    job.cancel_requested = false;
+    job.stall_error = 0;
+    job.read_timestep = n_T + 1;
+    job.light_read = false;
+    job.async_reported = false;
+    memcpy(job.context, context, PACKED_CONTEXT_RECORD_SIZE);
+
+    for         (int x = 0; x < GENERATED_WIDTH; x++) {
+        for     (int y = 0; y < GENERATED_WIDTH; y++) {
+            for (int z = 0; z < GENERATED_WIDTH; z++) {
+                job.applied_block_ids[packed_index(x, y, z, GENERATED_WIDTH)] =
+                    context[packed_index(x + 1, y + 1, z + 1, CHUNK_WIDTH)];
+            }
+        }
+    }
+
+    block_states_compute(context, job.applied_block_ids, job.applied_states);
+
+    stat_add(STAT_JOBS_SUBMITTED, 1);
+    record_call(RECORD_SEED, { job_id, (int32_t)job.seed });
+    history_begin(job_id);
+    trace_mark(job_id, TRACE_MARK_SUBMITTED, job.submit_ns);
+
+    /* A close enough pregenerated structure skips the denoise thread entirely */
+    if (library_hit) {
+        memcpy(job.block_ids, library_block_ids, PACKED_CHUNK_RECORD_SIZE);
+        job.state = JOB_STATE_DONE;
+        job.timestep = 0;
+        job.decoded_timestep = 0;
+        job.receipt.steps_skipped = (int64_t)n_T * n_U;
+        job.receipt.from_library = 1;
+        stat_add(STAT_JOBS_COMPLETED, 1);
+        trace_mark(job_id, TRACE_MARK_STARTED, job.submit_ns);
+        trace_mark(job_id, TRACE_MARK_DENOISED, job.submit_ns);
+
+        history_record(job_id, 0, library_block_ids);
+        finished_cv.notify_all();
+        return 0;
+    }
+
+    job.state = JOB_STATE_QUEUED;
+    job.timestep = n_T;
+    job.decoded_timestep = -1;
+
+    /* The same request is already queued or running, follow it instead of
+     * denoising the context twice */
+    if (leader >= 0) {
+        job.leader = leader;
+        job.leader_serial = jobs[leader].serial;
+        stat_add(STAT_JOBS_COALESCED, 1);
+        update_followers(leader, jobs[leader].timestep < n_T);
+        return 0;
+    }
+
+    jobs_cv.notify_one();
+
+    return 0;
+}
+
+int job_cancel(int32_t job_id) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    int slot = find_job(job_id);
+
+    if (slot < 0) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    Job& job = jobs[slot];
+
+    /* Whoever joined the job still wants the structure */
+    promote_follower(slot);
+
+    /* A follower isn't held by the denoise thread and stops following right away */
+    bool following = job.leader >= 0 && job_follows(job, job.leader);
+
+    if (job.state == JOB_STATE_QUEUED || following) {
+        if (job.state == JOB_STATE_QUEUED) {
+            job.receipt.queue_ns += job_now_ns() - job.queued_since_ns;
+        }
+        job.state = JOB_STATE_CANCELLED;
+        job.receipt.steps_skipped = following ? (int64_t)n_T * n_U : (int64_t)job.timestep * n_U;
+        stat_add(STAT_JOBS_CANCELLED, 1);
+        finished_cv.notify_all();
+    } else if (job.state == JOB_STATE_RUNNING) {
+        job.cancel_requested = true;
+    }
+
+    return 0;
+}
+
+void job_release(int32_t job_id) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    int slot = find_job(job_id);
+
+    if (slot < 0) {
+        return;
+    }
+
+    promote_follower(slot);
+
+    /* A running job keeps its slot until the denoise thread lets go of it. A
+     * follower only mirrors the state and can go now. */
+    if (jobs[slot].state == JOB_STATE_RUNNING && jobs[slot].leader < 0) {
+        jobs[slot].cancel_requested = true;
+        jobs[slot].id = -1;
+        return;
+    }
+
+    jobs[slot].state = JOB_STATE_FREE;
+}
+
+int job_state(int32_t job_id, int32_t* timestep) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    int slot = find_job(job_id);
+
+    if (slot < 0) {
+        return JOB_STATE_FREE;
+    }
+
+    if (timestep) {
+        *timestep = jobs[slot].timestep;
+    }
+
+    /* The denoise thread still holds a stalled job, but its outcome is settled */
+    if (jobs[slot].stall_error) {
+        return JOB_STATE_FAILED;
+    }
+
+    return jobs[slot].state;
+}
+
+/**
+ * @brief Fill sparse entries from decoded ids, or their states for
+ *        SPARSE_OUTPUT_CHANGED_STATES, according to mode.
+ * @return Number of entries.
+ */
+static int32_t build_sparse_output(int mode, const uint8_t* block_ids, const uint16_t* states, Job& job,
+                                   int32_t* sparse_entries) {
+
+    uint8_t* applied_block_ids = job.applied_block_ids;
+    int32_t count = 0;
+
+    if (mode == SPARSE_OUTPUT_CHANGED_STATES) {
+
+        for (int i = 0; i < PACKED_CHUNK_RECORD_SIZE; i++) {
+
+            if (states[i] != job.applied_states[i]) {
+                sparse_entries[count++] = sparse_pack_state(i, states[i]);
+                job.applied_states[i] = states[i];
+            }
+        }
+
+        return count;
+    }
+
+    for (int i = 0; i < PACKED_CHUNK_RECORD_SIZE; i++) {
+
+        bool emit;
+
+        if (mode == SPARSE_OUTPUT_NON_AIR) {
+            emit = (block_ids[i] != 0);
+        } else {
+            emit = (block_ids[i] != applied_block_ids[i]);
+            applied_block_ids[i] = block_ids[i];
+        }
+
+        if (emit) {
+            sparse_entries[count++] = sparse_pack(i, block_ids[i]);
+        }
+    }
+
+    return count;
+}
+
+int32_t job_read(int32_t job_id, int mode, bool only_new,
+                 uint8_t* block_ids, int32_t* sparse_entries, int32_t* sparse_count) {
+
+    /* Decoding happens outside the lock so the denoise thread can keep publishing */
+    static thread_local float latent[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+    static thread_local uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+    static thread_local uint16_t states[PACKED_CHUNK_RECORD_SIZE];
+
+    bool with_states = (mode == SPARSE_OUTPUT_CHANGED_STATES && sparse_entries && sparse_count);
+    bool settle = false;
+
+    int slot;
+    uint32_t serial;
+    int32_t t;
+    bool decoded;
+
+    if (sparse_count) {
+        *sparse_count = 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(jobs_mtx);
+
+        slot = find_job(job_id);
+
+        if (slot < 0) {
+            return JOB_READ_UNKNOWN;
+        }
+
+        Job& job = jobs[slot];
+        t = job.timestep;
+
+        if (t >= n_T) {
+            return only_new ? JOB_READ_UNCHANGED : n_T;
+        }
+
+        if (only_new && t == job.read_timestep) {
+            return JOB_READ_UNCHANGED;
+        }
+
+        serial = job.serial;
+        decoded = (job.decoded_timestep == t);
+
+        /* Only the final snapshot is placed for good, the others are previews. It's
+         * decoded once and kept, so every job is settled and counted once. */
+        settle = (t == 0 && settle_mode() != 0);
+
+        if (decoded) {
+            memcpy(block_ids, job.block_ids, PACKED_CHUNK_RECORD_SIZE);
+        } else {
+            PerfScope perf_scope(PERF_STAGE_SNAPSHOT_COPY);
+            memcpy(latent, job.latent, sizeof(latent));
+        }
+
+        if (with_states || (settle && !decoded)) {
+            memcpy(context, job.context, PACKED_CONTEXT_RECORD_SIZE);
+        }
+    }
+
+    int64_t decode_ns = 0;
+
+    if (!decoded) {
+        auto decode_start = std::chrono::steady_clock::now();
+
+        decode_block_ids(latent, block_ids);
+
+        if (settle) {
+            settle_apply(context, block_ids);
+        }
+
+        decode_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - decode_start).count();
+    }
+
+    if (with_states) {
+        block_states_compute(context, block_ids, states);
+    }
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    Job& job = jobs[slot];
+
+    if (job.serial != serial || job.state == JOB_STATE_FREE || job.id != job_id) {
+        return JOB_READ_UNKNOWN;
+    }
+
+    if (!decoded) {
+        memcpy(job.block_ids, block_ids, PACKED_CHUNK_RECORD_SIZE);
+        job.decoded_timestep = t;
+    }
+
+    job.read_timestep = t;
+    job.receipt.decode_ns += decode_ns;
+
+    if (mode != SPARSE_OUTPUT_OFF && sparse_entries && sparse_count) {
+        *sparse_count = build_sparse_output(mode, block_ids, states, job, sparse_entries);
+        job.receipt.delivered_bytes += *sparse_count * (int64_t)sizeof(int32_t);
+    } else {
+        job.receipt.delivered_bytes += PACKED_CHUNK_RECORD_SIZE;
+    }
+
+    return t;
+}
+
+int32_t job_read_light(int32_t job_id, uint8_t* record) {
+
+    static thread_local uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+    static thread_local uint8_t block_ids[PACKED_CHUNK_RECORD_SIZE];
+
+    {
+        std::lock_guard<std::mutex> lock(jobs_mtx);
+
+        int slot = find_job(job_id);
+
+        if (slot < 0) {
+            return JOB_READ_UNKNOWN;
+        }
+
+        Job& job = jobs[slot];
+
+        if (job.light_read || job.read_timestep != 0 || job.decoded_timestep != 0) {
+            return JOB_READ_UNCHANGED;
+        }
+
+        memcpy(context, job.context, PACKED_CONTEXT_RECORD_SIZE);
+        memcpy(block_ids, job.block_ids, PACKED_CHUNK_RECORD_SIZE);
+        job.light_read = true;
+        job.receipt.delivered_bytes += LIGHT_RECORD_SIZE;
+    }
+
+    light_compute(context, block_ids, record);
+    return 0;
+}
+
+int32_t job_wait_async(int64_t timeout_ns) {
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(timeout_ns);
+    std::unique_lock<std::mutex> lock(jobs_mtx);
+
+    for (;;) {
+
+        for (int slot = 0; slot < MAX_JOBS; slot++) {
+
+            Job& job = jobs[slot];
+
+            if (job.id < ASYNC_JOB_ID_FIRST || job.async_reported) {
+                continue;
+            }
+
+            if (job_finished(job) || (job.state == JOB_STATE_RUNNING && job.stall_error)) {
+                job.async_reported = true;
+                return job.id;
+            }
+        }
+
+        if (finished_cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            return 0;
+        }
+    }
+}
+
+int job_take_async(int32_t job_id, uint8_t* block_ids, uint8_t* context, int32_t* error) {
+
+    /* The final ids are decoded by job_read() like any other snapshot */
+    if (job_state(job_id, NULL) == JOB_STATE_DONE) {
+        job_read(job_id, SPARSE_OUTPUT_OFF, false, block_ids, NULL, NULL);
+    }
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    int slot = find_job(job_id);
+
+    if (slot < 0) {
+        return JOB_STATE_FREE;
+    }
+
+    Job& job = jobs[slot];
+
+    /* Freed whenever the stuck step returns, as in job_collect_finished() */
+    if (job.state == JOB_STATE_RUNNING && job.stall_error) {
+        *error = job.stall_error;
+        job.id = -1;
+        return JOB_STATE_FAILED;
+    }
+
+    if (!job_finished(job)) {
+        return job.state;
+    }
+
+    int state = job.state;
+
+    *error = job.error;
+    memcpy(context, job.context, PACKED_CONTEXT_RECORD_SIZE);
+    job.state = JOB_STATE_FREE;
+
+    if (state == JOB_STATE_DONE) {
+        trace_mark(job.id, TRACE_MARK_DELIVERED, job_now_ns());
+    }
+
+    return state;
+}
+
+bool job_collect_finished(int32_t* job_id, int32_t* state, int32_t* error, JobReceipt* receipt) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+
+        Job& job = jobs[slot];
+
+        /* A stalled job is reported now and freed whenever its step returns */
+        if (job.id >= ASYNC_JOB_ID_FIRST) {
+            continue;
+        }
+
+        if (job.id > 0 && job.state == JOB_STATE_RUNNING && job.stall_error) {
+            *job_id = job.id;
+            *state = JOB_STATE_FAILED;
+            *error = job.stall_error;
+            job.id = -1;
+
+            if (receipt) {
+                *receipt = job.receipt;
+                receipt->backend_ns = job.device_ns;
+            }
+            return true;
+        }
+
+        if (job.id <= 0 || !job_finished(job)) {
+            continue;
+        }
+
+        /* Hold a finished job until its final snapshot has been read */
+        if (job.state == JOB_STATE_DONE && job.read_timestep != 0) {
+            continue;
+        }
+
+        *job_id = job.id;
+        *state = job.state;
+        *error = job.error;
+        job.state = JOB_STATE_FREE;
+
+        if (receipt) {
+            *receipt = job.receipt;
+            receipt->backend_ns = job.device_ns;
+        }
+
+        if (*state == JOB_STATE_DONE) {
+            trace_mark(job.id, TRACE_MARK_DELIVERED, job_now_ns());
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief The job the policy runs next, with jobs_mtx held, or -1 if none is queued.
+ *        FIFO follows submission order, so a job preempted before a switch to FIFO
+ *        still goes first. Round robin follows queue order, which a preempted job
+ *        re-enters at the back.
+ */
+static int pick_next_job() {
+
+    int next = -1;
+
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+
+        /* Followers run when the job they follow does */
+        if (jobs[slot].state != JOB_STATE_QUEUED || jobs[slot].leader >= 0) {
+            continue;
+        }
+
+        uint64_t order = (policy == JOB_POLICY_FIFO) ? jobs[slot].submit_order : jobs[slot].queue_order;
+        uint64_t next_order = (next < 0) ? 0 : (policy == JOB_POLICY_FIFO) ? jobs[next].submit_order : jobs[next].queue_order;
+
+        if (next < 0 || order < next_order) {
+            next = slot;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * @brief Mark a picked job running, with jobs_mtx held.
+ */
+static void start_job(int slot, uint8_t* context,
+                      float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                      int32_t* next_timestep, uint32_t* seed) {
+
+    Job& job = jobs[slot];
+
+    memcpy(context, job.context, PACKED_CONTEXT_RECORD_SIZE);
+    *seed = job.seed;
+
+    /* A preempted job continues after its last published timestep */
+    if (job.timestep < n_T) {
+        if (x_t) {
+            memcpy(x_t, job.latent, sizeof(job.latent));
+        }
+        *next_timestep = job.timestep - 1;
+    } else {
+        *next_timestep = n_T - 1;
+    }
+
+    mark_running(job, job_now_ns());
+    update_followers(slot, false);
+}
+
+int job_wait_next(uint8_t* context, float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                  int32_t* next_timestep, uint32_t* seed) {
+
+    std::unique_lock<std::mutex> lock(jobs_mtx);
+
+    for (;;) {
+
+        int next = pick_next_job();
+
+        if (next >= 0) {
+            start_job(next, context, x_t, next_timestep, seed);
+            return next;
+        }
+
+        jobs_cv.wait(lock);
+    }
+}
+
+int32_t job_slot_id(int slot) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+    return jobs[slot].id;
+}
+
+int job_try_next(uint8_t* context, float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                 int32_t* next_timestep, uint32_t* seed) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    int next = pick_next_job();
+
+    if (next >= 0) {
+        start_job(next, context, x_t, next_timestep, seed);
+    }
+
+    return next;
+}
+
+bool job_publish(int slot, int32_t t,
+                 const float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    Job& job = jobs[slot];
+
+    if (x_t) {
+        memcpy(job.latent, x_t, sizeof(job.latent));
+    }
+    job.timestep = t;
+    update_followers(slot, x_t != NULL);
+
+    return !job.cancel_requested;
+}
+
+bool job_yield(int slot, int32_t timesteps_run) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    Job& job = jobs[slot];
+
+    if (policy != JOB_POLICY_ROUND_ROBIN || timesteps_run < policy_quantum ||
+        job.cancel_requested || job.timestep <= 0) {
+        return false;
+    }
+
+    bool waiting = false;
+
+    for (int other = 0; other < MAX_JOBS && !waiting; other++) {
+        waiting = (jobs[other].state == JOB_STATE_QUEUED && jobs[other].leader < 0);
+    }
+
+    if (!waiting) {
+        return false;
+    }
+
+    job.state = JOB_STATE_QUEUED;
+    job.queue_order = next_queue_order++;
+    job.queued_since_ns = job_now_ns();
+    stat_add(STAT_JOBS_PREEMPTED, 1);
+    update_followers(slot, false);
+
+    return true;
+}
+
+int64_t job_add_device_time(int slot, int64_t ns) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    jobs[slot].device_ns += ns;
+    return jobs[slot].device_ns;
+}
+
+void job_add_usage(int slot, int64_t model_invocations, int64_t device_bytes, int64_t decode_ns,
+                   int64_t memory_bytes) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    JobReceipt& receipt = jobs[slot].receipt;
+
+    receipt.model_invocations += model_invocations;
+    receipt.device_bytes += device_bytes;
+    receipt.decode_ns += decode_ns;
+
+    if ((int64_t)sizeof(Job) + memory_bytes > receipt.peak_memory_bytes) {
+        receipt.peak_memory_bytes = (int64_t)sizeof(Job) + memory_bytes;
+    }
+}
+
+void job_requeue(int slot) {
+
+    {
+        std::lock_guard<std::mutex> lock(jobs_mtx);
+
+        Job& job = jobs[slot];
+
+        if (job.id >= 0 && !job.stall_error && !job.cancel_requested) {
+            /* The queue order is kept, so the job goes back to the front */
+            job.state = JOB_STATE_QUEUED;
+            job.queued_since_ns = job_now_ns();
+            stat_add(STAT_JOBS_REQUEUED, 1);
+            update_followers(slot, false);
+            jobs_cv.notify_one();
+            return;
+        }
+    }
+
+    /* Nobody wants the rest of the job anymore */
+    job_finish(slot, JOB_STATE_CANCELLED, 0);
+}
+
+void job_finish(int slot, int state, int error) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    Job& job = jobs[slot];
+
+    /* The watchdog already failed the job while its step was stuck */
+    if (job.stall_error) {
+        state = JOB_STATE_FAILED;
+        error = job.stall_error;
+    }
+
+    job.error = error;
+
+    if (state == JOB_STATE_CANCELLED) {
+        job.receipt.steps_skipped = (int64_t)job.timestep * n_U;
+        stat_add(STAT_JOBS_CANCELLED, 1);
+    } else if (state == JOB_STATE_DONE) {
+        stat_add(STAT_JOBS_COMPLETED, 1);
+        trace_mark(job.id, TRACE_MARK_DENOISED, job_now_ns());
+    }
+
+    /* Released while running, nobody is waiting for the outcome */
+    job.state = (job.id < 0) ? JOB_STATE_FREE : state;
+    update_followers(slot, false);
+    finished_cv.notify_all();
+}
+
+void job_fail_stalled(int slot, int32_t job_id, int error) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    Job& job = jobs[slot];
+
+    if (job.state != JOB_STATE_RUNNING || job.id != job_id || job.stall_error) {
+        return;
+    }
+
+    job.stall_error = error;
+    job.cancel_requested = true;
+    update_followers(slot, false);
+    finished_cv.notify_all();
+}
+
+int job_fail_queued(int error) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    int failed = 0;
+
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+
+        Job& job = jobs[slot];
+
+        if (job.state != JOB_STATE_QUEUED) {
+            continue;
+        }
+
+        job.state = JOB_STATE_FAILED;
+        job.error = error;
+        job.receipt.steps_skipped = (int64_t)job.timestep * n_U;
+        job.receipt.queue_ns += job_now_ns() - job.queued_since_ns;
+        failed++;
+    }
+
+    if (failed > 0) {
+        finished_cv.notify_all();
+    }
+
+    return failed;
+}
+
+int job_count(int state) {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    int count = 0;
+
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+        count += (jobs[slot].state == state) ? 1 : 0;
+    }
+
+    return count;
+}
+
+int64_t job_table_bytes() {
+    return sizeof(jobs);
+}
+
+bool job_busy() {
+
+    std::lock_guard<std::mutex> lock(jobs_mtx);
+
+    for (int slot = 0; slot < MAX_JOBS; slot++) {
+        if (jobs[slot].state == JOB_STATE_QUEUED || jobs[slot].state == JOB_STATE_RUNNING) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,286 @@
+/**
+ * @file job_queue.h
+ * @brief Table of generation jobs shared by the game thread and the denoise thread.
+ *
+ *  A job is one context record denoised into one generated chunk. Jobs are submitted
+ *  with a caller chosen id and run one at a time on the denoise thread, in the order
+ *  the scheduling policy picks (see job_set_policy()). After every timestep the denoise thread publishes a copy of x_t into the
+ *  job, and readers decode the latest copy when they ask for it, so decoding is only
+ *  paid for the snapshots that are actually read.
+ *
+ *  The single job entry points (startDiffusion() and friends) drive the job with id
+ *  LEGACY_JOB_ID. Jobs submitted through the tick command buffer (tick_buffer.cpp)
+ *  use positive ids and are released once their completion has been reported.
+ *
+ *  A submission whose context and seed policy match a job that is still queued or
+ *  running is coalesced into it instead of being denoised again: the new job keeps
+ *  its own id, reads and receipt, and follows the state, snapshots and outcome of
+ *  the job it joined. If that job is cancelled or released first, the earliest of
+ *  its followers takes over from its latest snapshot.
+ *
+ *  Scheduling decisions are only made here, never in the denoise thread, so the
+ *  scheduler simulator (schedsim_main.cpp) drives this same code with a virtual
+ *  clock (job_set_clock()) in place of the denoise thread.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "inference.h"
+
+const int MAX_JOBS = 64;
+const int32_t LEGACY_JOB_ID = 0;
+
+/* Ids from here up are handed out by async_jobs.cpp to jobs submitted from worldgen
+ * threads. Their outcome is taken with job_take_async() instead of being collected
+ * by the tick. */
+const int32_t ASYNC_JOB_ID_FIRST = 1 << 30;
+
+/* Job states, also reported to Java in completion events */
+const int JOB_STATE_FREE      = 0;
+const int JOB_STATE_QUEUED    = 1;
+const int JOB_STATE_RUNNING   = 2;
+const int JOB_STATE_DONE      = 3;
+const int JOB_STATE_CANCELLED = 4;
+const int JOB_STATE_FAILED    = 5;
+
+/* Scheduling policies */
+const int JOB_POLICY_FIFO        = 0; /* Each job runs to completion, in submission order */
+const int JOB_POLICY_ROUND_ROBIN = 1; /* A running job goes to the back of the queue after
+                                       * a quantum of timesteps if another job is waiting,
+                                       * and later resumes from its last published latent */
+
+/**
+ * @brief What a job cost, reported to the mod in a RECEIPT event (tick_buffer.h)
+ *        right before its completion.
+ */
+struct JobReceipt {
+    int64_t model_invocations;  /* backend->step() calls */
+    int64_t steps_skipped;      /* Steps of a full run that weren't made: all of them
+                                 * for a library hit, the remaining ones after a cancel */
+    int64_t backend_ns;
+    int64_t queue_ns;           /* Time spent queued, including after preemptions */
+    int64_t device_bytes;       /* Handed to and returned by the backend */
+    int64_t delivered_bytes;    /* Snapshot ids and sparse entries read by the game */
+    int64_t decode_ns;          /* Snapshot and history decoding */
+    int64_t peak_memory_bytes;  /* The job's slot plus its history frames at most */
+    int64_t from_library;       /* 1 if the structure library answered the job */
+};
+
+const int JOB_RECEIPT_FIELDS = sizeof(JobReceipt) / sizeof(int64_t);
+
+/* Returned by job_read() instead of a timestep */
+const int32_t JOB_READ_UNKNOWN   = -1; /* No job with this id */
+const int32_t JOB_READ_UNCHANGED = -2; /* Nothing newer than the previous read */
+
+/**
+ * @brief Fraction of identical context voxels needed to answer a submission from
+ *        the structure library. A value above 1 disables the library.
+ */
+void job_set_library_similarity(float min_similarity);
+
+/**
+ * @brief Coalesce submissions into identical queued or running jobs. On by default.
+ *        The scheduler simulator turns it off, since its jobs share one context.
+ */
+void job_set_coalescing(bool enabled);
+
+/**
+ * @brief Select the scheduling policy. Takes effect at the next timestep.
+ * @param quantum_timesteps Timesteps a job runs before it can be preempted, only
+ *        used by JOB_POLICY_ROUND_ROBIN.
+ * @return 0 on success, INFER_ERROR_INVALID_ARG for an unknown policy or a quantum
+ *         below 1.
+ */
+int job_set_policy(int policy, int32_t quantum_timesteps);
+
+/**
+ * @brief Replace the clock used for the job timing stats, in nanoseconds. NULL
+ *        restores std::chrono::steady_clock.
+ */
+typedef int64_t (*JobClock)();
+void job_set_clock(JobClock clock);
+int64_t job_now_ns();
+
+/**
+ * @brief Use seed for the initial noise of the next job submitted with job_id,
+ *        instead of a fresh one. Used by replay_main.cpp to repeat recorded seeds.
+ */
+void job_override_seed(int32_t job_id, uint32_t seed);
+
+/**
+ * @brief Queue a job. The structure library is searched first and a hit completes
+ *        the job immediately, then the job is coalesced into an identical one if
+ *        there is one. The job's seed is recorded if recording is on (recorder.h).
+ *        A job submitted without a seed override only joins one that also has none,
+ *        and takes its seed; with an override only one with the same seed.
+ * @param context Packed CHUNK_WIDTH^3 context ids.
+ * @return 0 on success, INFER_ERROR_INVALID_OPERATION if the id is in use or the
+ *         table is full.
+ */
+int job_submit(int32_t job_id, const uint8_t* context);
+
+/**
+ * @brief Cancel a queued or running job. A running job stops at its next timestep.
+ * @return 0 on success, INFER_ERROR_INVALID_ARG if there is no such job.
+ */
+int job_cancel(int32_t job_id);
+
+/**
+ * @brief Free a job's slot whatever its state. Used to replace the legacy job.
+ */
+void job_release(int32_t job_id);
+
+/**
+ * @brief State and latest published timestep of a job, n_T before the first.
+ * @return JOB_STATE_FREE if there is no such job.
+ */
+int job_state(int32_t job_id, int32_t* timestep);
+
+/**
+ * @brief Decode the latest snapshot of a job.
+ * @param mode SPARSE_OUTPUT_ constant. Sparse entries are only built when not OFF.
+ * @param only_new Return JOB_READ_UNCHANGED if the snapshot was already read.
+ * @param block_ids Packed GENERATED_WIDTH^3 ids, left untouched before the first
+ *        snapshot.
+ * @return Timestep of the snapshot, n_T if nothing was published yet, or one of
+ *         the JOB_READ_ constants.
+ */
+int32_t job_read(int32_t job_id, int mode, bool only_new,
+                 uint8_t* block_ids, int32_t* sparse_entries, int32_t* sparse_count);
+
+/**
+ * @brief Compute the heightmap and skylight of a job's final structure, see light.h.
+ *        Available once, after the final snapshot was read.
+ * @param record Receives LIGHT_RECORD_SIZE bytes.
+ * @return 0 on success, or one of the JOB_READ_ constants.
+ */
+int32_t job_read_light(int32_t job_id, uint8_t* record);
+
+/**
+ * @brief Wait for a job with an id from ASYNC_JOB_ID_FIRST up to finish. Every
+ *        finished job is returned once, to one caller. Any thread may wait.
+ * @return Id of the finished job, 0 if none finished within the timeout.
+ */
+int32_t job_wait_async(int64_t timeout_ns);
+
+/**
+ * @brief Take the outcome of a finished async job and free it.
+ * @param block_ids Receives the final ids if the job is DONE.
+ * @param context Receives the job's context once it finished.
+ * @param error Receives the job's error once it finished.
+ * @return JOB_STATE_ constant. A job that's still QUEUED or RUNNING is left as is.
+ */
+int job_take_async(int32_t job_id, uint8_t* block_ids, uint8_t* context, int32_t* error);
+
+/**
+ * @brief Find a finished job with a positive id below ASYNC_JOB_ID_FIRST whose
+ *        outcome the caller can report, and free it. Finished jobs are only collected once their final snapshot
+ *        has been read.
+ * @param receipt Receives what the job cost. May be NULL.
+ * @return true if a job was collected.
+ */
+bool job_collect_finished(int32_t* job_id, int32_t* state, int32_t* error, JobReceipt* receipt);
+
+/*
+ * Denoise thread side.
+ */
+
+/**
+ * @brief Block until a job is queued, mark it running and copy out its context.
+ * @param x_t Receives the latent to continue from if the job was preempted. May be
+ *        NULL in the simulator.
+ * @param next_timestep Receives the first timestep to run, n_T - 1 for a new job.
+ * @param seed Receives the seed of the job's initial noise, drawn at submission.
+ * @return Slot of the job, passed to job_publish() and job_finish().
+ */
+int job_wait_next(uint8_t* context, float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                  int32_t* next_timestep, uint32_t* seed);
+
+/**
+ * @brief Id of the job in a slot returned by job_wait_next() or job_try_next().
+ */
+int32_t job_slot_id(int slot);
+
+/**
+ * @brief job_wait_next() without blocking.
+ * @return Slot of the job, or -1 if none is queued.
+ */
+int job_try_next(uint8_t* context, float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH],
+                 int32_t* next_timestep, uint32_t* seed);
+
+/**
+ * @brief Publish x_t after timestep t of the running job. The simulator passes NULL
+ *        for x_t, which only advances the timestep.
+ * @return false if the job was cancelled and should stop.
+ */
+bool job_publish(int slot, int32_t t,
+                 const float x_t[EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH]);
+
+/**
+ * @brief Ask the policy whether the running job should give way after running
+ *        timesteps_run timesteps since it was last picked. If so it's queued again
+ *        and the caller moves on to job_wait_next().
+ * @return true if the job was preempted.
+ */
+bool job_yield(int slot, int32_t timesteps_run);
+
+/**
+ * @brief Add time the backend spent on the running job.
+ * @return The job's total so far.
+ */
+int64_t job_add_device_time(int slot, int64_t ns);
+
+/**
+ * @brief Add to the receipt of the running job.
+ * @param memory_bytes Memory held for the job outside its slot right now, such as
+ *        its history frames. Only the peak is kept.
+ */
+void job_add_usage(int slot, int64_t model_invocations, int64_t device_bytes, int64_t decode_ns,
+                   int64_t memory_bytes);
+
+/**
+ * @brief Queue the running job again after a backend failure, or while the
+ *        supervisor waits to retry the primary backend (supervisor.h). It resumes
+ *        after its last published timestep on the next backend, like a preempted
+ *        job, and only fails once the primary is given up on. A cancelled,
+ *        released or stalled job is finished instead.
+ */
+void job_requeue(int slot);
+
+void job_finish(int slot, int state, int error);
+
+/*
+ * Watchdog side (watchdog.h).
+ */
+
+/**
+ * @brief Fail the job running in a slot whose step is stuck. The denoise thread
+ *        keeps the slot until the step returns, but the failure is reported by
+ *        job_state() and job_collect_finished() right away, and job_finish()
+ *        keeps it. Nothing happens if the slot no longer runs job_id.
+ */
+void job_fail_stalled(int slot, int32_t job_id, int error);
+
+/**
+ * @brief Fail every queued job.
+ * @return Number of jobs failed.
+ */
+int job_fail_queued(int error);
+
+/**
+ * @brief Number of jobs in a JOB_STATE_.
+ */
+int job_count(int state);
+
+/**
+ * @brief Size of the job table.
+ */
+int64_t job_table_bytes();
+
+/**
+ * @brief Whether any job is queued or running. Background work that shares the
+ *        device, such as shadow runs (shadow.h), waits while this is true.
+ */
+bool job_busy();
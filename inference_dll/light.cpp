@@ -0,0 +1,159 @@
+/**
+ * @file light.cpp
+ * @brief Heightmap and skylight propagation. See light.h.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "light.h"
+
+const int LIGHT_OPACITY_TRANSPARENT = 0; /* Passes light */
+const int LIGHT_OPACITY_PARTIAL     = 1; /* Holds light, passes none */
+const int LIGHT_OPACITY_OPAQUE      = 2;
+
+/**
+ * @brief How a palette id in DiffusionMod.BLOCK_STATES treats light.
+ */
+static int light_opacity(int block_id) {
+
+    switch (block_id) {
+    /* Air, the glass panes and glass. Ids past the palette are placed as air */
+    case 0: case 11: case 14: case 24:
+        return LIGHT_OPACITY_TRANSPARENT;
+
+    /* Slabs, the shulker box and stairs */
+    case 3: case 13: case 15:
+    case 18: case 19: case 20: case 21: case 26: case 27: case 28: case 29:
+        return LIGHT_OPACITY_PARTIAL;
+
+    default:
+        return (block_id <= 30) ? LIGHT_OPACITY_OPAQUE : LIGHT_OPACITY_TRANSPARENT;
+    }
+}
+
+void light_compute(const uint8_t* context, const uint8_t* block_ids, uint8_t* record) {
+
+    static const int offsets[6][3] = { { -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 } };
+    const int cells = CHUNK_WIDTH * CHUNK_WIDTH * CHUNK_WIDTH;
+
+    uint8_t opacity[cells];
+    uint8_t level[cells];
+    bool queued[cells];
+    int16_t queue[cells];   /* Circular, each cell is in it at most once */
+    int head = 0;
+    int queue_count = 0;
+
+    for         (int x = 0; x < CHUNK_WIDTH; x++) {
+        for     (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int z = 0; z < CHUNK_WIDTH; z++) {
+
+                bool generated = x >= 1 && x <= GENERATED_WIDTH &&
+                                 y >= 1 && y <= GENERATED_WIDTH &&
+                                 z >= 1 && z <= GENERATED_WIDTH;
+
+                int block_id = generated ? block_ids[packed_index(x - 1, y - 1, z - 1, GENERATED_WIDTH)]
+                                         : context[packed_index(x, y, z, CHUNK_WIDTH)];
+
+                opacity[packed_index(x, y, z, CHUNK_WIDTH)] = (uint8_t)light_opacity(block_id);
+            }
+        }
+    }
+
+    memset(level, 0, sizeof(level));
+    memset(queued, 0, sizeof(queued));
+
+    /* Full light falls straight down each column until something stops it */
+    for     (int x = 0; x < CHUNK_WIDTH; x++) {
+        for (int z = 0; z < CHUNK_WIDTH; z++) {
+            for (int y = CHUNK_WIDTH - 1; y >= 0; y--) {
+
+                int i = packed_index(x, y, z, CHUNK_WIDTH);
+
+                if (opacity[i] == LIGHT_OPACITY_OPAQUE) {
+                    break;
+                }
+
+                level[i] = LIGHT_MAX;
+
+                if (opacity[i] == LIGHT_OPACITY_PARTIAL) {
+                    break;
+                }
+
+                queue[queue_count++] = (int16_t)i;
+                queued[i] = true;
+            }
+        }
+    }
+
+    /* Then spreads sideways and under overhangs, losing a level per step. Levels
+     * only go up, so this ends once nothing can be raised any more */
+    while (queue_count > 0) {
+
+        int i = queue[head];
+        head = (head + 1) % cells;
+        queue_count--;
+        queued[i] = false;
+
+        int x = i / (CHUNK_WIDTH * CHUNK_WIDTH);
+        int y = (i / CHUNK_WIDTH) % CHUNK_WIDTH;
+        int z = i % CHUNK_WIDTH;
+        int spread = level[i] - 1;
+
+        if (spread <= 0) {
+            continue;
+        }
+
+        for (int side = 0; side < 6; side++) {
+
+            int nx = x + offsets[side][0];
+            int ny = y + offsets[side][1];
+            int nz = z + offsets[side][2];
+
+            if (nx < 0 || nx >= CHUNK_WIDTH || ny < 0 || ny >= CHUNK_WIDTH || nz < 0 || nz >= CHUNK_WIDTH) {
+                continue;
+            }
+
+            int n = packed_index(nx, ny, nz, CHUNK_WIDTH);
+
+            if (opacity[n] == LIGHT_OPACITY_OPAQUE || level[n] >= spread) {
+                continue;
+            }
+
+            level[n] = (uint8_t)spread;
+
+            if (opacity[n] == LIGHT_OPACITY_TRANSPARENT && !queued[n]) {
+                queue[(head + queue_count++) % cells] = (int16_t)n;
+                queued[n] = true;
+            }
+        }
+    }
+
+    uint8_t* heightmap = record;
+    uint8_t* sky = record + LIGHT_HEIGHTMAP_SIZE;
+
+    memset(sky, 0, LIGHT_SKY_SIZE);
+
+    for     (int x = 0; x < GENERATED_WIDTH; x++) {
+        for (int z = 0; z < GENERATED_WIDTH; z++) {
+
+            int height = 0;
+
+            for (int y = 0; y < GENERATED_WIDTH; y++) {
+
+                int i = packed_index(x, y, z, GENERATED_WIDTH);
+                int block_id = block_ids[i];
+
+                if (block_id != 0 && block_id <= 30) {
+                    height = y + 1;
+                }
+
+                sky[i / 2] |= (uint8_t)(level[packed_index(x + 1, y + 1, z + 1, CHUNK_WIDTH)] << (4 * (i & 1)));
+            }
+
+            heightmap[x * GENERATED_WIDTH + z] = (uint8_t)height;
+        }
+    }
+}
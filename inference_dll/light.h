@@ -0,0 +1,52 @@
+/**
+ * @file light.h
+ * @brief Heightmap and skylight of a generated volume.
+ *
+ *  light_compute() works out the skylight and heightmap of a generated volume in
+ *  one pass. It's exported with the READ_LIGHT tick command (tick_buffer.h) for
+ *  consumers that write structures outside a running server.
+ *
+ *  The mod doesn't seed a live server with it. The server's light engine owns its
+ *  section storage on its own executor, so a record queued from the server thread
+ *  races with it. The checks that placing the blocks queues also run a full
+ *  propagation whatever was seeded, so no relight work would be saved. Applying
+ *  the record would need the chunk loading path, with those checks suppressed for
+ *  the seeded sections.
+ *
+ *  A light record is:
+ *   heightmap  GENERATED_WIDTH^2 bytes, index x * GENERATED_WIDTH + z. One above
+ *              the highest block of the column, 0 if the column is empty. Every
+ *              block of the palette blocks motion and there are no fluids, so this
+ *              is both WORLD_SURFACE and MOTION_BLOCKING, in generated coordinates.
+ *   sky light  GENERATED_WIDTH^3 levels 0-15 at packed_index(), two per byte with
+ *              the even index in the low nibble, as in DataLayer.
+ *
+ *  Skylight is propagated over the context and the generated ids together, as the
+ *  game does: straight down from the sky without loss through transparent blocks,
+ *  and one level less per step in any other direction. Two approximations:
+ *   - The sky is assumed open above the context, and nothing lit is assumed beside
+ *     it. Only apply records of volumes whose top can see the sky.
+ *   - Slabs, stairs and the shulker box hold the light that reaches them but pass
+ *     none on, rather than occluding per face.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "inference.h"
+
+const int LIGHT_MAX = 15;
+const int LIGHT_HEIGHTMAP_SIZE = GENERATED_WIDTH * GENERATED_WIDTH;
+const int LIGHT_SKY_SIZE = GENERATED_WIDTH * GENERATED_WIDTH * GENERATED_WIDTH / 2;
+const int LIGHT_RECORD_SIZE = LIGHT_HEIGHTMAP_SIZE + LIGHT_SKY_SIZE;
+
+static_assert(LIGHT_RECORD_SIZE % 4 == 0, "Light records must keep tick events 4 byte aligned");
+
+/**
+ * @brief Compute the light record of a generated volume.
+ * @param context Packed CHUNK_WIDTH^3 context ids. Only the border is used.
+ * @param block_ids Packed GENERATED_WIDTH^3 generated ids, placed inside the border.
+ * @param record Receives LIGHT_RECORD_SIZE bytes.
+ */
+void light_compute(const uint8_t* context, const uint8_t* block_ids, uint8_t* record);
@@ -0,0 +1,669 @@
+/**
+ * @file loadgen_main.cpp
+ * @brief Server tick load generator. Simulates players on a server ticking at 20 TPS,
+ *        each using the diffusion egg every few seconds, and makes the same native
+ *        calls per tick as the mod's diffusionTick handler. The time spent in native
+ *        code on every tick is recorded and summarized as a distribution, so the
+ *        cost of the game thread side can be measured without a Minecraft server.
+ *
+ *        Two call patterns are available:
+ *         tick    The current mod: one tick() call with a command buffer holding
+ *                 every submit and read (see tick_buffer.h), once per server tick.
+ *         legacy  The PlayerTickEvent handler the mod used before the command buffer:
+ *                 4096 setContextBlock() calls and startDiffusion() per generation,
+ *                 then getCurrentTimestep(), cacheCurrentTimestepForReading() and
+ *                 the sparse reads once per player per tick. Only one generation
+ *                 runs at a time and uses during a generation are ignored, as they
+ *                 were.
+ *
+ *        The tick pattern also sends the mod's trace marks (see trace.h), so the
+ *        per phase latency of the requests is reported as well.
+ *
+ *        Build by compiling this file together with every other .cpp file except
+ *        the *_main.cpp tools and backend_tensorrt.cpp, with INFERENCE_NO_TEST_MAIN
+ *        and INFERENCE_MOCK_BACKEND defined (see backend.h). The mock backend takes
+ *        --step-us per model step, so no GPU is needed. Compiled with the TensorRT
+ *        backend instead, the tool measures against the real model.
+ *
+ *  Usage: loadgen [options]
+ *
+ *    --players N           Simulated players (default 4).
+ *    --ticks N             Server ticks to run (default 1200, one minute).
+ *    --api tick|legacy     Call pattern (default tick).
+ *    --request-interval S  Seconds between uses of the egg by each player (default 5).
+ *    --step-us N           Mock backend time per model step (default 200).
+ *    --fast                Don't wait for the tick deadline, run ticks back to back.
+ *    --json PATH           Write the results as JSON.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "backend.h"
+#include "job_queue.h"
+#include "tick_buffer.h"
+#include "recorder.h"
+#include "trace.h"
+
+const int TICKS_PER_SECOND = 20;
+const double TICK_BUDGET_MS = 1000.0 / TICKS_PER_SECOND;
+
+/* Same sizes as the direct buffers DiffusionMod.java allocates */
+const int COMMAND_BUFFER_BYTES = 1 << 20;
+const int EVENT_BUFFER_BYTES = 1 << 20;
+
+struct Generation {
+    int32_t job_id;
+    int player;
+    int64_t used_tick;
+    int64_t used_ns;
+    bool submitted;
+};
+
+struct LoadConfig {
+    int players = 4;
+    int64_t ticks = 1200;
+    bool legacy = false;
+    double request_interval = 5.0;
+    int64_t step_us = 200;
+    bool fast = false;
+};
+
+struct LoadResults {
+    std::vector<double> tick_ms;        /* Native time of every tick */
+    std::vector<int64_t> tick_calls;    /* Native calls of every tick */
+    std::vector<int64_t> latency_ticks; /* Use to final snapshot, per generation */
+    int64_t uses = 0;
+    int64_t ignored_uses = 0;
+    int64_t submit_retries = 0;
+    int64_t overflows = 0;
+    int64_t completed = 0;
+    int64_t receipts = 0;
+    JobReceipt receipt_total = {};      /* Sum of every RECEIPT event */
+    double wall_seconds = 0;
+};
+
+/**
+ * @brief Context a player's egg would capture: a ground layer whose height and top
+ *        block vary by player, so jobs don't all look alike.
+ */
+static void build_context(int player, int64_t use, uint8_t* context) {
+
+    int ground = 2 + (int)((player * 7 + use * 3) % 5);
+    int top = ((player + use) % 2) ? 4 : 1;
+
+    for         (int x = 0; x < CHUNK_WIDTH; x++) {
+        for     (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int z = 0; z < CHUNK_WIDTH; z++) {
+                uint8_t id = 0;
+
+                if (y < ground) {
+                    id = 1;
+                } else if (y == ground) {
+                    id = (uint8_t)top;
+                }
+
+                context[packed_index(x, y, z, CHUNK_WIDTH)] = id;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Whether a player uses the egg on this tick. Players are staggered over the
+ *        interval so their uses don't all land on the same tick.
+ */
+static bool player_uses_egg(const LoadConfig& config, int player, int64_t tick) {
+
+    int64_t interval = std::max<int64_t>(1, (int64_t)(config.request_interval * TICKS_PER_SECOND));
+    int64_t offset = (interval * player) / config.players;
+
+    return tick % interval == offset;
+}
+
+/**
+ * @brief State of the legacy handler, the statics of the old DiffusionMod.
+ */
+struct LegacyState {
+    bool is_denoising = false;
+    bool started_diffusion = false;
+    int player = 0;
+    int64_t used_tick = 0;
+    int64_t use_count = 0;
+    uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+};
+
+/**
+ * @brief One player's PlayerTickEvent handler as the old mod ran it.
+ *        previousTimestep was never updated there, so every player re-read the
+ *        snapshot on every tick; that is reproduced here.
+ * @return Native calls made.
+ */
+static int64_t legacy_player_tick(LegacyState& state, int64_t tick, LoadResults& results) {
+
+    if (!state.is_denoising) {
+        return 0;
+    }
+
+    int64_t calls = 0;
+
+    if (!state.started_diffusion) {
+
+        for         (int x = 0; x < CHUNK_WIDTH; x++) {
+            for     (int y = 0; y < CHUNK_WIDTH; y++) {
+                for (int z = 0; z < CHUNK_WIDTH; z++) {
+                    Java_tbarnes_diffusionmod_Inference_setContextBlock(NULL, NULL, x, y, z,
+                        state.context[packed_index(x, y, z, CHUNK_WIDTH)]);
+                }
+            }
+        }
+
+        Java_tbarnes_diffusionmod_Inference_startDiffusion(NULL, NULL);
+        state.started_diffusion = true;
+        calls += PACKED_CONTEXT_RECORD_SIZE + 1;
+    }
+
+    int32_t timestep = Java_tbarnes_diffusionmod_Inference_getCurrentTimestep(NULL, NULL);
+    calls++;
+
+    if (timestep < n_T) {
+        Java_tbarnes_diffusionmod_Inference_cacheCurrentTimestepForReading(NULL, NULL);
+
+        int32_t count = Java_tbarnes_diffusionmod_Inference_getSparseCount(NULL, NULL);
+        volatile int32_t sink = 0;
+
+        for (int32_t i = 0; i < count; i++) {
+            sink += Java_tbarnes_diffusionmod_Inference_readSparseEntry(NULL, NULL, i);
+        }
+
+        calls += 2 + count;
+    }
+
+    if (timestep == 0) {
+        state.is_denoising = false;
+        state.started_diffusion = false;
+        results.latency_ticks.push_back(tick - state.used_tick);
+        results.completed++;
+    }
+
+    return calls;
+}
+
+/**
+ * @brief Everything the tick call pattern needs between ticks, the equivalent of
+ *        the generations map in DiffusionMod.java.
+ */
+struct TickState {
+    std::vector<Generation> generations;
+    std::vector<int64_t> use_counts;
+    int32_t next_job_id = 1;
+    std::vector<Generation> applied;    /* APPLIED marks to send with the next tick */
+    uint8_t* commands;
+    uint8_t* events;
+};
+
+static void put_word(uint8_t* buffer, int32_t& used, int32_t word) {
+    memcpy(buffer + used, &word, sizeof(word));
+    used += sizeof(word);
+}
+
+static int32_t get_word(const uint8_t* buffer, int32_t offset) {
+    int32_t word;
+    memcpy(&word, buffer + offset, sizeof(word));
+    return word;
+}
+
+static void put_trace(uint8_t* buffer, int32_t& used, int32_t job_id, int mark, int64_t ns) {
+    put_word(buffer, used, TICK_COMMAND_TRACE);
+    put_word(buffer, used, job_id);
+    put_word(buffer, used, mark);
+    put_word(buffer, used, (int32_t)(uint32_t)ns);
+    put_word(buffer, used, (int32_t)(uint32_t)((uint64_t)ns >> 32));
+}
+
+/**
+ * @brief Build the command buffer for every generation, make the tick() call and
+ *        walk the events the way the mod applies them.
+ * @return Native calls made, or -1 if tick() failed.
+ */
+static int64_t run_tick_api(TickState& state, int64_t tick, LoadResults& results) {
+
+    if (state.generations.empty() && state.applied.empty()) {
+        return 0;
+    }
+
+    int32_t command_bytes = 0;
+
+    for (const Generation& generation : state.applied) {
+        put_trace(state.commands, command_bytes, generation.job_id, TRACE_MARK_APPLIED, generation.used_ns);
+    }
+
+    state.applied.clear();
+
+    for (Generation& generation : state.generations) {
+
+        if (!generation.submitted) {
+
+            if (command_bytes + 2 * TICK_TRACE_BYTES + TICK_SUBMIT_BYTES > COMMAND_BUFFER_BYTES) {
+                continue;
+            }
+
+            put_trace(state.commands, command_bytes, generation.job_id, TRACE_MARK_USED, generation.used_ns);
+            put_trace(state.commands, command_bytes, generation.job_id, TRACE_MARK_CAPTURE_START, job_now_ns());
+            put_word(state.commands, command_bytes, TICK_COMMAND_SUBMIT);
+            put_word(state.commands, command_bytes, generation.job_id);
+            build_context(generation.player, state.use_counts[generation.player], state.commands + command_bytes);
+            command_bytes += PACKED_CONTEXT_RECORD_SIZE;
+            generation.submitted = true;
+
+        } else if (command_bytes + 5 * (int32_t)sizeof(int32_t) <= COMMAND_BUFFER_BYTES) {
+            put_word(state.commands, command_bytes, TICK_COMMAND_READ);
+            put_word(state.commands, command_bytes, generation.job_id);
+            put_word(state.commands, command_bytes, SPARSE_OUTPUT_CHANGED);
+            put_word(state.commands, command_bytes, TICK_COMMAND_READ_LIGHT);
+            put_word(state.commands, command_bytes, generation.job_id);
+        }
+    }
+
+    int32_t event_bytes = Java_tbarnes_diffusionmod_Inference_tick(NULL, NULL, command_bytes);
+
+    if (event_bytes < 0) {
+        return -1;
+    }
+
+    volatile int32_t sink = 0;
+
+    for (int32_t offset = 0; offset < event_bytes; ) {
+
+        int32_t type = get_word(state.events, offset);
+
+        if (type == TICK_EVENT_SNAPSHOT) {
+
+            int32_t mode = get_word(state.events, offset + 12);
+            int32_t count = get_word(state.events, offset + 16);
+            int32_t payload = (mode == SPARSE_OUTPUT_OFF) ? ((count + 3) & ~3) : count * (int32_t)sizeof(int32_t);
+
+            for (int32_t i = 0; mode != SPARSE_OUTPUT_OFF && i < count; i++) {
+                sink += get_word(state.events, offset + TICK_SNAPSHOT_HEADER + i * (int32_t)sizeof(int32_t));
+            }
+
+            offset += TICK_SNAPSHOT_HEADER + payload;
+
+        } else if (type == TICK_EVENT_LIGHT) {
+
+            sink += state.events[offset + TICK_LIGHT_BYTES - 1];
+            offset += TICK_LIGHT_BYTES;
+
+        } else if (type == TICK_EVENT_RECEIPT) {
+
+            int64_t fields[JOB_RECEIPT_FIELDS];
+            int64_t* total = (int64_t*)&results.receipt_total;
+
+            memcpy(fields, state.events + offset + 2 * sizeof(int32_t), sizeof(fields));
+
+            for (int i = 0; i < JOB_RECEIPT_FIELDS; i++) {
+                total[i] += fields[i];
+            }
+
+            results.receipts++;
+            offset += TICK_RECEIPT_BYTES;
+
+        } else if (type == TICK_EVENT_COMPLETED) {
+
+            int32_t job_id = get_word(state.events, offset + 4);
+
+            for (size_t i = 0; i < state.generations.size(); i++) {
+                if (state.generations[i].job_id == job_id) {
+                    results.latency_ticks.push_back(tick - state.generations[i].used_tick);
+
+                    /* Sent next tick, with the time the events were walked */
+                    if (get_word(state.events, offset + 8) == JOB_STATE_DONE) {
+                        state.applied.push_back(state.generations[i]);
+                        state.applied.back().used_ns = job_now_ns();
+                    }
+
+                    state.generations.erase(state.generations.begin() + i);
+                    break;
+                }
+            }
+
+            results.completed++;
+            offset += 4 * sizeof(int32_t);
+
+        } else if (type == TICK_EVENT_ERROR) {
+
+            /* A rejected submit (full job table) is sent again next tick */
+            int32_t job_id = get_word(state.events, offset + 4);
+            int32_t command = get_word(state.events, offset + 8);
+
+            for (Generation& generation : state.generations) {
+                if (generation.job_id == job_id && command == TICK_COMMAND_SUBMIT) {
+                    generation.submitted = false;
+                    results.submit_retries++;
+                }
+            }
+
+            offset += 4 * sizeof(int32_t);
+
+        } else {
+            /* OVERFLOW is always last */
+            results.overflows++;
+            break;
+        }
+    }
+
+    return 1;
+}
+
+static double percentile(const std::vector<double>& sorted_values, double fraction) {
+
+    if (sorted_values.empty()) {
+        return 0;
+    }
+
+    size_t i = (size_t)(fraction * (sorted_values.size() - 1) + 0.5);
+    return sorted_values[i];
+}
+
+/**
+ * @brief Run the configured number of ticks.
+ * @return 0 on success, error code on failure.
+ */
+static int run_load(const LoadConfig& config, LoadResults& results) {
+
+    LegacyState legacy;
+    TickState ticking;
+
+    ticking.use_counts.assign(config.players, 0);
+
+    if (!config.legacy) {
+        ticking.commands = (uint8_t*)malloc(COMMAND_BUFFER_BYTES);
+        ticking.events = (uint8_t*)malloc(EVENT_BUFFER_BYTES);
+
+        int result = tick_register_buffers(ticking.commands, COMMAND_BUFFER_BYTES, ticking.events, EVENT_BUFFER_BYTES);
+
+        if (result != 0) {
+            return result;
+        }
+    } else {
+        Java_tbarnes_diffusionmod_Inference_setSparseOutputMode(NULL, NULL, SPARSE_OUTPUT_CHANGED);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start;
+
+    for (int64_t tick = 0; tick < config.ticks; tick++) {
+
+        /* Uses happen in useOn(), outside the tick handler, so they aren't timed */
+        for (int player = 0; player < config.players; player++) {
+
+            if (!player_uses_egg(config, player, tick)) {
+                continue;
+            }
+
+            results.uses++;
+
+            if (config.legacy) {
+                if (legacy.is_denoising) {
+                    results.ignored_uses++;
+                } else {
+                    legacy.is_denoising = true;
+                    legacy.player = player;
+                    legacy.used_tick = tick;
+                    build_context(player, legacy.use_count++, legacy.context);
+                }
+            } else {
+                ticking.use_counts[player]++;
+                ticking.generations.push_back({ ticking.next_job_id++, player, tick, job_now_ns(), false });
+            }
+        }
+
+        int64_t calls = 0;
+        auto tick_start = std::chrono::steady_clock::now();
+
+        if (config.legacy) {
+            for (int player = 0; player < config.players; player++) {
+                calls += legacy_player_tick(legacy, tick, results);
+            }
+        } else {
+            calls = run_tick_api(ticking, tick, results);
+
+            if (calls < 0) {
+                printf("tick() failed (%d)\n", Java_tbarnes_diffusionmod_Inference_getLastError(NULL, NULL));
+                return INFER_ERROR_FAILED_OPERATION;
+            }
+        }
+
+        auto tick_end = std::chrono::steady_clock::now();
+
+        results.tick_ms.push_back(std::chrono::duration<double, std::milli>(tick_end - tick_start).count());
+        results.tick_calls.push_back(calls);
+
+        if (!config.fast) {
+            deadline += std::chrono::microseconds(1000000 / TICKS_PER_SECOND);
+            std::this_thread::sleep_until(deadline);
+        }
+    }
+
+    results.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return 0;
+}
+
+struct Summary {
+    double mean_ms, p50_ms, p90_ms, p99_ms, p999_ms, max_ms;
+    int64_t over_budget_ticks;
+    double mean_calls;
+    int64_t max_calls;
+    double mean_latency_s;
+};
+
+static Summary summarize(const LoadResults& results) {
+
+    Summary summary = {};
+    std::vector<double> sorted = results.tick_ms;
+    std::sort(sorted.begin(), sorted.end());
+
+    double total = 0;
+
+    for (double ms : sorted) {
+        total += ms;
+        summary.over_budget_ticks += (ms > TICK_BUDGET_MS) ? 1 : 0;
+    }
+
+    summary.mean_ms = sorted.empty() ? 0 : total / sorted.size();
+    summary.p50_ms = percentile(sorted, 0.5);
+    summary.p90_ms = percentile(sorted, 0.9);
+    summary.p99_ms = percentile(sorted, 0.99);
+    summary.p999_ms = percentile(sorted, 0.999);
+    summary.max_ms = sorted.empty() ? 0 : sorted.back();
+
+    int64_t total_calls = 0;
+
+    for (int64_t calls : results.tick_calls) {
+        total_calls += calls;
+        summary.max_calls = std::max(summary.max_calls, calls);
+    }
+
+    summary.mean_calls = results.tick_calls.empty() ? 0 : (double)total_calls / results.tick_calls.size();
+
+    int64_t total_latency = 0;
+
+    for (int64_t latency : results.latency_ticks) {
+        total_latency += latency;
+    }
+
+    summary.mean_latency_s = results.latency_ticks.empty() ? 0
+        : (double)total_latency / results.latency_ticks.size() / TICKS_PER_SECOND;
+
+    return summary;
+}
+
+static const char* trace_phase_names[TRACE_PHASE_COUNT] = {
+    "wait_capture", "capture", "queue", "denoise", "deliver", "apply", "total",
+};
+
+/**
+ * @brief Per phase request latency from trace.h, in milliseconds.
+ */
+static void print_trace_phases(FILE* file) {
+
+    fprintf(file, "request phases, ms    p50        p90        p99\n");
+
+    for (int phase = 0; phase < TRACE_PHASE_COUNT; phase++) {
+        fprintf(file, "  %-14s %10.3f %10.3f %10.3f\n", trace_phase_names[phase],
+            trace_percentile(phase, 500) / 1e6, trace_percentile(phase, 900) / 1e6, trace_percentile(phase, 990) / 1e6);
+    }
+}
+
+static bool write_json(const char* path, const LoadConfig& config, const LoadResults& results, const Summary& summary) {
+
+    FILE* file = fopen(path, "w");
+
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "{\n  \"config\": { \"api\": \"%s\", \"players\": %d, \"ticks\": %lld, "
+        "\"request_interval_s\": %.3f, \"step_us\": %lld, \"fast\": %s },\n",
+        config.legacy ? "legacy" : "tick", config.players, (long long)config.ticks,
+        config.request_interval, (long long)config.step_us, config.fast ? "true" : "false");
+    fprintf(file, "  \"tick_native_ms\": { \"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, "
+        "\"p999\": %.4f, \"max\": %.4f },\n",
+        summary.mean_ms, summary.p50_ms, summary.p90_ms, summary.p99_ms, summary.p999_ms, summary.max_ms);
+    fprintf(file, "  \"budget_ms\": %.1f,\n  \"mean_budget_share\": %.6f,\n  \"ticks_over_budget\": %lld,\n",
+        TICK_BUDGET_MS, summary.mean_ms / TICK_BUDGET_MS, (long long)summary.over_budget_ticks);
+    fprintf(file, "  \"calls_per_tick\": { \"mean\": %.2f, \"max\": %lld },\n", summary.mean_calls, (long long)summary.max_calls);
+    fprintf(file, "  \"uses\": %lld,\n  \"ignored_uses\": %lld,\n  \"completed\": %lld,\n  \"submit_retries\": %lld,\n"
+        "  \"overflows\": %lld,\n  \"mean_generation_s\": %.3f,\n  \"wall_s\": %.3f,\n",
+        (long long)results.uses, (long long)results.ignored_uses, (long long)results.completed,
+        (long long)results.submit_retries, (long long)results.overflows, summary.mean_latency_s, results.wall_seconds);
+    fprintf(file, "  \"trace_ms\": {");
+
+    for (int phase = 0; phase < TRACE_PHASE_COUNT; phase++) {
+        fprintf(file, "%s\n    \"%s\": { \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f }", phase ? "," : "",
+            trace_phase_names[phase], trace_percentile(phase, 500) / 1e6, trace_percentile(phase, 900) / 1e6,
+            trace_percentile(phase, 990) / 1e6);
+    }
+
+    fprintf(file, "\n  }\n}\n");
+
+    return fclose(file) == 0;
+}
+
+/**
+ * @brief Mean of the job receipts (job_queue.h).
+ */
+static void print_mean_receipt(FILE* file, const LoadResults& results) {
+
+    const JobReceipt& total = results.receipt_total;
+    double n = (double)std::max<int64_t>(1, results.receipts);
+
+    fprintf(file, "mean receipt of %lld jobs: %.0f model steps, %.0f skipped, backend %.2f ms, queued %.2f ms, "
+        "%.0f KB to the backend, %.1f KB delivered, decode %.3f ms, peak %.0f KB, %.0f%% from library\n",
+        (long long)results.receipts, total.model_invocations / n, total.steps_skipped / n, total.backend_ns / n / 1e6,
+        total.queue_ns / n / 1e6, total.device_bytes / n / 1024, total.delivered_bytes / n / 1024,
+        total.decode_ns / n / 1e6, total.peak_memory_bytes / n / 1024, 100.0 * total.from_library / n);
+}
+
+static void print_usage() {
+    printf("Usage: loadgen [--players N] [--ticks N] [--api tick|legacy] [--request-interval S] [--step-us N] [--fast] [--json PATH]\n");
+}
+
+int main(int argc, char** argv) {
+
+    LoadConfig config;
+    const char* json_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "--players") == 0 && i + 1 < argc) {
+            config.players = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+            config.ticks = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--api") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "legacy") == 0) {
+                config.legacy = true;
+            } else if (strcmp(argv[i], "tick") != 0) {
+                print_usage();
+                return INFER_ERROR_INVALID_ARG;
+            }
+        } else if (strcmp(argv[i], "--request-interval") == 0 && i + 1 < argc) {
+            config.request_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--step-us") == 0 && i + 1 < argc) {
+            config.step_us = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            config.fast = true;
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            print_usage();
+            return INFER_ERROR_INVALID_ARG;
+        }
+    }
+
+    if (config.players < 1 || config.ticks < 1 || config.request_interval <= 0 || config.step_us < 0) {
+        print_usage();
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    mock_backend_set_step_time(config.step_us * 1000);
+
+    /* No pregenerated answers, every use should reach the backend */
+    Java_tbarnes_diffusionmod_Inference_setLibrarySimilarityThreshold(NULL, NULL, 2.0f);
+
+    int result = Java_tbarnes_diffusionmod_Inference_init(NULL, NULL);
+
+    if (result != 0) {
+        printf("init failed (%d)\n", result);
+        return result;
+    }
+
+    LoadResults results;
+    result = run_load(config, results);
+
+    if (result != 0) {
+        return result;
+    }
+
+    Summary summary = summarize(results);
+
+    printf("%s API, %d players, %lld ticks in %.1f s\n", config.legacy ? "legacy" : "tick",
+        config.players, (long long)config.ticks, results.wall_seconds);
+    printf("native ms per tick: mean %.4f  p50 %.4f  p90 %.4f  p99 %.4f  p99.9 %.4f  max %.4f\n",
+        summary.mean_ms, summary.p50_ms, summary.p90_ms, summary.p99_ms, summary.p999_ms, summary.max_ms);
+    printf("tick budget: mean %.3f%% of %.0f ms, %lld ticks over budget\n",
+        100.0 * summary.mean_ms / TICK_BUDGET_MS, TICK_BUDGET_MS, (long long)summary.over_budget_ticks);
+    printf("native calls per tick: mean %.1f  max %lld\n", summary.mean_calls, (long long)summary.max_calls);
+    printf("uses %lld (%lld ignored), completed %lld, mean generation %.2f s, submit retries %lld, overflows %lld\n",
+        (long long)results.uses, (long long)results.ignored_uses, (long long)results.completed,
+        summary.mean_latency_s, (long long)results.submit_retries, (long long)results.overflows);
+
+    if (!config.legacy) {
+        print_trace_phases(stdout);
+        print_mean_receipt(stdout, results);
+    }
+
+    fflush(stdout);
+
+    if (json_path && !write_json(json_path, config, results, summary)) {
+        printf("Failed to write %s\n", json_path);
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    /* Keeps a recording made with INFERENCE_RECORD_PATH complete */
+    recorder_stop();
+
+    /* The denoise thread never exits */
+    _Exit(0);
+}
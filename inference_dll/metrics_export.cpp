@@ -0,0 +1,326 @@
+/**
+ * @file metrics_export.cpp
+ * @brief Prometheus text format export. See metrics_export.h.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <winsock2.h>
+    #include <windows.h>
+    typedef SOCKET MetricsSocket;
+    #define close_socket closesocket
+#else
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+    typedef int MetricsSocket;
+    #define INVALID_SOCKET (-1)
+    #define close_socket close
+#endif
+
+#include "inference.h"
+#include "stats.h"
+#include "perf_counters.h"
+#include "job_queue.h"
+#include "history.h"
+#include "structure_library.h"
+#include "trace.h"
+#include "recorder.h"
+#include "metrics_export.h"
+
+const char* const METRICS_PREFIX = "diffusion_";
+
+static std::atomic<bool> http_started;
+static std::atomic<bool> file_started;
+
+static const char* trace_phase_labels[TRACE_PHASE_COUNT] = {
+    "wait_capture", "capture", "queue", "denoise", "deliver", "apply", "total",
+};
+
+static void append(std::string& out, const char* format, ...) {
+
+    char line[256];
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (length > 0) {
+        out.append(line, (size_t)length < sizeof(line) ? (size_t)length : sizeof(line) - 1);
+    }
+}
+
+static void append_header(std::string& out, const char* name, const char* type, const char* help) {
+    append(out, "# HELP %s%s %s\n", METRICS_PREFIX, name, help);
+    append(out, "# TYPE %s%s %s\n", METRICS_PREFIX, name, type);
+}
+
+void metrics_format(std::string& out) {
+
+    /* The running maxima and the degraded flag are gauges, everything else only grows */
+    for (int stat = 0; stat < STAT_COUNT; stat++) {
+
+        const char* name = stat_name(stat);
+        bool gauge = strstr(name, "_max_") != NULL || stat == STAT_BACKEND_DEGRADED;
+
+        append(out, "# TYPE %s%s%s %s\n", METRICS_PREFIX, name, gauge ? "" : "_total", gauge ? "gauge" : "counter");
+        append(out, "%s%s%s %lld\n", METRICS_PREFIX, name, gauge ? "" : "_total", (long long)stat_get(stat));
+    }
+
+    append_header(out, "jobs", "gauge", "Jobs in the job table by state.");
+    append(out, "%sjobs{state=\"queued\"} %d\n", METRICS_PREFIX, job_count(JOB_STATE_QUEUED));
+    append(out, "%sjobs{state=\"running\"} %d\n", METRICS_PREFIX, job_count(JOB_STATE_RUNNING));
+
+    /* Every line of a metric has to follow its header, so one loop per metric */
+    append_header(out, "stage_calls_total", "counter", "Sampled calls of each denoise stage.");
+
+    for (int stage = 0; stage < PERF_STAGE_COUNT; stage++) {
+        append(out, "%sstage_calls_total{stage=\"%s\"} %lld\n", METRICS_PREFIX, perf_stage_name(stage),
+            (long long)stat_get(stat_perf(stage, PERF_VALUE_CALLS)));
+    }
+
+    append_header(out, "stage_seconds_total", "counter", "Time spent in each denoise stage.");
+
+    for (int stage = 0; stage < PERF_STAGE_COUNT; stage++) {
+        append(out, "%sstage_seconds_total{stage=\"%s\"} %.9f\n", METRICS_PREFIX, perf_stage_name(stage),
+            stat_get(stat_perf(stage, PERF_VALUE_NS)) / 1e9);
+    }
+
+    if (perf_counters_available()) {
+
+        append_header(out, "stage_hardware_events_total", "counter", "Hardware counter events in each denoise stage.");
+
+        for (int stage = 0; stage < PERF_STAGE_COUNT; stage++) {
+            for (int value = PERF_VALUE_CYCLES; value < PERF_VALUE_COUNT; value++) {
+                append(out, "%sstage_hardware_events_total{stage=\"%s\",event=\"%s\"} %lld\n", METRICS_PREFIX,
+                    perf_stage_name(stage), perf_value_name(value), (long long)stat_get(stat_perf(stage, value)));
+            }
+        }
+    }
+
+    append_header(out, "request_phase_seconds", "histogram", "Phases of applied requests, see trace.h.");
+
+    for (int phase = 0; phase < TRACE_PHASE_COUNT; phase++) {
+
+        TraceHistogram histogram;
+        trace_histogram(phase, &histogram);
+
+        for (int bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS; bucket++) {
+            append(out, "%srequest_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lld\n", METRICS_PREFIX,
+                trace_phase_labels[phase], trace_histogram_bounds_ns[bucket] / 1e9, (long long)histogram.buckets[bucket]);
+        }
+
+        append(out, "%srequest_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lld\n", METRICS_PREFIX,
+            trace_phase_labels[phase], (long long)histogram.count);
+        append(out, "%srequest_phase_seconds_sum{phase=\"%s\"} %.9f\n", METRICS_PREFIX,
+            trace_phase_labels[phase], histogram.sum_ns / 1e9);
+        append(out, "%srequest_phase_seconds_count{phase=\"%s\"} %lld\n", METRICS_PREFIX,
+            trace_phase_labels[phase], (long long)histogram.count);
+    }
+
+    int64_t lookups = stat_get(STAT_LIBRARY_LOOKUPS);
+
+    append_header(out, "library_hit_ratio", "gauge", "Share of submissions answered by the structure library.");
+    append(out, "%slibrary_hit_ratio %.6f\n", METRICS_PREFIX,
+        lookups ? (double)stat_get(STAT_LIBRARY_HITS) / lookups : 0.0);
+
+    append_header(out, "memory_bytes", "gauge", "Memory held by each subsystem.");
+    append(out, "%smemory_bytes{subsystem=\"jobs\"} %lld\n", METRICS_PREFIX, (long long)job_table_bytes());
+    append(out, "%smemory_bytes{subsystem=\"history\"} %lld\n", METRICS_PREFIX, (long long)history_total_bytes());
+    append(out, "%smemory_bytes{subsystem=\"library\"} %lld\n", METRICS_PREFIX, (long long)library_memory_bytes());
+}
+
+/**
+ * @brief Answer every connection with the metrics, whatever it asked for. Only
+ *        loopback connections can reach the socket.
+ */
+static void http_thread_main(MetricsSocket listener) {
+
+    for (;;) {
+
+        MetricsSocket client = accept(listener, NULL, NULL);
+
+        if (client == INVALID_SOCKET) {
+            continue;
+        }
+
+        /* The request itself doesn't matter, but has to be read before replying */
+        char request[1024];
+        recv(client, request, sizeof(request), 0);
+
+        std::string body;
+        metrics_format(body);
+
+        std::string response;
+        append(response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+        response += body;
+
+        for (size_t sent = 0; sent < response.size(); ) {
+
+            int result = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+
+            if (result <= 0) {
+                break;
+            }
+
+            sent += result;
+        }
+
+        close_socket(client);
+    }
+}
+
+int metrics_serve_http(int32_t port) {
+
+    if (port <= 0 || port > 65535) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    if (http_started.exchange(true)) {
+        return INFER_ERROR_INVALID_OPERATION;
+    }
+
+#if defined(_WIN32)
+    WSADATA wsa_data;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        http_started = false;
+        return INFER_ERROR_INVALID_OPERATION;
+    }
+#endif
+
+    MetricsSocket listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (listener == INVALID_SOCKET ||
+        bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 4) != 0) {
+
+        if (listener != INVALID_SOCKET) {
+            close_socket(listener);
+        }
+
+        printf("Metrics can't listen on 127.0.0.1:%d\n", port);
+        http_started = false;
+        return INFER_ERROR_INVALID_OPERATION;
+    }
+
+    std::thread(http_thread_main, listener).detach();
+    printf("Serving metrics on http://127.0.0.1:%d/metrics\n", port);
+
+    return 0;
+}
+
+/**
+ * @brief Write to a temporary file next to path and move it over path.
+ */
+static bool replace_file(const std::string& path, const std::string& contents) {
+
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+
+    if (!file) {
+        return false;
+    }
+
+    bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    written = (fclose(file) == 0) && written;
+
+    if (!written) {
+        return false;
+    }
+
+#if defined(_WIN32)
+    return MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+}
+
+static void file_thread_main(std::string path, int32_t interval_ms) {
+
+    bool reported = false;
+
+    for (;;) {
+
+        std::string contents;
+        metrics_format(contents);
+
+        /* Report a failing path once rather than every interval */
+        if (!replace_file(path, contents) && !reported) {
+            printf("Can't write metrics to %s\n", path.c_str());
+            reported = true;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    }
+}
+
+int metrics_write_file(const char* path, int32_t interval_ms) {
+
+    if (!path || !path[0] || interval_ms <= 0) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    if (file_started.exchange(true)) {
+        return INFER_ERROR_INVALID_OPERATION;
+    }
+
+    std::thread(file_thread_main, std::string(path), interval_ms).detach();
+
+    return 0;
+}
+
+void metrics_start_from_environment() {
+
+    const char* port = getenv("INFERENCE_METRICS_PORT");
+    const char* path = getenv("INFERENCE_METRICS_FILE");
+    const char* interval = getenv("INFERENCE_METRICS_INTERVAL_MS");
+
+    if (port) {
+        metrics_serve_http(atoi(port));
+    }
+
+    if (path) {
+        metrics_write_file(path, interval ? atoi(interval) : METRICS_DEFAULT_INTERVAL_MS);
+    }
+}
+
+/**
+ * @brief startMetricsServer
+ *  Serve the stats in Prometheus text format on 127.0.0.1. See metrics_export.h.
+ * @param: port TCP port
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_startMetricsServer(void* unused1, void* unused2, int32_t port) {
+
+    record_call(RECORD_START_METRICS_SERVER, { port });
+
+    int result = metrics_serve_http(port);
+
+    if (result != 0) {
+        inference_set_last_error(result);
+    }
+
+    return result;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file metrics_export.h
+ * @brief Optional export of the stats in the Prometheus text exposition format,
+ *        either served on a localhost HTTP port or written periodically to a file
+ *        for the node exporter's textfile collector.
+ *
+ *  The export is started from init() by environment variables:
+ *   INFERENCE_METRICS_PORT         Serve http://127.0.0.1:<port>/metrics
+ *   INFERENCE_METRICS_FILE         Rewrite this file (e.g. a .prom file in the
+ *                                  collector's directory)
+ *   INFERENCE_METRICS_INTERVAL_MS  File rewrite interval, default 10000
+ *  or with startMetricsServer() from Java.
+ *
+ *  Both run on their own thread, so the denoise thread never formats anything.
+ *  The counters of stats.h are read without locks. The job counts, phase
+ *  histograms and memory gauges briefly take the job table, trace, history and
+ *  library mutexes, as any other reader of them would. Exported:
+ *   - every STAT_ counter, plus the model steps for a steps/s rate
+ *   - queued and running jobs
+ *   - per stage calls, time and hardware counters from perf_counters.h
+ *   - request phase histograms from trace.h
+ *   - structure library hit ratio
+ *   - memory held by the job table, history and structure library
+ */
+
+#pragma once
+
+#include <string>
+
+#include <stdint.h>
+
+const int32_t METRICS_DEFAULT_INTERVAL_MS = 10000;
+
+/**
+ * @brief Append every metric to out.
+ */
+void metrics_format(std::string& out);
+
+/**
+ * @brief Serve the metrics on 127.0.0.1:port from a new thread.
+ * @return 0 on success, INFER_ERROR_INVALID_ARG for a bad port,
+ *         INFER_ERROR_INVALID_OPERATION if already serving or the port can't be
+ *         bound.
+ */
+int metrics_serve_http(int32_t port);
+
+/**
+ * @brief Rewrite path with the metrics every interval_ms from a new thread. The
+ *        file is replaced atomically so the collector never reads half of it.
+ * @return 0 on success, INFER_ERROR_INVALID_ARG for a bad interval,
+ *         INFER_ERROR_INVALID_OPERATION if already writing.
+ */
+int metrics_write_file(const char* path, int32_t interval_ms);
+
+/**
+ * @brief Start whichever exports the INFERENCE_METRICS_ environment variables ask for.
+ */
+void metrics_start_from_environment();
@@ -0,0 +1,108 @@
+/**
+ * @file packed_chunk.h
+ * @brief Binary stream format for contexts and generated chunks used by the offline tools.
+ *
+ *  A stream is a small header followed by fixed size records of one byte per block id.
+ *  Every block id fits in a byte since BLOCK_ID_COUNT is below 256.
+ *
+ *  Context streams ("VXCT") hold CHUNK_WIDTH^3 ids per record, the full 16^3 volume
+ *  including the border that the model in-paints against.
+ *
+ *  Chunk streams ("VXCK") hold GENERATED_WIDTH^3 ids per record, the middle 14^3
+ *  generated blocks. Record N of a chunk stream is the result for record N of the
+ *  context stream it was generated from.
+ *
+ *  Within a record, ids are stored in the same [x][y][z] order as the DLL buffers,
+ *  so the index of (x, y, z) is (x * width + y) * width + z.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "inference.h"
+
+/* Streams can exceed 2 GB, so seek with 64 bit offsets */
+#if defined(_MSC_VER)
+    #define file_seek _fseeki64
+    #define file_tell _ftelli64
+#else
+    #define file_seek fseeko
+    #define file_tell ftello
+#endif
+
+const uint32_t PACKED_CONTEXT_MAGIC = 0x54435856; /* "VXCT" little endian */
+const uint32_t PACKED_CHUNK_MAGIC   = 0x4B435856; /* "VXCK" little endian */
+const uint16_t PACKED_VERSION       = 1;
+
+const int PACKED_CONTEXT_RECORD_SIZE = CHUNK_WIDTH * CHUNK_WIDTH * CHUNK_WIDTH;
+const int PACKED_CHUNK_RECORD_SIZE   = GENERATED_WIDTH * GENERATED_WIDTH * GENERATED_WIDTH;
+
+/*
+ * Sparse entries pack a record index and a block id into one int32 so they can be
+ * passed to Java without an object per voxel.
+ */
+const int SPARSE_ID_BITS = 8;
+
+inline int32_t sparse_pack(int index, int block_id) {
+    return (index << SPARSE_ID_BITS) | block_id;
+}
+
+inline int sparse_index(int32_t entry) {
+    return entry >> SPARSE_ID_BITS;
+}
+
+inline int sparse_block_id(int32_t entry) {
+    return entry & ((1 << SPARSE_ID_BITS) - 1);
+}
+
+/* SPARSE_OUTPUT_CHANGED_STATES entries hold a state index (block_states.h) instead */
+const int SPARSE_STATE_BITS = 12;
+
+inline int32_t sparse_pack_state(int index, uint16_t state) {
+    return (index << SPARSE_STATE_BITS) | state;
+}
+
+struct PackedHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t width;
+};
+
+static_assert(sizeof(PackedHeader) == 8, "PackedHeader must not contain padding");
+
+inline int packed_index(int x, int y, int z, int width) {
+    return (x * width + y) * width + z;
+}
+
+/**
+ * @brief Write a stream header.
+ * @return true on success
+ */
+inline bool packed_write_header(FILE* file, uint32_t magic, int width) {
+
+    PackedHeader header;
+    header.magic = magic;
+    header.version = PACKED_VERSION;
+    header.width = (uint16_t)width;
+
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+/**
+ * @brief Read a stream header and check that it matches the expected format.
+ * @return true if the header was read and matches
+ */
+inline bool packed_read_header(FILE* file, uint32_t magic, int width) {
+
+    PackedHeader header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1) {
+        return false;
+    }
+
+    return header.magic == magic &&
+           header.version == PACKED_VERSION &&
+           header.width == width;
+}
@@ -0,0 +1,271 @@
+/**
+ * @file perf_counters.cpp
+ * @brief perf_event_open() based stage counters. See perf_counters.h.
+ */
+
+#include <atomic>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__linux__)
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#include "inference.h"
+#include "stats.h"
+#include "perf_counters.h"
+#include "recorder.h"
+
+static const char* stage_names[PERF_STAGE_COUNT] = {
+    "context_upload",
+    "rng_fill",
+    "backend_step",
+    "snapshot_copy",
+    "decode",
+};
+
+static const char* value_names[PERF_VALUE_COUNT] = {
+    "calls",
+    "ns",
+    "cycles",
+    "instructions",
+    "llc_misses",
+    "branch_misses",
+};
+
+static std::atomic<bool> sampling_enabled;
+static std::atomic<bool> counters_available;
+
+const char* perf_stage_name(int stage) {
+    return stage_names[stage];
+}
+
+const char* perf_value_name(int value) {
+    return value_names[value];
+}
+
+void perf_set_enabled(bool enabled) {
+    sampling_enabled = enabled;
+}
+
+bool perf_enabled() {
+    return sampling_enabled;
+}
+
+bool perf_counters_available() {
+    return counters_available;
+}
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#if defined(__linux__)
+
+static const uint64_t counter_configs[PERF_COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, /* Last level cache on most CPUs */
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+/**
+ * @brief Counter group of one thread, opened the first time the thread enters a
+ *        stage. Counters the kernel refuses are left out of the group and read as 0.
+ */
+struct PerfThreadGroup {
+    bool opened = false;
+    int fds[PERF_COUNTER_COUNT] = { -1, -1, -1, -1 };
+    int slots[PERF_COUNTER_COUNT]; /* Position of each counter in the group read, or -1 */
+    int slot_count = 0;
+
+    void open_group() {
+
+        opened = true;
+
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = counter_configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+
+            /* The first counter that opens becomes the group leader */
+            int leader = -1;
+
+            for (int j = 0; j < i; j++) {
+                if (fds[j] >= 0) {
+                    leader = fds[j];
+                    break;
+                }
+            }
+
+            attr.disabled = (leader < 0);
+            fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+            slots[i] = (fds[i] >= 0) ? slot_count++ : -1;
+        }
+
+        int leader = leader_fd();
+
+        if (leader >= 0) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            counters_available = true;
+        }
+    }
+
+    int leader_fd() const {
+
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (fds[i] >= 0) {
+                return fds[i];
+            }
+        }
+
+        return -1;
+    }
+
+    bool read_counts(uint64_t counts[PERF_COUNTER_COUNT]) {
+
+        if (!opened) {
+            open_group();
+        }
+
+        int leader = leader_fd();
+
+        if (leader < 0) {
+            return false;
+        }
+
+        uint64_t buffer[1 + PERF_COUNTER_COUNT];
+
+        if (read(leader, buffer, sizeof(buffer)) < (ssize_t)sizeof(uint64_t)) {
+            return false;
+        }
+
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            counts[i] = (slots[i] >= 0 && (uint64_t)slots[i] < buffer[0]) ? buffer[1 + slots[i]] : 0;
+        }
+
+        return true;
+    }
+
+    ~PerfThreadGroup() {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+    }
+};
+
+static thread_local PerfThreadGroup thread_group;
+
+static bool read_thread_counts(uint64_t counts[PERF_COUNTER_COUNT]) {
+    return thread_group.read_counts(counts);
+}
+
+#else
+
+static bool read_thread_counts(uint64_t counts[PERF_COUNTER_COUNT]) {
+    return false;
+}
+
+#endif
+
+bool perf_read_thread_counters(uint64_t counts[PERF_COUNTER_COUNT]) {
+
+    if (!read_thread_counts(counts)) {
+        memset(counts, 0, PERF_COUNTER_COUNT * sizeof(uint64_t));
+        return false;
+    }
+
+    return true;
+}
+
+PerfScope::PerfScope(int stage) : stage(stage), active(sampling_enabled) {
+
+    if (!active) {
+        return;
+    }
+
+    if (!read_thread_counts(start_counts)) {
+        memset(start_counts, 0, sizeof(start_counts));
+    }
+
+    start_ns = now_ns();
+}
+
+PerfScope::~PerfScope() {
+
+    if (!active) {
+        return;
+    }
+
+    int64_t elapsed_ns = now_ns() - start_ns;
+    uint64_t end_counts[PERF_COUNTER_COUNT];
+
+    stat_add(stat_perf(stage, PERF_VALUE_CALLS), 1);
+    stat_add(stat_perf(stage, PERF_VALUE_NS), elapsed_ns);
+
+    if (read_thread_counts(end_counts)) {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            stat_add(stat_perf(stage, PERF_VALUE_CYCLES + i), (int64_t)(end_counts[i] - start_counts[i]));
+        }
+    }
+}
+
+void perf_write_json(FILE* file) {
+
+    fprintf(file, "{\n    \"available\": %s,\n    \"stages\": {\n", counters_available ? "true" : "false");
+
+    for (int stage = 0; stage < PERF_STAGE_COUNT; stage++) {
+
+        double calls         = (double)stat_get(stat_perf(stage, PERF_VALUE_CALLS));
+        double ns            = (double)stat_get(stat_perf(stage, PERF_VALUE_NS));
+        double cycles        = (double)stat_get(stat_perf(stage, PERF_VALUE_CYCLES));
+        double instructions  = (double)stat_get(stat_perf(stage, PERF_VALUE_INSTRUCTIONS));
+        double llc_misses    = (double)stat_get(stat_perf(stage, PERF_VALUE_LLC_MISSES));
+        double branch_misses = (double)stat_get(stat_perf(stage, PERF_VALUE_BRANCH_MISSES));
+
+        fprintf(file,
+            "      \"%s\": { \"calls\": %.0f, \"mean_ns\": %.1f, \"cycles\": %.0f, \"instructions\": %.0f, "
+            "\"ipc\": %.3f, \"llc_misses_per_kinstr\": %.3f, \"branch_misses_per_kinstr\": %.3f }%s\n",
+            stage_names[stage], calls,
+            calls > 0 ? ns / calls : 0.0,
+            cycles, instructions,
+            cycles > 0 ? instructions / cycles : 0.0,
+            instructions > 0 ? 1000.0 * llc_misses / instructions : 0.0,
+            instructions > 0 ? 1000.0 * branch_misses / instructions : 0.0,
+            (stage + 1 < PERF_STAGE_COUNT) ? "," : "");
+    }
+
+    fprintf(file, "    }\n  }");
+}
+
+/**
+ * @brief setPerfCountersEnabled
+ *  Turn per-stage sampling on or off. Samples are read with getStat(). The
+ *  hardware counter stats stay at 0 if the counters aren't permitted.
+ * @param: enabled
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_setPerfCountersEnabled(void* unused1, void* unused2, int32_t enabled) {
+
+    record_call(RECORD_SET_PERF_COUNTERS_ENABLED, { enabled });
+
+    perf_set_enabled(enabled != 0);
+    return 0;
+}
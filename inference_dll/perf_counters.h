@@ -0,0 +1,80 @@
+/**
+ * @file perf_counters.h
+ * @brief Optional hardware performance counters around the hot stages.
+ *
+ *  On Linux each thread that enters a stage opens a perf_event_open() group counting
+ *  cycles, instructions, last level cache misses and branch misses for that thread.
+ *  Every PerfScope reads the group on entry and exit and adds the difference to the
+ *  stage's stats (see stats.h), along with the call count and wall time.
+ *
+ *  If the counters can't be opened (other platforms, perf_event_paranoid, containers
+ *  without the syscall, virtual machines without a PMU), scopes still record calls
+ *  and wall time and the counter stats stay at 0.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+const int PERF_STAGE_CONTEXT_UPLOAD = 0;
+const int PERF_STAGE_RNG_FILL       = 1;
+const int PERF_STAGE_BACKEND_STEP   = 2;
+const int PERF_STAGE_SNAPSHOT_COPY  = 3;
+const int PERF_STAGE_DECODE         = 4;
+const int PERF_STAGE_COUNT          = 5;
+
+/* Values recorded per stage */
+const int PERF_VALUE_CALLS          = 0;
+const int PERF_VALUE_NS             = 1;
+const int PERF_VALUE_CYCLES         = 2;
+const int PERF_VALUE_INSTRUCTIONS   = 3;
+const int PERF_VALUE_LLC_MISSES     = 4;
+const int PERF_VALUE_BRANCH_MISSES  = 5;
+const int PERF_VALUE_COUNT          = 6;
+
+/* Hardware counters, PERF_VALUE_CYCLES onwards */
+const int PERF_COUNTER_COUNT        = 4;
+
+const char* perf_stage_name(int stage);
+const char* perf_value_name(int value);
+
+/**
+ * @brief Turn stage sampling on or off. Off by default.
+ */
+void perf_set_enabled(bool enabled);
+bool perf_enabled();
+
+/**
+ * @brief Whether hardware counters could be opened on any thread that entered a stage.
+ */
+bool perf_counters_available();
+
+/**
+ * @brief Read the calling thread's hardware counters, PERF_VALUE_CYCLES onwards,
+ *        opening them on first use. Doesn't depend on perf_set_enabled(), for
+ *        callers that sample a whole loop rather than a stage.
+ * @return false if the counters aren't available. counts are 0 then.
+ */
+bool perf_read_thread_counters(uint64_t counts[PERF_COUNTER_COUNT]);
+
+/**
+ * @brief Write per-stage totals with derived IPC and misses per thousand instructions
+ *        as a JSON object.
+ */
+void perf_write_json(FILE* file);
+
+/**
+ * @brief Samples one stage for the lifetime of the object.
+ */
+class PerfScope {
+public:
+    explicit PerfScope(int stage);
+    ~PerfScope();
+
+private:
+    int stage;
+    bool active;
+    int64_t start_ns;
+    uint64_t start_counts[PERF_COUNTER_COUNT];
+};
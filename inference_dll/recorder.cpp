@@ -0,0 +1,220 @@
+/**
+ * @file recorder.cpp
+ * @brief Entry point call recorder. See recorder.h.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "inference.h"
+#include "recorder.h"
+
+/* The recording is flushed once this much recorded time has passed, so a crashed
+ * or killed server still leaves most of its session behind */
+const int64_t RECORDER_FLUSH_INTERVAL_NS = 1000000000;
+
+const int RECORDER_BUFFER_BYTES = 1 << 20;
+
+std::atomic<bool> recorder_enabled;
+
+static std::mutex recorder_mtx;
+static FILE* recorder_file;
+static std::chrono::steady_clock::time_point recorder_last;
+static int64_t recorder_unflushed_ns;
+
+static void write_varint(uint64_t value) {
+
+    uint8_t bytes[10];
+    int count = 0;
+
+    do {
+        bytes[count] = (uint8_t)(value & 0x7F);
+        value >>= 7;
+        bytes[count++] |= value ? 0x80 : 0;
+    } while (value);
+
+    fwrite(bytes, 1, count, recorder_file);
+}
+
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+int recorder_start(const char* path) {
+
+    std::lock_guard<std::mutex> lock(recorder_mtx);
+
+    if (recorder_file) {
+        return INFER_ERROR_INVALID_OPERATION;
+    }
+
+    FILE* file = fopen(path, "wb");
+
+    if (!file) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    setvbuf(file, NULL, _IOFBF, RECORDER_BUFFER_BYTES);
+
+    RecordingHeader header = {};
+    header.magic = RECORDING_MAGIC;
+    header.version = RECORDING_VERSION;
+    header.start_unix_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    recorder_file = file;
+    recorder_last = std::chrono::steady_clock::now();
+    recorder_unflushed_ns = 0;
+    recorder_enabled = true;
+
+    printf("Recording entry point calls to %s\n", path);
+
+    return 0;
+}
+
+void recorder_stop() {
+
+    std::lock_guard<std::mutex> lock(recorder_mtx);
+
+    recorder_enabled = false;
+
+    if (recorder_file) {
+        fclose(recorder_file);
+        recorder_file = NULL;
+    }
+}
+
+void recorder_write(int call, std::initializer_list<int32_t> args, const void* blob, int32_t blob_bytes) {
+
+    std::lock_guard<std::mutex> lock(recorder_mtx);
+
+    if (!recorder_file) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    int64_t delta_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - recorder_last).count();
+
+    recorder_last = now;
+
+    uint8_t type = (uint8_t)call;
+    fwrite(&type, 1, 1, recorder_file);
+    write_varint((uint64_t)delta_ns);
+
+    uint8_t arg_count = (uint8_t)(args.size() | (blob ? RECORD_HAS_BLOB : 0));
+    fwrite(&arg_count, 1, 1, recorder_file);
+
+    for (int32_t arg : args) {
+        write_varint(zigzag(arg));
+    }
+
+    if (blob) {
+        write_varint((uint64_t)blob_bytes);
+        fwrite(blob, 1, blob_bytes, recorder_file);
+    }
+
+    recorder_unflushed_ns += delta_ns;
+
+    if (recorder_unflushed_ns >= RECORDER_FLUSH_INTERVAL_NS) {
+        fflush(recorder_file);
+        recorder_unflushed_ns = 0;
+    }
+}
+
+bool recording_read_header(FILE* file, RecordingHeader* header) {
+    return fread(header, sizeof(*header), 1, file) == 1 && header->magic == RECORDING_MAGIC &&
+           header->version >= RECORDING_VERSION_MIN && header->version <= RECORDING_VERSION;
+}
+
+static bool read_varint(FILE* file, uint64_t* value) {
+
+    *value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+
+        int byte = fgetc(file);
+
+        if (byte == EOF) {
+            return false;
+        }
+
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool recording_read(FILE* file, uint16_t version, RecordedCall* call) {
+
+    int type = fgetc(file);
+    uint64_t delta_ns;
+
+    if (type == EOF || !read_varint(file, &delta_ns)) {
+        return false;
+    }
+
+    int arg_count = fgetc(file);
+
+    if (arg_count == EOF) {
+        return false;
+    }
+
+    bool has_blob = (version >= 2) ? (arg_count & RECORD_HAS_BLOB) != 0 : type == RECORD_TICK;
+
+    if (version >= 2) {
+        arg_count &= ~RECORD_HAS_BLOB;
+    }
+
+    if (arg_count > RECORD_MAX_ARGS) {
+        return false;
+    }
+
+    call->call = type;
+    call->time_ns += (int64_t)delta_ns;
+    call->arg_count = arg_count;
+
+    for (int i = 0; i < arg_count; i++) {
+
+        uint64_t encoded;
+
+        if (!read_varint(file, &encoded)) {
+            return false;
+        }
+
+        uint32_t bits = (uint32_t)encoded;
+        call->args[i] = (int32_t)((bits >> 1) ^ (0u - (bits & 1)));
+    }
+
+    call->blob.clear();
+
+    if (has_blob) {
+
+        uint64_t bytes;
+
+        if (!read_varint(file, &bytes) || bytes > (1u << 30)) {
+            return false;
+        }
+
+        call->blob.resize((size_t)bytes);
+
+        if (bytes && fread(call->blob.data(), 1, (size_t)bytes, file) != bytes) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,150 @@
+/**
+ * @file recorder.h
+ * @brief Optional recording of every entry point call, for replaying a production
+ *        session with replay_main.cpp.
+ *
+ *  Recording starts in init() when the INFERENCE_RECORD_PATH environment variable
+ *  names a file, or with recorder_start() from the native tools. Each call is
+ *  written as it enters the DLL, together with its arguments and the time since
+ *  the previous record. Calls that pass a buffer, tick() and submitAsyncBatch(),
+ *  also carry its bytes. Job seeds
+ *  are written as RECORD_SEED records right after the call that submitted the job,
+ *  so a replay draws the same initial noise.
+ *
+ *  File layout, all integers little endian:
+ *   RecordingHeader
+ *   Records:
+ *    uint8   call, a RECORD_ constant
+ *    varint  nanoseconds since the previous record (since the header for the first)
+ *    uint8   argument count, | RECORD_HAS_BLOB if bytes follow the arguments
+ *    varint  zigzag encoded int32 arguments. Float arguments are stored as their bits.
+ *    RECORD_HAS_BLOB only: varint byte count, then the bytes
+ *
+ *  Version 1 recordings have no RECORD_HAS_BLOB flag, only TICK records carry bytes
+ *  there and submitAsyncBatch() records have lost theirs. They are still read.
+ *
+ *  A setContextBlock() call takes about 8 bytes, so recording a full legacy
+ *  generation costs roughly 32 KB.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <initializer_list>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+const uint32_t RECORDING_MAGIC   = 0x43525856; /* "VXRC" little endian */
+const uint16_t RECORDING_VERSION = 2;
+
+/* Oldest version recording_read() understands */
+const uint16_t RECORDING_VERSION_MIN = 1;
+
+struct RecordingHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    int64_t start_unix_ms;
+};
+
+static_assert(sizeof(RecordingHeader) == 16, "RecordingHeader must not contain padding");
+
+/* Recorded entry points */
+const int RECORD_INIT                      = 1;
+const int RECORD_SET_CONTEXT_BLOCK         = 2;
+const int RECORD_START_DIFFUSION           = 3;
+const int RECORD_GET_CURRENT_TIMESTEP      = 4;
+const int RECORD_CACHE_CURRENT_TIMESTEP    = 5;
+const int RECORD_READ_BLOCK                = 6;
+const int RECORD_SET_LIBRARY_SIMILARITY    = 7;
+const int RECORD_GET_STAT                  = 8;
+const int RECORD_SET_PERF_COUNTERS_ENABLED = 9;
+const int RECORD_SET_SPARSE_OUTPUT_MODE    = 10;
+const int RECORD_GET_SPARSE_COUNT          = 11;
+const int RECORD_READ_SPARSE_ENTRY         = 12;
+const int RECORD_SET_HISTORY_MEMORY_LIMIT  = 13;
+const int RECORD_GET_HISTORY_FRAME_COUNT   = 14;
+const int RECORD_CACHE_HISTORY_FRAME       = 15;
+const int RECORD_REGISTER_TICK_BUFFERS     = 16;
+const int RECORD_TICK                      = 17;
+const int RECORD_SET_SCHEDULER_POLICY      = 18;
+const int RECORD_SET_SHADOW_MODE           = 19;
+const int RECORD_GET_LAST_ERROR            = 20;
+const int RECORD_GET_TRACE_PHASE           = 21;
+const int RECORD_GET_TRACE_PERCENTILE      = 22;
+const int RECORD_START_METRICS_SERVER      = 23;
+const int RECORD_SET_WATCHDOG_TIMEOUT      = 24;
+const int RECORD_GET_WATCHDOG_WINDOW       = 25;
+const int RECORD_SET_SETTLE_MODE           = 26;
+const int RECORD_SUBMIT_ASYNC_BATCH        = 27;
+const int RECORD_WAIT_ASYNC_JOB            = 28;
+const int RECORD_TAKE_ASYNC_JOB            = 29;
+const int RECORD_EXPORT_SCHEMATIC          = 30;
+const int RECORD_CALL_COUNT                = 31;
+
+/* Not a call: job_id, seed of a submitted job */
+const int RECORD_SEED                      = 100;
+
+const int RECORD_MAX_ARGS = 8;
+
+/* Set in the argument count byte of a record that carries bytes */
+const int RECORD_HAS_BLOB = 0x80;
+
+extern std::atomic<bool> recorder_enabled;
+
+/**
+ * @brief Start recording to path, replacing the file.
+ * @return 0 on success, INFER_ERROR_INVALID_ARG if the file can't be created.
+ */
+int recorder_start(const char* path);
+
+/**
+ * @brief Flush and close the recording.
+ */
+void recorder_stop();
+
+void recorder_write(int call, std::initializer_list<int32_t> args, const void* blob, int32_t blob_bytes);
+
+inline int32_t float_bits(float value) {
+    int32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+/**
+ * @brief Record a call if recording is on. Costs one atomic load otherwise.
+ */
+inline void record_call(int call, std::initializer_list<int32_t> args,
+                        const void* blob = NULL, int32_t blob_bytes = 0) {
+
+    if (recorder_enabled.load(std::memory_order_relaxed)) {
+        recorder_write(call, args, blob, blob_bytes);
+    }
+}
+
+/*
+ * Reading, used by replay_main.cpp.
+ */
+
+struct RecordedCall {
+    int call;
+    int64_t time_ns;           /* Since the start of the recording */
+    int arg_count;
+    int32_t args[RECORD_MAX_ARGS];
+    std::vector<uint8_t> blob;
+};
+
+/**
+ * @return true if file starts with a recording header of a known version.
+ */
+bool recording_read_header(FILE* file, RecordingHeader* header);
+
+/**
+ * @brief Read the next record. time_ns accumulates, so pass the previous record's.
+ * @param version Of the recording, from its header.
+ * @return false at the end of the file or on a truncated record.
+ */
+bool recording_read(FILE* file, uint16_t version, RecordedCall* call);
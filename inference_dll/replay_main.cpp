@@ -0,0 +1,490 @@
+/**
+ * @file replay_main.cpp
+ * @brief Replays a recording of entry point calls (see recorder.h) against this
+ *        build of the DLL, with the recorded arguments, tick() command bytes and job
+ *        seeds, and reports how long each call took. A slow tick seen on a
+ *        production server can be recorded there and reproduced here under a
+ *        profiler, or replayed against a changed build to compare timings.
+ *
+ *        Only the calls are recorded, not what they returned, so a replay drives
+ *        the same inputs but the denoise thread may be at a different timestep
+ *        when a call arrives. At original timing that difference is small.
+ *
+ *        Build like loadgen_main.cpp: compile this file together with every other
+ *        .cpp file except the *_main.cpp tools, with INFERENCE_NO_TEST_MAIN defined.
+ *        Define INFERENCE_MOCK_BACKEND and leave out backend_tensorrt.cpp to replay
+ *        without a GPU.
+ *
+ *  Usage: replay <recording> [options]
+ *
+ *    --fast                Make each call as soon as the previous one returns,
+ *                          instead of at its recorded time.
+ *    --step-us N           Mock backend time per model step (default 200).
+ *    --slowest N           Slowest calls to list (default 10).
+ *    --json PATH           Write the results as JSON.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "inference.h"
+#include "backend.h"
+#include "job_queue.h"
+#include "tick_buffer.h"
+#include "async_jobs.h"
+#include "recorder.h"
+
+struct ReplayConfig {
+    const char* path = NULL;
+    bool fast = false;
+    int64_t step_us = 200;
+    int slowest = 10;
+    const char* json_path = NULL;
+};
+
+struct TimedCall {
+    int call;
+    int64_t time_ns;    /* Recorded time since the start of the recording */
+    int64_t took_ns;    /* Time of the replayed call */
+};
+
+static const char* call_names[RECORD_CALL_COUNT] = {
+    "",
+    "init",
+    "setContextBlock",
+    "startDiffusion",
+    "getCurrentTimestep",
+    "cacheCurrentTimestepForReading",
+    "readBlockFromCachedTimestep",
+    "setLibrarySimilarityThreshold",
+    "getStat",
+    "setPerfCountersEnabled",
+    "setSparseOutputMode",
+    "getSparseCount",
+    "readSparseEntry",
+    "setHistoryMemoryLimit",
+    "getHistoryFrameCount",
+    "cacheHistoryFrameForReading",
+    "registerTickBuffers",
+    "tick",
+    "setSchedulerPolicy",
+    "setShadowMode",
+    "getLastError",
+    "getTracePhase",
+    "getTracePercentile",
+    "startMetricsServer",
+    "setWatchdogTimeout",
+    "getWatchdogWindow",
+    "setSettleMode",
+    "submitAsyncBatch",
+    "waitAsyncJob",
+    "takeAsyncJob",
+    "exportSchematic",
+};
+
+static uint8_t* command_buffer;
+static uint8_t* event_buffer;
+static int64_t command_capacity;
+
+/* What replay_call() did with a record */
+const int REPLAY_MADE     = 0;
+const int REPLAY_UNKNOWN  = 1;  /* Not a call this build knows */
+const int REPLAY_BAD_BLOB = 2;  /* The recorded bytes don't fit the arguments */
+
+static float bits_float(int32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Make one recorded call.
+ * @return A REPLAY_ constant. Only REPLAY_MADE makes the call.
+ */
+static int replay_call(const RecordedCall& record) {
+
+    /* Missing arguments read as 0 */
+    int32_t a[RECORD_MAX_ARGS] = {};
+    memcpy(a, record.args, record.arg_count * sizeof(int32_t));
+
+    switch (record.call) {
+    case RECORD_INIT:
+        Java_tbarnes_diffusionmod_Inference_init(NULL, NULL);
+        break;
+    case RECORD_SET_CONTEXT_BLOCK:
+        Java_tbarnes_diffusionmod_Inference_setContextBlock(NULL, NULL, a[0], a[1], a[2], a[3]);
+        break;
+    case RECORD_START_DIFFUSION:
+        Java_tbarnes_diffusionmod_Inference_startDiffusion(NULL, NULL);
+        break;
+    case RECORD_GET_CURRENT_TIMESTEP:
+        Java_tbarnes_diffusionmod_Inference_getCurrentTimestep(NULL, NULL);
+        break;
+    case RECORD_CACHE_CURRENT_TIMESTEP:
+        Java_tbarnes_diffusionmod_Inference_cacheCurrentTimestepForReading(NULL, NULL);
+        break;
+    case RECORD_READ_BLOCK:
+        Java_tbarnes_diffusionmod_Inference_readBlockFromCachedTimestep(NULL, NULL, a[0], a[1], a[2]);
+        break;
+    case RECORD_SET_LIBRARY_SIMILARITY:
+        Java_tbarnes_diffusionmod_Inference_setLibrarySimilarityThreshold(NULL, NULL, bits_float(a[0]));
+        break;
+    case RECORD_GET_STAT:
+        Java_tbarnes_diffusionmod_Inference_getStat(NULL, NULL, a[0]);
+        break;
+    case RECORD_SET_PERF_COUNTERS_ENABLED:
+        Java_tbarnes_diffusionmod_Inference_setPerfCountersEnabled(NULL, NULL, a[0]);
+        break;
+    case RECORD_SET_SPARSE_OUTPUT_MODE:
+        Java_tbarnes_diffusionmod_Inference_setSparseOutputMode(NULL, NULL, a[0]);
+        break;
+    case RECORD_GET_SPARSE_COUNT:
+        Java_tbarnes_diffusionmod_Inference_getSparseCount(NULL, NULL);
+        break;
+    case RECORD_READ_SPARSE_ENTRY:
+        Java_tbarnes_diffusionmod_Inference_readSparseEntry(NULL, NULL, a[0]);
+        break;
+    case RECORD_SET_HISTORY_MEMORY_LIMIT:
+        Java_tbarnes_diffusionmod_Inference_setHistoryMemoryLimit(NULL, NULL, a[0]);
+        break;
+    case RECORD_GET_HISTORY_FRAME_COUNT:
+        /* Recordings from before per job histories have no job id, which reads as
+         * LEGACY_JOB_ID */
+        Java_tbarnes_diffusionmod_Inference_getHistoryFrameCount(NULL, NULL, a[0]);
+        break;
+    case RECORD_CACHE_HISTORY_FRAME:
+        if (record.arg_count >= 2) {
+            Java_tbarnes_diffusionmod_Inference_cacheHistoryFrameForReading(NULL, NULL, a[0], a[1]);
+        } else {
+            Java_tbarnes_diffusionmod_Inference_cacheHistoryFrameForReading(NULL, NULL, LEGACY_JOB_ID, a[0]);
+        }
+        break;
+    case RECORD_REGISTER_TICK_BUFFERS:
+        /* The mod's direct buffers, allocated here at the recorded sizes */
+        free(command_buffer);
+        free(event_buffer);
+        command_capacity = std::max(a[0], 0);
+        command_buffer = (uint8_t*)malloc((size_t)std::max(a[0], 4));
+        event_buffer = (uint8_t*)malloc((size_t)std::max(a[1], 4));
+        tick_register_buffers(command_buffer, a[0], event_buffer, a[1]);
+        break;
+    case RECORD_TICK:
+        if (command_buffer && (int64_t)record.blob.size() > command_capacity) {
+            return REPLAY_BAD_BLOB;
+        }
+        if (command_buffer) {
+            memcpy(command_buffer, record.blob.data(), record.blob.size());
+        }
+        Java_tbarnes_diffusionmod_Inference_tick(NULL, NULL, a[0]);
+        break;
+    case RECORD_SET_SCHEDULER_POLICY:
+        Java_tbarnes_diffusionmod_Inference_setSchedulerPolicy(NULL, NULL, a[0], a[1]);
+        break;
+    case RECORD_SET_SHADOW_MODE:
+        Java_tbarnes_diffusionmod_Inference_setShadowMode(NULL, NULL, a[0], a[1], a[2]);
+        break;
+    case RECORD_GET_LAST_ERROR:
+        Java_tbarnes_diffusionmod_Inference_getLastError(NULL, NULL);
+        break;
+    case RECORD_GET_TRACE_PHASE:
+        Java_tbarnes_diffusionmod_Inference_getTracePhase(NULL, NULL, a[0], a[1]);
+        break;
+    case RECORD_GET_TRACE_PERCENTILE:
+        Java_tbarnes_diffusionmod_Inference_getTracePercentile(NULL, NULL, a[0], a[1]);
+        break;
+    case RECORD_START_METRICS_SERVER:
+        Java_tbarnes_diffusionmod_Inference_startMetricsServer(NULL, NULL, a[0]);
+        break;
+    case RECORD_SET_WATCHDOG_TIMEOUT:
+        Java_tbarnes_diffusionmod_Inference_setWatchdogTimeout(NULL, NULL, a[0]);
+        break;
+    case RECORD_GET_WATCHDOG_WINDOW:
+        Java_tbarnes_diffusionmod_Inference_getWatchdogWindow(NULL, NULL, a[0], a[1]);
+        break;
+    case RECORD_SET_SETTLE_MODE:
+        Java_tbarnes_diffusionmod_Inference_setSettleMode(NULL, NULL, a[0]);
+        break;
+    case RECORD_SUBMIT_ASYNC_BATCH: {
+        if (a[0] < 0 || (int64_t)record.blob.size() != (int64_t)a[0] * PACKED_CONTEXT_RECORD_SIZE) {
+            return REPLAY_BAD_BLOB;
+        }
+        std::vector<int32_t> job_ids(a[0]);
+        async_submit_batch(record.blob.data(), a[0], job_ids.data());
+        break;
+    }
+    case RECORD_WAIT_ASYNC_JOB:
+        Java_tbarnes_diffusionmod_Inference_waitAsyncJob(NULL, NULL, a[0]);
+        break;
+    case RECORD_TAKE_ASYNC_JOB: {
+        static uint16_t states[PACKED_CHUNK_RECORD_SIZE];
+        async_take_job(a[0], states);
+        break;
+    }
+    case RECORD_EXPORT_SCHEMATIC:
+        /* The sections aren't recorded, and a replay shouldn't write the mod's files */
+        break;
+    default:
+        return REPLAY_UNKNOWN;
+    }
+
+    return REPLAY_MADE;
+}
+
+/**
+ * @brief Replay every call in the recording.
+ * @return 0 on success, error code on failure.
+ */
+static int run_replay(const ReplayConfig& config, std::vector<TimedCall>& calls, int64_t* unknown,
+                      int64_t* bad_blobs, double* wall_seconds) {
+
+    FILE* file = fopen(config.path, "rb");
+    RecordingHeader header;
+
+    if (!file) {
+        printf("Can't open %s\n", config.path);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    if (!recording_read_header(file, &header)) {
+        printf("%s isn't a recording this build can read\n", config.path);
+        fclose(file);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    RecordedCall record = {};
+    RecordedCall next = {};
+    bool have_next = recording_read(file, header.version, &next);
+
+    auto start = std::chrono::steady_clock::now();
+
+    while (have_next) {
+
+        record = next;
+
+        /* Seeds are written after the call that drew them and have to be in place
+         * before that call is made */
+        for (;;) {
+            have_next = recording_read(file, header.version, &next);
+
+            if (!have_next || next.call != RECORD_SEED) {
+                break;
+            }
+
+            job_override_seed(next.args[0], (uint32_t)next.args[1]);
+        }
+
+        if (record.call == RECORD_SEED) {
+            continue;
+        }
+
+        if (!config.fast) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.time_ns));
+        }
+
+        auto call_start = std::chrono::steady_clock::now();
+
+        int replayed = replay_call(record);
+
+        if (replayed == REPLAY_UNKNOWN) {
+            (*unknown)++;
+            continue;
+        }
+
+        if (replayed == REPLAY_BAD_BLOB) {
+            printf("Skipped %s at %.3f s: %zu recorded bytes don't match its arguments\n",
+                   call_names[record.call], record.time_ns / 1e9, record.blob.size());
+            (*bad_blobs)++;
+            continue;
+        }
+
+        int64_t took_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - call_start).count();
+
+        calls.push_back({ record.call, record.time_ns, took_ns });
+    }
+
+    *wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    fclose(file);
+
+    return 0;
+}
+
+struct CallSummary {
+    int64_t count;
+    double mean_us, p50_us, p99_us, max_us;
+};
+
+static double percentile(const std::vector<int64_t>& sorted_values, double fraction) {
+
+    if (sorted_values.empty()) {
+        return 0;
+    }
+
+    size_t i = (size_t)(fraction * (sorted_values.size() - 1) + 0.5);
+    return (double)sorted_values[i];
+}
+
+static void summarize(const std::vector<TimedCall>& calls, CallSummary* summaries) {
+
+    for (int call = 0; call < RECORD_CALL_COUNT; call++) {
+
+        std::vector<int64_t> took;
+        int64_t total = 0;
+
+        for (const TimedCall& timed : calls) {
+            if (timed.call == call) {
+                took.push_back(timed.took_ns);
+                total += timed.took_ns;
+            }
+        }
+
+        std::sort(took.begin(), took.end());
+
+        CallSummary& summary = summaries[call];
+
+        summary.count = (int64_t)took.size();
+        summary.mean_us = took.empty() ? 0 : total / 1000.0 / took.size();
+        summary.p50_us = percentile(took, 0.5) / 1000.0;
+        summary.p99_us = percentile(took, 0.99) / 1000.0;
+        summary.max_us = took.empty() ? 0 : took.back() / 1000.0;
+    }
+}
+
+static void print_usage() {
+    printf("Usage: replay <recording> [--fast] [--step-us N] [--slowest N] [--json PATH]\n");
+}
+
+int main(int argc, char** argv) {
+
+    ReplayConfig config;
+
+    for (int i = 1; i < argc; i++) {
+
+        bool has_value = i + 1 < argc;
+
+        if (!strcmp(argv[i], "--fast")) {
+            config.fast = true;
+        } else if (!strcmp(argv[i], "--step-us") && has_value) {
+            config.step_us = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--slowest") && has_value) {
+            config.slowest = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--json") && has_value) {
+            config.json_path = argv[++i];
+        } else if (argv[i][0] != '-' && !config.path) {
+            config.path = argv[i];
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (!config.path || config.slowest < 0) {
+        print_usage();
+        return 1;
+    }
+
+    mock_backend_set_step_time(config.step_us * 1000);
+
+    std::vector<TimedCall> calls;
+    int64_t unknown = 0;
+    int64_t bad_blobs = 0;
+    double wall_seconds = 0;
+
+    int result = run_replay(config, calls, &unknown, &bad_blobs, &wall_seconds);
+
+    if (result != 0) {
+        return 1;
+    }
+
+    CallSummary summaries[RECORD_CALL_COUNT];
+    summarize(calls, summaries);
+
+    printf("Replayed %zu calls in %.2f s%s\n", calls.size(), wall_seconds, config.fast ? " (fast)" : "");
+
+    if (unknown > 0) {
+        printf("Skipped %lld records of unknown calls\n", (long long)unknown);
+    }
+
+    if (bad_blobs > 0) {
+        printf("Skipped %lld calls whose recorded bytes don't match their arguments\n", (long long)bad_blobs);
+    }
+
+    printf("%-32s %9s %10s %10s %10s %10s\n", "call", "count", "mean us", "p50 us", "p99 us", "max us");
+
+    for (int call = 1; call < RECORD_CALL_COUNT; call++) {
+
+        const CallSummary& summary = summaries[call];
+
+        if (summary.count > 0) {
+            printf("%-32s %9lld %10.2f %10.2f %10.2f %10.2f\n", call_names[call], (long long)summary.count,
+                   summary.mean_us, summary.p50_us, summary.p99_us, summary.max_us);
+        }
+    }
+
+    std::vector<TimedCall> slowest = calls;
+    size_t slowest_count = std::min(slowest.size(), (size_t)config.slowest);
+
+    std::partial_sort(slowest.begin(), slowest.begin() + slowest_count, slowest.end(),
+        [](const TimedCall& a, const TimedCall& b) { return a.took_ns > b.took_ns; });
+    slowest.resize(slowest_count);
+
+    if (!slowest.empty()) {
+        printf("Slowest calls:\n");
+
+        for (const TimedCall& timed : slowest) {
+            printf("  %10.3f s  %-32s %10.2f us\n", timed.time_ns / 1e9, call_names[timed.call], timed.took_ns / 1000.0);
+        }
+    }
+
+    if (config.json_path) {
+
+        FILE* json = fopen(config.json_path, "w");
+
+        if (!json) {
+            printf("Can't write %s\n", config.json_path);
+            return 1;
+        }
+
+        fprintf(json, "{\n  \"recording\": \"%s\",\n  \"fast\": %s,\n  \"wall_seconds\": %.3f,\n  \"calls\": {",
+                config.path, config.fast ? "true" : "false", wall_seconds);
+
+        bool first = true;
+
+        for (int call = 1; call < RECORD_CALL_COUNT; call++) {
+
+            const CallSummary& summary = summaries[call];
+
+            if (summary.count == 0) {
+                continue;
+            }
+
+            fprintf(json, "%s\n    \"%s\": { \"count\": %lld, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+                          "\"p99_us\": %.3f, \"max_us\": %.3f }",
+                    first ? "" : ",", call_names[call], (long long)summary.count,
+                    summary.mean_us, summary.p50_us, summary.p99_us, summary.max_us);
+            first = false;
+        }
+
+        fprintf(json, "\n  },\n  \"slowest\": [");
+
+        for (size_t i = 0; i < slowest.size(); i++) {
+            fprintf(json, "%s\n    { \"time_s\": %.6f, \"call\": \"%s\", \"took_us\": %.3f }",
+                    i ? "," : "", slowest[i].time_ns / 1e9, call_names[slowest[i].call], slowest[i].took_ns / 1000.0);
+        }
+
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+
+    /* The denoise thread is still waiting for jobs and can't be joined */
+    fflush(stdout);
+    _Exit(0);
+}
@@ -0,0 +1,459 @@
+/**
+ * @file schedsim_main.cpp
+ * @brief Discrete event simulator for the job scheduler. Replays a trace of job
+ *        arrivals against the job table in job_queue.cpp on a virtual clock, with
+ *        a cost model standing in for the backend, and reports queue latency
+ *        percentiles and device utilization for every policy given.
+ *
+ *        The simulator takes the place of the denoise thread and makes the same
+ *        job_queue.h calls it makes: job_try_next(), job_publish() after every
+ *        timestep, job_yield() and job_finish(). Every scheduling decision is
+ *        therefore made by the code the DLL runs. Only time is simulated: each
+ *        timestep advances the clock by n_U model steps and switching to a job
+ *        costs one context upload. Latents aren't copied and nothing is decoded,
+ *        so thousands of jobs replay in seconds.
+ *
+ *        Arrivals wait outside the table while it's full, as the mod's submits do
+ *        when tick() rejects them, and are admitted at timestep boundaries.
+ *
+ *        Build by compiling this file together with every other .cpp file except
+ *        the *_main.cpp tools and backend_tensorrt.cpp, with INFERENCE_NO_TEST_MAIN
+ *        and INFERENCE_MOCK_BACKEND defined. No model is run.
+ *
+ *  Usage: schedsim [options]
+ *
+ *    --trace PATH      Arrival times in seconds, one per line, in any order.
+ *    --jobs N          Without --trace, generate N Poisson arrivals (default 1000).
+ *    --rate R          Mean arrivals per second of the generated trace (default 0.3).
+ *    --seed N          Seed of the generated trace and the step jitter (default 1).
+ *    --step-us N       Cost of one model step (default 500).
+ *    --step-jitter F   Each step costs up to F times more or less (default 0).
+ *    --switch-us N     Cost of uploading a job's context when it starts or
+ *                      resumes (default 200).
+ *    --policy LIST     Comma separated policies: fifo, or rr:QUANTUM for round robin
+ *                      every QUANTUM timesteps (default fifo,rr:100).
+ *    --json PATH       Write the results as JSON.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "job_queue.h"
+#include "stats.h"
+
+struct SimConfig {
+    int64_t step_ns = 500 * 1000;
+    double step_jitter = 0;
+    int64_t switch_ns = 200 * 1000;
+    uint32_t seed = 1;
+};
+
+struct SimPolicy {
+    int policy;
+    int32_t quantum;
+    char name[32];
+};
+
+struct SimJob {
+    int64_t arrival_ns;
+    int64_t start_ns = -1;          /* First time the job was picked */
+    int64_t first_snapshot_ns = -1; /* First published timestep */
+    int64_t finish_ns = -1;
+};
+
+struct Distribution {
+    double p50, p90, p99, max, mean;
+};
+
+struct SimResult {
+    SimPolicy policy;
+    Distribution queue_s;           /* Arrival to first start */
+    Distribution first_snapshot_s;  /* Arrival to first published timestep */
+    Distribution completion_s;      /* Arrival to final timestep */
+    double utilization;             /* Device busy time over the span of the trace */
+    double switch_share;            /* Part of the busy time spent on context uploads */
+    double makespan_s;
+    int64_t preemptions;
+    int64_t max_backlog;            /* Arrivals waiting for a free slot in the table */
+    double wall_s;
+};
+
+static int64_t virtual_now_ns;
+
+static int64_t virtual_clock() {
+    return virtual_now_ns;
+}
+
+static Distribution distribution(std::vector<double> values) {
+
+    Distribution d = {};
+
+    if (values.empty()) {
+        return d;
+    }
+
+    std::sort(values.begin(), values.end());
+
+    double total = 0;
+
+    for (double value : values) {
+        total += value;
+    }
+
+    size_t last = values.size() - 1;
+
+    d.p50 = values[(size_t)(0.50 * last + 0.5)];
+    d.p90 = values[(size_t)(0.90 * last + 0.5)];
+    d.p99 = values[(size_t)(0.99 * last + 0.5)];
+    d.max = values[last];
+    d.mean = total / values.size();
+
+    return d;
+}
+
+/**
+ * @brief Run the whole trace under one policy.
+ */
+static int simulate(const SimConfig& config, const SimPolicy& policy,
+                    const std::vector<int64_t>& arrivals, SimResult& result) {
+
+    auto wall_start = std::chrono::steady_clock::now();
+
+    int error = job_set_policy(policy.policy, policy.quantum);
+
+    if (error != 0) {
+        return error;
+    }
+
+    std::vector<SimJob> jobs(arrivals.size());
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i].arrival_ns = arrivals[i];
+    }
+
+    std::deque<size_t> backlog;
+    std::mt19937 rng(config.seed);
+    std::uniform_real_distribution<double> jitter(-config.step_jitter, config.step_jitter);
+
+    /* Every job has the same all air context, only time matters here */
+    static uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+
+    int64_t preempted_before = stat_get(STAT_JOBS_PREEMPTED);
+    int64_t busy_ns = 0;
+    int64_t switch_ns = 0;
+    size_t next_arrival = 0;
+    size_t finished = 0;
+
+    result = SimResult();
+    result.policy = policy;
+    virtual_now_ns = arrivals.empty() ? 0 : arrivals[0];
+
+    auto admit = [&]() {
+
+        while (next_arrival < arrivals.size() && arrivals[next_arrival] <= virtual_now_ns) {
+            backlog.push_back(next_arrival++);
+        }
+
+        result.max_backlog = std::max<int64_t>(result.max_backlog, backlog.size());
+
+        /* Job ids are the trace index plus one, 0 belongs to the legacy job */
+        while (!backlog.empty() && job_submit((int32_t)backlog.front() + 1, context) == 0) {
+            backlog.pop_front();
+        }
+    };
+
+    while (finished < jobs.size()) {
+
+        admit();
+
+        uint8_t job_context[PACKED_CONTEXT_RECORD_SIZE];
+        int32_t first_t;
+        uint32_t seed;
+        int slot = job_try_next(job_context, NULL, &first_t, &seed);
+
+        if (slot < 0) {
+            /* Idle until the next arrival. Nothing is queued, so nothing is waiting
+             * in the backlog either and there is a next arrival. */
+            virtual_now_ns = std::max(virtual_now_ns, arrivals[next_arrival]);
+            continue;
+        }
+
+        SimJob& job = jobs[job_slot_id(slot) - 1];
+
+        if (job.start_ns < 0) {
+            job.start_ns = virtual_now_ns;
+        }
+
+        virtual_now_ns += config.switch_ns;
+        busy_ns += config.switch_ns;
+        switch_ns += config.switch_ns;
+
+        for (int32_t t = first_t; t >= 0; t--) {
+
+            int64_t step_ns = config.step_ns * n_U;
+
+            if (config.step_jitter > 0) {
+                step_ns = (int64_t)(step_ns * (1.0 + jitter(rng)));
+            }
+
+            virtual_now_ns += step_ns;
+            busy_ns += step_ns;
+
+            job_publish(slot, t, NULL);
+
+            if (job.first_snapshot_ns < 0) {
+                job.first_snapshot_ns = virtual_now_ns;
+            }
+
+            if (t == 0) {
+                job_finish(slot, JOB_STATE_DONE, 0);
+                job_release(job_slot_id(slot));
+                job.finish_ns = virtual_now_ns;
+                finished++;
+                break;
+            }
+
+            /* Jobs that arrived during the step are visible to the policy */
+            admit();
+
+            if (job_yield(slot, first_t - t + 1)) {
+                break;
+            }
+        }
+    }
+
+    std::vector<double> queue_s, first_snapshot_s, completion_s;
+
+    for (const SimJob& job : jobs) {
+        queue_s.push_back((job.start_ns - job.arrival_ns) * 1e-9);
+        first_snapshot_s.push_back((job.first_snapshot_ns - job.arrival_ns) * 1e-9);
+        completion_s.push_back((job.finish_ns - job.arrival_ns) * 1e-9);
+    }
+
+    int64_t span_ns = jobs.empty() ? 0 : virtual_now_ns - arrivals[0];
+
+    result.queue_s = distribution(queue_s);
+    result.first_snapshot_s = distribution(first_snapshot_s);
+    result.completion_s = distribution(completion_s);
+    result.utilization = (span_ns > 0) ? (double)busy_ns / span_ns : 0;
+    result.switch_share = (busy_ns > 0) ? (double)switch_ns / busy_ns : 0;
+    result.makespan_s = span_ns * 1e-9;
+    result.preemptions = stat_get(STAT_JOBS_PREEMPTED) - preempted_before;
+    result.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+    return 0;
+}
+
+static bool parse_policies(const char* list, std::vector<SimPolicy>& policies) {
+
+    const char* p = list;
+
+    while (*p) {
+
+        SimPolicy policy = {};
+        const char* end = strchr(p, ',');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+
+        if (length == 4 && strncmp(p, "fifo", 4) == 0) {
+            policy.policy = JOB_POLICY_FIFO;
+            policy.quantum = n_T;
+            snprintf(policy.name, sizeof(policy.name), "fifo");
+        } else if (length > 3 && strncmp(p, "rr:", 3) == 0) {
+            policy.policy = JOB_POLICY_ROUND_ROBIN;
+            policy.quantum = atoi(p + 3);
+            snprintf(policy.name, sizeof(policy.name), "rr:%d", policy.quantum);
+
+            if (policy.quantum < 1) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+
+        policies.push_back(policy);
+        p += length + (end ? 1 : 0);
+    }
+
+    return !policies.empty();
+}
+
+static bool read_trace(const char* path, std::vector<int64_t>& arrivals) {
+
+    FILE* file = fopen(path, "r");
+
+    if (!file) {
+        return false;
+    }
+
+    char line[256];
+
+    while (fgets(line, sizeof(line), file)) {
+
+        char* end;
+        double seconds = strtod(line, &end);
+
+        if (end != line) {
+            arrivals.push_back((int64_t)(seconds * 1e9));
+        }
+    }
+
+    fclose(file);
+    std::sort(arrivals.begin(), arrivals.end());
+
+    return true;
+}
+
+static void generate_trace(int64_t count, double rate, uint32_t seed, std::vector<int64_t>& arrivals) {
+
+    std::mt19937 rng(seed);
+    std::exponential_distribution<double> gap(rate);
+    double seconds = 0;
+
+    for (int64_t i = 0; i < count; i++) {
+        arrivals.push_back((int64_t)(seconds * 1e9));
+        seconds += gap(rng);
+    }
+}
+
+static void write_distribution(FILE* file, const char* name, const Distribution& d, bool last) {
+    fprintf(file, "      \"%s\": { \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f, \"mean\": %.4f }%s\n",
+        name, d.p50, d.p90, d.p99, d.max, d.mean, last ? "" : ",");
+}
+
+static bool write_json(const char* path, const SimConfig& config, size_t job_count,
+                       const std::vector<SimResult>& results) {
+
+    FILE* file = fopen(path, "w");
+
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "{\n  \"config\": { \"jobs\": %zu, \"step_us\": %.1f, \"step_jitter\": %.3f, \"switch_us\": %.1f },\n",
+        job_count, config.step_ns * 1e-3, config.step_jitter, config.switch_ns * 1e-3);
+    fprintf(file, "  \"policies\": [\n");
+
+    for (size_t i = 0; i < results.size(); i++) {
+
+        const SimResult& r = results[i];
+
+        fprintf(file, "    {\n      \"policy\": \"%s\",\n", r.policy.name);
+        write_distribution(file, "queue_s", r.queue_s, false);
+        write_distribution(file, "first_snapshot_s", r.first_snapshot_s, false);
+        write_distribution(file, "completion_s", r.completion_s, false);
+        fprintf(file, "      \"utilization\": %.4f,\n      \"switch_share\": %.4f,\n      \"makespan_s\": %.3f,\n"
+            "      \"preemptions\": %lld,\n      \"max_backlog\": %lld,\n      \"wall_s\": %.3f\n    }%s\n",
+            r.utilization, r.switch_share, r.makespan_s, (long long)r.preemptions, (long long)r.max_backlog,
+            r.wall_s, (i + 1 < results.size()) ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+
+    return fclose(file) == 0;
+}
+
+static void print_usage() {
+    printf("Usage: schedsim [--trace PATH | --jobs N --rate R] [--seed N] [--step-us N] [--step-jitter F] [--switch-us N] [--policy LIST] [--json PATH]\n");
+}
+
+int main(int argc, char** argv) {
+
+    SimConfig config;
+    const char* trace_path = NULL;
+    const char* policy_list = "fifo,rr:100";
+    const char* json_path = NULL;
+    int64_t job_count = 1000;
+    double rate = 0.3;
+
+    for (int i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            job_count = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            config.seed = (uint32_t)atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--step-us") == 0 && i + 1 < argc) {
+            config.step_ns = (int64_t)(atof(argv[++i]) * 1000);
+        } else if (strcmp(argv[i], "--step-jitter") == 0 && i + 1 < argc) {
+            config.step_jitter = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--switch-us") == 0 && i + 1 < argc) {
+            config.switch_ns = (int64_t)(atof(argv[++i]) * 1000);
+        } else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+            policy_list = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            print_usage();
+            return INFER_ERROR_INVALID_ARG;
+        }
+    }
+
+    std::vector<SimPolicy> policies;
+
+    if (!parse_policies(policy_list, policies) || job_count < 1 || !(rate > 0) ||
+        config.step_ns < 0 || config.switch_ns < 0 || config.step_jitter < 0 || config.step_jitter >= 1) {
+        print_usage();
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    std::vector<int64_t> arrivals;
+
+    if (trace_path) {
+        if (!read_trace(trace_path, arrivals) || arrivals.empty()) {
+            printf("Failed to read a trace from %s\n", trace_path);
+            return INFER_ERROR_INVALID_ARG;
+        }
+    } else {
+        generate_trace(job_count, rate, config.seed, arrivals);
+    }
+
+    /* No pregenerated answers and no coalescing of the shared context, every job
+     * should reach the scheduler */
+    job_set_library_similarity(2.0f);
+    job_set_coalescing(false);
+    job_set_clock(virtual_clock);
+
+    std::vector<SimResult> results;
+
+    printf("%zu jobs over %.1f s, %.0f us per model step, %.0f us per context upload\n",
+        arrivals.size(), (arrivals.back() - arrivals.front()) * 1e-9, config.step_ns * 1e-3, config.switch_ns * 1e-3);
+    printf("%-10s %10s %10s %10s %10s %10s %10s %8s %8s %8s\n", "policy", "queue p50", "queue p99", "queue max",
+        "first p50", "done p50", "done p99", "util", "preempt", "wall s");
+
+    for (const SimPolicy& policy : policies) {
+
+        SimResult result;
+        int error = simulate(config, policy, arrivals, result);
+
+        if (error != 0) {
+            return error;
+        }
+
+        printf("%-10s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %8.3f %8lld %8.2f\n", policy.name,
+            result.queue_s.p50, result.queue_s.p99, result.queue_s.max, result.first_snapshot_s.p50,
+            result.completion_s.p50, result.completion_s.p99, result.utilization,
+            (long long)result.preemptions, result.wall_s);
+
+        results.push_back(result);
+    }
+
+    if (json_path && !write_json(json_path, config, arrivals.size(), results)) {
+        printf("Failed to write %s\n", json_path);
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    return 0;
+}
@@ -0,0 +1,649 @@
+/**
+ * @file schematic.cpp
+ * @brief Sponge schematic and structure template export. See schematic.h.
+ *
+ *  Like tick_buffer.cpp this includes "jni.h", to resolve direct ByteBuffers.
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <jni.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "block_states.h"
+#include "recorder.h"
+#include "schematic.h"
+
+const int SECTION_STATES = CHUNK_WIDTH * CHUNK_WIDTH * CHUNK_WIDTH;
+
+/* A single byte varint holds palette indices below this */
+const int SCHEMATIC_MAX_PALETTE = 128;
+
+const int NBT_END        = 0;
+const int NBT_SHORT      = 2;
+const int NBT_INT        = 3;
+const int NBT_BYTE_ARRAY = 7;
+const int NBT_STRING     = 8;
+const int NBT_LIST       = 9;
+const int NBT_COMPOUND   = 10;
+const int NBT_INT_ARRAY  = 11;
+
+/*
+ * gzip writer
+ */
+
+const int DEFLATE_WINDOW    = 32768;
+const int DEFLATE_MIN_MATCH = 3;
+const int DEFLATE_MAX_MATCH = 258;
+const int DEFLATE_HASH_BITS = 15;
+const int DEFLATE_END_OF_BLOCK = 256;
+
+const size_t GZIP_OUTPUT_FLUSH = 64 * 1024;
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537,
+    2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static uint32_t crc_table[256];
+
+static void crc_init() {
+
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+struct GzipWriter {
+    FILE* file;
+    bool ok;
+    uint32_t crc;
+    uint32_t input_size;            /* Modulo 2^32, as the trailer stores it */
+    uint64_t bits;
+    int bit_count;
+    std::vector<uint8_t> output;
+    std::vector<uint8_t> window;    /* Two windows: the one matches look back into, and input */
+    int fill;
+    int pos;                        /* Everything before has been encoded */
+    std::vector<int32_t> head;      /* Last window position of each 3 byte hash, or -1 */
+};
+
+static void gzip_flush_output(GzipWriter& writer) {
+
+    if (!writer.output.empty() && fwrite(writer.output.data(), writer.output.size(), 1, writer.file) != 1) {
+        writer.ok = false;
+    }
+    writer.output.clear();
+}
+
+static void put_bits(GzipWriter& writer, uint32_t value, int count) {
+
+    writer.bits |= (uint64_t)value << writer.bit_count;
+    writer.bit_count += count;
+
+    while (writer.bit_count >= 8) {
+        writer.output.push_back((uint8_t)writer.bits);
+        writer.bits >>= 8;
+        writer.bit_count -= 8;
+    }
+
+    if (writer.output.size() >= GZIP_OUTPUT_FLUSH) {
+        gzip_flush_output(writer);
+    }
+}
+
+/* Huffman codes go most significant bit first, unlike everything else in deflate */
+static void put_code(GzipWriter& writer, uint32_t code, int length) {
+
+    uint32_t reversed = 0;
+
+    for (int i = 0; i < length; i++) {
+        reversed |= ((code >> i) & 1) << (length - 1 - i);
+    }
+
+    put_bits(writer, reversed, length);
+}
+
+/* The fixed literal/length code of RFC 1951 3.2.6 */
+static void put_symbol(GzipWriter& writer, int symbol) {
+
+    if (symbol < 144) {
+        put_code(writer, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(writer, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(writer, symbol - 256, 7);
+    } else {
+        put_code(writer, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void put_match(GzipWriter& writer, int length, int distance) {
+
+    int code = 28;
+
+    while (length_base[code] > length) {
+        code--;
+    }
+
+    put_symbol(writer, 257 + code);
+    put_bits(writer, length - length_base[code], length_extra[code]);
+
+    code = 29;
+
+    while (distance_base[code] > distance) {
+        code--;
+    }
+
+    put_code(writer, code, 5);
+    put_bits(writer, distance - distance_base[code], distance_extra[code]);
+}
+
+static uint32_t hash3(const uint8_t* data) {
+    return (((uint32_t)data[0] << 10) ^ ((uint32_t)data[1] << 5) ^ data[2]) & ((1u << DEFLATE_HASH_BITS) - 1);
+}
+
+/**
+ * @brief Encode the window up to end with greedy matches against the last
+ *        occurrence of each 3 byte hash.
+ */
+static void deflate_window(GzipWriter& writer, int end) {
+
+    uint8_t* window = writer.window.data();
+
+    while (writer.pos < end) {
+
+        int available = writer.fill - writer.pos;
+        int match_length = 0;
+        int match_distance = 0;
+
+        if (available >= DEFLATE_MIN_MATCH) {
+
+            uint32_t hash = hash3(window + writer.pos);
+            int32_t candidate = writer.head[hash];
+            writer.head[hash] = writer.pos;
+
+            if (candidate >= 0 && writer.pos - candidate <= DEFLATE_WINDOW) {
+
+                int max_length = std::min(available, DEFLATE_MAX_MATCH);
+                int length = 0;
+
+                while (length < max_length && window[candidate + length] == window[writer.pos + length]) {
+                    length++;
+                }
+
+                if (length >= DEFLATE_MIN_MATCH) {
+                    match_length = length;
+                    match_distance = writer.pos - candidate;
+                }
+            }
+        }
+
+        if (match_length == 0) {
+            put_symbol(writer, window[writer.pos]);
+            writer.pos++;
+            continue;
+        }
+
+        put_match(writer, match_length, match_distance);
+
+        for (int i = 1; i < match_length; i++) {
+            int position = writer.pos + i;
+            if (writer.fill - position >= DEFLATE_MIN_MATCH) {
+                writer.head[hash3(window + position)] = position;
+            }
+        }
+
+        writer.pos += match_length;
+    }
+}
+
+static bool gzip_open(GzipWriter& writer, const char* path) {
+
+    static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+
+    if (crc_table[1] == 0) {
+        crc_init();
+    }
+
+    writer.file = fopen(path, "wb");
+    writer.ok = writer.file != NULL;
+    writer.crc = 0xFFFFFFFFu;
+    writer.input_size = 0;
+    writer.bits = 0;
+    writer.bit_count = 0;
+    writer.window.assign(2 * DEFLATE_WINDOW, 0);
+    writer.fill = 0;
+    writer.pos = 0;
+    writer.head.assign(1 << DEFLATE_HASH_BITS, -1);
+
+    if (!writer.ok) {
+        return false;
+    }
+
+    writer.output.assign(header, header + sizeof(header));
+
+    /* One fixed Huffman block holds all the data, an empty final block ends it */
+    put_bits(writer, 0, 1);
+    put_bits(writer, 1, 2);
+
+    return true;
+}
+
+static void gzip_write(GzipWriter& writer, const void* data, size_t size) {
+
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    for (size_t i = 0; i < size; i++) {
+        writer.crc = crc_table[(writer.crc ^ bytes[i]) & 0xFF] ^ (writer.crc >> 8);
+    }
+
+    writer.input_size += (uint32_t)size;
+
+    while (size > 0) {
+
+        if (writer.fill == 2 * DEFLATE_WINDOW) {
+
+            /* Keep a full match of lookahead, then slide the newer window down */
+            deflate_window(writer, writer.fill - DEFLATE_MAX_MATCH);
+
+            memmove(writer.window.data(), writer.window.data() + DEFLATE_WINDOW, DEFLATE_WINDOW);
+            writer.fill -= DEFLATE_WINDOW;
+            writer.pos -= DEFLATE_WINDOW;
+
+            for (int32_t& position : writer.head) {
+                position = (position >= DEFLATE_WINDOW) ? position - DEFLATE_WINDOW : -1;
+            }
+        }
+
+        size_t copy = std::min(size, (size_t)(2 * DEFLATE_WINDOW - writer.fill));
+        memcpy(writer.window.data() + writer.fill, bytes, copy);
+        writer.fill += (int)copy;
+        bytes += copy;
+        size -= copy;
+    }
+}
+
+static bool gzip_close(GzipWriter& writer) {
+
+    if (!writer.file) {
+        return false;
+    }
+
+    deflate_window(writer, writer.fill);
+    put_symbol(writer, DEFLATE_END_OF_BLOCK);
+
+    put_bits(writer, 1, 1);
+    put_bits(writer, 1, 2);
+    put_symbol(writer, DEFLATE_END_OF_BLOCK);
+    put_bits(writer, 0, (8 - writer.bit_count) & 7);
+
+    uint32_t crc = writer.crc ^ 0xFFFFFFFFu;
+
+    for (int i = 0; i < 4; i++) {
+        writer.output.push_back((uint8_t)(crc >> (8 * i)));
+    }
+    for (int i = 0; i < 4; i++) {
+        writer.output.push_back((uint8_t)(writer.input_size >> (8 * i)));
+    }
+
+    gzip_flush_output(writer);
+
+    bool ok = writer.ok;
+    ok = (fclose(writer.file) == 0) && ok;
+    writer.file = NULL;
+
+    return ok;
+}
+
+/*
+ * NBT, written as it streams
+ */
+
+static void nbt_put(GzipWriter& writer, uint64_t value, int bytes) {
+
+    uint8_t big_endian[8];
+
+    for (int i = 0; i < bytes; i++) {
+        big_endian[i] = (uint8_t)(value >> (8 * (bytes - 1 - i)));
+    }
+
+    gzip_write(writer, big_endian, bytes);
+}
+
+static void nbt_string(GzipWriter& writer, const char* value) {
+    size_t length = strlen(value);
+    nbt_put(writer, length, 2);
+    gzip_write(writer, value, length);
+}
+
+static void nbt_tag(GzipWriter& writer, int type, const char* name) {
+    nbt_put(writer, type, 1);
+    nbt_string(writer, name);
+}
+
+static void nbt_int(GzipWriter& writer, const char* name, int32_t value) {
+    nbt_tag(writer, NBT_INT, name);
+    nbt_put(writer, (uint32_t)value, 4);
+}
+
+static void nbt_list(GzipWriter& writer, const char* name, int element_type, int32_t count) {
+    nbt_tag(writer, NBT_LIST, name);
+    nbt_put(writer, element_type, 1);
+    nbt_put(writer, (uint32_t)count, 4);
+}
+
+/*
+ * Palette
+ */
+
+struct SchematicPalette {
+    int16_t index_of_state[1 << SPARSE_STATE_BITS];
+    std::vector<std::string> states;
+    bool overflow;
+};
+
+static void palette_init(SchematicPalette& palette) {
+    std::fill(palette.index_of_state, palette.index_of_state + (1 << SPARSE_STATE_BITS), (int16_t)-1);
+    palette.states.clear();
+    palette.overflow = false;
+}
+
+/**
+ * @brief Palette index of a state index. States that format the same, such as the
+ *        two stone brick ids, share an entry.
+ */
+static int palette_index(SchematicPalette& palette, uint16_t state) {
+
+    state &= (1 << SPARSE_STATE_BITS) - 1;
+
+    if (palette.index_of_state[state] >= 0) {
+        return palette.index_of_state[state];
+    }
+
+    char text[BLOCK_STATE_STRING_MAX];
+    block_state_string(state, text);
+
+    auto found = std::find(palette.states.begin(), palette.states.end(), text);
+    int index = (int)(found - palette.states.begin());
+
+    if (found == palette.states.end()) {
+
+        if (index == SCHEMATIC_MAX_PALETTE) {
+            palette.overflow = true;
+            return 0;
+        }
+
+        palette.states.push_back(text);
+    }
+
+    palette.index_of_state[state] = (int16_t)index;
+    return index;
+}
+
+/*
+ * Formats
+ */
+
+static bool export_sponge(GzipWriter& writer, SchematicPalette& palette, int sections_x, int sections_y, int sections_z,
+                          SchematicSource source, void* user) {
+
+    int width  = sections_x * CHUNK_WIDTH;
+    int height = sections_y * CHUNK_WIDTH;
+    int length = sections_z * CHUNK_WIDTH;
+
+    nbt_tag(writer, NBT_COMPOUND, "Schematic");
+    nbt_int(writer, "Version", 2);
+    nbt_int(writer, "DataVersion", SCHEMATIC_DATA_VERSION);
+
+    nbt_tag(writer, NBT_SHORT, "Width");
+    nbt_put(writer, (uint32_t)width, 2);
+    nbt_tag(writer, NBT_SHORT, "Height");
+    nbt_put(writer, (uint32_t)height, 2);
+    nbt_tag(writer, NBT_SHORT, "Length");
+    nbt_put(writer, (uint32_t)length, 2);
+
+    nbt_tag(writer, NBT_INT_ARRAY, "Offset");
+    nbt_put(writer, 3, 4);
+    nbt_put(writer, 0, 4);
+    nbt_put(writer, 0, 4);
+    nbt_put(writer, 0, 4);
+
+    /* Index (y * length + z) * width + x, one varint byte each */
+    nbt_tag(writer, NBT_BYTE_ARRAY, "BlockData");
+    nbt_put(writer, (uint64_t)width * height * length, 4);
+
+    std::vector<uint16_t> row((size_t)sections_x * SECTION_STATES);
+    std::vector<uint8_t> line(width);
+
+    for (int section_y = 0; section_y < sections_y; section_y++) {
+        for (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int section_z = 0; section_z < sections_z; section_z++) {
+
+                for (int section_x = 0; section_x < sections_x; section_x++) {
+                    if (!source(user, section_x, section_y, section_z, row.data() + (size_t)section_x * SECTION_STATES)) {
+                        return false;
+                    }
+                }
+
+                for (int z = 0; z < CHUNK_WIDTH; z++) {
+
+                    for (int x = 0; x < width; x++) {
+                        uint16_t state = row[(size_t)(x / CHUNK_WIDTH) * SECTION_STATES + packed_index(x % CHUNK_WIDTH, y, z, CHUNK_WIDTH)];
+                        line[x] = (uint8_t)palette_index(palette, state);
+                    }
+
+                    gzip_write(writer, line.data(), line.size());
+                }
+            }
+        }
+
+        if (!writer.ok) {
+            return false;
+        }
+    }
+
+    nbt_int(writer, "PaletteMax", (int32_t)palette.states.size());
+    nbt_tag(writer, NBT_COMPOUND, "Palette");
+
+    for (size_t i = 0; i < palette.states.size(); i++) {
+        nbt_int(writer, palette.states[i].c_str(), (int32_t)i);
+    }
+
+    nbt_put(writer, NBT_END, 1);
+    nbt_list(writer, "BlockEntities", NBT_COMPOUND, 0);
+    nbt_put(writer, NBT_END, 1);
+
+    return true;
+}
+
+static bool export_structure(GzipWriter& writer, SchematicPalette& palette, int sections_x, int sections_y, int sections_z,
+                             SchematicSource source, void* user) {
+
+    nbt_tag(writer, NBT_COMPOUND, "");
+    nbt_int(writer, "DataVersion", SCHEMATIC_DATA_VERSION);
+
+    nbt_list(writer, "size", NBT_INT, 3);
+    nbt_put(writer, (uint32_t)(sections_x * CHUNK_WIDTH), 4);
+    nbt_put(writer, (uint32_t)(sections_y * CHUNK_WIDTH), 4);
+    nbt_put(writer, (uint32_t)(sections_z * CHUNK_WIDTH), 4);
+
+    /* Air is listed too, so placing the template clears the rooms of the structure */
+    nbt_list(writer, "blocks", NBT_COMPOUND, sections_x * sections_y * sections_z * SECTION_STATES);
+
+    std::vector<uint16_t> states(SECTION_STATES);
+
+    for             (int section_x = 0; section_x < sections_x; section_x++) {
+        for         (int section_y = 0; section_y < sections_y; section_y++) {
+            for     (int section_z = 0; section_z < sections_z; section_z++) {
+
+                if (!source(user, section_x, section_y, section_z, states.data())) {
+                    return false;
+                }
+
+                for         (int x = 0; x < CHUNK_WIDTH; x++) {
+                    for     (int y = 0; y < CHUNK_WIDTH; y++) {
+                        for (int z = 0; z < CHUNK_WIDTH; z++) {
+
+                            nbt_list(writer, "pos", NBT_INT, 3);
+                            nbt_put(writer, (uint32_t)(section_x * CHUNK_WIDTH + x), 4);
+                            nbt_put(writer, (uint32_t)(section_y * CHUNK_WIDTH + y), 4);
+                            nbt_put(writer, (uint32_t)(section_z * CHUNK_WIDTH + z), 4);
+                            nbt_int(writer, "state", palette_index(palette, states[packed_index(x, y, z, CHUNK_WIDTH)]));
+                            nbt_put(writer, NBT_END, 1);
+                        }
+                    }
+                }
+
+                if (!writer.ok) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    nbt_list(writer, "palette", NBT_COMPOUND, (int32_t)palette.states.size());
+
+    for (const std::string& state : palette.states) {
+
+        /* "minecraft:name[property=value,...]" */
+        std::string name = state.substr(0, state.find('['));
+        nbt_tag(writer, NBT_STRING, "Name");
+        nbt_string(writer, name.c_str());
+
+        if (name.size() < state.size()) {
+
+            nbt_tag(writer, NBT_COMPOUND, "Properties");
+
+            size_t start = name.size() + 1;
+
+            while (start < state.size()) {
+
+                size_t equals = state.find('=', start);
+                size_t end = state.find_first_of(",]", equals);
+
+                nbt_tag(writer, NBT_STRING, state.substr(start, equals - start).c_str());
+                nbt_string(writer, state.substr(equals + 1, end - equals - 1).c_str());
+
+                start = end + 1;
+            }
+
+            nbt_put(writer, NBT_END, 1);
+        }
+
+        nbt_put(writer, NBT_END, 1);
+    }
+
+    nbt_list(writer, "entities", NBT_COMPOUND, 0);
+    nbt_put(writer, NBT_END, 1);
+
+    return true;
+}
+
+int schematic_export(const char* path, int format, int sections_x, int sections_y, int sections_z,
+                     SchematicSource source, void* user) {
+
+    if (sections_x < 1 || sections_y < 1 || sections_z < 1 ||
+        (format != SCHEMATIC_FORMAT_SPONGE && format != SCHEMATIC_FORMAT_STRUCTURE)) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    /* Sponge sizes are unsigned shorts, and both formats count blocks in an int */
+    int64_t volume = (int64_t)sections_x * sections_y * sections_z * SECTION_STATES;
+    int64_t max_side = std::max(sections_x, std::max(sections_y, sections_z)) * (int64_t)CHUNK_WIDTH;
+
+    if (volume > INT32_MAX || (format == SCHEMATIC_FORMAT_SPONGE && max_side > UINT16_MAX)) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    GzipWriter writer;
+    SchematicPalette* palette = new SchematicPalette();
+    palette_init(*palette);
+
+    if (!gzip_open(writer, path)) {
+        delete palette;
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    bool ok = (format == SCHEMATIC_FORMAT_SPONGE)
+        ? export_sponge(writer, *palette, sections_x, sections_y, sections_z, source, user)
+        : export_structure(writer, *palette, sections_x, sections_y, sections_z, source, user);
+
+    ok = gzip_close(writer) && ok && !palette->overflow;
+    delete palette;
+
+    if (!ok) {
+        remove(path);
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    return 0;
+}
+
+/*
+ * Exported entry point
+ */
+
+struct BufferSource {
+    const uint16_t* sections;
+    int sections_y;
+    int sections_z;
+};
+
+static bool buffer_source(void* user, int section_x, int section_y, int section_z, uint16_t* states) {
+
+    const BufferSource* buffer = (const BufferSource*)user;
+    size_t section = ((size_t)section_x * buffer->sections_y + section_y) * buffer->sections_z + section_z;
+
+    memcpy(states, buffer->sections + section * SECTION_STATES, SECTION_STATES * sizeof(uint16_t));
+    return true;
+}
+
+/**
+ * @brief exportSchematic
+ *
+ *  Write sections the mod holds in memory to a schematic file, see schematic.h.
+ *
+ * @param path Direct ByteBuffer with the file path, UTF-8 and zero terminated.
+ * @param sections Direct ByteBuffer of CHUNK_WIDTH^3 native order state indices per
+ *        section, section (x, y, z) at packed index (x * sections_y + y) * sections_z + z.
+ * @param format SCHEMATIC_FORMAT_ constant
+ * @return 0 on success, error code on failure.
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_exportSchematic(JNIEnv* env, jclass unused, jobject path, jobject sections,
+                                                            int32_t sections_x, int32_t sections_y, int32_t sections_z,
+                                                            int32_t format) {
+
+    record_call(RECORD_EXPORT_SCHEMATIC, { sections_x, sections_y, sections_z, format });
+
+    const char* path_data = (const char*)env->GetDirectBufferAddress(path);
+    const uint16_t* section_data = (const uint16_t*)env->GetDirectBufferAddress(sections);
+
+    if (!path_data || !section_data || sections_x < 1 || sections_y < 1 || sections_z < 1 ||
+        !memchr(path_data, 0, (size_t)env->GetDirectBufferCapacity(path)) ||
+        env->GetDirectBufferCapacity(sections) <
+            (int64_t)sections_x * sections_y * sections_z * SECTION_STATES * (int64_t)sizeof(uint16_t)) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    BufferSource buffer = { section_data, sections_y, sections_z };
+
+    return schematic_export(path_data, format, sections_x, sections_y, sections_z, buffer_source, &buffer);
+}
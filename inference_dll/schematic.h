@@ -0,0 +1,56 @@
+/**
+ * @file schematic.h
+ * @brief Streaming export of generated volumes to schematic files.
+ *
+ *  Builders share structures as Sponge schematics (.schem, WorldEdit and friends)
+ *  or vanilla structure templates (.nbt, the structure block and /place template).
+ *  Reading a generated region back through the world API costs a getBlockState()
+ *  per block, so the export runs natively on the state indices (block_states.h).
+ *
+ *  A region is a grid of sections of CHUNK_WIDTH^3 state indices, laid side by side
+ *  as the chunks they came from: the generated volume with its context border. The
+ *  caller supplies the sections one at a time through a callback, and the file is
+ *  written as it goes, so memory doesn't grow with the size of the region:
+ *
+ *   SCHEMATIC_FORMAT_STRUCTURE  Blocks are listed in any order, so each section is
+ *                               fetched once and only one is held.
+ *   SCHEMATIC_FORMAT_SPONGE     Block data runs in y, z, x order across the whole
+ *                               region, so one row of sections along x is held, and
+ *                               each section is fetched once per block layer.
+ *
+ *  Palettes are built while the blocks stream and written after them, which NBT
+ *  allows since compound entries aren't ordered. Every state of the palette fits a
+ *  one byte varint, so the Sponge block data has a known length up front.
+ *
+ *  Files are gzip compressed, as both formats require. The deflate stream is written
+ *  here with fixed Huffman codes and greedy matches over a 32 KiB window, which
+ *  keeps the DLL free of a zlib dependency; the long runs of equal blocks and the
+ *  repeated tag names are what compresses, and those it finds.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+const int SCHEMATIC_FORMAT_SPONGE    = 0;   /* Sponge schematic version 2 */
+const int SCHEMATIC_FORMAT_STRUCTURE = 1;   /* Vanilla structure template */
+
+/* Minecraft 1.21.1, the version the mod targets */
+const int SCHEMATIC_DATA_VERSION = 3955;
+
+/**
+ * @brief Supplies the section at a grid position.
+ * @param states Receives CHUNK_WIDTH^3 state indices at packed_index().
+ * @return false to abort the export.
+ */
+typedef bool (*SchematicSource)(void* user, int section_x, int section_y, int section_z, uint16_t* states);
+
+/**
+ * @brief Write a grid of sections to a schematic file.
+ * @param format SCHEMATIC_FORMAT_ constant
+ * @return 0 on success, INFER_ERROR_INVALID_ARG if the region is too large for the
+ *         format, INFER_ERROR_FAILED_OPERATION if the file can't be written or the
+ *         source aborts.
+ */
+int schematic_export(const char* path, int format, int sections_x, int sections_y, int sections_z,
+                     SchematicSource source, void* user);
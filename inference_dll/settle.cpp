@@ -0,0 +1,180 @@
+/**
+ * @file settle.cpp
+ * @brief Gravity and floating voxel settling. See settle.h.
+ */
+
+#include <atomic>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "stats.h"
+#include "recorder.h"
+#include "settle.h"
+
+static std::atomic<int> mode;
+
+/**
+ * @brief FallingBlock.isFree(): blocks can fall through. Ids past the palette in
+ *        DiffusionMod.BLOCK_STATES are placed as air.
+ */
+static bool settle_free(int block_id) {
+    return block_id == 0 || block_id > 30;
+}
+
+/**
+ * @brief Gravel. The palette has no sand, concrete powder or anvils.
+ */
+static bool settle_falls(int block_id) {
+    return block_id == 25;
+}
+
+/**
+ * @brief Id at context coordinates, generated ids inside the border.
+ */
+static int settle_at(const uint8_t* context, const uint8_t* block_ids, int x, int y, int z) {
+
+    if (x < 0 || x >= CHUNK_WIDTH || y < 0 || y >= CHUNK_WIDTH || z < 0 || z >= CHUNK_WIDTH) {
+        return 0;
+    }
+
+    bool generated = x >= 1 && x <= GENERATED_WIDTH &&
+                     y >= 1 && y <= GENERATED_WIDTH &&
+                     z >= 1 && z <= GENERATED_WIDTH;
+
+    return generated ? block_ids[packed_index(x - 1, y - 1, z - 1, GENERATED_WIDTH)]
+                     : context[packed_index(x, y, z, CHUNK_WIDTH)];
+}
+
+/**
+ * @brief Remove non-gravity blocks with air on every face. Judged on the ids as
+ *        decoded, so removing one voxel never isolates another.
+ * @return Number of blocks removed
+ */
+static int settle_floating(const uint8_t* context, uint8_t* block_ids) {
+
+    static const int offsets[6][3] = { { -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 } };
+
+    uint8_t decoded[PACKED_CHUNK_RECORD_SIZE];
+    memcpy(decoded, block_ids, PACKED_CHUNK_RECORD_SIZE);
+
+    int removed = 0;
+
+    for         (int x = 0; x < GENERATED_WIDTH; x++) {
+        for     (int y = 0; y < GENERATED_WIDTH; y++) {
+            for (int z = 0; z < GENERATED_WIDTH; z++) {
+
+                int i = packed_index(x, y, z, GENERATED_WIDTH);
+
+                if (settle_free(decoded[i]) || settle_falls(decoded[i])) {
+                    continue;
+                }
+
+                bool isolated = true;
+
+                for (int side = 0; side < 6 && isolated; side++) {
+                    isolated = settle_free(settle_at(context, decoded,
+                        x + 1 + offsets[side][0], y + 1 + offsets[side][1], z + 1 + offsets[side][2]));
+                }
+
+                if (isolated) {
+                    block_ids[i] = 0;
+                    removed++;
+                }
+            }
+        }
+    }
+
+    return removed;
+}
+
+/**
+ * @brief Drop gravity blocks down their columns, bottom up so a stack lands in
+ *        order.
+ * @param moved Receives the number of blocks that fell
+ * @return Number of blocks removed for falling out of the volume
+ */
+static int settle_gravity(const uint8_t* context, uint8_t* block_ids, int* moved) {
+
+    int removed = 0;
+    *moved = 0;
+
+    for     (int x = 0; x < GENERATED_WIDTH; x++) {
+        for (int z = 0; z < GENERATED_WIDTH; z++) {
+
+            /* Lowest free cell a falling block lands in, -1 if the block below is support */
+            int land = -1;
+            bool bottomless = settle_free(context[packed_index(x + 1, 0, z + 1, CHUNK_WIDTH)]);
+
+            for (int y = 0; y < GENERATED_WIDTH; y++) {
+
+                int i = packed_index(x, y, z, GENERATED_WIDTH);
+                int block_id = block_ids[i];
+
+                if (settle_free(block_id)) {
+                    if (land < 0) {
+                        land = y;
+                    }
+                } else if (settle_falls(block_id) && bottomless) {
+                    block_ids[i] = 0;
+                    removed++;
+                } else if (settle_falls(block_id) && land >= 0) {
+                    /* Every cell from land up to y is free, so the next block lands above this one */
+                    block_ids[packed_index(x, land, z, GENERATED_WIDTH)] = (uint8_t)block_id;
+                    block_ids[i] = 0;
+                    land++;
+                    (*moved)++;
+                } else {
+                    land = -1;
+                    bottomless = false;
+                }
+            }
+        }
+    }
+
+    return removed;
+}
+
+int settle_mode() {
+    return mode;
+}
+
+void settle_apply(const uint8_t* context, uint8_t* block_ids) {
+
+    int flags = mode;
+    int removed = 0;
+    int moved = 0;
+
+    if (flags & SETTLE_FLOATING) {
+        removed += settle_floating(context, block_ids);
+    }
+
+    if (flags & SETTLE_GRAVITY) {
+        removed += settle_gravity(context, block_ids, &moved);
+    }
+
+    stat_add(STAT_SETTLE_MOVED, moved);
+    stat_add(STAT_SETTLE_REMOVED, removed);
+}
+
+/**
+ * @brief setSettleMode
+ *  Settle decoded structures before they're read, see settle.h.
+ * @param: flags SETTLE_ flags, 0 to place ids as decoded
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_setSettleMode(void* unused1, void* unused2, int32_t flags) {
+
+    record_call(RECORD_SET_SETTLE_MODE, { flags });
+
+    if (flags & ~SETTLE_ALL) {
+        inference_set_last_error(INFER_ERROR_INVALID_ARG);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    mode = flags;
+    return 0;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file settle.h
+ * @brief Optional pass that makes decoded structures stable before they're placed.
+ *
+ *  The model doesn't know about physics, so a decoded chunk can hold gravel over
+ *  air. Placed as is, every such block turns into a falling block entity on its
+ *  next tick, one by one, and lands wherever the game takes it. Single voxels with
+ *  nothing around them are decoding noise left floating in the air.
+ *
+ *  settle_apply() resolves both on the packed generated ids, deterministically and
+ *  before export, so the mod writes the settled structure once:
+ *
+ *   SETTLE_FLOATING  Non-gravity blocks with air on all six faces, counting the
+ *                    context border, are removed.
+ *   SETTLE_GRAVITY   Gravity blocks drop down their column onto the first support,
+ *                    stacking in order. A block that would fall out the bottom of
+ *                    the volume over context air is removed, since it would land in
+ *                    the world outside the generated volume.
+ *
+ *  Only air and the ids past the palette, which are placed as air, let a block fall
+ *  through, as with FallingBlock.isFree(). Floating voxels are removed first, so
+ *  gravity blocks that lose their support to it fall as well.
+ *
+ *  The pass is off by default. Once enabled with setSettleMode() it applies to
+ *  the final snapshot (timestep 0) of every job and to library hits, once per job.
+ *  Intermediate snapshots are previews and are returned as decoded.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+const int SETTLE_GRAVITY  = 1;
+const int SETTLE_FLOATING = 2;
+const int SETTLE_ALL      = SETTLE_GRAVITY | SETTLE_FLOATING;
+
+/**
+ * @return SETTLE_ flags of the current mode, 0 if off.
+ */
+int settle_mode();
+
+/**
+ * @brief Settle generated ids in place with the current mode.
+ * @param context Packed CHUNK_WIDTH^3 context ids. Only the border is used.
+ * @param block_ids Packed GENERATED_WIDTH^3 generated ids, placed inside the border.
+ */
+void settle_apply(const uint8_t* context, uint8_t* block_ids);
@@ -0,0 +1,264 @@
+/**
+ * @file shadow.cpp
+ * @brief Shadow run thread and output comparison. See shadow.h.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "backend.h"
+#include "block_embeddings.h"
+#include "job_queue.h"
+#include "stats.h"
+#include "shadow.h"
+
+/* How long the shadow thread sleeps while jobs are queued or running */
+const int SHADOW_IDLE_POLL_MS = 1;
+
+struct ShadowTask {
+    uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+    uint32_t seed;
+    uint8_t block_ids[PACKED_CHUNK_RECORD_SIZE];
+    int64_t device_ns;
+};
+
+static std::mutex shadow_mtx;
+static std::condition_variable shadow_cv;
+static std::deque<ShadowTask> shadow_tasks;
+static std::thread shadow_thread;
+
+static std::atomic<int> shadow_backend_kind = SHADOW_BACKEND_TENSORRT;
+static std::atomic<int32_t> shadow_sample_every = 0;
+static std::atomic<int32_t> shadow_u_steps = n_U;
+static std::atomic<int64_t> shadow_finished_jobs = 0;
+
+static const float* schedule_alpha;
+static const float* schedule_alpha_bar;
+static const float* schedule_beta;
+
+int shadow_configure(int backend, int32_t sample_every, int32_t u_steps) {
+
+    if ((backend != SHADOW_BACKEND_TENSORRT && backend != SHADOW_BACKEND_MOCK) ||
+        sample_every < 0 || u_steps < 1 || u_steps > 4 * n_U) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    shadow_backend_kind = backend;
+    shadow_u_steps = u_steps;
+    shadow_sample_every = sample_every;
+
+    return 0;
+}
+
+void shadow_set_schedule(const float* alpha, const float* alpha_bar, const float* beta) {
+    schedule_alpha = alpha;
+    schedule_alpha_bar = alpha_bar;
+    schedule_beta = beta;
+}
+
+bool shadow_sample() {
+
+    int32_t every = shadow_sample_every;
+
+    if (every <= 0) {
+        return false;
+    }
+
+    return (shadow_finished_jobs++ % every) == 0;
+}
+
+int32_t seam_mismatches(const uint8_t* context, const uint8_t* block_ids) {
+
+    const int last = GENERATED_WIDTH - 1;
+    int32_t mismatches = 0;
+
+    /* Generated (x, y, z) is context (x + 1, y + 1, z + 1), so the context voxel
+     * across a face of the generated volume is at 0 or CHUNK_WIDTH - 1 on that axis */
+    for     (int a = 0; a < GENERATED_WIDTH; a++) {
+        for (int b = 0; b < GENERATED_WIDTH; b++) {
+
+            const int faces[6][6] = {
+                { 0, a, b,       0, a + 1, b + 1 },
+                { last, a, b,    CHUNK_WIDTH - 1, a + 1, b + 1 },
+                { a, 0, b,       a + 1, 0, b + 1 },
+                { a, last, b,    a + 1, CHUNK_WIDTH - 1, b + 1 },
+                { a, b, 0,       a + 1, b + 1, 0 },
+                { a, b, last,    a + 1, b + 1, CHUNK_WIDTH - 1 },
+            };
+
+            for (const int* f : faces) {
+                uint8_t inside = block_ids[packed_index(f[0], f[1], f[2], GENERATED_WIDTH)];
+                uint8_t outside = context[packed_index(f[3], f[4], f[5], CHUNK_WIDTH)];
+
+                mismatches += (inside != outside) ? 1 : 0;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+static DenoiseBackend* create_shadow_backend(int kind) {
+#if defined(INFERENCE_MOCK_BACKEND)
+    /* TensorRT isn't linked into the mock builds */
+    (void)kind;
+    return create_mock_backend();
+#else
+    return (kind == SHADOW_BACKEND_MOCK) ? create_mock_backend() : create_tensorrt_backend();
+#endif
+}
+
+/**
+ * @brief Denoise one task the way denoise_thread_main() does, stepping only while
+ *        the job table is idle.
+ * @return 0 on success, error code on failure.
+ */
+static int run_shadow_task(DenoiseBackend* backend, const ShadowTask& task, int64_t* device_ns,
+                           uint8_t* block_ids) {
+
+    static float x_t       [EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+    static float x_context [EMBEDDING_DIMENSIONS][CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+    static float x_mask                          [CHUNK_WIDTH][CHUNK_WIDTH][CHUNK_WIDTH];
+
+    int32_t u_steps = shadow_u_steps;
+    bool context_set = false;
+
+    fill_normal_noise(task.seed, x_t);
+    embed_context(task.context, x_context);
+    build_context_mask(x_mask);
+
+    *device_ns = 0;
+
+    for (int t = n_T - 1; t >= 0; t--) {
+
+        while (job_busy()) {
+            context_set = false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(SHADOW_IDLE_POLL_MS));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        /* A job may have replaced the context on a shared device in between */
+        if (!context_set) {
+            int result = backend->set_context(x_context, x_mask);
+
+            if (result != 0) {
+                return result;
+            }
+
+            context_set = true;
+        }
+
+        for (int u = 0; u < u_steps; u++) {
+
+            int result = backend->step(t, schedule_alpha[t], schedule_alpha_bar[t], schedule_beta[t], x_t, x_t);
+
+            if (result != 0) {
+                return result;
+            }
+        }
+
+        *device_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    decode_block_ids(x_t, block_ids);
+
+    return 0;
+}
+
+static void shadow_thread_main() {
+
+    DenoiseBackend* backend = NULL;
+    int backend_kind = -1;
+
+    for (;;) {
+
+        ShadowTask task;
+
+        {
+            std::unique_lock<std::mutex> lock(shadow_mtx);
+
+            shadow_cv.wait(lock, [] { return !shadow_tasks.empty(); });
+            task = shadow_tasks.front();
+            shadow_tasks.pop_front();
+        }
+
+        if (backend_kind != shadow_backend_kind) {
+
+            delete backend;
+            backend_kind = shadow_backend_kind;
+            backend = create_shadow_backend(backend_kind);
+
+            int result = backend->init();
+
+            if (result != 0) {
+                printf("Shadow %s backend failed to initialize (%d)\n", backend->name(), result);
+                stat_add(STAT_SHADOW_FAILED, 1);
+                delete backend;
+                backend = NULL;
+                backend_kind = -1;
+                continue;
+            }
+        }
+
+        uint8_t block_ids[PACKED_CHUNK_RECORD_SIZE];
+        int64_t device_ns;
+        int result = run_shadow_task(backend, task, &device_ns, block_ids);
+
+        if (result != 0) {
+            stat_add(STAT_SHADOW_FAILED, 1);
+            continue;
+        }
+
+        int64_t agree = 0;
+
+        for (int i = 0; i < PACKED_CHUNK_RECORD_SIZE; i++) {
+            agree += (block_ids[i] == task.block_ids[i]) ? 1 : 0;
+        }
+
+        stat_add(STAT_SHADOW_RUNS, 1);
+        stat_add(STAT_SHADOW_VOXELS, PACKED_CHUNK_RECORD_SIZE);
+        stat_add(STAT_SHADOW_AGREE_VOXELS, agree);
+        stat_add(STAT_SHADOW_PRIMARY_SEAMS, seam_mismatches(task.context, task.block_ids));
+        stat_add(STAT_SHADOW_SECONDARY_SEAMS, seam_mismatches(task.context, block_ids));
+        stat_add(STAT_SHADOW_PRIMARY_NS, task.device_ns);
+        stat_add(STAT_SHADOW_SECONDARY_NS, device_ns);
+    }
+}
+
+void shadow_submit(const uint8_t* context, uint32_t seed, const uint8_t* block_ids, int64_t device_ns) {
+
+    std::lock_guard<std::mutex> lock(shadow_mtx);
+
+    if (shadow_tasks.size() >= (size_t)SHADOW_MAX_PENDING) {
+        stat_add(STAT_SHADOW_DROPPED, 1);
+        return;
+    }
+
+    ShadowTask task;
+
+    memcpy(task.context, context, PACKED_CONTEXT_RECORD_SIZE);
+    task.seed = seed;
+    memcpy(task.block_ids, block_ids, PACKED_CHUNK_RECORD_SIZE);
+    task.device_ns = device_ns;
+
+    shadow_tasks.push_back(task);
+
+    /* The thread only exists once something was sampled */
+    if (!shadow_thread.joinable()) {
+        shadow_thread = std::thread(shadow_thread_main);
+    }
+
+    shadow_cv.notify_one();
+}
@@ -0,0 +1,65 @@
+/**
+ * @file shadow.h
+ * @brief Shadow runs: a sample of finished jobs is run again on a secondary backend
+ *        or sampler config and the two outputs are compared, so a new backend can be
+ *        checked against real traffic before it replaces the current one.
+ *
+ *  A shadow run starts from the same context and seed as the job it copies, on its
+ *  own thread with its own backend, and only steps while the job table is idle
+ *  (job_busy()), so it never delays a job. Nothing from a shadow run reaches the
+ *  game; the comparison only shows up in the STAT_SHADOW_ stats:
+ *   - id agreement: generated voxels with the same id in both outputs
+ *   - seams: pairs of a generated voxel on the boundary of the 14^3 and the context
+ *     voxel next to it with different ids, for each output
+ *   - latency: backend time of the job and of its shadow run
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "inference.h"
+
+const int SHADOW_BACKEND_TENSORRT = 0;
+const int SHADOW_BACKEND_MOCK     = 1;
+
+/* Finished jobs waiting for a shadow run. Samples beyond this are dropped. */
+const int SHADOW_MAX_PENDING = 4;
+
+/* Generated voxel faces that touch the context, per run */
+const int SHADOW_SEAM_PAIRS = 6 * GENERATED_WIDTH * GENERATED_WIDTH;
+
+/**
+ * @brief Configure shadow runs.
+ * @param backend SHADOW_BACKEND_ constant.
+ * @param sample_every Shadow one in every sample_every finished jobs, 0 to stop.
+ * @param u_steps In-painting steps per timestep of the shadow runs, n_U to keep the
+ *        primary sampler.
+ * @return 0 on success, INFER_ERROR_INVALID_ARG for bad arguments.
+ */
+int shadow_configure(int backend, int32_t sample_every, int32_t u_steps);
+
+/**
+ * @brief Schedule used by the shadow runs, the denoise thread's own arrays.
+ */
+void shadow_set_schedule(const float* alpha, const float* alpha_bar, const float* beta);
+
+/**
+ * @brief Called by the denoise thread for every finished job.
+ * @return true if this job should be shadowed.
+ */
+bool shadow_sample();
+
+/**
+ * @brief Queue a shadow run of a finished job.
+ * @param context Packed CHUNK_WIDTH^3 context of the job.
+ * @param block_ids Packed GENERATED_WIDTH^3 ids the job produced.
+ * @param device_ns Backend time of the job.
+ */
+void shadow_submit(const uint8_t* context, uint32_t seed, const uint8_t* block_ids, int64_t device_ns);
+
+/**
+ * @brief Generated voxels on the boundary whose id differs from the context voxel
+ *        across the face, out of SHADOW_SEAM_PAIRS.
+ */
+int32_t seam_mismatches(const uint8_t* context, const uint8_t* block_ids);
@@ -0,0 +1,158 @@
+/**
+ * @file stats.cpp
+ * @brief Storage for the counters declared in stats.h.
+ */
+
+#include <atomic>
+#include <mutex>
+
+#include <stdio.h>
+
+#include "inference.h"
+#include "stats.h"
+#include "recorder.h"
+
+static std::atomic<int64_t> stat_values[STAT_COUNT];
+static std::atomic<int64_t> stat_perf_values[STAT_PERF_END - STAT_PERF_FIRST];
+
+static const char* stat_names[STAT_COUNT] = {
+    "library_lookups",
+    "library_hits",
+    "library_lookup_ns",
+    "library_lookup_max_ns",
+    "jobs_submitted",
+    "jobs_completed",
+    "jobs_cancelled",
+    "tick_calls",
+    "tick_commands",
+    "tick_event_bytes",
+    "jobs_preempted",
+    "jobs_queue_ns",
+    "jobs_queue_max_ns",
+    "shadow_runs",
+    "shadow_dropped",
+    "shadow_failed",
+    "shadow_voxels",
+    "shadow_agree_voxels",
+    "shadow_primary_seams",
+    "shadow_secondary_seams",
+    "shadow_primary_ns",
+    "shadow_secondary_ns",
+    "traces_applied",
+    "model_steps",
+    "watchdog_outliers",
+    "watchdog_timeouts",
+    "backend_failures",
+    "backend_restarts",
+    "backend_failovers",
+    "backend_degraded",
+    "jobs_requeued",
+    "settle_moved",
+    "settle_removed",
+    "async_batches",
+    "async_jobs",
+    "library_transformed_hits",
+    "jobs_coalesced",
+};
+
+/* "perf_<stage>_<value>" names for the per stage samples */
+static char stat_perf_names[STAT_PERF_END - STAT_PERF_FIRST][64];
+static std::once_flag stat_perf_names_once;
+
+bool stat_valid(int stat) {
+    return (stat >= 0 && stat < STAT_COUNT) || (stat >= STAT_PERF_FIRST && stat < STAT_PERF_END);
+}
+
+static std::atomic<int64_t>& stat_value(int stat) {
+    return (stat < STAT_COUNT) ? stat_values[stat] : stat_perf_values[stat - STAT_PERF_FIRST];
+}
+
+void stat_add(int stat, int64_t value) {
+    stat_value(stat) += value;
+}
+
+void stat_max(int stat, int64_t value) {
+
+    std::atomic<int64_t>& target = stat_value(stat);
+    int64_t current = target;
+
+    while (value > current && !target.compare_exchange_weak(current, value)) {
+    }
+}
+
+int64_t stat_get(int stat) {
+    return stat_value(stat);
+}
+
+const char* stat_name(int stat) {
+
+    if (stat < STAT_COUNT) {
+        return stat_names[stat];
+    }
+
+    std::call_once(stat_perf_names_once, []() {
+        for (int stage = 0; stage < PERF_STAGE_COUNT; stage++) {
+            for (int value = 0; value < PERF_VALUE_COUNT; value++) {
+                snprintf(stat_perf_names[stage * PERF_VALUE_COUNT + value], sizeof(stat_perf_names[0]),
+                    "perf_%s_%s", perf_stage_name(stage), perf_value_name(value));
+            }
+        }
+    });
+
+    return stat_perf_names[stat - STAT_PERF_FIRST];
+}
+
+/**
+ * @brief Call visit for every valid stat id in order.
+ */
+template <typename Visitor>
+static void for_each_stat(Visitor visit) {
+
+    for (int i = 0; i < STAT_COUNT; i++) {
+        visit(i);
+    }
+
+    for (int i = STAT_PERF_FIRST; i < STAT_PERF_END; i++) {
+        visit(i);
+    }
+}
+
+void stats_print(FILE* file) {
+
+    for_each_stat([file](int stat) {
+        fprintf(file, "%-36s %lld\n", stat_name(stat), (long long)stat_get(stat));
+    });
+}
+
+void stats_write_json(FILE* file) {
+
+    const char* separator = "";
+
+    fprintf(file, "{\n  \"stats\": {");
+
+    for_each_stat([file, &separator](int stat) {
+        fprintf(file, "%s\n    \"%s\": %lld", separator, stat_name(stat), (long long)stat_get(stat));
+        separator = ",";
+    });
+
+    fprintf(file, "\n  },\n  \"perf\": ");
+    perf_write_json(file);
+    fprintf(file, "\n}\n");
+}
+
+/** 
+ * @brief getStat
+ * @param: stat One of the STAT_ ids in stats.h
+ * @return: Current value of the counter, or 0 for an unknown id.
+ */
+extern "C" DLL_EXPORT
+int64_t Java_tbarnes_diffusionmod_Inference_getStat(void* unused1, void* unused2, int32_t stat) {
+
+    record_call(RECORD_GET_STAT, { stat });
+
+    if (!stat_valid(stat)) {
+        return 0;
+    }
+
+    return stat_get(stat);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file stats.h
+ * @brief Process wide counters readable through getStat(). Counters are lock free
+ *        so they can be updated from the denoise thread and read from the game thread.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "perf_counters.h"
+
+/*
+ * Stat ids. These are part of the Java interface, so only append new ids and
+ * keep stat_names in stats.cpp in the same order.
+ */
+const int STAT_LIBRARY_LOOKUPS        = 0;
+const int STAT_LIBRARY_HITS           = 1;
+const int STAT_LIBRARY_LOOKUP_NS      = 2; /* Sum over all lookups */
+const int STAT_LIBRARY_LOOKUP_MAX_NS  = 3;
+const int STAT_JOBS_SUBMITTED         = 4;
+const int STAT_JOBS_COMPLETED         = 5;
+const int STAT_JOBS_CANCELLED         = 6;
+const int STAT_TICK_CALLS             = 7;
+const int STAT_TICK_COMMANDS          = 8;
+const int STAT_TICK_EVENT_BYTES       = 9;
+const int STAT_JOBS_PREEMPTED         = 10;
+const int STAT_JOBS_QUEUE_NS          = 11; /* Submission to first start, sum over all jobs */
+const int STAT_JOBS_QUEUE_MAX_NS      = 12;
+const int STAT_SHADOW_RUNS            = 13; /* Completed shadow runs, see shadow.h */
+const int STAT_SHADOW_DROPPED         = 14;
+const int STAT_SHADOW_FAILED          = 15;
+const int STAT_SHADOW_VOXELS          = 16;
+const int STAT_SHADOW_AGREE_VOXELS    = 17;
+const int STAT_SHADOW_PRIMARY_SEAMS   = 18;
+const int STAT_SHADOW_SECONDARY_SEAMS = 19;
+const int STAT_SHADOW_PRIMARY_NS      = 20;
+const int STAT_SHADOW_SECONDARY_NS    = 21;
+const int STAT_TRACES_APPLIED         = 22; /* Requests whose trace reached APPLIED, see trace.h */
+const int STAT_MODEL_STEPS            = 23; /* backend->step() calls of every job */
+const int STAT_WATCHDOG_OUTLIERS      = 24; /* Unusually slow backend steps, see watchdog.h */
+const int STAT_WATCHDOG_TIMEOUTS      = 25; /* Backend steps that exceeded the stall timeout */
+const int STAT_BACKEND_FAILURES       = 26; /* Failed backend inits and calls, see supervisor.h */
+const int STAT_BACKEND_RESTARTS       = 27; /* Primary backend reinitialized after a failure */
+const int STAT_BACKEND_FAILOVERS      = 28;
+const int STAT_BACKEND_DEGRADED       = 29; /* 1 while the primary backend is down, else 0 */
+const int STAT_JOBS_REQUEUED          = 30; /* Jobs resumed after a backend failure */
+const int STAT_SETTLE_MOVED           = 31; /* Gravity blocks dropped by the settle pass, see settle.h */
+const int STAT_SETTLE_REMOVED         = 32; /* Floating or bottomless blocks removed by it */
+const int STAT_ASYNC_BATCHES          = 33; /* submitAsyncBatch() calls, see async_jobs.h */
+const int STAT_ASYNC_JOBS             = 34; /* Jobs they submitted */
+const int STAT_LIBRARY_TRANSFORMED_HITS = 35; /* Library hits on a turned or mirrored entry, see symmetry.h */
+const int STAT_JOBS_COALESCED         = 36; /* Submissions that joined an identical queued or running job */
+const int STAT_COUNT                  = 37;
+
+/* Per stage samples from perf_counters.h have their own id range so the ids
+ * above can keep growing. The id of a sample is
+ * STAT_PERF_FIRST + stage * PERF_VALUE_COUNT + value */
+const int STAT_PERF_FIRST             = 1000;
+const int STAT_PERF_END               = STAT_PERF_FIRST + PERF_STAGE_COUNT * PERF_VALUE_COUNT;
+
+inline int stat_perf(int stage, int value) {
+    return STAT_PERF_FIRST + stage * PERF_VALUE_COUNT + value;
+}
+
+/*
+ * Ids in [0, STAT_COUNT) and [STAT_PERF_FIRST, STAT_PERF_END) are valid.
+ */
+void stat_add(int stat, int64_t value);
+void stat_max(int stat, int64_t value);
+int64_t stat_get(int stat);
+const char* stat_name(int stat);
+bool stat_valid(int stat);
+
+/**
+ * @brief Print every counter, one per line.
+ */
+void stats_print(FILE* file);
+
+/**
+ * @brief Write every counter and the derived per-stage metrics as a JSON object.
+ */
+void stats_write_json(FILE* file);
@@ -0,0 +1,408 @@
+/**
+ * @file structure_library.cpp
+ * @brief Memory mapped library of pregenerated structures. See structure_library.h.
+ */
+
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "inference.h"
+#include "stats.h"
+#include "structure_library.h"
+#include "symmetry.h"
+
+const int HISTOGRAM_BINS = 64;
+const int SIGNATURE_BANDS = 4;
+const int BAND_BITS = 64 / SIGNATURE_BANDS;
+
+/*
+ * Loaded library. The lock is only contended while a library is being (re)loaded.
+ */
+static std::mutex library_mtx;
+static const LibraryEntry* library_entries;
+static uint64_t library_entry_count;
+static bool library_canonical;
+static std::unordered_map<uint64_t, std::vector<uint32_t>> library_buckets;
+
+#if defined(_WIN32)
+static HANDLE library_file = INVALID_HANDLE_VALUE;
+static HANDLE library_mapping;
+#else
+static size_t library_mapped_size;
+#endif
+static const void* library_view;
+
+static FILE* writer_file;
+static uint64_t writer_entry_count;
+static uint32_t writer_version;
+
+/**
+ * @brief splitmix64 finalizer, used as a cheap well mixed hash.
+ */
+static uint64_t mix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+uint64_t library_signature(const uint8_t* context) {
+
+    int histogram[HISTOGRAM_BINS] = {};
+    const int last = CHUNK_WIDTH - 1;
+
+    /* Bin every border voxel by the face it lies on and its block id. Voxels on
+     * edges and corners are counted for the first face that matches. */
+    for         (int x = 0; x < CHUNK_WIDTH; x++) {
+        for     (int y = 0; y < CHUNK_WIDTH; y++) {
+            for (int z = 0; z < CHUNK_WIDTH; z++) {
+
+                int face;
+
+                if      (x == 0)    { face = 0; }
+                else if (x == last) { face = 1; }
+                else if (y == 0)    { face = 2; }
+                else if (y == last) { face = 3; }
+                else if (z == 0)    { face = 4; }
+                else if (z == last) { face = 5; }
+                else                { continue; }
+
+                int block_id = context[packed_index(x, y, z, CHUNK_WIDTH)];
+                uint64_t feature = (uint64_t)face * BLOCK_ID_COUNT + block_id;
+
+                histogram[mix64(feature) % HISTOGRAM_BINS]++;
+            }
+        }
+    }
+
+    /* SimHash: each signature bit is the sign of a random +/-1 projection of the
+     * histogram, so similar histograms agree on most bits. */
+    uint64_t signature = 0;
+
+    for (int bit = 0; bit < 64; bit++) {
+
+        int sum = 0;
+
+        for (int bin = 0; bin < HISTOGRAM_BINS; bin++) {
+            if (mix64((uint64_t)bin * 64 + bit) & 1) {
+                sum += histogram[bin];
+            } else {
+                sum -= histogram[bin];
+            }
+        }
+
+        if (sum > 0) {
+            signature |= 1ull << bit;
+        }
+    }
+
+    return signature;
+}
+
+static uint64_t band_key(uint64_t signature, int band) {
+
+    uint64_t bits = (signature >> (band * BAND_BITS)) & ((1ull << BAND_BITS) - 1);
+    return ((uint64_t)band << BAND_BITS) | bits;
+}
+
+static void library_unmap() {
+
+#if defined(_WIN32)
+    if (library_view)    { UnmapViewOfFile(library_view); }
+    if (library_mapping) { CloseHandle(library_mapping); }
+    if (library_file != INVALID_HANDLE_VALUE) { CloseHandle(library_file); }
+    library_mapping = NULL;
+    library_file = INVALID_HANDLE_VALUE;
+#else
+    if (library_view) { munmap((void*)library_view, library_mapped_size); }
+    library_mapped_size = 0;
+#endif
+
+    library_view = NULL;
+    library_entries = NULL;
+    library_entry_count = 0;
+    library_canonical = false;
+    library_buckets.clear();
+}
+
+int library_load(const char* path) {
+
+    std::lock_guard<std::mutex> lock(library_mtx);
+
+    library_unmap();
+
+    uint64_t file_size;
+
+#if defined(_WIN32)
+    library_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (library_file == INVALID_HANDLE_VALUE) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(library_file, &size);
+    file_size = (uint64_t)size.QuadPart;
+
+    if (file_size < sizeof(LibraryHeader)) {
+        library_unmap();
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    library_mapping = CreateFileMappingA(library_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    library_view = library_mapping ? MapViewOfFile(library_mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    file_size = (uint64_t)st.st_size;
+
+    if (file_size < sizeof(LibraryHeader)) {
+        close(fd);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    void* view = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (view != MAP_FAILED) {
+        library_view = view;
+        library_mapped_size = file_size;
+    }
+#endif
+
+    if (!library_view) {
+        printf("Failed to map structure library %s\n", path);
+        library_unmap();
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    const LibraryHeader* header = (const LibraryHeader*)library_view;
+    uint64_t capacity = (file_size - sizeof(LibraryHeader)) / sizeof(LibraryEntry);
+
+    if (header->magic != LIBRARY_MAGIC || header->version < 1 || header->version > LIBRARY_VERSION ||
+        header->entry_count > capacity) {
+        printf("%s is not a valid structure library\n", path);
+        library_unmap();
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    library_entries = (const LibraryEntry*)(header + 1);
+    library_entry_count = header->entry_count;
+    library_canonical = header->version >= LIBRARY_VERSION_CANONICAL;
+
+    for (uint64_t i = 0; i < library_entry_count; i++) {
+        for (int band = 0; band < SIGNATURE_BANDS; band++) {
+            library_buckets[band_key(library_entries[i].signature, band)].push_back((uint32_t)i);
+        }
+    }
+
+    printf("Loaded %llu pregenerated structures from %s\n", (unsigned long long)library_entry_count, path);
+    return 0;
+}
+
+bool library_lookup(const uint8_t* context, float min_similarity, uint8_t* result) {
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(library_mtx);
+
+    if (library_entry_count == 0) {
+        return false;
+    }
+
+    uint8_t canonical[PACKED_CONTEXT_RECORD_SIZE];
+    int symmetry = SYMMETRY_IDENTITY;
+
+    if (library_canonical) {
+        symmetry = symmetry_canonicalize(context, canonical);
+        context = canonical;
+    }
+
+    uint64_t signature = library_signature(context);
+
+    int best_matches = -1;
+    const LibraryEntry* best_entry = NULL;
+
+    for (int band = 0; band < SIGNATURE_BANDS; band++) {
+
+        auto bucket = library_buckets.find(band_key(signature, band));
+
+        if (bucket == library_buckets.end()) {
+            continue;
+        }
+
+        for (uint32_t index : bucket->second) {
+
+            const LibraryEntry* entry = &library_entries[index];
+
+            /* An entry can share several bands with the query. Skip rescoring the
+             * current best, which is the common case for near duplicates. */
+            if (entry == best_entry) {
+                continue;
+            }
+
+            int matches = 0;
+
+            for (int i = 0; i < PACKED_CONTEXT_RECORD_SIZE; i++) {
+                matches += (entry->context[i] == context[i]);
+            }
+
+            if (matches > best_matches) {
+                best_matches = matches;
+                best_entry = entry;
+            }
+        }
+    }
+
+    float similarity = (float)best_matches / PACKED_CONTEXT_RECORD_SIZE;
+    bool hit = best_entry && similarity >= min_similarity;
+
+    /* A result with fixed ids only answers its own orientation */
+    if (hit && symmetry != SYMMETRY_IDENTITY &&
+        symmetry_has_fixed_ids(best_entry->result, PACKED_CHUNK_RECORD_SIZE)) {
+        hit = false;
+    }
+
+    if (hit && symmetry != SYMMETRY_IDENTITY) {
+        symmetry_apply(symmetry_inverse(symmetry), best_entry->result, result, GENERATED_WIDTH);
+    } else if (hit) {
+        memcpy(result, best_entry->result, PACKED_CHUNK_RECORD_SIZE);
+    }
+
+    int64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    stat_add(STAT_LIBRARY_LOOKUPS, 1);
+    stat_add(STAT_LIBRARY_HITS, hit ? 1 : 0);
+    stat_add(STAT_LIBRARY_TRANSFORMED_HITS, (hit && symmetry != SYMMETRY_IDENTITY) ? 1 : 0);
+    stat_add(STAT_LIBRARY_LOOKUP_NS, elapsed_ns);
+    stat_max(STAT_LIBRARY_LOOKUP_MAX_NS, elapsed_ns);
+
+    return hit;
+}
+
+static bool writer_update_header() {
+
+    LibraryHeader header;
+    header.magic = LIBRARY_MAGIC;
+    header.version = writer_version;
+    header.entry_count = writer_entry_count;
+
+    return fseek(writer_file, 0, SEEK_SET) == 0 &&
+           fwrite(&header, sizeof(header), 1, writer_file) == 1 &&
+           fflush(writer_file) == 0;
+}
+
+int64_t library_memory_bytes() {
+
+    std::lock_guard<std::mutex> lock(library_mtx);
+
+    int64_t bytes = (int64_t)(library_entry_count * sizeof(LibraryEntry));
+
+    for (const auto& bucket : library_buckets) {
+        bytes += sizeof(bucket) + bucket.second.capacity() * sizeof(uint32_t);
+    }
+
+    return bytes;
+}
+
+int library_writer_open(const char* path) {
+
+    LibraryHeader header;
+
+    writer_entry_count = 0;
+    writer_version = LIBRARY_VERSION;
+    writer_file = fopen(path, "r+b");
+
+    if (writer_file) {
+        /* Continue an existing library */
+        if (fread(&header, sizeof(header), 1, writer_file) != 1 ||
+            header.magic != LIBRARY_MAGIC || header.version < 1 || header.version > LIBRARY_VERSION) {
+
+            printf("%s is not a valid structure library\n", path);
+            fclose(writer_file);
+            writer_file = NULL;
+            return INFER_ERROR_INVALID_ARG;
+        }
+
+        /* Keep the version, so entries are keyed like those already written */
+        writer_entry_count = header.entry_count;
+        writer_version = header.version;
+    } else {
+        writer_file = fopen(path, "w+b");
+
+        if (!writer_file) {
+            return INFER_ERROR_INVALID_ARG;
+        }
+    }
+
+    return writer_update_header() ? 0 : INFER_ERROR_FAILED_OPERATION;
+}
+
+int library_writer_append(const uint8_t* context, const uint8_t* result) {
+
+    if (!writer_file) {
+        return INFER_ERROR_INVALID_OPERATION;
+    }
+
+    LibraryEntry entry;
+
+    if (writer_version >= LIBRARY_VERSION_CANONICAL) {
+        int symmetry = symmetry_canonicalize(context, entry.context);
+
+        /* Turned, a dropper in the result would face the wrong way */
+        if (symmetry != SYMMETRY_IDENTITY && symmetry_has_fixed_ids(result, PACKED_CHUNK_RECORD_SIZE)) {
+            return 0;
+        }
+
+        symmetry_apply(symmetry, result, entry.result, GENERATED_WIDTH);
+    } else {
+        memcpy(entry.context, context, PACKED_CONTEXT_RECORD_SIZE);
+        memcpy(entry.result, result, PACKED_CHUNK_RECORD_SIZE);
+    }
+
+    entry.signature = library_signature(entry.context);
+
+    /* Entries past the header count are leftovers of an interrupted write */
+    uint64_t offset = sizeof(LibraryHeader) + writer_entry_count * sizeof(LibraryEntry);
+
+    if (file_seek(writer_file, offset, SEEK_SET) != 0 ||
+        fwrite(&entry, sizeof(entry), 1, writer_file) != 1) {
+        return INFER_ERROR_FAILED_OPERATION;
+    }
+
+    writer_entry_count++;
+
+    return writer_update_header() ? 0 : INFER_ERROR_FAILED_OPERATION;
+}
+
+void library_writer_close() {
+
+    if (writer_file) {
+        fclose(writer_file);
+        writer_file = NULL;
+    }
+}
@@ -0,0 +1,84 @@
+/**
+ * @file structure_library.h
+ * @brief Library of pregenerated (context, result) pairs. When a new context is close
+ *        enough to one in the library, the stored result is returned instead of
+ *        running the 5000 model steps.
+ *
+ *  The library file is a LibraryHeader followed by fixed size LibraryEntry records
+ *  and is memory mapped read-only. Each entry carries a 64 bit signature of its
+ *  context border, a SimHash of a hashed histogram of (face, block id) pairs. At load
+ *  time the signatures are split into bands and bucketed, so a lookup only compares
+ *  the query against entries that share at least one band (locality-sensitive
+ *  hashing). Candidates are then scored by the fraction of identical context voxels.
+ *
+ *  From version 2 every entry is stored in the canonical orientation of its context
+ *  (symmetry.h), with the result transformed to match. A query is canonicalized the
+ *  same way and a hit is transformed back, so one entry answers the context turned
+ *  or mirrored any of the 8 ways. Version 1 libraries are still read and extended,
+ *  keyed on the contexts as they were generated.
+ *
+ *  Droppers can't be turned (symmetry.h). Contexts holding one are keyed as they
+ *  are. A result holding one is only stored, and only served, in its context's
+ *  canonical orientation, so it never comes back facing the wrong way.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "packed_chunk.h"
+
+const uint32_t LIBRARY_MAGIC   = 0x424C5856; /* "VXLB" little endian */
+const uint32_t LIBRARY_VERSION = 2;
+const uint32_t LIBRARY_VERSION_CANONICAL = 2; /* First version with canonical entries */
+
+struct LibraryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t entry_count;
+};
+
+struct LibraryEntry {
+    uint64_t signature;
+    uint8_t context[PACKED_CONTEXT_RECORD_SIZE];
+    uint8_t result[PACKED_CHUNK_RECORD_SIZE];
+};
+
+static_assert(sizeof(LibraryHeader) == 16, "LibraryHeader must not contain padding");
+static_assert(sizeof(LibraryEntry) == 8 + PACKED_CONTEXT_RECORD_SIZE + PACKED_CHUNK_RECORD_SIZE,
+              "LibraryEntry must not contain padding");
+
+/**
+ * @brief Compute the border signature of a packed 16^3 context.
+ */
+uint64_t library_signature(const uint8_t* context);
+
+/**
+ * @brief Map a library file and build the band index. Replaces any loaded library.
+ * @return 0 on success, error code on failure.
+ */
+int library_load(const char* path);
+
+/**
+ * @brief Find the closest stored context. Updates the STAT_LIBRARY_ counters.
+ * @param context Packed 16^3 context ids.
+ * @param min_similarity Fraction of identical context voxels required for a hit.
+ * @param result Receives the packed 14^3 result on a hit, in the orientation of the query.
+ * @return true on a hit.
+ */
+bool library_lookup(const uint8_t* context, float min_similarity, uint8_t* result);
+
+/**
+ * @brief Bytes of the mapped entries plus the band index.
+ */
+int64_t library_memory_bytes();
+
+/**
+ * @brief Writer used by the offline tools to build a library file.
+ *        Entries are appended and the header count is kept current, so a
+ *        partially built library is still valid.
+ * @return 0 on success, error code on failure.
+ */
+int library_writer_open(const char* path);
+int library_writer_append(const uint8_t* context, const uint8_t* result);
+void library_writer_close();
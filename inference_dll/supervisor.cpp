@@ -0,0 +1,189 @@
+/**
+ * @file supervisor.cpp
+ * @brief Backend restarts and failover. See supervisor.h.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inference.h"
+#include "backend.h"
+#include "stats.h"
+#include "supervisor.h"
+
+/* Everything below belongs to the denoise thread */
+static DenoiseBackend* current;
+static bool current_is_primary;
+static bool fallback_read;
+static bool fallback_enabled;
+
+static int failures;            /* Since a job last finished on the primary */
+static int backoff_ms = SUPERVISOR_FIRST_BACKOFF_MS;
+static int64_t retry_at_ns;     /* Earliest time to initialize the primary again */
+static bool primary_given_up;
+static bool degraded;           /* The primary is down */
+
+static std::atomic<int> last_error;
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Pick the backend the DLL was built for, see backend.h.
+ */
+static DenoiseBackend* create_primary_backend() {
+#if defined(INFERENCE_MOCK_BACKEND)
+    return create_mock_backend();
+#else
+    return create_tensorrt_backend();
+#endif
+}
+
+/**
+ * @brief Count a failure of the primary and schedule the next attempt.
+ */
+static void primary_failed(int error) {
+
+    last_error = error;
+    inference_set_last_error(error);
+    stat_add(STAT_BACKEND_FAILURES, 1);
+
+    if (!degraded) {
+        degraded = true;
+        stat_add(STAT_BACKEND_DEGRADED, 1);
+    }
+
+    if (++failures >= SUPERVISOR_MAX_FAILURES) {
+        printf("Giving up on the primary backend after %d failures\n", failures);
+        primary_given_up = true;
+        return;
+    }
+
+    printf("Retrying the primary backend in %d ms\n", backoff_ms);
+    retry_at_ns = now_ns() + (int64_t)backoff_ms * 1000000;
+    backoff_ms = std::min(backoff_ms * 2, SUPERVISOR_MAX_BACKOFF_MS);
+}
+
+DenoiseBackend* supervisor_backend() {
+
+    if (!fallback_read) {
+        const char* fallback = getenv("INFERENCE_BACKEND_FALLBACK");
+
+        /* Off unless asked for, the mock doesn't run the model */
+        fallback_enabled = fallback && strcmp(fallback, "mock") == 0;
+        fallback_read = true;
+    }
+
+    if (current && current_is_primary) {
+        return current;
+    }
+
+    if (!primary_given_up && now_ns() >= retry_at_ns) {
+
+        DenoiseBackend* primary = create_primary_backend();
+        int result = primary->init();
+
+        if (result == 0) {
+
+            if (failures > 0) {
+                stat_add(STAT_BACKEND_RESTARTS, 1);
+                printf("Reinitialized the %s backend\n", primary->name());
+            } else {
+                printf("Denoising with the %s backend\n", primary->name());
+            }
+
+            if (degraded) {
+                degraded = false;
+                stat_add(STAT_BACKEND_DEGRADED, -1);
+            }
+
+            delete current;
+            current = primary;
+            current_is_primary = true;
+            return current;
+        }
+
+        printf("Initializing the %s backend failed (error %d)\n", primary->name(), result);
+        delete primary;
+        primary_failed(result);
+    }
+
+    if (current || !fallback_enabled) {
+        return current;
+    }
+
+    DenoiseBackend* fallback = create_mock_backend();
+    int result = fallback->init();
+
+    if (result != 0) {
+        delete fallback;
+        last_error = result;
+        return NULL;
+    }
+
+    printf("Failing over to the %s test backend, its structures are not model output\n", fallback->name());
+    stat_add(STAT_BACKEND_FAILOVERS, 1);
+
+    current = fallback;
+    current_is_primary = false;
+    return current;
+}
+
+bool supervisor_retry_pending() {
+    return !current && degraded && !primary_given_up;
+}
+
+void supervisor_wait_for_retry() {
+
+    if (!supervisor_retry_pending()) {
+        return;
+    }
+
+    int64_t wait_ns = retry_at_ns - now_ns();
+
+    if (wait_ns > 0) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(wait_ns));
+    }
+}
+
+void supervisor_backend_failed(int error) {
+
+    if (!current) {
+        return;
+    }
+
+    printf("The %s backend failed (error %d)\n", current->name(), error);
+
+    if (current_is_primary) {
+        primary_failed(error);
+    } else {
+        last_error = error;
+        inference_set_last_error(error);
+        stat_add(STAT_BACKEND_FAILURES, 1);
+    }
+
+    delete current;
+    current = NULL;
+    current_is_primary = false;
+}
+
+void supervisor_job_succeeded() {
+
+    if (current_is_primary && failures > 0) {
+        failures = 0;
+        backoff_ms = SUPERVISOR_FIRST_BACKOFF_MS;
+    }
+}
+
+int supervisor_last_error() {
+    return last_error;
+}
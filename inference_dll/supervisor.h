@@ -0,0 +1,74 @@
+/**
+ * @file supervisor.h
+ * @brief Keeps the denoise thread supplied with a working backend.
+ *
+ *  Before this a failed CUDA call ended the denoise thread and every later job
+ *  waited forever. Now the denoise thread asks the supervisor for a backend before
+ *  each job and reports failed backend calls to it:
+ *
+ *   - The job whose call failed is queued again and resumes from its last
+ *     published latent (job_requeue()), on whichever backend runs next.
+ *   - The failed backend is released. If a fallback is configured the supervisor
+ *     fails over to it right away and runs degraded, otherwise jobs stay queued
+ *     until the primary is retried.
+ *   - The primary is reinitialized between jobs after a backoff that doubles from
+ *     SUPERVISOR_FIRST_BACKOFF_MS to SUPERVISOR_MAX_BACKOFF_MS. After
+ *     SUPERVISOR_MAX_FAILURES failures without a job finishing on the primary in
+ *     between, it's given up on for the rest of the session, and from then on
+ *     jobs fail with the backend's error.
+ *
+ *  There is no CPU implementation of the model, so by default there is no fallback
+ *  and jobs wait while the primary is down. INFERENCE_BACKEND_FALLBACK=mock opts in
+ *  to failing over to the mock backend of backend.h. It's a test backend that
+ *  doesn't run the model, so what it produces isn't a real generation; only use it
+ *  to exercise failover. Failures, restarts, failovers, requeued jobs and whether
+ *  the supervisor is running degraded are in stats.h.
+ *
+ *  A CUDA error that corrupts the context ("sticky" errors) survives
+ *  reinitialization, so those only recover by failing over.
+ */
+
+#pragma once
+
+#include "backend.h"
+
+const int SUPERVISOR_FIRST_BACKOFF_MS = 1000;
+const int SUPERVISOR_MAX_BACKOFF_MS = 60000;
+const int SUPERVISOR_MAX_FAILURES = 10;
+
+/**
+ * @brief Backend to run the next job on. Called by the denoise thread only, which
+ *        is also where backends are created and initialized.
+ * @return NULL if the primary is down and there is no fallback. The job should
+ *         then be queued again if supervisor_retry_pending(), and fail with
+ *         supervisor_last_error() otherwise.
+ */
+DenoiseBackend* supervisor_backend();
+
+/**
+ * @return true while there is no backend but the primary will be retried, so jobs
+ *         should wait for it rather than fail.
+ */
+bool supervisor_retry_pending();
+
+/**
+ * @brief Sleep until the primary is due to be retried, if supervisor_retry_pending().
+ */
+void supervisor_wait_for_retry();
+
+/**
+ * @brief Report that a call on the backend from supervisor_backend() failed. The
+ *        backend is deleted.
+ */
+void supervisor_backend_failed(int error);
+
+/**
+ * @brief Report that a job finished on the backend, which resets the backoff if
+ *        it's the primary.
+ */
+void supervisor_job_succeeded();
+
+/**
+ * @return Error of the latest backend failure, 0 if none.
+ */
+int supervisor_last_error();
@@ -0,0 +1,122 @@
+/**
+ * @file symmetry.cpp
+ * @brief Horizontal symmetries of packed volumes. See symmetry.h.
+ */
+
+#include <mutex>
+
+#include <string.h>
+#include <stdint.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "symmetry.h"
+
+/* Directions in clockwise order, so a quarter turn adds one */
+const int DIRECTION_NORTH = 0;
+const int DIRECTION_EAST  = 1;
+const int DIRECTION_SOUTH = 2;
+const int DIRECTION_WEST  = 3;
+
+/* Stairs ids by [top][facing], see the palette in DiffusionMod.BLOCK_STATES */
+static const int stairs_ids[2][4] = {
+    { 18, 20, 19, 21 },
+    { 27, 29, 26, 28 },
+};
+
+const int PANE_ID_EAST_WEST   = 11;
+const int PANE_ID_NORTH_SOUTH = 14;
+
+/* Only facing north, see symmetry_has_fixed_ids() */
+const int DROPPER_ID_NORTH = 30;
+
+/* Remapped ids by symmetry. Ids past the palette map to themselves */
+static uint8_t symmetry_ids[SYMMETRY_COUNT][256];
+static std::once_flag symmetry_ids_once;
+
+static int transform_direction(int symmetry, int direction) {
+
+    if (symmetry & 4) {
+        /* Mirroring x swaps east and west */
+        direction = (4 - direction) & 3;
+    }
+
+    return (direction + symmetry) & 3;
+}
+
+static void build_symmetry_ids() {
+
+    for (int symmetry = 0; symmetry < SYMMETRY_COUNT; symmetry++) {
+
+        uint8_t* ids = symmetry_ids[symmetry];
+
+        for (int id = 0; id < 256; id++) {
+            ids[id] = (uint8_t)id;
+        }
+
+        for (int top = 0; top < 2; top++) {
+            for (int direction = DIRECTION_NORTH; direction <= DIRECTION_WEST; direction++) {
+                ids[stairs_ids[top][direction]] = (uint8_t)stairs_ids[top][transform_direction(symmetry, direction)];
+            }
+        }
+
+        if (symmetry & 1) {
+            ids[PANE_ID_EAST_WEST] = PANE_ID_NORTH_SOUTH;
+            ids[PANE_ID_NORTH_SOUTH] = PANE_ID_EAST_WEST;
+        }
+    }
+}
+
+void symmetry_apply(int symmetry, const uint8_t* in, uint8_t* out, int width) {
+
+    std::call_once(symmetry_ids_once, build_symmetry_ids);
+
+    const uint8_t* ids = symmetry_ids[symmetry];
+    const int last = width - 1;
+
+    for (int x = 0; x < width; x++) {
+        for (int z = 0; z < width; z++) {
+
+            int out_x = (symmetry & 4) ? last - x : x;
+            int out_z = z;
+
+            for (int turn = 0; turn < (symmetry & 3); turn++) {
+                int turned_x = last - out_z;
+                out_z = out_x;
+                out_x = turned_x;
+            }
+
+            for (int y = 0; y < width; y++) {
+                out[packed_index(out_x, y, out_z, width)] = ids[in[packed_index(x, y, z, width)]];
+            }
+        }
+    }
+}
+
+bool symmetry_has_fixed_ids(const uint8_t* ids, int count) {
+    return memchr(ids, DROPPER_ID_NORTH, count) != NULL;
+}
+
+int symmetry_canonicalize(const uint8_t* context, uint8_t* canonical) {
+
+    uint8_t candidate[PACKED_CONTEXT_RECORD_SIZE];
+    int best = SYMMETRY_IDENTITY;
+
+    memcpy(canonical, context, PACKED_CONTEXT_RECORD_SIZE);
+
+    if (symmetry_has_fixed_ids(context, PACKED_CONTEXT_RECORD_SIZE)) {
+        return best;
+    }
+
+    for (int symmetry = 1; symmetry < SYMMETRY_COUNT; symmetry++) {
+
+        symmetry_apply(symmetry, context, candidate, CHUNK_WIDTH);
+
+        if (memcmp(candidate, canonical, PACKED_CONTEXT_RECORD_SIZE) < 0) {
+            memcpy(canonical, candidate, PACKED_CONTEXT_RECORD_SIZE);
+            best = symmetry;
+        }
+    }
+
+    return best;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file symmetry.h
+ * @brief The 8 horizontal symmetries of a volume, for canonical context keys.
+ *
+ *  Terrain has no preferred direction, so the same hillside shows up turned by
+ *  90 degrees or mirrored as often as it shows up as is. Keyed on the raw context,
+ *  the structure library only finds the orientation it was generated in. Keyed on a
+ *  canonical orientation, one entry answers all 8.
+ *
+ *  A symmetry turns the volume about the y axis and may mirror it first:
+ *
+ *   symmetry = quarter_turns | (mirror << 2)
+ *
+ *  Mirroring flips x, each quarter turn is clockwise seen from above (north, -z,
+ *  turns to east, +x). Ids of the palette that face a direction are remapped along
+ *  with the voxels: the stairs variants turn their facing and a quarter turn swaps
+ *  the axis of the panes. Stairs shapes and pane connections aren't part of the ids,
+ *  they're computed from the transformed ids afterwards (block_states.h).
+ *
+ *  The dropper only has a north facing id, so a volume holding one has no turned
+ *  or mirrored version. A context with a dropper is its own canonical orientation,
+ *  and a result with one must not be transformed (symmetry_has_fixed_ids()).
+ *
+ *  The canonical orientation of a context is the one whose packed ids compare
+ *  lowest. Ties, from contexts with symmetries of their own, give the same ids
+ *  whichever orientation wins. The first differing voxel decides, and that is
+ *  nearly always on the first face in packed order, so a near duplicate that
+ *  differs elsewhere still picks the same orientation.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+const int SYMMETRY_COUNT    = 8;
+const int SYMMETRY_IDENTITY = 0;
+
+/**
+ * @brief The symmetry that undoes another. Mirrored ones are their own inverse.
+ */
+inline int symmetry_inverse(int symmetry) {
+    return (symmetry & 4) ? symmetry : ((4 - symmetry) & 3);
+}
+
+/**
+ * @brief Transform a packed width^3 volume of ids.
+ * @param out Receives the transformed volume, must not alias in.
+ */
+void symmetry_apply(int symmetry, const uint8_t* in, uint8_t* out, int width);
+
+/**
+ * @return true if the ids hold a block that faces a direction without ids for
+ *         the others, so symmetry_apply() can't turn it.
+ */
+bool symmetry_has_fixed_ids(const uint8_t* ids, int count);
+
+/**
+ * @brief Find the canonical orientation of a packed CHUNK_WIDTH^3 context. A
+ *        context with fixed ids is canonical as it is.
+ * @param canonical Receives the context in that orientation.
+ * @return The symmetry that maps the context to its canonical orientation.
+ */
+int symmetry_canonicalize(const uint8_t* context, uint8_t* canonical);
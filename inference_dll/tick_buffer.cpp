@@ -0,0 +1,292 @@
+/**
+ * @file tick_buffer.cpp
+ * @brief Per tick command buffer entry points. See tick_buffer.h for the layout.
+ *
+ *  Unlike inference_main.cpp this file includes "jni.h", since the buffers are
+ *  handed over as direct ByteBuffers and only the JNIEnv can resolve their
+ *  addresses. That happens once at registration; tick() itself only takes
+ *  primitive arguments.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <jni.h>
+
+#include "inference.h"
+#include "packed_chunk.h"
+#include "job_queue.h"
+#include "stats.h"
+#include "tick_buffer.h"
+#include "recorder.h"
+#include "trace.h"
+
+static uint8_t* command_buffer;
+static int64_t command_capacity;
+static uint8_t* event_buffer;
+static int64_t event_capacity;
+
+/**
+ * @brief Appends events to event_buffer, keeping room for an OVERFLOW event.
+ */
+struct EventWriter {
+    int64_t used = 0;
+    bool overflowed = false;
+
+    bool fits(int64_t bytes) {
+
+        if (used + bytes + (int64_t)sizeof(int32_t) <= event_capacity) {
+            return true;
+        }
+
+        if (!overflowed) {
+            int32_t overflow = TICK_EVENT_OVERFLOW;
+            memcpy(event_buffer + used, &overflow, sizeof(overflow));
+            used += sizeof(overflow);
+            overflowed = true;
+        }
+
+        return false;
+    }
+
+    void put(const void* data, int64_t bytes) {
+        memcpy(event_buffer + used, data, bytes);
+        used += (bytes + 3) & ~3;
+    }
+};
+
+static void put_error(EventWriter& events, int32_t job_id, int32_t command, int32_t error) {
+
+    int32_t event[4] = { TICK_EVENT_ERROR, job_id, command, error };
+
+    if (events.fits(sizeof(event))) {
+        events.put(event, sizeof(event));
+    }
+}
+
+/**
+ * @brief Run a READ command. The worst case event size is checked before reading,
+ *        since a SPARSE_OUTPUT_CHANGED read moves the job's baseline forward and
+ *        the entries can't be produced a second time.
+ */
+static void run_read(EventWriter& events, int32_t job_id, int32_t mode) {
+
+    static uint8_t block_ids[PACKED_CHUNK_RECORD_SIZE];
+    static int32_t sparse_entries[PACKED_CHUNK_RECORD_SIZE];
+
+    int64_t payload = (mode == SPARSE_OUTPUT_OFF) ? PACKED_CHUNK_RECORD_SIZE
+                                                  : PACKED_CHUNK_RECORD_SIZE * sizeof(int32_t);
+
+    if (!events.fits(TICK_SNAPSHOT_HEADER + payload)) {
+        return;
+    }
+
+    int32_t sparse_count = 0;
+    int32_t t = job_read(job_id, mode, true, block_ids, sparse_entries, &sparse_count);
+
+    if (t == JOB_READ_UNKNOWN) {
+        put_error(events, job_id, TICK_COMMAND_READ, INFER_ERROR_INVALID_ARG);
+        return;
+    }
+
+    if (t == JOB_READ_UNCHANGED) {
+        return;
+    }
+
+    int32_t count = (mode == SPARSE_OUTPUT_OFF) ? PACKED_CHUNK_RECORD_SIZE : sparse_count;
+    int32_t header[5] = { TICK_EVENT_SNAPSHOT, job_id, t, mode, count };
+
+    events.put(header, sizeof(header));
+
+    if (mode == SPARSE_OUTPUT_OFF) {
+        events.put(block_ids, PACKED_CHUNK_RECORD_SIZE);
+    } else {
+        events.put(sparse_entries, sparse_count * sizeof(int32_t));
+    }
+}
+
+/**
+ * @brief Run a READ_LIGHT command.
+ */
+static void run_read_light(EventWriter& events, int32_t job_id) {
+
+    static uint8_t record[LIGHT_RECORD_SIZE];
+
+    if (!events.fits(TICK_LIGHT_BYTES)) {
+        return;
+    }
+
+    int32_t result = job_read_light(job_id, record);
+
+    if (result == JOB_READ_UNKNOWN) {
+        put_error(events, job_id, TICK_COMMAND_READ_LIGHT, INFER_ERROR_INVALID_ARG);
+        return;
+    }
+
+    if (result == JOB_READ_UNCHANGED) {
+        return;
+    }
+
+    int32_t header[2] = { TICK_EVENT_LIGHT, job_id };
+
+    events.put(header, sizeof(header));
+    events.put(record, LIGHT_RECORD_SIZE);
+}
+
+int tick_register_buffers(uint8_t* commands, int64_t commands_size, uint8_t* events, int64_t events_size) {
+
+    record_call(RECORD_REGISTER_TICK_BUFFERS, { (int32_t)commands_size, (int32_t)events_size });
+
+    /* An event buffer must at least hold one dense snapshot */
+    if (!commands || !events || commands_size < 0 ||
+        events_size < TICK_SNAPSHOT_HEADER + PACKED_CHUNK_RECORD_SIZE * (int64_t)sizeof(int32_t) + (int64_t)sizeof(int32_t)) {
+
+        inference_set_last_error(INFER_ERROR_INVALID_ARG);
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    command_buffer = commands;
+    command_capacity = commands_size;
+    event_buffer = events;
+    event_capacity = events_size;
+
+    return 0;
+}
+
+/**
+ * @brief registerTickBuffers
+ *  Register the direct ByteBuffers used by every later tick() call. The buffers
+ *  must stay reachable on the Java side for as long as tick() is used.
+ * @param: commands Written by Java, read by tick()
+ * @param: events Written by tick(), read by Java
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_registerTickBuffers(JNIEnv* env, jclass unused,
+        jobject commands, jobject events) {
+
+    return tick_register_buffers((uint8_t*)env->GetDirectBufferAddress(commands),
+                                 env->GetDirectBufferCapacity(commands),
+                                 (uint8_t*)env->GetDirectBufferAddress(events),
+                                 env->GetDirectBufferCapacity(events));
+}
+
+/**
+ * @brief tick
+ *  Execute the commands written to the command buffer, then report finished jobs.
+ *  Events are written to the event buffer.
+ * @param: command_bytes Bytes of commands written from the start of the buffer
+ * @return: Bytes of events written, or -1 on failure
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_tick(void* unused1, void* unused2, int32_t command_bytes) {
+
+    if (!command_buffer || !event_buffer) {
+        record_call(RECORD_TICK, { command_bytes });
+        inference_set_last_error(INFER_ERROR_INVALID_OPERATION);
+        return -1;
+    }
+
+    if (command_bytes < 0 || command_bytes > command_capacity || (command_bytes & 3)) {
+        record_call(RECORD_TICK, { command_bytes });
+        inference_set_last_error(INFER_ERROR_INVALID_ARG);
+        return -1;
+    }
+
+    record_call(RECORD_TICK, { command_bytes }, command_buffer, command_bytes);
+
+    const int32_t* words = (const int32_t*)command_buffer;
+    int32_t word_count = command_bytes / (int32_t)sizeof(int32_t);
+    int32_t commands = 0;
+    EventWriter events;
+
+    for (int32_t i = 0; i < word_count; commands++) {
+
+        int32_t type = words[i];
+        int32_t job_id = (i + 1 < word_count) ? words[i + 1] : 0;
+
+        if (type == TICK_COMMAND_SUBMIT && i + TICK_SUBMIT_BYTES / (int32_t)sizeof(int32_t) <= word_count) {
+
+            /* Ids from ASYNC_JOB_ID_FIRST up are handed out by async_jobs.cpp */
+            int result = (job_id > 0 && job_id < ASYNC_JOB_ID_FIRST) ? job_submit(job_id, (const uint8_t*)&words[i + 2])
+                                                                     : INFER_ERROR_INVALID_ARG;
+
+            if (result != 0) {
+                put_error(events, job_id, type, result);
+            }
+
+            i += TICK_SUBMIT_BYTES / sizeof(int32_t);
+
+        } else if (type == TICK_COMMAND_CANCEL && i + 2 <= word_count) {
+
+            int result = (job_id > 0) ? job_cancel(job_id) : INFER_ERROR_INVALID_ARG;
+
+            if (result != 0) {
+                put_error(events, job_id, type, result);
+            }
+
+            i += 2;
+
+        } else if (type == TICK_COMMAND_READ && i + 3 <= word_count) {
+
+            int32_t mode = words[i + 2];
+
+            if (job_id > 0 && (mode == SPARSE_OUTPUT_OFF || mode == SPARSE_OUTPUT_NON_AIR || mode == SPARSE_OUTPUT_CHANGED ||
+                               mode == SPARSE_OUTPUT_CHANGED_STATES)) {
+                run_read(events, job_id, mode);
+            } else {
+                put_error(events, job_id, type, INFER_ERROR_INVALID_ARG);
+            }
+
+            i += 3;
+
+        } else if (type == TICK_COMMAND_TRACE && i + TICK_TRACE_BYTES / (int32_t)sizeof(int32_t) <= word_count) {
+
+            int32_t mark = words[i + 2];
+            int64_t ns = (int64_t)(((uint64_t)(uint32_t)words[i + 4] << 32) | (uint32_t)words[i + 3]);
+
+            /* The native marks come from the job table */
+            if (job_id > 0 && (mark == TRACE_MARK_USED || mark == TRACE_MARK_CAPTURE_START || mark == TRACE_MARK_APPLIED)) {
+                trace_mark(job_id, mark, ns);
+            } else {
+                put_error(events, job_id, type, INFER_ERROR_INVALID_ARG);
+            }
+
+            i += TICK_TRACE_BYTES / sizeof(int32_t);
+
+        } else if (type == TICK_COMMAND_READ_LIGHT && i + 2 <= word_count) {
+
+            if (job_id > 0) {
+                run_read_light(events, job_id);
+            } else {
+                put_error(events, job_id, type, INFER_ERROR_INVALID_ARG);
+            }
+
+            i += 2;
+
+        } else {
+            /* Unknown or truncated command, the rest of the buffer can't be parsed */
+            put_error(events, job_id, type, INFER_ERROR_INVALID_ARG);
+            break;
+        }
+    }
+
+    int32_t completed[4] = { TICK_EVENT_COMPLETED };
+    JobReceipt receipt;
+
+    while (events.fits(TICK_RECEIPT_BYTES + sizeof(completed)) &&
+           job_collect_finished(&completed[1], &completed[2], &completed[3], &receipt)) {
+
+        int32_t header[2] = { TICK_EVENT_RECEIPT, completed[1] };
+
+        events.put(header, sizeof(header));
+        events.put(&receipt, sizeof(receipt));
+        events.put(completed, sizeof(completed));
+    }
+
+    stat_add(STAT_TICK_CALLS, 1);
+    stat_add(STAT_TICK_COMMANDS, commands);
+    stat_add(STAT_TICK_EVENT_BYTES, events.used);
+
+    return (int32_t)events.used;
+}
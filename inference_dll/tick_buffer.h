@@ -0,0 +1,75 @@
+/**
+ * @file tick_buffer.h
+ * @brief Layout of the per tick command and event buffers.
+ *
+ *  The mod registers two direct ByteBuffers once with registerTickBuffers(). Every
+ *  server tick it writes its commands into the first buffer and makes a single
+ *  tick() call, which executes the commands and fills the second buffer with
+ *  events. The number of native calls per tick is then the same however many
+ *  players and jobs there are.
+ *
+ *  Both buffers hold int32 words in native byte order. Every command and event
+ *  starts with its type, and everything stays 4 byte aligned.
+ *
+ *  Commands:
+ *   SUBMIT  job_id, then PACKED_CONTEXT_RECORD_SIZE context id bytes
+ *   CANCEL  job_id
+ *   READ    job_id, SPARSE_OUTPUT_ mode. Produces a SNAPSHOT event only if a newer
+ *           timestep than the previous read is available.
+ *   TRACE   job_id, TRACE_MARK_ constant, low and high word of a System.nanoTime()
+ *           value. Records a mark only the mod can see, see trace.h.
+ *   READ_LIGHT  job_id. Produces a LIGHT event once, in the tick the final snapshot
+ *           was read or any later one before the job completes. Send it after
+ *           the READ of the same job.
+ *
+ *  Events:
+ *   SNAPSHOT   job_id, timestep, mode, count, then count sparse entries, or for
+ *              SPARSE_OUTPUT_OFF count = PACKED_CHUNK_RECORD_SIZE id bytes padded
+ *              to a multiple of 4
+ *   RECEIPT    job_id, then the JOB_RECEIPT_FIELDS int64 fields of JobReceipt
+ *              (job_queue.h) in native byte order. Comes right before the job's
+ *              COMPLETED event.
+ *   COMPLETED  job_id, JOB_STATE_ constant, error. Reported once per job with a
+ *              positive id, after its final snapshot was read. The job id can be
+ *              reused afterwards.
+ *   LIGHT      job_id, then the LIGHT_RECORD_SIZE bytes of the final structure's
+ *              light record, see light.h
+ *   ERROR      job_id, command type, error code of a rejected command
+ *   OVERFLOW   No fields. The event buffer ran out of space. Reads that didn't fit
+ *              are still pending and completions are reported on a later tick.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "packed_chunk.h"
+#include "job_queue.h"
+#include "light.h"
+
+const int32_t TICK_COMMAND_SUBMIT = 1;
+const int32_t TICK_COMMAND_CANCEL = 2;
+const int32_t TICK_COMMAND_READ   = 3;
+const int32_t TICK_COMMAND_TRACE  = 4;
+const int32_t TICK_COMMAND_READ_LIGHT = 5;
+
+const int32_t TICK_EVENT_SNAPSHOT  = 1;
+const int32_t TICK_EVENT_COMPLETED = 2;
+const int32_t TICK_EVENT_ERROR     = 3;
+const int32_t TICK_EVENT_OVERFLOW  = 4;
+const int32_t TICK_EVENT_RECEIPT   = 5;
+const int32_t TICK_EVENT_LIGHT     = 6;
+
+const int TICK_SUBMIT_BYTES    = 2 * sizeof(int32_t) + PACKED_CONTEXT_RECORD_SIZE;
+const int TICK_TRACE_BYTES     = 5 * sizeof(int32_t);
+const int TICK_SNAPSHOT_HEADER = 5 * sizeof(int32_t);
+const int TICK_RECEIPT_BYTES   = 2 * sizeof(int32_t) + JOB_RECEIPT_FIELDS * sizeof(int64_t);
+const int TICK_LIGHT_BYTES     = 2 * sizeof(int32_t) + LIGHT_RECORD_SIZE;
+
+/**
+ * @brief Register the command and event buffers without going through JNI, as
+ *        registerTickBuffers() does. Used by the native tools.
+ * @return 0 on success, INFER_ERROR_INVALID_ARG if the event buffer can't hold a
+ *         dense snapshot.
+ */
+int tick_register_buffers(uint8_t* commands, int64_t commands_size, uint8_t* events, int64_t events_size);
@@ -0,0 +1,229 @@
+/**
+ * @file trace.cpp
+ * @brief Request timelines and phase percentiles. See trace.h.
+ */
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "inference.h"
+#include "stats.h"
+#include "recorder.h"
+#include "trace.h"
+
+const int64_t TRACE_NO_MARK = INT64_MIN;
+
+struct Trace {
+    int32_t job_id;
+    bool used;
+    int64_t marks[TRACE_MARK_COUNT];
+    uint64_t touched;           /* Order of the latest mark, for dropping the oldest */
+};
+
+static std::mutex trace_mtx;
+static Trace traces[TRACE_MAX_REQUESTS];
+static uint64_t next_touch;
+
+/* Ring of the phases of recently applied requests, TRACE_NO_MARK where missing */
+static int64_t window[TRACE_WINDOW][TRACE_PHASE_COUNT];
+static int window_next;
+static int window_count;
+
+static TraceHistogram histograms[TRACE_PHASE_COUNT];
+
+static void reset_trace(Trace& trace, int32_t job_id) {
+
+    trace.job_id = job_id;
+    trace.used = true;
+
+    for (int mark = 0; mark < TRACE_MARK_COUNT; mark++) {
+        trace.marks[mark] = TRACE_NO_MARK;
+    }
+}
+
+/**
+ * @brief Trace of a request with trace_mtx held, or NULL.
+ */
+static Trace* find_trace(int32_t job_id) {
+
+    for (Trace& trace : traces) {
+        if (trace.used && trace.job_id == job_id) {
+            return &trace;
+        }
+    }
+
+    return NULL;
+}
+
+static int64_t phase_of(const Trace& trace, int phase) {
+
+    int first = (phase == TRACE_PHASE_TOTAL) ? TRACE_MARK_USED : phase;
+    int last = (phase == TRACE_PHASE_TOTAL) ? TRACE_MARK_APPLIED : phase + 1;
+
+    if (trace.marks[first] == TRACE_NO_MARK || trace.marks[last] == TRACE_NO_MARK) {
+        return TRACE_NO_MARK;
+    }
+
+    return trace.marks[last] - trace.marks[first];
+}
+
+void trace_mark(int32_t job_id, int mark, int64_t ns) {
+
+    if (mark < 0 || mark >= TRACE_MARK_COUNT) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(trace_mtx);
+
+    Trace* trace = find_trace(job_id);
+
+    if (!trace) {
+        trace = &traces[0];
+
+        for (Trace& candidate : traces) {
+            if (!candidate.used) {
+                trace = &candidate;
+                break;
+            }
+            if (candidate.touched < trace->touched) {
+                trace = &candidate;
+            }
+        }
+
+        reset_trace(*trace, job_id);
+    }
+
+    for (int later = mark; later < TRACE_MARK_COUNT; later++) {
+        if (trace->marks[later] != TRACE_NO_MARK) {
+            reset_trace(*trace, job_id);
+            break;
+        }
+    }
+
+    trace->marks[mark] = ns;
+    trace->touched = next_touch++;
+
+    if (mark == TRACE_MARK_APPLIED) {
+
+        for (int phase = 0; phase < TRACE_PHASE_COUNT; phase++) {
+
+            int64_t ns = phase_of(*trace, phase);
+            window[window_next][phase] = ns;
+
+            if (ns == TRACE_NO_MARK) {
+                continue;
+            }
+
+            TraceHistogram& histogram = histograms[phase];
+
+            for (int bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS; bucket++) {
+                histogram.buckets[bucket] += (ns <= trace_histogram_bounds_ns[bucket]) ? 1 : 0;
+            }
+
+            histogram.count++;
+            histogram.sum_ns += ns;
+        }
+
+        window_next = (window_next + 1) % TRACE_WINDOW;
+        window_count = std::min(window_count + 1, TRACE_WINDOW);
+        stat_add(STAT_TRACES_APPLIED, 1);
+    }
+}
+
+int64_t trace_phase(int32_t job_id, int phase) {
+
+    if (phase < 0 || phase >= TRACE_PHASE_COUNT) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(trace_mtx);
+
+    Trace* trace = find_trace(job_id);
+    int64_t ns = trace ? phase_of(*trace, phase) : TRACE_NO_MARK;
+
+    return (ns == TRACE_NO_MARK) ? -1 : ns;
+}
+
+int64_t trace_percentile(int phase, int32_t permille) {
+
+    if (phase < 0 || phase >= TRACE_PHASE_COUNT || permille < 0 || permille > 1000) {
+        return -1;
+    }
+
+    std::vector<int64_t> values;
+
+    {
+        std::lock_guard<std::mutex> lock(trace_mtx);
+
+        values.reserve(window_count);
+
+        for (int i = 0; i < window_count; i++) {
+            if (window[i][phase] != TRACE_NO_MARK) {
+                values.push_back(window[i][phase]);
+            }
+        }
+    }
+
+    if (values.empty()) {
+        return -1;
+    }
+
+    size_t rank = (size_t)(((int64_t)permille * (int64_t)(values.size() - 1) + 500) / 1000);
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+
+    return values[rank];
+}
+
+bool trace_histogram(int phase, TraceHistogram* histogram) {
+
+    if (phase < 0 || phase >= TRACE_PHASE_COUNT) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(trace_mtx);
+
+    *histogram = histograms[phase];
+    return true;
+}
+
+/**
+ * @brief getTracePhase
+ *  Length of one phase of a traced request. See trace.h.
+ * @param: job_id Job id the request was submitted with
+ * @param: phase TRACE_PHASE_ constant
+ * @return: Nanoseconds, or -1 if the phase hasn't completed or isn't known
+ */
+extern "C" DLL_EXPORT
+int64_t Java_tbarnes_diffusionmod_Inference_getTracePhase(void* unused1, void* unused2,
+        int32_t job_id, int32_t phase) {
+
+    record_call(RECORD_GET_TRACE_PHASE, { job_id, phase });
+
+    return trace_phase(job_id, phase);
+}
+
+/**
+ * @brief getTracePercentile
+ *  Percentile of one phase over recently applied requests.
+ * @param: phase TRACE_PHASE_ constant
+ * @param: permille Percentile in tenths of a percent, 990 for p99
+ * @return: Nanoseconds, or -1 if no applied request has the phase
+ */
+extern "C" DLL_EXPORT
+int64_t Java_tbarnes_diffusionmod_Inference_getTracePercentile(void* unused1, void* unused2,
+        int32_t phase, int32_t permille) {
+
+    record_call(RECORD_GET_TRACE_PERCENTILE, { phase, permille });
+
+    int64_t ns = trace_percentile(phase, permille);
+
+    if (ns < 0 && (phase < 0 || phase >= TRACE_PHASE_COUNT || permille < 0 || permille > 1000)) {
+        inference_set_last_error(INFER_ERROR_INVALID_ARG);
+    }
+
+    return ns;
+}
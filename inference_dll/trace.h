@@ -0,0 +1,96 @@
+/**
+ * @file trace.h
+ * @brief Per request timelines from the use of the egg to the last block placed.
+ *
+ *  A request is traced under its job id. Each boundary it crosses is a mark with
+ *  a timestamp. The mod sends the marks only it can see as TRACE commands in the
+ *  tick command buffer (tick_buffer.h), and the job table adds the native ones:
+ *
+ *   USED           Java, DIFFUSION_EGG.useOn()
+ *   CAPTURE_START  Java, the tick that reads the context from the world
+ *   SUBMITTED      native, the SUBMIT command was accepted
+ *   STARTED        native, the denoise thread first picked the job
+ *   DENOISED       native, the last timestep finished
+ *   DELIVERED      native, the final snapshot was read and the completion reported
+ *   APPLIED        Java, the final snapshot was placed in the world
+ *
+ *  A phase is the time between two consecutive marks, plus TRACE_PHASE_TOTAL from
+ *  USED to APPLIED. Phases can be read per request with getTracePhase(), and once
+ *  a request is APPLIED its phases are added to a window of recent requests that
+ *  getTracePercentile() reads, and to histograms over every applied request since
+ *  init() for the metrics export (metrics_export.h).
+ *
+ *  Java marks are System.nanoTime() values. That reads the same monotonic clock as
+ *  std::chrono::steady_clock (QueryPerformanceCounter on Windows, CLOCK_MONOTONIC
+ *  on Linux), so both sides' marks can be subtracted directly.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+const int TRACE_MARK_USED          = 0;
+const int TRACE_MARK_CAPTURE_START = 1;
+const int TRACE_MARK_SUBMITTED     = 2;
+const int TRACE_MARK_STARTED       = 3;
+const int TRACE_MARK_DENOISED      = 4;
+const int TRACE_MARK_DELIVERED     = 5;
+const int TRACE_MARK_APPLIED       = 6;
+const int TRACE_MARK_COUNT         = 7;
+
+/* Phase i runs from mark i to mark i + 1 */
+const int TRACE_PHASE_WAIT_CAPTURE = 0; /* Use to the tick that captures the context */
+const int TRACE_PHASE_CAPTURE      = 1; /* Context capture and the submit */
+const int TRACE_PHASE_QUEUE        = 2;
+const int TRACE_PHASE_DENOISE      = 3; /* Includes time spent preempted */
+const int TRACE_PHASE_DELIVER      = 4; /* Until the final snapshot was read and reported */
+const int TRACE_PHASE_APPLY        = 5;
+const int TRACE_PHASE_TOTAL        = 6;
+const int TRACE_PHASE_COUNT        = 7;
+
+/* Requests traced at once. The oldest one is dropped to make room. */
+const int TRACE_MAX_REQUESTS = 256;
+
+/* Finished requests the percentiles are taken over */
+const int TRACE_WINDOW = 1024;
+
+/* Upper bounds of the phase histogram buckets, from a captured context to a
+ * request queued behind a full table. Longer phases only count in +Inf. */
+const int TRACE_HISTOGRAM_BUCKETS = 15;
+
+const int64_t trace_histogram_bounds_ns[TRACE_HISTOGRAM_BUCKETS] = {
+    1000000, 5000000, 10000000, 50000000, 100000000, 250000000, 500000000,
+    1000000000, 2500000000, 5000000000, 10000000000, 30000000000, 60000000000,
+    120000000000, 300000000000,
+};
+
+struct TraceHistogram {
+    int64_t buckets[TRACE_HISTOGRAM_BUCKETS];  /* Phases up to each bound, cumulative */
+    int64_t count;                             /* All phases, the +Inf bucket */
+    int64_t sum_ns;
+};
+
+/**
+ * @brief Record a mark of a request. A mark at or before one the request already
+ *        has means the id was reused, and starts a new timeline.
+ */
+void trace_mark(int32_t job_id, int mark, int64_t ns);
+
+/**
+ * @return Length of a phase of a request in nanoseconds, -1 if a mark it needs
+ *         is missing or the request isn't traced.
+ */
+int64_t trace_phase(int32_t job_id, int phase);
+
+/**
+ * @param permille 0 to 1000, 500 for the median.
+ * @return Phase length at that percentile over the last TRACE_WINDOW applied
+ *         requests that have the phase, -1 if there are none.
+ */
+int64_t trace_percentile(int phase, int32_t permille);
+
+/**
+ * @brief Copy the histogram of a phase over every request applied since init().
+ * @return false for an unknown phase.
+ */
+bool trace_histogram(int phase, TraceHistogram* histogram);
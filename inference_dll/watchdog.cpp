@@ -0,0 +1,327 @@
+/**
+ * @file watchdog.cpp
+ * @brief Step time tracking and stall detection. See watchdog.h.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inference.h"
+#include "job_queue.h"
+#include "stats.h"
+#include "recorder.h"
+#include "watchdog.h"
+
+/* Backends times batch sizes tracked. Further combinations aren't tracked. */
+const int WATCHDOG_MAX_KEYS = 8;
+
+/* Weight of a new step in the moving averages */
+const double WATCHDOG_SMOOTHING = 1.0 / 64;
+
+struct StepExpectation {
+    const char* backend;
+    int batch_size;
+    int64_t steps;
+    double mean_ns;
+    double deviation_ns;
+};
+
+struct WatchdogStep {
+    int64_t start_ns;
+    int64_t duration_ns;
+    int32_t timestep;
+    int32_t job_id;
+    int64_t expected_ns;
+};
+
+static std::atomic<int32_t> timeout_ms{ -1 };   /* -1 until set or read from the environment */
+static std::once_flag watchdog_once;
+
+/* Step in progress, written by the denoise thread and polled by the watchdog thread.
+ * step_sequence is odd while the denoise thread updates the others, so a poll that
+ * reads the same even sequence before and after them has one step's values. */
+static std::atomic<uint64_t> step_sequence;
+static std::atomic<int64_t> step_start_ns;      /* 0 while no step is in progress */
+static std::atomic<int> step_slot;
+static std::atomic<int32_t> step_job_id;
+
+/* Denoise thread only */
+static int32_t step_timestep;
+static StepExpectation* step_expectation;
+static WatchdogStep recent[WATCHDOG_WINDOW_BEFORE + 1];
+static uint64_t recent_count;
+static WatchdogStep pending[WATCHDOG_WINDOW];
+static int pending_count;                       /* 0 while no capture is pending */
+
+static std::mutex watchdog_mtx;
+static StepExpectation expectations[WATCHDOG_MAX_KEYS];
+static WatchdogStep captured[WATCHDOG_WINDOW];
+static int captured_count;
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Fail the stalled job once and the queued jobs on every poll while the
+ *        step stays stuck.
+ */
+static void watchdog_thread_main() {
+
+    uint64_t failed_sequence = 0;
+
+    for (;;) {
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(WATCHDOG_POLL_MS));
+
+        int32_t timeout = timeout_ms;
+        uint64_t sequence = step_sequence;
+        int64_t start = step_start_ns;
+        int slot = step_slot;
+        int32_t job_id = step_job_id;
+
+        /* A step began or ended while reading, so it isn't stuck */
+        if ((sequence & 1) || step_sequence != sequence) {
+            continue;
+        }
+
+        if (timeout <= 0 || start == 0 || now_ns() - start < (int64_t)timeout * 1000000) {
+            continue;
+        }
+
+        if (sequence != failed_sequence) {
+            failed_sequence = sequence;
+            stat_add(STAT_WATCHDOG_TIMEOUTS, 1);
+            printf("Backend step of job %d stalled for over %d ms, failing it\n", job_id, timeout);
+
+            job_fail_stalled(slot, job_id, INFER_ERROR_STEP_TIMEOUT);
+        }
+
+        job_fail_queued(INFER_ERROR_STEP_TIMEOUT);
+    }
+}
+
+int watchdog_set_timeout(int32_t timeout) {
+
+    if (timeout < 0) {
+        return INFER_ERROR_INVALID_ARG;
+    }
+
+    timeout_ms = timeout;
+    return 0;
+}
+
+/**
+ * @brief Expectation of a backend and batch size with watchdog_mtx held, or NULL
+ *        if the table is full.
+ */
+static StepExpectation* find_expectation(const char* backend, int batch_size, bool create) {
+
+    for (StepExpectation& expectation : expectations) {
+
+        if (expectation.backend && expectation.batch_size == batch_size &&
+            strcmp(expectation.backend, backend) == 0) {
+            return &expectation;
+        }
+
+        if (!expectation.backend && create) {
+            expectation.backend = backend;
+            expectation.batch_size = batch_size;
+            return &expectation;
+        }
+    }
+
+    return NULL;
+}
+
+void watchdog_step_begin(int slot, int32_t job_id, int32_t t, const char* backend, int batch_size) {
+
+    std::call_once(watchdog_once, []() {
+        const char* timeout = getenv("INFERENCE_WATCHDOG_TIMEOUT_MS");
+        int32_t expected = -1;
+
+        timeout_ms.compare_exchange_strong(expected, timeout ? atoi(timeout) : WATCHDOG_DEFAULT_TIMEOUT_MS);
+        std::thread(watchdog_thread_main).detach();
+    });
+
+    if (!step_expectation || step_expectation->backend != backend || step_expectation->batch_size != batch_size) {
+        std::lock_guard<std::mutex> lock(watchdog_mtx);
+        step_expectation = find_expectation(backend, batch_size, true);
+    }
+
+    step_timestep = t;
+
+    step_sequence++;
+    step_slot = slot;
+    step_job_id = job_id;
+    step_start_ns = now_ns();
+    step_sequence++;
+}
+
+/**
+ * @brief Add a finished step to a pending capture, and publish the capture once
+ *        it's complete.
+ */
+static void continue_capture(const WatchdogStep& step) {
+
+    pending[pending_count++] = step;
+
+    if (pending_count < WATCHDOG_WINDOW) {
+        return;
+    }
+
+    const WatchdogStep& outlier = pending[WATCHDOG_WINDOW_BEFORE];
+
+    {
+        std::lock_guard<std::mutex> lock(watchdog_mtx);
+
+        for (int i = 0; i < WATCHDOG_WINDOW; i++) {
+            captured[i] = pending[i];
+            captured[i].start_ns -= outlier.start_ns;
+        }
+
+        captured_count = WATCHDOG_WINDOW;
+    }
+
+    /* No print here, this is the denoise thread and outliers can come every few
+     * steps. The capture is in getWatchdogWindow() and STAT_WATCHDOG_OUTLIERS. */
+    pending_count = 0;
+}
+
+void watchdog_step_end() {
+
+    int64_t end = now_ns();
+    int64_t start = step_start_ns;
+    WatchdogStep step = { start, end - start, step_timestep, step_job_id, 0 };
+
+    step_sequence++;
+    step_start_ns = 0;
+    step_sequence++;
+
+    bool outlier = false;
+
+    if (step_expectation) {
+
+        std::lock_guard<std::mutex> lock(watchdog_mtx);
+
+        StepExpectation& expectation = *step_expectation;
+        double duration = (double)step.duration_ns;
+
+        if (expectation.steps >= WATCHDOG_WARMUP_STEPS) {
+            step.expected_ns = (int64_t)expectation.mean_ns;
+            outlier = duration > WATCHDOG_OUTLIER_FACTOR * expectation.mean_ns &&
+                      duration > expectation.mean_ns + WATCHDOG_OUTLIER_DEVIATIONS * expectation.deviation_ns &&
+                      duration > expectation.mean_ns + WATCHDOG_OUTLIER_MIN_EXCESS_NS;
+        }
+
+        /* The first step seeds the average instead of pulling it up from 0 */
+        if (expectation.steps == 0) {
+            expectation.mean_ns = duration;
+        }
+
+        expectation.deviation_ns += (fabs(duration - expectation.mean_ns) - expectation.deviation_ns) * WATCHDOG_SMOOTHING;
+        expectation.mean_ns += (duration - expectation.mean_ns) * WATCHDOG_SMOOTHING;
+        expectation.steps++;
+    }
+
+    if (outlier) {
+        stat_add(STAT_WATCHDOG_OUTLIERS, 1);
+    }
+
+    if (pending_count > 0) {
+        continue_capture(step);
+    } else if (outlier) {
+        /* Oldest first, the outlier last */
+        int before = (int)(recent_count < (uint64_t)WATCHDOG_WINDOW_BEFORE ? recent_count : WATCHDOG_WINDOW_BEFORE);
+
+        for (int i = 0; i < WATCHDOG_WINDOW_BEFORE - before; i++) {
+            pending[i] = { step.start_ns, -1, -1, -1, -1 };
+        }
+
+        for (int i = 0; i < before; i++) {
+            pending[WATCHDOG_WINDOW_BEFORE - before + i] = recent[(recent_count - before + i) % (WATCHDOG_WINDOW_BEFORE + 1)];
+        }
+
+        pending_count = WATCHDOG_WINDOW_BEFORE;
+        continue_capture(step);
+    }
+
+    recent[recent_count++ % (WATCHDOG_WINDOW_BEFORE + 1)] = step;
+}
+
+int64_t watchdog_expected_ns(const char* backend, int batch_size) {
+
+    std::lock_guard<std::mutex> lock(watchdog_mtx);
+
+    StepExpectation* expectation = find_expectation(backend, batch_size, false);
+
+    if (!expectation || expectation->steps < WATCHDOG_WARMUP_STEPS) {
+        return 0;
+    }
+
+    return (int64_t)expectation->mean_ns;
+}
+
+int64_t watchdog_window(int32_t i, int32_t field) {
+
+    std::lock_guard<std::mutex> lock(watchdog_mtx);
+
+    if (i < 0 || i >= captured_count || field < 0 || field >= WATCHDOG_FIELD_COUNT) {
+        return -1;
+    }
+
+    const WatchdogStep& step = captured[i];
+
+    switch (field) {
+    case WATCHDOG_FIELD_START_NS:    return step.start_ns;
+    case WATCHDOG_FIELD_DURATION_NS: return step.duration_ns;
+    case WATCHDOG_FIELD_TIMESTEP:    return step.timestep;
+    case WATCHDOG_FIELD_JOB_ID:      return step.job_id;
+    default:                         return step.expected_ns;
+    }
+}
+
+/**
+ * @brief setWatchdogTimeout
+ *  Fail jobs with INFER_ERROR_STEP_TIMEOUT when a backend step runs longer than
+ *  this. See watchdog.h.
+ * @param: timeout_ms Milliseconds, 0 to never time out
+ * @return: 0 on success
+ */
+extern "C" DLL_EXPORT
+int32_t Java_tbarnes_diffusionmod_Inference_setWatchdogTimeout(void* unused1, void* unused2, int32_t timeout) {
+
+    record_call(RECORD_SET_WATCHDOG_TIMEOUT, { timeout });
+
+    int result = watchdog_set_timeout(timeout);
+
+    if (result != 0) {
+        inference_set_last_error(result);
+    }
+
+    return result;
+}
+
+/**
+ * @brief getWatchdogWindow
+ *  Read the steps captured around the latest slow backend step.
+ * @param: i Step in the window, the slow step is at WATCHDOG_WINDOW_BEFORE
+ * @param: field WATCHDOG_FIELD_ constant
+ * @return: Value of the field, -1 if nothing was captured
+ */
+extern "C" DLL_EXPORT
+int64_t Java_tbarnes_diffusionmod_Inference_getWatchdogWindow(void* unused1, void* unused2, int32_t i, int32_t field) {
+
+    record_call(RECORD_GET_WATCHDOG_WINDOW, { i, field });
+
+    return watchdog_window(i, field);
+}
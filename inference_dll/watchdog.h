@@ -0,0 +1,83 @@
+/**
+ * @file watchdog.h
+ * @brief Watchdog for stalled and unusually slow backend steps.
+ *
+ *  The denoise thread brackets every backend->step() call with
+ *  watchdog_step_begin() and watchdog_step_end(). Per backend and batch size the
+ *  watchdog keeps a moving average of the step time and of its deviation, the
+ *  expected step duration.
+ *
+ *  Outliers: a step slower than WATCHDOG_OUTLIER_FACTOR times the expected
+ *  duration, the average plus WATCHDOG_OUTLIER_DEVIATIONS deviations and the
+ *  average plus WATCHDOG_OUTLIER_MIN_EXCESS_NS counts in
+ *  STAT_WATCHDOG_OUTLIERS. The first outlier while no capture is pending also
+ *  captures a window of WATCHDOG_WINDOW steps around it: the steps before it, the
+ *  outlier and the steps after it, readable with getWatchdogWindow().
+ *
+ *  Stalls: a thread checks the step in progress every WATCHDOG_POLL_MS. Once it
+ *  has run longer than the timeout (setWatchdogTimeout()), the running job and
+ *  every queued job fail with INFER_ERROR_STEP_TIMEOUT, and jobs submitted while
+ *  the step stays stuck fail too, so the game hears about it instead of waiting
+ *  forever. If the step ever returns, the denoise thread carries on with the next
+ *  job.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+const int WATCHDOG_POLL_MS = 100;
+const int32_t WATCHDOG_DEFAULT_TIMEOUT_MS = 30000;
+
+/* Steps of a backend and batch size seen before outliers are flagged */
+const int WATCHDOG_WARMUP_STEPS = 50;
+const double WATCHDOG_OUTLIER_FACTOR = 3.0;
+const double WATCHDOG_OUTLIER_DEVIATIONS = 6.0;
+
+/* An outlier also has to run this much over the expected duration, so scheduler
+ * jitter on steps of a few microseconds (the mock backend) isn't flagged */
+const int64_t WATCHDOG_OUTLIER_MIN_EXCESS_NS = 1000000;
+
+/* Steps in a captured window. The outlier is at WATCHDOG_WINDOW_BEFORE. */
+const int WATCHDOG_WINDOW = 64;
+const int WATCHDOG_WINDOW_BEFORE = 32;
+
+/* Fields of a captured step for getWatchdogWindow() */
+const int WATCHDOG_FIELD_START_NS    = 0; /* Relative to the start of the outlier */
+const int WATCHDOG_FIELD_DURATION_NS = 1;
+const int WATCHDOG_FIELD_TIMESTEP    = 2;
+const int WATCHDOG_FIELD_JOB_ID      = 3;
+const int WATCHDOG_FIELD_EXPECTED_NS = 4; /* Expected duration when the step ended */
+const int WATCHDOG_FIELD_COUNT       = 5;
+
+/**
+ * @brief Set the stall timeout. 0 turns the timeout off; outliers are still
+ *        flagged. Defaults to INFERENCE_WATCHDOG_TIMEOUT_MS or
+ *        WATCHDOG_DEFAULT_TIMEOUT_MS.
+ * @return 0 on success, INFER_ERROR_INVALID_ARG for a negative timeout.
+ */
+int watchdog_set_timeout(int32_t timeout_ms);
+
+/**
+ * @brief Called by the denoise thread right before backend->step().
+ * @param slot Job slot from job_wait_next().
+ * @param backend Name of the backend, a string that lives as long as the backend.
+ */
+void watchdog_step_begin(int slot, int32_t job_id, int32_t t, const char* backend, int batch_size);
+
+/**
+ * @brief Called by the denoise thread right after backend->step() returns.
+ */
+void watchdog_step_end();
+
+/**
+ * @return Expected step duration of a backend and batch size in nanoseconds, 0
+ *         until WATCHDOG_WARMUP_STEPS steps were seen.
+ */
+int64_t watchdog_expected_ns(const char* backend, int batch_size);
+
+/**
+ * @return One field of step i of the latest captured window, -1 if there is no
+ *         such step.
+ */
+int64_t watchdog_window(int32_t i, int32_t field);
@@ -0,0 +1,68 @@
+package tbarnes.diffusionmod;
+
+import com.mojang.logging.LogUtils;
+import net.minecraft.core.BlockPos;
+import net.minecraft.world.level.WorldGenLevel;
+import net.minecraft.world.level.block.Block;
+import net.minecraft.world.level.levelgen.feature.Feature;
+import net.minecraft.world.level.levelgen.feature.FeaturePlaceContext;
+import net.minecraft.world.level.levelgen.feature.configurations.NoneFeatureConfiguration;
+import org.slf4j.Logger;
+
+import java.util.concurrent.CompletionException;
+
+// Places a diffusion structure while a chunk generates, in place of using the egg.
+//
+// The context is the 16^3 volume from the chunk's lowest corner at the placement's
+// height, so the structure stays inside the chunk being decorated. place() runs on a
+// worldgen worker and waits there for its future (DiffusionWorldgen); the DLL batches
+// the requests of all workers
+public class DiffusionFeature extends Feature<NoneFeatureConfiguration> {
+
+    private static final Logger LOGGER = LogUtils.getLogger();
+
+    public DiffusionFeature() {
+        super(NoneFeatureConfiguration.CODEC);
+    }
+
+    @Override
+    public boolean place(FeaturePlaceContext<NoneFeatureConfiguration> context) {
+
+        WorldGenLevel level = context.level();
+        BlockPos corner = new BlockPos(
+                context.origin().getX() & ~15,
+                context.origin().getY(),
+                context.origin().getZ() & ~15);
+
+        byte[] ids = new byte[16 * 16 * 16];
+
+        for (int x = 0; x < 16; x++) {
+            for (int y = 0; y < 16; y++) {
+                for (int z = 0; z < 16; z++) {
+                    ids[(x * 16 + y) * 16 + z] = (byte) DiffusionMod.blockStateToId(level.getBlockState(corner.offset(x, y, z)));
+                }
+            }
+        }
+
+        short[] states;
+
+        try {
+            states = DiffusionWorldgen.submit(ids).join();
+        } catch (CompletionException e) {
+            LOGGER.warn("Diffusion structure at {} failed: {}", corner, e.getMessage());
+            return false;
+        }
+
+        // Stair shapes and pane connections are already final, see block_states.h
+        for (int x = 0; x < 14; x++) {
+            for (int y = 0; y < 14; y++) {
+                for (int z = 0; z < 14; z++) {
+                    int state = states[(x * 14 + y) * 14 + z] & Inference.SPARSE_STATE_MASK;
+                    level.setBlock(corner.offset(x + 1, y + 1, z + 1), DiffusionMod.FINAL_STATES[state], Block.UPDATE_CLIENTS);
+                }
+            }
+        }
+
+        return true;
+    }
+}
@@ -1,6 +1,6 @@
 package tbarnes.diffusionmod;
 
-import net.neoforged.neoforge.event.tick.PlayerTickEvent;
+import net.neoforged.neoforge.event.tick.ServerTickEvent;
 import org.slf4j.Logger;
 import com.mojang.logging.LogUtils;
 import net.minecraft.client.Minecraft;
@@ -34,11 +34,23 @@ import net.neoforged.neoforge.registries.DeferredItem;
 import net.neoforged.neoforge.registries.DeferredRegister;
 import net.minecraft.world.InteractionResult;
 import net.minecraft.world.item.context.UseOnContext;
-import net.minecraft.world.level.Level;
 import net.minecraft.world.level.block.state.BlockState;
 import net.minecraft.core.BlockPos;
+import net.minecraft.core.Direction;
+import net.minecraft.server.level.ServerLevel;
+import net.minecraft.server.level.TicketType;
+import net.minecraft.world.level.ChunkPos;
+import net.minecraft.world.level.levelgen.feature.Feature;
 import net.minecraft.world.item.ItemStack;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.Comparator;
+import java.util.LinkedHashMap;
+import java.util.List;
+import java.util.Map;
+
 import net.minecraft.world.level.block.state.properties.*;
 
 // The value here should match an entry in the META-INF/neoforge.mods.toml file
@@ -55,6 +67,11 @@ public class DiffusionMod
     public static final DeferredRegister.Items ITEMS = DeferredRegister.createItems(MODID);
     // Create a Deferred Register to hold CreativeModeTabs which will all be registered under the "examplemod" namespace
     public static final DeferredRegister<CreativeModeTab> CREATIVE_MODE_TABS = DeferredRegister.create(Registries.CREATIVE_MODE_TAB, MODID);
+    // Worldgen features, for placing diffusion structures during chunk generation
+    public static final DeferredRegister<Feature<?>> FEATURES = DeferredRegister.create(Registries.FEATURE, MODID);
+
+    // "diffusionmod:diffusion_structure", for configured features of map pregeneration data packs
+    public static final DeferredHolder<Feature<?>, DiffusionFeature> DIFFUSION_FEATURE = FEATURES.register("diffusion_structure", DiffusionFeature::new);
 
     // Creates a new Block with the id "examplemod:example_block", combining the namespace and path
     public static final DeferredBlock<Block> EXAMPLE_BLOCK = BLOCKS.registerSimpleBlock("example_block", BlockBehaviour.Properties.of().mapColor(MapColor.STONE));
@@ -122,21 +139,25 @@ public class DiffusionMod
 
             // 18 - minecraft:stone_brick_stairs[facing=north,half=bottom,shape=straight]
             Blocks.STONE_BRICK_STAIRS.defaultBlockState()
+                    .setValue(BlockStateProperties.HORIZONTAL_FACING, Direction.NORTH)
                     .setValue(BlockStateProperties.HALF, Half.BOTTOM)
                     .setValue(BlockStateProperties.STAIRS_SHAPE, StairsShape.STRAIGHT),
 
             // 19 - minecraft:stone_brick_stairs[facing=south,half=bottom,shape=straight]
             Blocks.STONE_BRICK_STAIRS.defaultBlockState()
+                    .setValue(BlockStateProperties.HORIZONTAL_FACING, Direction.SOUTH)
                     .setValue(BlockStateProperties.HALF, Half.BOTTOM)
                     .setValue(BlockStateProperties.STAIRS_SHAPE, StairsShape.STRAIGHT),
 
             // 20 - minecraft:stone_brick_stairs[facing=east,half=bottom,shape=straight]
             Blocks.STONE_BRICK_STAIRS.defaultBlockState()
+                    .setValue(BlockStateProperties.HORIZONTAL_FACING, Direction.EAST)
                     .setValue(BlockStateProperties.HALF, Half.BOTTOM)
                     .setValue(BlockStateProperties.STAIRS_SHAPE, StairsShape.STRAIGHT),
 
             // 21 - minecraft:stone_brick_stairs[facing=west,half=bottom,shape=straight]
             Blocks.STONE_BRICK_STAIRS.defaultBlockState()
+                    .setValue(BlockStateProperties.HORIZONTAL_FACING, Direction.WEST)
                     .setValue(BlockStateProperties.HALF, Half.BOTTOM)
                     .setValue(BlockStateProperties.STAIRS_SHAPE, StairsShape.STRAIGHT),
 
@@ -154,21 +175,25 @@ public class DiffusionMod
 
             // 26 - minecraft:stone_brick_stairs[facing=south,half=top,shape=straight]
             Blocks.STONE_BRICK_STAIRS.defaultBlockState()
+                    .setValue(BlockStateProperties.HORIZONTAL_FACING, Direction.SOUTH)
                     .setValue(BlockStateProperties.HALF, Half.TOP)
                     .setValue(BlockStateProperties.STAIRS_SHAPE, StairsShape.STRAIGHT),
 
             // 27 - minecraft:stone_brick_stairs[facing=north,half=top,shape=straight]
             Blocks.STONE_BRICK_STAIRS.defaultBlockState()
+                    .setValue(BlockStateProperties.HORIZONTAL_FACING, Direction.NORTH)
                     .setValue(BlockStateProperties.HALF, Half.TOP)
                     .setValue(BlockStateProperties.STAIRS_SHAPE, StairsShape.STRAIGHT),
 
             // 28 - minecraft:stone_brick_stairs[facing=west,half=top,shape=straight]
             Blocks.STONE_BRICK_STAIRS.defaultBlockState()
+                    .setValue(BlockStateProperties.HORIZONTAL_FACING, Direction.WEST)
                     .setValue(BlockStateProperties.HALF, Half.TOP)
                     .setValue(BlockStateProperties.STAIRS_SHAPE, StairsShape.STRAIGHT),
 
             // 29 - minecraft:stone_brick_stairs[facing=east,half=top,shape=straight]
             Blocks.STONE_BRICK_STAIRS.defaultBlockState()
+                    .setValue(BlockStateProperties.HORIZONTAL_FACING, Direction.EAST)
                     .setValue(BlockStateProperties.HALF, Half.TOP)
                     .setValue(BlockStateProperties.STAIRS_SHAPE, StairsShape.STRAIGHT),
 
@@ -254,6 +279,41 @@ public class DiffusionMod
             Blocks.AIR.defaultBlockState(),
     };
 
+    // Every state index of block_states.h: the BLOCK_STATES entry of the id with the
+    // stair shape or pane connections the DLL worked out from its neighbors
+    public static final BlockState[] FINAL_STATES = buildFinalStates();
+
+    static BlockState[] buildFinalStates() {
+
+        StairsShape[] shapes = new StairsShape[] {
+                StairsShape.STRAIGHT, StairsShape.INNER_LEFT, StairsShape.INNER_RIGHT,
+                StairsShape.OUTER_LEFT, StairsShape.OUTER_RIGHT };
+
+        BlockState[] states = new BlockState[1 << Inference.SPARSE_STATE_BITS];
+
+        for (int state = 0; state < states.length; state++) {
+
+            int id = state & Inference.BLOCK_STATE_ID_MASK;
+            int properties = state >>> Inference.BLOCK_STATE_ID_BITS;
+            BlockState blockState = (id < BLOCK_STATES.length) ? BLOCK_STATES[id] : Blocks.AIR.defaultBlockState();
+
+            if (blockState.is(Blocks.STONE_BRICK_STAIRS)) {
+                blockState = blockState.setValue(BlockStateProperties.STAIRS_SHAPE,
+                        shapes[Math.min(properties, shapes.length - 1)]);
+            } else if (id == 11 || id == 14) {
+                blockState = Blocks.GLASS_PANE.defaultBlockState()
+                        .setValue(BlockStateProperties.NORTH, (properties & Inference.PANE_NORTH) != 0)
+                        .setValue(BlockStateProperties.EAST, (properties & Inference.PANE_EAST) != 0)
+                        .setValue(BlockStateProperties.SOUTH, (properties & Inference.PANE_SOUTH) != 0)
+                        .setValue(BlockStateProperties.WEST, (properties & Inference.PANE_WEST) != 0);
+            }
+
+            states[state] = blockState;
+        }
+
+        return states;
+    }
+
     public static final int[] DUMMY_IDS = new int[] {
            // 1,1,1,1,1,1,1,1,1,1,1,1,1,1,5,10,4,4,4,2,2,2,2,2,4,6,6,6,2,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,4,4,4,2,2,2,2,2,4,6,6,6,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,4,4,4,2,2,2,2,2,4,6,6,6,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,4,4,4,2,2,2,2,2,4,6,6,6,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,3,3,3,3,0,0,0,0,0,0,0,0,0,0,0,0,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,5,4,4,4,1,1,1,1,1,1,1,6,6,6,2,0,0,0,6,6,6,20,20,6,6,0,0,0,2,0,0,0,0,0,0,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,2,29,29,29,0,0,0,0,3,3,3,3,3,3,2,2,2,2,0,0,0,0,0,0,0,0,0,0,3,3,2,3,0,0,0,0,0,0,0,0,0,0,0,0,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,4,4,1,1,1,1,1,1,1,6,6,6,0,0,0,0,6,7,7,7,7,7,6,30,30,30,0,0,0,0,0,0,0,0,0,0,2,30,30,30,0,0,0,0,0,0,0,0,0,0,2,30,30,30,0,0,0,0,0,0,0,0,0,0,2,21,21,21,0,0,0,3,3,3,3,3,3,3,2,2,2,2,0,0,0,0,3,3,3,0,0,0,3,3,8,3,0,0,0,0,0,0,3,3,3,0,3,3,3,0,0,0,0,0,0,0,0,0,3,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,10,4,4,1,1,1,1,1,1,1,6,6,6,0,0,0,0,6,6,6,7,7,6,6,0,0,0,0,0,0,0,2,74,2,36,36,2,2,0,0,0,0,0,0,0,2,14,2,35,35,2,2,0,0,0,0,0,0,0,2,14,2,29,29,2,2,0,0,0,0,0,0,3,2,2,2,2,2,2,2,2,2,2,0,0,0,0,3,8,2,2,2,2,2,8,8,8,0,0,0,0,0,0,3,8,2,2,2,8,3,0,0,0,0,0,0,0,0,0,3,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,10,4,1,1,1,1,1,1,1,6,6,6,0,0,0,0,6,5,5,5,5,5,6,0,0,0,0,0,0,0,2,18,11,0,0,0,2,0,0,0,0,0,0,0,2,0,0,0,0,0,2,0,0,0,0,0,0,0,2,0,0,0,0,0,2,0,0,0,0,0,0,3,2,2,2,2,2,2,2,2,2,2,0,0,0,0,3,8,8,8,8,8,8,8,8,8,0,0,0,0,0,0,3,8,8,8,8,8,3,0,0,0,0,0,0,0,0,0,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,5,4,4,4,1,1,1,1,1,1,1,6,6,6,2,0,0,0,6,5,5,5,5,5,6,0,0,0,2,0,0,0,19,0,11,19,0,0,2,0,0,0,0,0,0,0,11,0,0,0,0,0,2,0,0,0,0,0,0,0,11,0,0,0,0,0,2,0,0,0,0,0,0,3,2,2,2,2,2,2,2,2,2,2,0,0,0,0,3,8,8,8,8,8,8,8,8,8,0,0,0,0,0,0,3,8,8,8,8,3,3,0,0,0,0,0,0,0,0,0,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,4,4,1,1,1,1,1,1,1,6,6,6,0,0,0,0,6,5,5,5,5,5,6,0,20,0,0,0,0,0,19,18,66,0,0,0,2,0,0,0,0,0,0,0,11,0,0,0,0,0,2,0,0,0,0,0,0,0,11,0,0,0,0,0,2,0,0,0,0,0,0,3,2,2,2,2,2,2,2,2,2,2,0,0,0,0,3,8,8,8,8,8,8,8,8,8,0,0,0,0,0,0,3,8,8,8,8,3,0,0,0,0,0,0,0,0,0,0,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,4,4,1,1,1,1,1,1,1,1,1,1,0,0,0,0,6,5,5,5,5,5,6,6,7,6,0,0,0,0,2,0,0,0,0,0,2,2,36,2,0,0,0,0,2,0,0,0,0,0,2,2,35,2,0,0,0,0,2,0,0,0,0,0,2,2,2,2,0,0,0,3,2,2,2,2,2,2,2,2,2,2,0,0,0,0,3,8,8,8,8,8,8,8,8,3,0,0,0,0,0,0,3,8,8,8,8,3,0,0,0,0,0,0,0,0,0,0,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,4,4,1,1,1,1,1,1,1,1,1,1,0,0,0,0,6,5,5,5,5,5,0,0,0,6,0,0,0,0,2,0,0,0,53,0,2,0,0,2,0,0,0,0,2,0,0,0,0,0,2,0,0,2,0,0,0,0,2,0,0,0,0,0,0,0,0,2,0,0,0,3,2,2,2,2,2,2,2,2,2,2,0,0,0,0,3,8,8,8,8,8,8,8,8,3,0,0,0,0,0,0,3,8,8,8,8,3,0,0,0,0,0,0,0,0,0,0,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,5,4,4,4,1,1,1,1,1,1,1,1,1,1,2,0,0,0,6,5,5,5,5,5,0,0,0,6,2,0,0,0,2,0,0,0,19,0,38,0,0,2,0,0,0,0,2,0,0,0,0,0,37,0,0,2,0,0,0,0,2,0,0,0,0,0,0,0,0,2,0,0,0,3,2,2,0,2,2,2,2,2,2,2,0,0,0,0,3,8,8,8,8,8,8,8,8,3,0,0,0,0,0,0,3,8,8,8,8,3,0,0,0,0,0,0,0,0,0,0,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,4,4,4,4,1,1,1,1,1,1,1,1,1,1,0,0,0,0,6,5,5,5,5,5,0,0,0,6,0,0,0,0,2,0,0,0,19,0,0,0,0,18,0,0,0,0,2,0,0,0,0,0,0,0,0,11,0,0,0,0,2,0,0,0,0,0,0,0,39,11,0,0,0,3,2,2,0,2,2,2,2,2,2,2,0,0,0,0,3,8,8,8,8,8,8,8,8,3,0,0,0,0,0,0,3,8,8,8,8,3,0,0,0,0,0,0,0,0,0,0,3,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 8, 11, 2, 11, 8, 2, 2, 2, 2, 11, 2, 8, 2, 8, 2, 2, 11, 8, 12, 8, 2, 2, 2, 11, 2, 11, 8, 9, 2, 9, 11, 8, 9, 9, 8, 8, 11, 8, 2, 2, 2, 11, 2, 2, 2, 9, 9, 9, 9, 9, 8, 9, 8, 11, 11, 2, 2, 11, 8, 9, 11, 10, 12, 8, 11, 8, 11, 11, 8, 2, 8, 12, 8, 9, 8, 10, 8, 9, 8, 8, 11, 8, 9, 8, 2, 9, 8, 9, 9, 9, 8, 9, 8, 2, 8, 8, 9, 8, 8, 9, 11, 9, 9, 2, 12, 12, 12, 8, 12, 8, 9, 12, 8, 9, 11, 9, 8, 8, 8, 9, 8, 2, 8, 8, 9, 8, 2, 8, 8, 9, 8, 8, 8, 9, 8, 8, 8, 8, 9, 8, 9, 2, 12, 9, 8, 11, 8, 12, 8, 9, 2, 8, 8, 11, 8, 11, 8, 8, 12, 8, 12, 8, 12, 8, 8, 12, 12, 8, 2, 2, 2, 11, 11, 11, 9, 11, 8, 11, 11, 8, 2, 2, 2, 11, 12, 12, 12, 12, 12, 12, 12, 8, 9, 11, 11, 11, 11, 8, 11, 8, 7, 9, 2, 8, 8, 2, 8, 8, 11, 8, 11, 2, 11, 2, 9, 11, 11, 9, 2, 11, 11, 2, 8, 11, 8, 11, 2, 8, 9, 9, 8, 9, 9, 8, 9, 2, 2, 11, 2, 2, 9, 9, 9, 9, 9, 9, 8, 9, 9, 8, 8, 2, 11, 2, 11, 9, 9, 8, 10, 9, 9, 9, 9, 8, 9, 9, 11, 12, 11, 9, 8, 11, 9, 9, 11, 9, 2, 8, 9, 8, 2, 9, 8, 9, 8, 8, 8, 9, 11, 11, 11, 8, 9, 8, 11, 9, 11, 2, 2, 12, 12, 12, 12, 12, 12, 5, 7, 9, 8, 9, 11, 9, 8, 9, 8, 9, 8, 9, 9, 8, 9, 8, 11, 9, 8, 9, 11, 2, 8, 9, 8, 2, 8, 8, 8, 8, 8, 11, 12, 9, 8, 2, 12, 12, 8, 8, 12, 8, 8, 11, 11, 11, 12, 8, 12, 8, 12, 8, 12, 12, 8, 9, 2, 8, 2, 2, 2, 11, 11, 11, 8, 11, 2, 2, 11, 11, 9, 2, 2, 11, 12, 12, 12, 12, 12, 12, 12, 8, 8, 8, 2, 8, 9, 11, 2, 8, 8, 8, 8, 9, 8, 8, 12, 5, 8, 12, 8, 11, 11, 8, 8, 11, 11, 9, 8, 8, 8, 8, 11, 8, 12, 8, 11, 8, 2, 8, 8, 9, 8, 11, 8, 8, 8, 8, 8, 11, 8, 9, 9, 9, 9, 9, 8, 9, 9, 8, 12, 8, 11, 11, 11, 2, 10, 8, 9, 9, 9, 11, 8, 12, 8, 11, 11, 12, 9, 9, 8, 11, 8, 9, 11, 11, 8, 8, 9, 11, 11, 9, 11, 9, 11, 8, 8, 9, 11, 8, 8, 8, 9, 11, 2, 9, 11, 2, 12, 12, 5, 2, 12, 12, 12, 12, 7, 9, 9, 9, 2, 9, 8, 8, 8, 9, 9, 8, 8, 8, 8, 8, 8, 8, 11, 9, 8, 2, 2, 9, 9, 9, 12, 8, 9, 9, 9, 8, 8, 9, 12, 8, 8, 12, 9, 9, 12, 8, 8, 8, 8, 2, 12, 8, 2, 2, 2, 8, 8, 8, 8, 9, 8, 2, 9, 2, 2, 11, 11, 11, 11, 11, 11, 11, 11, 8, 12, 11, 2, 11, 12, 12, 12, 12, 12, 12, 12, 12, 9, 9, 9, 9, 8, 2, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 11, 2, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 2, 9, 12, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 11, 9, 8, 8, 9, 9, 9, 8, 9, 9, 9, 9, 8, 12, 8, 9, 11, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 9, 8, 9, 8, 9, 9, 9, 9, 9, 9, 9, 9, 8, 10, 9, 5, 2, 12, 2, 12, 8, 5, 8, 12, 8, 9, 9, 8, 9, 8, 9, 11, 8, 8, 9, 9, 8, 11, 2, 11, 2, 2, 8, 11, 9, 11, 2, 2, 8, 9, 8, 8, 8, 8, 8, 8, 2, 8, 9, 8, 9, 11, 12, 9, 2, 12, 2, 12, 8, 2, 11, 12, 8, 2, 8, 9, 8, 12, 12, 8, 9, 8, 2, 2, 2, 2, 11, 11, 11, 11, 11, 8, 11, 11, 8, 5, 11, 2, 11, 12, 12, 12, 12, 12, 12, 12, 2, 9, 9, 9, 9, 2, 9, 8, 8, 8, 9, 8, 8, 8, 9, 8, 8, 8, 9, 11, 2, 11, 8, 11, 9, 8, 8, 11, 8, 8, 8, 8, 9, 8, 2, 9, 8, 8, 9, 8, 8, 8, 8, 9, 8, 8, 9, 8, 2, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 11, 9, 8, 9, 11, 8, 8, 9, 8, 2, 8, 8, 12, 9, 8, 12, 11, 9, 8, 2, 8, 9, 10, 11, 8, 8, 9, 9, 9, 9, 8, 9, 8, 8, 12, 9, 10, 8, 8, 8, 9, 9, 2, 9, 12, 9, 7, 7, 12, 12, 5, 12, 12, 8, 9, 9, 8, 8, 8, 9, 10, 8, 8, 8, 9, 8, 8, 2, 8, 8, 11, 2, 11, 9, 8, 2, 2, 8, 9, 11, 2, 2, 2, 11, 2, 2, 8, 9, 11, 11, 8, 12, 9, 8, 2, 8, 11, 11, 11, 11, 12, 8, 2, 2, 2, 11, 8, 12, 8, 9, 8, 2, 2, 2, 11, 11, 11, 11, 11, 11, 11, 11, 2, 8, 5, 11, 2, 11, 12, 12, 12, 12, 12, 12, 12, 12, 8, 9, 9, 9, 2, 9, 9, 9, 9, 8, 9, 9, 8, 8, 8, 11, 2, 9, 11, 2, 2, 2, 2, 8, 9, 2, 8, 12, 9, 8, 11, 9, 8, 11, 9, 9, 8, 9, 8, 9, 9, 8, 9, 8, 8, 9, 11, 2, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 11, 2, 11, 8, 2, 11, 11, 8, 11, 11, 8, 11, 8, 9, 8, 11, 2, 8, 2, 2, 8, 8, 11, 9, 11, 11, 8, 9, 9, 8, 8, 9, 8, 11, 9, 9, 9, 9, 8, 8, 9, 9, 7, 9, 12, 9, 12, 8, 8, 8, 12, 8, 8, 8, 9, 9, 8, 8, 8, 9, 10, 12, 8, 10, 9, 8, 2, 2, 11, 2, 11, 11, 11, 9, 11, 8, 2, 8, 9, 11, 2, 2, 11, 8, 2, 2, 8, 9, 11, 11, 11, 8, 9, 11, 11, 8, 11, 8, 11, 8, 12, 12, 12, 8, 9, 11, 12, 12, 8, 9, 8, 2, 2, 9, 2, 11, 11, 11, 11, 11, 11, 2, 4, 8, 5, 11, 2, 11, 12, 12, 12, 12, 5, 12, 12, 2, 8, 9, 9, 9, 9, 9, 8, 8, 8, 9, 10, 11, 8, 11, 9, 8, 8, 9, 8, 8, 8, 11, 11, 11, 8, 11, 8, 10, 9, 8, 11, 9, 12, 8, 8, 8, 8, 8, 11, 8, 11, 10, 9, 8, 8, 9, 8, 2, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 2, 8, 11, 11, 11, 11, 9, 11, 11, 12, 8, 9, 9, 8, 9, 8, 8, 11, 8, 11, 9, 11, 9, 11, 2, 11, 9, 9, 11, 8, 9, 8, 8, 8, 9, 9, 9, 8, 8, 9, 9, 9, 9, 2, 9, 2, 5, 8, 5, 2, 8, 2, 8, 12, 9, 8, 2, 2, 9, 8, 8, 8, 5, 9, 8, 11, 11, 2, 8, 11, 11, 2, 9, 8, 11, 11, 8, 9, 9, 11, 11, 11, 11, 2, 8, 8, 9, 8, 8, 11, 8, 9, 11, 2, 8, 2, 9, 8, 12, 12, 8, 11, 11, 11, 11, 12, 12, 8, 9, 8, 2, 2, 9, 2, 11, 11, 11, 11, 11, 11, 8, 12, 12, 12, 8, 2, 11, 2, 12, 12, 12, 12, 2, 2, 9, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 9, 9, 9, 9, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 11, 8, 9, 12, 8, 9, 9, 9, 9, 9, 9, 9, 9, 8, 9, 11, 8, 12, 8, 9, 8, 9, 9, 9, 9, 9, 9, 9, 9, 8, 8, 9, 8, 9, 8, 5, 9, 9, 9, 9, 9, 12, 8, 2, 8, 9, 9, 9, 8, 8, 9, 9, 9, 9, 9, 9, 8, 11, 8, 11, 11, 8, 11, 9, 9, 9, 9, 9, 9, 9, 8, 9, 2, 9, 8, 12, 8, 8, 9, 9, 9, 9, 9, 9, 8, 2, 8, 2, 9, 8, 12, 12, 8, 12, 8, 8, 12, 12, 12, 8, 9, 8, 2, 2, 9, 2, 11, 11, 11, 11, 11, 11, 8, 12, 12, 12, 11, 2, 11, 12, 12, 12, 12, 11, 11, 9, 2, 11, 9, 2, 9, 9, 9, 8, 8, 8, 8, 12, 9, 8, 8, 8, 9, 8, 8, 8, 9, 8, 8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 8, 8, 9, 8, 8, 10, 8, 8, 8, 11, 8, 9, 9, 8, 8, 8, 9, 8, 9, 9, 9, 9, 8, 8, 9, 12, 12, 8, 8, 8, 9, 8, 12, 8, 10, 8, 9, 2, 2, 11, 7, 9, 11, 8, 9, 8, 8, 8, 8, 9, 9, 2, 8, 11, 8, 9, 2, 8, 9, 8, 9, 8, 8, 8, 8, 8, 9, 8, 8, 9, 8, 9, 2, 12, 9, 2, 8, 2, 8, 12, 8, 2, 8, 12, 9, 8, 2, 11, 9, 8, 8, 8, 9, 9, 8, 11, 8, 2, 11, 2, 11, 11, 9, 8, 8, 11, 8, 8, 11, 8, 8, 11, 8, 8, 11, 11, 9, 8, 8, 8, 2, 9, 8, 8, 9, 8, 8, 12, 12, 2, 2, 2, 11, 2, 8, 12, 9, 9, 9, 12, 11, 2, 2, 11, 11, 11, 11, 11, 11, 8, 4, 12, 12, 2, 11, 11, 11, 12, 12, 12, 12, 12, 12, 12, 5, 8, 9, 2, 9, 11, 9, 8, 9, 9, 8, 8, 8, 8, 11, 9, 9, 8, 8, 10, 9, 11, 9, 9, 8, 13, 8, 8, 8, 11, 9, 8, 11, 8, 9, 11, 2, 2, 8, 9, 8, 11, 8, 9, 9, 8, 12, 12, 9, 11, 8, 8, 8, 9, 8, 8, 9, 8, 9, 8, 8, 8, 2, 11, 8, 8, 9, 9, 8, 11, 11, 11, 7, 8, 2, 9, 9, 11, 8, 9, 9, 8, 8, 8, 8, 8, 12, 11, 2, 8, 9, 8, 8, 8, 8, 8, 11, 8, 9, 11, 9, 9, 9, 9, 8, 12, 9, 12, 12, 9, 8, 8, 8, 11, 11, 8, 8, 8, 2, 2, 8, 11, 8, 8, 2, 8, 8, 11, 11, 9, 8, 8, 11, 11, 8, 11, 11, 11, 8, 8, 8, 9, 9, 9, 9, 9, 8, 8, 9, 12, 2, 12, 12, 8, 8, 9, 9, 9, 9, 12, 12, 11, 9, 11, 8, 8, 8, 12, 8, 9, 9, 8, 2, 8, 8, 11, 11, 11, 11, 11, 11, 11, 4, 12, 12, 5, 11, 11, 11, 12, 12, 12, 12, 11, 12, 12, 12, 2, 8, 9, 8, 9, 8, 8, 9, 8, 8, 12, 9, 9, 9, 9, 9, 9, 2, 11, 9, 2, 9, 8, 8, 8, 9, 9, 9, 9, 9, 9, 8, 11, 9, 11, 8, 9, 8, 9, 9, 9, 9, 9, 9, 8, 12, 8, 9, 11, 9, 11, 12, 7, 9, 9, 9, 9, 9, 8, 8, 2, 12, 11, 9, 8, 7, 9, 9, 9, 9, 12, 12, 8, 9, 8, 9, 8, 9, 8, 9, 9, 9, 9, 9, 9, 2, 9, 8, 12, 9, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 9, 8, 4, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 12, 9, 11, 8, 9, 9, 8, 9, 9, 9, 9, 9, 2, 8, 11, 7, 7, 11, 9, 8, 12, 8, 9, 9, 9, 9, 9, 8, 9, 9, 8, 8, 9, 12, 2, 12, 12, 9, 9, 9, 2, 8, 12, 12, 12, 12, 12, 12, 8, 9, 8, 12, 9, 9, 9, 2, 8, 8, 8, 2, 11, 8, 11, 11, 11, 11, 4, 12, 12, 11, 2, 11, 11, 12, 12, 12, 12, 2, 2, 2, 2, 2, 9, 9, 9, 2, 9, 8, 8, 8, 8, 12, 8, 8, 8, 8, 8, 2, 9, 9, 9, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 9, 8, 2, 9, 8, 8, 11, 8, 8, 8, 8, 9, 8, 8, 12, 12, 8, 9, 8, 8, 8, 12, 12, 2, 8, 8, 2, 2, 11, 8, 11, 8, 9, 9, 2, 8, 8, 8, 8, 11, 11, 8, 8, 8, 8, 9, 11, 9, 8, 8, 8, 8, 8, 8, 8, 9, 11, 9, 8, 9, 8, 9, 8, 8, 8, 8, 8, 8, 9, 8, 8, 8, 8, 12, 5, 9, 8, 8, 8, 8, 8, 8, 8, 11, 2, 11, 8, 8, 12, 9, 8, 2, 8, 8, 8, 8, 8, 8, 11, 9, 8, 8, 8, 9, 8, 8, 2, 8, 8, 8, 8, 11, 8, 8, 9, 2, 11, 9, 8, 8, 11, 8, 8, 8, 8, 8, 2, 12, 12, 8, 11, 8, 11, 2, 2, 11, 12, 8, 9, 9, 9, 8, 8, 11, 2, 11, 11, 11, 11, 11, 11, 2, 12, 12, 11, 11, 11, 11, 2, 12, 8, 12, 11, 9, 9, 8, 8, 8, 9, 8, 9, 8, 9, 9, 9, 9, 9, 8, 2, 2, 2, 9, 8, 11, 9, 9, 9, 9, 9, 9, 9, 8, 8, 8, 9, 9, 9, 8, 9, 9, 9, 9, 9, 9, 9, 9, 8, 8, 11, 2, 8, 8, 2, 9, 12, 12, 12, 12, 12, 2, 8, 8, 2, 8, 11, 9, 2, 9, 8, 8, 9, 8, 8, 8, 2, 8, 8, 8, 11, 11, 9, 9, 2, 8, 2, 2, 8, 2, 8, 8, 8, 8, 9, 9, 9, 9, 8, 9, 8, 8, 8, 11, 8, 8, 11, 11, 8, 2, 8, 2, 5, 9, 8, 2, 9, 9, 8, 8, 8, 11, 9, 9, 9, 8, 12, 9, 8, 9, 8, 11, 8, 11, 8, 11, 11, 8, 8, 8, 8, 9, 8, 8, 2, 8, 9, 11, 11, 2, 8, 8, 7, 8, 2, 8, 11, 2, 2, 9, 9, 9, 8, 8, 12, 12, 2, 8, 2, 9, 11, 11, 2, 2, 2, 8, 8, 8, 8, 8, 9,
@@ -266,116 +326,360 @@ public class DiffusionMod
 
     Inference infer = new Inference();
 
-    static BlockPos userClickedPos = new BlockPos(0, 0, 0);
-    static Boolean isDenoising = false;
-    static int denoiseCount = 0;
+    // Buffers shared with the DLL for the single tick() call per server tick, see tick_buffer.h
+    static final ByteBuffer commandBuffer = ByteBuffer.allocateDirect(1 << 20).order(ByteOrder.nativeOrder());
+    static final ByteBuffer eventBuffer = ByteBuffer.allocateDirect(1 << 20).order(ByteOrder.nativeOrder());
+
+    // A chunk being generated where a diffusion egg was used
+    // Keeps the chunks of a generation loaded from its use to its final apply
+    static final TicketType<ChunkPos> DIFFUSION_TICKET = TicketType.create("diffusion", Comparator.comparingLong(ChunkPos::toLong));
+
+    static class Generation {
+        final int jobId;
+        final ServerLevel level;
+        final BlockPos clickedPos;
+        final long usedNanos;
+        final List<ChunkPos> chunks = new ArrayList<>();
+        boolean submitted = false;
+
+        Generation(int jobId, ServerLevel level, BlockPos clickedPos) {
+            this.jobId = jobId;
+            this.level = level;
+            this.clickedPos = clickedPos;
+            this.usedNanos = System.nanoTime();
+
+            // The 16^3 context spans up to 2 x 2 chunks
+            for (int chunkX = clickedPos.getX() >> 4; chunkX <= (clickedPos.getX() + 15) >> 4; chunkX++) {
+                for (int chunkZ = clickedPos.getZ() >> 4; chunkZ <= (clickedPos.getZ() + 15) >> 4; chunkZ++) {
+                    chunks.add(new ChunkPos(chunkX, chunkZ));
+                }
+            }
+        }
+
+        // Distance 0 tickets bring the chunks to FULL status without ticking them. The
+        // chunk system loads them in the background
+        void addTickets() {
+            for (ChunkPos chunk : chunks) {
+                level.getChunkSource().addRegionTicket(DIFFUSION_TICKET, chunk, 0, chunk);
+            }
+        }
+
+        void removeTickets() {
+            for (ChunkPos chunk : chunks) {
+                level.getChunkSource().removeRegionTicket(DIFFUSION_TICKET, chunk, 0, chunk);
+            }
+        }
+
+        // Capturing the context before this would load the missing chunks synchronously
+        boolean chunksLoaded() {
+            for (ChunkPos chunk : chunks) {
+                if (!level.hasChunk(chunk.x, chunk.z)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+
+    static final Map<Integer, Generation> generations = new LinkedHashMap<>();
+
+    // APPLIED trace marks of finished generations, sent with the next tick as job id, System.nanoTime()
+    static final List<long[]> appliedMarks = new ArrayList<>();
+    static int nextJobId = 1;
 
     static Boolean doneInit = false;
-    static Boolean startedDiffusion = false;
-    static int previousTimestep = 1000;
+    static int initResult = 0;
+    static boolean tickBuffersRegistered = false;
 
-    @SubscribeEvent
-    public void diffusionTick(PlayerTickEvent.Post event) {
-        Level level = event.getEntity().level();
+    // Start the DLL once, from the server thread or the worldgen futures thread, whichever is first
+    // Returns init()'s result, 0 on success
+    static synchronized int initInference(Inference infer) {
+
+        if (doneInit) {
+            return initResult;
+        }
+
+        initResult = infer.init();
+        // Land gravel natively rather than spawning a falling block entity per block
+        infer.setSettleMode(Inference.SETTLE_GRAVITY | Inference.SETTLE_FLOATING);
+        doneInit = true;
+        return initResult;
+    }
 
-        if (isDenoising) {
+    static int blockToId(Block block) {
+
+        if (block == Blocks.AIR) {
+            return 0;
+        } else if (block == Blocks.DIRT) {
+            return 1;
+        } else if (block == Blocks.WHITE_CONCRETE) {
+            return 2;
+        } else if (block == Blocks.STONE_BRICK_SLAB) {
+            return 3;
+        } else if (block == Blocks.GRASS_BLOCK) {
+            return 4;
+        } else if (block == Blocks.OAK_PLANKS) {
+            return 5;
+        } else if (block == Blocks.STONE_BRICKS) {
+            return 6;
+        }  else if (block == Blocks.STRIPPED_OAK_WOOD) {
+            return 7;
+        } else if (block == Blocks.WHITE_WOOL) {
+            return 9;
+        } else if (block == Blocks.GREEN_CONCRETE) {
+            return 10;
+        } else if (block == Blocks.OAK_SLAB) {
+            return 15;
+        }  else if (block == Blocks.SANDSTONE) {
+            return 16;
+        } else if (block == Blocks.BRICKS) {
+            return 17;
+        } else if (block == Blocks.GRAVEL) {
+            return 25;
+        }
+
+        return 0;
+    }
+
+    // blockToId() for context capture. Stairs and panes need their state to pick a palette id
+    static int blockStateToId(BlockState state) {
 
-            if (!doneInit) {
-                infer.init();
-                doneInit = true;
+        if (state.is(Blocks.STONE_BRICK_STAIRS)) {
+
+            boolean top = state.getValue(BlockStateProperties.HALF) == Half.TOP;
+
+            switch (state.getValue(BlockStateProperties.HORIZONTAL_FACING)) {
+                case NORTH: return top ? 27 : 18;
+                case SOUTH: return top ? 26 : 19;
+                case EAST:  return top ? 29 : 20;
+                default:    return top ? 28 : 21;
             }
+        } else if (state.is(Blocks.GLASS_PANE)) {
+            return (state.getValue(BlockStateProperties.NORTH) || state.getValue(BlockStateProperties.SOUTH)) ? 14 : 11;
+        }
 
-            if (!startedDiffusion) {
-
-                for (int x = 0; x < 16; x++) {
-                    for (int y = 0; y < 16; y++) {
-                        for (int z = 0; z < 16; z++) {
-
-                            BlockPos position = new BlockPos(
-                                    userClickedPos.getX() + x,
-                                    userClickedPos.getY() + y,
-                                    userClickedPos.getZ() + z);
-
-                            BlockState blockState = level.getBlockState(position);
-                            Block block = blockState.getBlock();
-
-                            int block_id = 0;
-
-                            if (block == Blocks.AIR) {
-                                block_id = 0;
-                            } else if (block == Blocks.DIRT) {
-                                block_id = 1;
-                            } else if (block == Blocks.WHITE_CONCRETE) {
-                                block_id = 2;
-                            } else if (block == Blocks.STONE_BRICK_SLAB) {
-                                block_id = 3;
-                            } else if (block == Blocks.GRASS_BLOCK) {
-                                block_id = 4;
-                            } else if (block == Blocks.OAK_PLANKS) {
-                                block_id = 5;
-                            } else if (block == Blocks.STONE_BRICKS) {
-                                block_id = 6;
-                            }  else if (block == Blocks.STRIPPED_OAK_WOOD) {
-                                block_id = 7;
-                            } else if (block == Blocks.WHITE_WOOL) {
-                                block_id = 9;
-                            } else if (block == Blocks.GREEN_CONCRETE) {
-                                block_id = 10;
-                            } else if (block == Blocks.OAK_SLAB) {
-                                block_id = 15;
-                            }  else if (block == Blocks.SANDSTONE) {
-                                block_id = 16;
-                            } else if (block == Blocks.BRICKS) {
-                                block_id = 17;
-                            } else if (block == Blocks.GRAVEL) {
-                                block_id = 25;
-                            }
-
-                            //int block_id = context_blocks[x + (16 * y) + (16 * 16 * z)];
-                            infer.setContextBlock(x, y, z, block_id);
-
-                            //if (y == 0) {
-                            //    infer.setContextBlock(x, y, z, 1);
-                            //} else {
-                            //    infer.setContextBlock(x, y, z, 0);
-                            //}
-                        }
-                    }
+        return blockToId(state.getBlock());
+    }
+
+    // Write a TRACE command for one of the marks only the mod sees, see trace.h
+    static void putTraceCommand(int jobId, int mark, long nanos) {
+
+        commandBuffer.putInt(Inference.TICK_COMMAND_TRACE);
+        commandBuffer.putInt(jobId);
+        commandBuffer.putInt(mark);
+        commandBuffer.putInt((int) nanos);
+        commandBuffer.putInt((int) (nanos >>> 32));
+    }
+
+    // Write a SUBMIT command with the 16^3 context in front of the clicked position,
+    // after the trace marks of the use and of the capture starting
+    static void putSubmitCommand(Generation generation) {
+
+        putTraceCommand(generation.jobId, Inference.TRACE_MARK_USED, generation.usedNanos);
+        putTraceCommand(generation.jobId, Inference.TRACE_MARK_CAPTURE_START, System.nanoTime());
+
+        commandBuffer.putInt(Inference.TICK_COMMAND_SUBMIT);
+        commandBuffer.putInt(generation.jobId);
+
+        for (int x = 0; x < 16; x++) {
+            for (int y = 0; y < 16; y++) {
+                for (int z = 0; z < 16; z++) {
+
+                    BlockPos position = new BlockPos(
+                            generation.clickedPos.getX() + x,
+                            generation.clickedPos.getY() + y,
+                            generation.clickedPos.getZ() + z);
+
+                    commandBuffer.put((byte) blockStateToId(generation.level.getBlockState(position)));
                 }
+            }
+        }
+    }
 
-                infer.startDiffusion();
-                startedDiffusion = true;
+    static void applySparseEntries(Generation generation, int offset, int count) {
+
+        for (int i = 0; i < count; i++) {
+
+            int entry = eventBuffer.getInt(offset + 4 * i);
+            int index = entry >>> Inference.SPARSE_ID_BITS;
+            int new_id = entry & Inference.SPARSE_ID_MASK;
+
+            int x = index / (14 * 14);
+            int y = (index / 14) % 14;
+            int z = index % 14;
+
+            // Generated block (x, y, z) is context block (x + 1, y + 1, z + 1)
+            BlockPos position = new BlockPos(
+                    generation.clickedPos.getX() + x + 1,
+                    generation.clickedPos.getY() + y + 1,
+                    generation.clickedPos.getZ() + z + 1);
+
+            generation.level.setBlockAndUpdate(position, BLOCK_STATES[new_id]);
+        }
+    }
+
+    // Place SPARSE_OUTPUT_CHANGED_STATES entries. Their shapes are final, so blocks inside
+    // the volume skip the neighbor shape updates. The outer layer updates normally so the
+    // world around the volume can react to it
+    static void applyStateEntries(Generation generation, int offset, int count) {
+
+        for (int i = 0; i < count; i++) {
+
+            int entry = eventBuffer.getInt(offset + 4 * i);
+            int index = entry >>> Inference.SPARSE_STATE_BITS;
+            BlockState state = FINAL_STATES[entry & Inference.SPARSE_STATE_MASK];
+
+            int x = index / (14 * 14);
+            int y = (index / 14) % 14;
+            int z = index % 14;
+
+            BlockPos position = new BlockPos(
+                    generation.clickedPos.getX() + x + 1,
+                    generation.clickedPos.getY() + y + 1,
+                    generation.clickedPos.getZ() + z + 1);
+
+            boolean outer = x == 0 || x == 13 || y == 0 || y == 13 || z == 0 || z == 13;
+
+            if (outer) {
+                generation.level.setBlockAndUpdate(position, state);
+            } else {
+                generation.level.setBlock(position, state, Block.UPDATE_CLIENTS | Block.UPDATE_KNOWN_SHAPE);
+            }
+        }
+    }
+
+    // All generations share one native call per server tick, however many there are
+    @SubscribeEvent
+    public void diffusionTick(ServerTickEvent.Post event) {
+
+        if (generations.isEmpty() && appliedMarks.isEmpty()) {
+            return;
+        }
+
+        if (!tickBuffersRegistered) {
+            initInference(infer);
+            infer.registerTickBuffers(commandBuffer, eventBuffer);
+            tickBuffersRegistered = true;
+        }
+
+        commandBuffer.clear();
+
+        while (!appliedMarks.isEmpty() && commandBuffer.remaining() >= Inference.TICK_TRACE_BYTES) {
+            long[] mark = appliedMarks.remove(appliedMarks.size() - 1);
+            putTraceCommand((int) mark[0], Inference.TRACE_MARK_APPLIED, mark[1]);
+        }
+
+        for (Generation generation : generations.values()) {
+
+            if (!generation.submitted && generation.chunksLoaded() && commandBuffer.remaining() >=
+                    2 * Inference.TICK_TRACE_BYTES + Inference.TICK_SUBMIT_BYTES + Inference.TICK_READ_BYTES) {
+                putSubmitCommand(generation);
+                generation.submitted = true;
             }
 
-            int timestep = infer.getCurrentTimestep();
+            // Only visit positions whose block actually changes
+            if (generation.submitted && commandBuffer.remaining() >= Inference.TICK_READ_BYTES) {
+                commandBuffer.putInt(Inference.TICK_COMMAND_READ);
+                commandBuffer.putInt(generation.jobId);
+                commandBuffer.putInt(Inference.SPARSE_OUTPUT_CHANGED_STATES);
+            }
+        }
+
+        int eventBytes = infer.tick(commandBuffer.position());
+
+        if (eventBytes < 0) {
+            LOGGER.error("Diffusion tick failed");
+            return;
+        }
+
+        int offset = 0;
+
+        while (offset < eventBytes) {
+
+            int type = eventBuffer.getInt(offset);
+
+            if (type == Inference.TICK_EVENT_SNAPSHOT) {
+
+                Generation generation = generations.get(eventBuffer.getInt(offset + 4));
+                int mode = eventBuffer.getInt(offset + 12);
+                int count = eventBuffer.getInt(offset + 16);
+
+                offset += Inference.TICK_SNAPSHOT_HEADER;
+
+                if (generation != null && mode == Inference.SPARSE_OUTPUT_CHANGED_STATES) {
+                    applyStateEntries(generation, offset, count);
+                } else if (generation != null && mode != Inference.SPARSE_OUTPUT_OFF) {
+                    applySparseEntries(generation, offset, count);
+                }
+
+                offset += (mode == Inference.SPARSE_OUTPUT_OFF) ? (count + 3) & ~3 : 4 * count;
 
-            if (timestep < previousTimestep) {
-                infer.cacheCurrentTimestepForReading();
+            } else if (type == Inference.TICK_EVENT_LIGHT) {
 
-                for (int x = 0; x < 14; x++) {
-                    for (int y = 0; y < 14; y++) {
-                        for (int z = 0; z < 14; z++) {
+                // Not requested: the server's light engine runs on its own executor, so
+                // the light record can't be applied from this thread (see light.h)
+                offset += Inference.TICK_LIGHT_BYTES;
 
-                            //int new_id = DUMMY_IDS[x + 14 * y + (14 * 14) * z];
-                            int new_id = infer.readBlockFromCachedTimestep(x, y, z);
+            } else if (type == Inference.TICK_EVENT_RECEIPT) {
 
-                            BlockPos position = new BlockPos(
-                                    userClickedPos.getX() + x,
-                                    userClickedPos.getY() + y,
-                                    userClickedPos.getZ() + z);
+                // What the generation cost, for capacity planning and quotas
+                LOGGER.debug("Diffusion job {} receipt: {} model steps, {} skipped, backend {} ms, queued {} ms, "
+                                + "{} device bytes, {} delivered bytes, decode {} ms, peak {} bytes, library {}",
+                        eventBuffer.getInt(offset + 4),
+                        eventBuffer.getLong(offset + Inference.RECEIPT_MODEL_INVOCATIONS),
+                        eventBuffer.getLong(offset + Inference.RECEIPT_STEPS_SKIPPED),
+                        eventBuffer.getLong(offset + Inference.RECEIPT_BACKEND_NS) / 1000000,
+                        eventBuffer.getLong(offset + Inference.RECEIPT_QUEUE_NS) / 1000000,
+                        eventBuffer.getLong(offset + Inference.RECEIPT_DEVICE_BYTES),
+                        eventBuffer.getLong(offset + Inference.RECEIPT_DELIVERED_BYTES),
+                        eventBuffer.getLong(offset + Inference.RECEIPT_DECODE_NS) / 1000000,
+                        eventBuffer.getLong(offset + Inference.RECEIPT_PEAK_MEMORY_BYTES),
+                        eventBuffer.getLong(offset + Inference.RECEIPT_FROM_LIBRARY) != 0);
 
-                            BlockState state = BLOCK_STATES[new_id];
+                offset += Inference.TICK_RECEIPT_BYTES;
 
-                            level.setBlockAndUpdate(position, state);
-                        }
+            } else if (type == Inference.TICK_EVENT_COMPLETED) {
+
+                int jobId = eventBuffer.getInt(offset + 4);
+                int state = eventBuffer.getInt(offset + 8);
+
+                if (eventBuffer.getInt(offset + 12) == Inference.INFER_ERROR_STEP_TIMEOUT) {
+                    LOGGER.error("Diffusion job {} failed, the inference backend stopped responding", jobId);
+                } else if (state != Inference.JOB_STATE_DONE) {
+                    LOGGER.warn("Diffusion job {} ended in state {} (error {})", jobId, state, eventBuffer.getInt(offset + 12));
+                } else {
+                    // The final snapshot was applied earlier in this walk or on an earlier tick
+                    appliedMarks.add(new long[] { jobId, System.nanoTime() });
+                }
+
+                Generation generation = generations.remove(jobId);
+
+                if (generation != null) {
+                    generation.removeTickets();
+                }
+
+                offset += 16;
+
+            } else if (type == Inference.TICK_EVENT_ERROR) {
+
+                int jobId = eventBuffer.getInt(offset + 4);
+                int command = eventBuffer.getInt(offset + 8);
+
+                LOGGER.error("Diffusion command {} for job {} failed (error {})", command, jobId, eventBuffer.getInt(offset + 12));
+
+                if (command == Inference.TICK_COMMAND_SUBMIT) {
+                    Generation generation = generations.remove(jobId);
+
+                    if (generation != null) {
+                        generation.removeTickets();
                     }
                 }
-            }
 
-            if (timestep == 0) {
-                isDenoising = false;
-                startedDiffusion = false;
-                previousTimestep = 1000;
+                offset += 16;
+
+            } else {
+                // TICK_EVENT_OVERFLOW, anything that didn't fit is still pending next tick
+                offset += 4;
             }
         }
     }
@@ -387,10 +691,11 @@ public class DiffusionMod
                     if (!context.getLevel().isClientSide) {
                         BlockPos pos = context.getClickedPos();
 
-                        if (!isDenoising) {
-                            userClickedPos = pos;
-                            isDenoising = true;
-                        }
+                        // The context is captured on the first server tick its chunks are loaded
+                        Generation generation = new Generation(nextJobId, (ServerLevel) context.getLevel(), pos);
+                        generation.addTickets();
+                        generations.put(nextJobId, generation);
+                        nextJobId++;
 
                         //BlockState currentState = level.getBlockState(pos);
                         //Block block = currentState.getBlock();
@@ -432,6 +737,7 @@ public class DiffusionMod
         ITEMS.register(modEventBus);
         // Register the Deferred Register to the mod event bus so tabs get registered
         CREATIVE_MODE_TABS.register(modEventBus);
+        FEATURES.register(modEventBus);
 
         // Register ourselves for server and other game events we are interested in.
         // Note that this is necessary if and only if we want *this* class (ExampleMod) to respond directly to events.
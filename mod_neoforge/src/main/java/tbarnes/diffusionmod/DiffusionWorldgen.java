@@ -0,0 +1,174 @@
+package tbarnes.diffusionmod;
+
+import com.mojang.logging.LogUtils;
+import org.slf4j.Logger;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.ConcurrentLinkedQueue;
+
+// Diffusion structures for worldgen worker threads, see async_jobs.h.
+//
+// Any thread can submit a 16^3 context and gets a future of the final state indices
+// back. Submissions are queued and a single daemon thread hands everything queued
+// to the DLL in one submitAsyncBatch() call per round, then waits natively for jobs
+// to finish and completes their futures. Neither side touches the server thread.
+//
+// If the thread dies (the DLL doesn't load or init, or a native call throws) every
+// future it holds and every later submission fails, so worldgen workers waiting in
+// join() carry on without the structure.
+public class DiffusionWorldgen {
+
+    private static final Logger LOGGER = LogUtils.getLogger();
+
+    // Leaves the rest of the DLL's 64 job slots to players using the egg
+    static final int MAX_IN_FLIGHT = 32;
+
+    // Longest native wait before queued submissions are picked up
+    static final int WAIT_MS = 5;
+
+    record Request(byte[] context, CompletableFuture<short[]> result) {}
+
+    static final ConcurrentLinkedQueue<Request> pending = new ConcurrentLinkedQueue<>();
+    static Thread service;
+
+    // Why the service thread stopped, null while it runs
+    static volatile Throwable serviceFailure;
+
+    // Queue a context for denoising. Never blocks. The future completes with the state
+    // index of each generated block at (x * 14 + y) * 14 + z, see DiffusionMod.FINAL_STATES
+    public static CompletableFuture<short[]> submit(byte[] context) {
+
+        if (context.length != 16 * 16 * 16) {
+            throw new IllegalArgumentException("Diffusion contexts are 16^3 ids");
+        }
+
+        CompletableFuture<short[]> result = new CompletableFuture<>();
+        pending.add(new Request(context, result));
+        startService();
+
+        // The service may have stopped after it last emptied the queue
+        if (serviceFailure != null) {
+            failPending(serviceFailure);
+        }
+
+        return result;
+    }
+
+    static void failPending(Throwable cause) {
+
+        Request request;
+
+        while ((request = pending.poll()) != null) {
+            request.result().completeExceptionally(cause);
+        }
+    }
+
+    static synchronized void startService() {
+
+        if (service != null) {
+            return;
+        }
+
+        service = new Thread(DiffusionWorldgen::serve, "Diffusion worldgen");
+        service.setDaemon(true);
+        service.start();
+    }
+
+    static void serve() {
+
+        // Only this thread touches them. Requests taken from pending stay in one of
+        // them until their future completes
+        List<Request> batch = new ArrayList<>();
+        Map<Integer, CompletableFuture<short[]>> inFlight = new HashMap<>();
+
+        try {
+            serveLoop(batch, inFlight);
+        } catch (Throwable e) {
+            LOGGER.error("Diffusion worldgen stopped, structures won't generate", e);
+            serviceFailure = e;
+
+            for (Request request : batch) {
+                request.result().completeExceptionally(e);
+            }
+
+            for (CompletableFuture<short[]> result : inFlight.values()) {
+                result.completeExceptionally(e);
+            }
+
+            failPending(e);
+        }
+    }
+
+    static void serveLoop(List<Request> batch, Map<Integer, CompletableFuture<short[]>> inFlight) {
+
+        Inference infer = new Inference();
+        int initResult = DiffusionMod.initInference(infer);
+
+        if (initResult != 0) {
+            throw new IllegalStateException("Diffusion DLL init failed (error " + initResult + ")");
+        }
+
+        ByteBuffer contexts = ByteBuffer.allocateDirect(MAX_IN_FLIGHT * 16 * 16 * 16).order(ByteOrder.nativeOrder());
+        ByteBuffer jobIds = ByteBuffer.allocateDirect(MAX_IN_FLIGHT * 4).order(ByteOrder.nativeOrder());
+        ByteBuffer states = ByteBuffer.allocateDirect(14 * 14 * 14 * 2).order(ByteOrder.nativeOrder());
+
+        for (;;) {
+
+            batch.clear();
+            contexts.clear();
+
+            while (inFlight.size() + batch.size() < MAX_IN_FLIGHT && !pending.isEmpty()) {
+                Request request = pending.poll();
+                batch.add(request);
+                contexts.put(request.context());
+            }
+
+            if (!batch.isEmpty() && infer.submitAsyncBatch(contexts, batch.size(), jobIds) < 0) {
+                for (Request request : batch) {
+                    request.result().completeExceptionally(new IllegalStateException("Diffusion batch submit failed"));
+                }
+                batch.clear();
+            }
+
+            for (int i = 0; i < batch.size(); i++) {
+
+                int jobId = jobIds.getInt(4 * i);
+
+                if (jobId > 0) {
+                    inFlight.put(jobId, batch.get(i).result());
+                } else {
+                    batch.get(i).result().completeExceptionally(
+                            new IllegalStateException("Diffusion submit failed (error " + -jobId + ")"));
+                }
+            }
+
+            int jobId = infer.waitAsyncJob(WAIT_MS);
+
+            if (jobId == 0) {
+                continue;
+            }
+
+            int state = infer.takeAsyncJob(jobId, states);
+            CompletableFuture<short[]> result = inFlight.remove(jobId);
+
+            if (result == null) {
+                continue;
+            }
+
+            if (state == Inference.JOB_STATE_DONE) {
+                short[] stateIndices = new short[14 * 14 * 14];
+                states.asShortBuffer().get(0, stateIndices);
+                result.complete(stateIndices);
+            } else {
+                LOGGER.warn("Diffusion worldgen job {} ended in state {} (error {})", jobId, state, infer.getLastError());
+                result.completeExceptionally(new IllegalStateException("Diffusion job ended in state " + state));
+            }
+        }
+    }
+}
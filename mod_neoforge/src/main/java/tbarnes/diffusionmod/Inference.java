@@ -1,5 +1,7 @@
 package tbarnes.diffusionmod;
 
+import java.nio.ByteBuffer;
+
 public class Inference {
 
     public native int init();
@@ -8,6 +10,206 @@ public class Inference {
     public native int getCurrentTimestep();
     public native int cacheCurrentTimestepForReading();
     public native int readBlockFromCachedTimestep(int x, int y, int z);
+    public native int setLibrarySimilarityThreshold(float threshold);
+    public native long getStat(int stat);
+    public native int setPerfCountersEnabled(int enabled);
+    public native int setSparseOutputMode(int mode);
+    public native int getSparseCount();
+    public native int readSparseEntry(int i);
+    public native int setHistoryMemoryLimit(int maxBytes);
+    public native int getHistoryFrameCount(int jobId);
+    public native int cacheHistoryFrameForReading(int jobId, int frame);
+    public native int registerTickBuffers(ByteBuffer commands, ByteBuffer events);
+    public native int tick(int commandBytes);
+    public native int setSchedulerPolicy(int policy, int quantumTimesteps);
+    public native int setShadowMode(int backend, int sampleEvery, int uSteps);
+    public native long getTracePhase(int jobId, int phase);
+    public native long getTracePercentile(int phase, int permille);
+    public native int startMetricsServer(int port);
+    public native int setWatchdogTimeout(int timeoutMs);
+    public native long getWatchdogWindow(int i, int field);
+    public native int getLastError();
+    public native int setSettleMode(int flags);
+    public native int submitAsyncBatch(ByteBuffer contexts, int count, ByteBuffer jobIds);
+    public native int waitAsyncJob(int timeoutMs);
+    public native int takeAsyncJob(int jobId, ByteBuffer states);
+    public native int exportSchematic(ByteBuffer path, ByteBuffer sections, int sectionsX, int sectionsY, int sectionsZ, int format);
+
+    // A backend step stalled past the watchdog timeout, must match inference.h
+    public static final int INFER_ERROR_STEP_TIMEOUT = 10;
+
+    // Modes for setSparseOutputMode(), must match inference.h
+    public static final int SPARSE_OUTPUT_OFF = 0;
+    public static final int SPARSE_OUTPUT_NON_AIR = 1;
+    public static final int SPARSE_OUTPUT_CHANGED = 2;
+    public static final int SPARSE_OUTPUT_CHANGED_STATES = 3;
+
+    // Sparse entries are (index << SPARSE_ID_BITS) | block_id with index = (x * 14 + y) * 14 + z
+    public static final int SPARSE_ID_BITS = 8;
+    public static final int SPARSE_ID_MASK = (1 << SPARSE_ID_BITS) - 1;
+
+    // SPARSE_OUTPUT_CHANGED_STATES entries are (index << SPARSE_STATE_BITS) | state index, where a
+    // state index is block_id | (properties << BLOCK_STATE_ID_BITS). Must match block_states.h
+    public static final int SPARSE_STATE_BITS = 12;
+    public static final int SPARSE_STATE_MASK = (1 << SPARSE_STATE_BITS) - 1;
+    public static final int BLOCK_STATE_ID_BITS = 7;
+    public static final int BLOCK_STATE_ID_MASK = (1 << BLOCK_STATE_ID_BITS) - 1;
+
+    public static final int STAIRS_SHAPE_STRAIGHT = 0;
+    public static final int STAIRS_SHAPE_INNER_LEFT = 1;
+    public static final int STAIRS_SHAPE_INNER_RIGHT = 2;
+    public static final int STAIRS_SHAPE_OUTER_LEFT = 3;
+    public static final int STAIRS_SHAPE_OUTER_RIGHT = 4;
+
+    public static final int PANE_NORTH = 1;
+    public static final int PANE_EAST = 2;
+    public static final int PANE_SOUTH = 4;
+    public static final int PANE_WEST = 8;
+
+    // Command and event buffer layout for tick(), must match tick_buffer.h. Buffers are
+    // direct ByteBuffers in native byte order holding int32 words
+    public static final int TICK_COMMAND_SUBMIT = 1; // job id, 16^3 context id bytes
+    public static final int TICK_COMMAND_CANCEL = 2; // job id
+    public static final int TICK_COMMAND_READ = 3;   // job id, sparse output mode
+    public static final int TICK_COMMAND_TRACE = 4;  // job id, trace mark, System.nanoTime() low and high word
+    public static final int TICK_COMMAND_READ_LIGHT = 5; // job id
+
+    public static final int TICK_EVENT_SNAPSHOT = 1;  // job id, timestep, mode, count, entries
+    public static final int TICK_EVENT_COMPLETED = 2; // job id, job state, error
+    public static final int TICK_EVENT_ERROR = 3;     // job id, command, error
+    public static final int TICK_EVENT_OVERFLOW = 4;
+    public static final int TICK_EVENT_RECEIPT = 5;   // job id, JobReceipt longs, before COMPLETED
+    public static final int TICK_EVENT_LIGHT = 6;     // job id, light record
+
+    public static final int TICK_SUBMIT_BYTES = 8 + 16 * 16 * 16;
+    public static final int TICK_READ_BYTES = 12;
+    public static final int TICK_TRACE_BYTES = 20;
+    public static final int TICK_SNAPSHOT_HEADER = 20;
+    public static final int TICK_RECEIPT_BYTES = 8 + 8 * 9;
+    public static final int TICK_READ_LIGHT_BYTES = 8;
+
+    // Light record of a LIGHT event, must match light.h. The heightmap is one byte per
+    // column at x * 14 + z, then sky light nibbles at (x * 14 + y) * 14 + z, even index low
+    public static final int LIGHT_HEIGHTMAP_SIZE = 14 * 14;
+    public static final int LIGHT_RECORD_SIZE = LIGHT_HEIGHTMAP_SIZE + 14 * 14 * 14 / 2;
+    public static final int TICK_LIGHT_BYTES = 8 + LIGHT_RECORD_SIZE;
+
+    // Offsets of the JobReceipt fields in a RECEIPT event, must match job_queue.h
+    public static final int RECEIPT_MODEL_INVOCATIONS = 8;
+    public static final int RECEIPT_STEPS_SKIPPED = 16;
+    public static final int RECEIPT_BACKEND_NS = 24;
+    public static final int RECEIPT_QUEUE_NS = 32;
+    public static final int RECEIPT_DEVICE_BYTES = 40;
+    public static final int RECEIPT_DELIVERED_BYTES = 48;
+    public static final int RECEIPT_DECODE_NS = 56;
+    public static final int RECEIPT_PEAK_MEMORY_BYTES = 64;
+    public static final int RECEIPT_FROM_LIBRARY = 72;
+
+    // Job states in completion events, must match job_queue.h
+    public static final int JOB_STATE_DONE = 3;
+    public static final int JOB_STATE_CANCELLED = 4;
+    public static final int JOB_STATE_FAILED = 5;
+
+    // Policies for setSchedulerPolicy(), must match job_queue.h
+    public static final int JOB_POLICY_FIFO = 0;
+    public static final int JOB_POLICY_ROUND_ROBIN = 1;
+
+    // Backends for setShadowMode(), must match shadow.h
+    public static final int SHADOW_BACKEND_TENSORRT = 0;
+    public static final int SHADOW_BACKEND_MOCK = 1;
+
+    // Request trace marks and phases, must match trace.h. Only the marks the mod
+    // sends are listed, the others are recorded natively
+    public static final int TRACE_MARK_USED = 0;
+    public static final int TRACE_MARK_CAPTURE_START = 1;
+    public static final int TRACE_MARK_APPLIED = 6;
+
+    public static final int TRACE_PHASE_WAIT_CAPTURE = 0;
+    public static final int TRACE_PHASE_CAPTURE = 1;
+    public static final int TRACE_PHASE_QUEUE = 2;
+    public static final int TRACE_PHASE_DENOISE = 3;
+    public static final int TRACE_PHASE_DELIVER = 4;
+    public static final int TRACE_PHASE_APPLY = 5;
+    public static final int TRACE_PHASE_TOTAL = 6;
+
+    // Fields for getWatchdogWindow(), must match watchdog.h. The slow step is at WATCHDOG_WINDOW_BEFORE
+    public static final int WATCHDOG_WINDOW = 64;
+    public static final int WATCHDOG_WINDOW_BEFORE = 32;
+    public static final int WATCHDOG_FIELD_START_NS = 0;
+    public static final int WATCHDOG_FIELD_DURATION_NS = 1;
+    public static final int WATCHDOG_FIELD_TIMESTEP = 2;
+    public static final int WATCHDOG_FIELD_JOB_ID = 3;
+    public static final int WATCHDOG_FIELD_EXPECTED_NS = 4;
+
+    // Flags for setSettleMode(), must match settle.h
+    public static final int SETTLE_GRAVITY = 1;
+    public static final int SETTLE_FLOATING = 2;
+
+    // Formats for exportSchematic(), must match schematic.h. The path is a direct ByteBuffer
+    // holding the NUL terminated UTF-8 path, the sections a direct ByteBuffer in native byte
+    // order of 16^3 int16 state indices per section, section (x * sectionsY + y) * sectionsZ + z
+    public static final int SCHEMATIC_FORMAT_SPONGE = 0;
+    public static final int SCHEMATIC_FORMAT_STRUCTURE = 1;
+
+    // Stat ids for getStat(), must match stats.h
+    public static final int STAT_LIBRARY_LOOKUPS = 0;
+    public static final int STAT_LIBRARY_HITS = 1;
+    public static final int STAT_LIBRARY_LOOKUP_NS = 2;
+    public static final int STAT_LIBRARY_LOOKUP_MAX_NS = 3;
+    public static final int STAT_JOBS_SUBMITTED = 4;
+    public static final int STAT_JOBS_COMPLETED = 5;
+    public static final int STAT_JOBS_CANCELLED = 6;
+    public static final int STAT_TICK_CALLS = 7;
+    public static final int STAT_TICK_COMMANDS = 8;
+    public static final int STAT_TICK_EVENT_BYTES = 9;
+    public static final int STAT_JOBS_PREEMPTED = 10;
+    public static final int STAT_JOBS_QUEUE_NS = 11;
+    public static final int STAT_JOBS_QUEUE_MAX_NS = 12;
+    public static final int STAT_SHADOW_RUNS = 13;
+    public static final int STAT_SHADOW_DROPPED = 14;
+    public static final int STAT_SHADOW_FAILED = 15;
+    public static final int STAT_SHADOW_VOXELS = 16;
+    public static final int STAT_SHADOW_AGREE_VOXELS = 17;
+    public static final int STAT_SHADOW_PRIMARY_SEAMS = 18;
+    public static final int STAT_SHADOW_SECONDARY_SEAMS = 19;
+    public static final int STAT_SHADOW_PRIMARY_NS = 20;
+    public static final int STAT_SHADOW_SECONDARY_NS = 21;
+    public static final int STAT_TRACES_APPLIED = 22;
+    public static final int STAT_MODEL_STEPS = 23;
+    public static final int STAT_WATCHDOG_OUTLIERS = 24;
+    public static final int STAT_WATCHDOG_TIMEOUTS = 25;
+    public static final int STAT_BACKEND_FAILURES = 26;
+    public static final int STAT_BACKEND_RESTARTS = 27;
+    public static final int STAT_BACKEND_FAILOVERS = 28;
+    public static final int STAT_BACKEND_DEGRADED = 29;
+    public static final int STAT_JOBS_REQUEUED = 30;
+    public static final int STAT_SETTLE_MOVED = 31;
+    public static final int STAT_SETTLE_REMOVED = 32;
+    public static final int STAT_ASYNC_BATCHES = 33;
+    public static final int STAT_ASYNC_JOBS = 34;
+    public static final int STAT_LIBRARY_TRANSFORMED_HITS = 35;
+    public static final int STAT_JOBS_COALESCED = 36;
+
+    // Per stage samples, read with getStat(perfStat(stage, value)). Must match perf_counters.h
+    public static final int STAT_PERF_FIRST = 1000;
+
+    public static final int PERF_STAGE_CONTEXT_UPLOAD = 0;
+    public static final int PERF_STAGE_RNG_FILL = 1;
+    public static final int PERF_STAGE_BACKEND_STEP = 2;
+    public static final int PERF_STAGE_SNAPSHOT_COPY = 3;
+    public static final int PERF_STAGE_DECODE = 4;
+
+    public static final int PERF_VALUE_CALLS = 0;
+    public static final int PERF_VALUE_NS = 1;
+    public static final int PERF_VALUE_CYCLES = 2;
+    public static final int PERF_VALUE_INSTRUCTIONS = 3;
+    public static final int PERF_VALUE_LLC_MISSES = 4;
+    public static final int PERF_VALUE_BRANCH_MISSES = 5;
+    public static final int PERF_VALUE_COUNT = 6;
+
+    public static int perfStat(int stage, int value) {
+        return STAT_PERF_FIRST + stage * PERF_VALUE_COUNT + value;
+    }
 
     static {
         System.load("C:/Users/tbarnes/Desktop/projects/voxel-diffusion-minecraft-mod/inference_dll/visual_studio_build/x64/Release/inference.dll");